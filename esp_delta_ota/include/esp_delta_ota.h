@@ -39,6 +39,22 @@ typedef struct esp_delta_ota_cfg {
 
 #undef DEPRECATED_ATTRIBUTE
 
+/**
+ * @brief Statistics of a delta OTA process
+ *
+ * The hit rate of the source image cache is src_cache_hits / src_read_calls.
+ */
+typedef struct esp_delta_ota_stats {
+    uint32_t src_read_calls;        /*!< Reads of the source image issued by the patcher */
+    uint32_t src_cache_hits;        /*!< Reads served from the source cache, without calling read_cb */
+    uint32_t src_bytes_requested;   /*!< Bytes of the source image requested by the patcher */
+    uint32_t src_cb_calls;          /*!< Calls of read_cb */
+    uint32_t src_bytes_read;        /*!< Bytes read through read_cb, including readahead */
+    uint32_t write_calls;           /*!< Pieces of output produced by the patcher */
+    uint32_t write_cb_calls;        /*!< Calls of the write callback */
+    uint32_t bytes_written;         /*!< Bytes passed to the write callback */
+} esp_delta_ota_stats_t;
+
 /**
  * @brief Initializes the delta OTA process
  *
@@ -63,11 +79,23 @@ esp_err_t esp_delta_ota_feed_patch(esp_delta_ota_handle_t handle, const uint8_t
 /**
  * @brief This function finishes the patch applying operation.
  *
+ * Output which is still buffered, see CONFIG_ESP_DELTA_OTA_WRITE_BUFFER_SECTORS, is passed to the write callback.
+ *
  * @param[in] handle    esp_delta_ota_handle_t
  * @return int
  */
 esp_err_t esp_delta_ota_finalize(esp_delta_ota_handle_t handle);
 
+/**
+ * @brief Get the statistics of a delta OTA process
+ *
+ * @param[in]  handle   esp_delta_ota_handle_t
+ * @param[out] stats    statistics since esp_delta_ota_init
+ * @return - ESP_OK
+ *         - ESP_ERR_INVALID_ARG
+ */
+esp_err_t esp_delta_ota_get_stats(esp_delta_ota_handle_t handle, esp_delta_ota_stats_t *stats);
+
 /**
  * @brief Clean-up delta ota process
  *
@@ -75,6 +103,96 @@ esp_err_t esp_delta_ota_finalize(esp_delta_ota_handle_t handle);
  */
 esp_err_t esp_delta_ota_deinit(esp_delta_ota_handle_t handle);
 
+typedef void *esp_delta_ota_pipeline_handle_t;
+
+/**
+ * @brief Process callback of a pipeline stage, e.g. decryption or decompression of the patch
+ *
+ * The stage consumes up to in_len bytes of input and writes up to out_size bytes of output. It may consume only a part
+ * of the input when the output does not fit, and is called again with the rest once its output has been passed on.
+ * Input which does not produce output yet, e.g. a partial block, is kept by the stage. A call with input must consume
+ * or produce at least one byte.
+ *
+ * At the end of the stream, the stage is called with in == NULL and in_len == 0 until it produces no more output. It
+ * checks the integrity of the stream in the last of these calls, e.g. the authentication tag of an encrypted image.
+ *
+ * @param[in]  stage_ctx    ctx of the stage
+ * @param[in]  in           input of the stage, NULL at the end of the stream
+ * @param[in]  in_len       length of the input
+ * @param[out] in_used      bytes of the input consumed
+ * @param[out] out          output buffer of the stage
+ * @param[in]  out_size     size of the output buffer
+ * @param[out] out_len      bytes written to the output buffer
+ * @return - ESP_OK
+ *         - an error code, which aborts the pipeline
+ */
+typedef esp_err_t (*esp_delta_ota_stage_process_cb_t)(void *stage_ctx, const uint8_t *in, size_t in_len, size_t *in_used,
+        uint8_t *out, size_t out_size, size_t *out_len);
+
+typedef struct esp_delta_ota_stage {
+    esp_delta_ota_stage_process_cb_t process;   /*!< Process callback, NULL for an unused stage */
+    void *ctx;                                  /*!< Passed to the process callback */
+} esp_delta_ota_stage_t;
+
+#define ESP_DELTA_OTA_PIPELINE_MAX_STAGES       4
+#define ESP_DELTA_OTA_PIPELINE_BUFFER_SIZE      4096
+
+// Callback for the header which precedes the patch in the output of the last stage, e.g. to check its magic and digest
+typedef esp_err_t (*esp_delta_ota_header_cb_t)(const uint8_t *header, size_t size, void *user_data);
+
+typedef struct esp_delta_ota_pipeline_cfg {
+    esp_delta_ota_handle_t patcher;     /*!< Delta OTA handle which applies the output of the last stage */
+    esp_delta_ota_stage_t stages[ESP_DELTA_OTA_PIPELINE_MAX_STAGES];  /*!< Stages, in the order they process the data */
+    size_t buffer_size;                 /*!< Size of the output buffer of each stage, 0 for ESP_DELTA_OTA_PIPELINE_BUFFER_SIZE */
+    size_t header_size;                 /*!< Bytes at the start of the patch which are not passed to the patcher, e.g. 64 */
+    esp_delta_ota_header_cb_t header_cb;    /*!< Called with the header once it is complete, may be NULL */
+    void *user_data;                    /*!< Passed to header_cb */
+} esp_delta_ota_pipeline_cfg_t;
+
+/**
+ * @brief Initializes a pipeline which passes the patch stream through stages before it is applied
+ *
+ * All buffers of the pipeline are allocated here, one of buffer_size bytes per stage and one for the header.
+ * Feeding the pipeline does not allocate memory.
+ *
+ * @param[in] cfg   pointer to esp_delta_ota_pipeline_cfg_t structure
+ * @return - NULL   On failure
+ *         - esp_delta_ota_pipeline_handle_t handle
+ */
+esp_delta_ota_pipeline_handle_t esp_delta_ota_pipeline_init(const esp_delta_ota_pipeline_cfg_t *cfg);
+
+/**
+ * @brief Passes data through the stages and applies their output to the source image
+ *
+ * The data is consumed completely. A stage whose output buffer is full is held back until the following stages and
+ * the patcher have consumed that output.
+ *
+ * @param[in] handle    esp_delta_ota_pipeline_handle_t handle
+ * @param[in] buf       pointer to the data, e.g. as received from the server
+ * @param[in] size      size of the data
+ * @return - ESP_OK
+ *         - ESP_ERR_INVALID_ARG
+ *         - ESP_FAIL or the error returned by a stage or header_cb
+ */
+esp_err_t esp_delta_ota_pipeline_feed(esp_delta_ota_pipeline_handle_t handle, const uint8_t *buf, size_t size);
+
+/**
+ * @brief Ends the stream of each stage, and finishes the patch applying operation with esp_delta_ota_finalize
+ *
+ * @param[in] handle    esp_delta_ota_pipeline_handle_t handle
+ * @return - ESP_OK
+ *         - ESP_ERR_INVALID_ARG
+ *         - ESP_FAIL or the error returned by a stage
+ */
+esp_err_t esp_delta_ota_pipeline_finalize(esp_delta_ota_pipeline_handle_t handle);
+
+/**
+ * @brief Clean-up a pipeline. The patcher handle is not deinitialized.
+ *
+ * @param[in] handle    esp_delta_ota_pipeline_handle_t handle
+ */
+esp_err_t esp_delta_ota_pipeline_deinit(esp_delta_ota_pipeline_handle_t handle);
+
 #ifdef __cplusplus
 }
 #endif
@@ -11,12 +11,19 @@
 
 #include "esp_err.h"
 #include "esp_log.h"
+#include "sdkconfig.h"
 
 #include "esp_delta_ota.h"
 #include "detools.h"
 
 static const char *TAG = "esp_delta_ota";
 
+#define FLASH_SECTOR_SIZE 4096
+
+#define SRC_CACHE_SIZE (CONFIG_ESP_DELTA_OTA_SRC_CACHE_SECTORS * FLASH_SECTOR_SIZE)
+
+#define WRITE_BUFFER_SIZE (CONFIG_ESP_DELTA_OTA_WRITE_BUFFER_SECTORS * FLASH_SECTOR_SIZE)
+
 typedef struct esp_delta_ota_ctx {
     void *user_data;
     src_read_cb_t read_cb;
@@ -26,15 +33,20 @@ typedef struct esp_delta_ota_ctx {
     };
     struct detools_apply_patch_t *apply_patch;
     int src_offset;
+    uint8_t *src_cache;         // window of the source image, see CONFIG_ESP_DELTA_OTA_SRC_CACHE_SECTORS
+    int src_cache_start;        // source offset of the window
+    size_t src_cache_len;       // valid bytes in the window, 0 if it is empty
+    int src_cache_bad_start;    // window which could not be read, e.g. at the end of the partition, -1 if none
+    uint8_t *write_buf;         // output collected for the write callback, see CONFIG_ESP_DELTA_OTA_WRITE_BUFFER_SECTORS
+    size_t write_buf_len;
+    esp_delta_ota_stats_t stats;
 } esp_delta_ota_ctx;
 
-static int esp_delta_ota_write_cb(void *arg_p, const uint8_t *buf_p, size_t size)
+static esp_err_t out_write(esp_delta_ota_ctx *handle, const uint8_t *buf_p, size_t size)
 {
-    if (size <= 0) {
-        return ESP_ERR_INVALID_ARG;
-    }
-    esp_delta_ota_ctx *handle = (esp_delta_ota_ctx *)arg_p;
     esp_err_t err = ESP_OK;
+    handle->stats.write_cb_calls++;
+    handle->stats.bytes_written += size;
     if (!handle->user_data) {
         err = handle->write_cb(buf_p, size);
         if (err != ESP_OK) {
@@ -51,13 +63,111 @@ static int esp_delta_ota_write_cb(void *arg_p, const uint8_t *buf_p, size_t size
     return ESP_OK;
 }
 
+static esp_err_t out_flush(esp_delta_ota_ctx *handle)
+{
+    if (handle->write_buf_len == 0) {
+        return ESP_OK;
+    }
+    esp_err_t err = out_write(handle, handle->write_buf, handle->write_buf_len);
+    handle->write_buf_len = 0;
+    return err;
+}
+
+static int esp_delta_ota_write_cb(void *arg_p, const uint8_t *buf_p, size_t size)
+{
+    if (size <= 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    esp_delta_ota_ctx *handle = (esp_delta_ota_ctx *)arg_p;
+    handle->stats.write_calls++;
+#if WRITE_BUFFER_SIZE > 0
+    while (size > 0) {
+        if (handle->write_buf_len == 0 && size >= WRITE_BUFFER_SIZE) {
+            // Whole buffers worth of output skip the copy
+            size_t len = size - size % WRITE_BUFFER_SIZE;
+            if (out_write(handle, buf_p, len) != ESP_OK) {
+                return ESP_FAIL;
+            }
+            buf_p += len;
+            size -= len;
+            continue;
+        }
+        size_t len = WRITE_BUFFER_SIZE - handle->write_buf_len;
+        if (len > size) {
+            len = size;
+        }
+        memcpy(handle->write_buf + handle->write_buf_len, buf_p, len);
+        handle->write_buf_len += len;
+        buf_p += len;
+        size -= len;
+        if (handle->write_buf_len == WRITE_BUFFER_SIZE && out_flush(handle) != ESP_OK) {
+            return ESP_FAIL;
+        }
+    }
+    return ESP_OK;
+#else
+    return out_write(handle, buf_p, size);
+#endif
+}
+
+static esp_err_t src_read(esp_delta_ota_ctx *handle, uint8_t *buf_p, size_t size, int src_offset)
+{
+    handle->stats.src_cb_calls++;
+    handle->stats.src_bytes_read += size;
+    return handle->read_cb(buf_p, size, src_offset);
+}
+
+// Serves small reads from a window of the source image, which is loaded with a single read_cb call
+static esp_err_t src_cache_read(esp_delta_ota_ctx *handle, uint8_t *buf_p, size_t size, int src_offset)
+{
+#if SRC_CACHE_SIZE > 0
+    if (size >= SRC_CACHE_SIZE) {
+        return src_read(handle, buf_p, size, src_offset);
+    }
+    bool hit = true;
+    while (size > 0) {
+        if (src_offset < handle->src_cache_start || src_offset >= handle->src_cache_start + (int)handle->src_cache_len) {
+            hit = false;
+            int start = src_offset - src_offset % SRC_CACHE_SIZE;
+            esp_err_t err = start == handle->src_cache_bad_start ? ESP_FAIL :
+                            src_read(handle, handle->src_cache, SRC_CACHE_SIZE, start);
+            if (err != ESP_OK) {
+                // The window may reach past the end of the source partition, read only what was asked for, and do
+                // not try this window again
+                handle->src_cache_len = 0;
+                handle->src_cache_bad_start = start;
+                return src_read(handle, buf_p, size, src_offset);
+            }
+            handle->src_cache_start = start;
+            handle->src_cache_len = SRC_CACHE_SIZE;
+        }
+        size_t len = handle->src_cache_start + handle->src_cache_len - src_offset;
+        if (len > size) {
+            len = size;
+        }
+        memcpy(buf_p, handle->src_cache + (src_offset - handle->src_cache_start), len);
+        buf_p += len;
+        src_offset += len;
+        size -= len;
+    }
+    if (hit) {
+        handle->stats.src_cache_hits++;
+    }
+    return ESP_OK;
+#else
+    return src_read(handle, buf_p, size, src_offset);
+#endif
+}
+
 static int esp_delta_ota_read_cb(void *arg_p, uint8_t *buf_p, size_t size)
 {
     if (size <= 0 || !arg_p) {
         return -ESP_ERR_INVALID_ARG;
     }
     esp_delta_ota_ctx *handle = (esp_delta_ota_ctx *)arg_p;
-    esp_err_t err = handle->read_cb(buf_p, size, handle->src_offset);
+    handle->stats.src_read_calls++;
+    handle->stats.src_bytes_requested += size;
+    esp_err_t err = src_cache_read(handle, buf_p, size, handle->src_offset);
     if (err != ESP_OK) {
         ESP_LOGE(TAG, "Error in read_cb(): %s", esp_err_to_name(err));
         return ESP_FAIL;
@@ -90,9 +200,31 @@ esp_delta_ota_handle_t esp_delta_ota_init(esp_delta_ota_cfg_t *cfg)
         ctx = NULL;
         return NULL;
     }
+#if SRC_CACHE_SIZE > 0
+    ctx->src_cache_bad_start = -1;
+    ctx->src_cache = malloc(SRC_CACHE_SIZE);
+    if (!ctx->src_cache) {
+        ESP_LOGE(TAG, "Unable to allocate memory");
+        free(ctx->apply_patch);
+        free(ctx);
+        return NULL;
+    }
+#endif
+#if WRITE_BUFFER_SIZE > 0
+    ctx->write_buf = malloc(WRITE_BUFFER_SIZE);
+    if (!ctx->write_buf) {
+        ESP_LOGE(TAG, "Unable to allocate memory");
+        free(ctx->src_cache);
+        free(ctx->apply_patch);
+        free(ctx);
+        return NULL;
+    }
+#endif
     int ret = detools_apply_patch_init(ctx->apply_patch, &esp_delta_ota_read_cb, &esp_delta_ota_seek_cb, 0, &esp_delta_ota_write_cb, ctx);
     if (ret < 0) {
         ESP_LOGE(TAG, "Error while initializing delta_ota: %s", detools_error_as_string(ret));
+        free(ctx->write_buf);
+        free(ctx->src_cache);
         free(ctx->apply_patch);
         ctx->apply_patch = NULL;
         free(ctx);
@@ -129,6 +261,21 @@ esp_err_t esp_delta_ota_finalize(esp_delta_ota_handle_t handle)
         ESP_LOGE(TAG, "Error while finishing the patching: %s", detools_error_as_string(err));
         return ESP_FAIL;
     }
+    if (out_flush(ctx) != ESP_OK) {
+        ESP_LOGE(TAG, "Error while writing the end of the output");
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_delta_ota_get_stats(esp_delta_ota_handle_t handle, esp_delta_ota_stats_t *stats)
+{
+    if (handle == NULL || stats == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    esp_delta_ota_ctx *ctx = (esp_delta_ota_ctx *)handle;
+
+    *stats = ctx->stats;
     return ESP_OK;
 }
 
@@ -139,6 +286,10 @@ esp_err_t esp_delta_ota_deinit(esp_delta_ota_handle_t handle)
     }
     esp_delta_ota_ctx *ctx = (esp_delta_ota_ctx *)handle;
 
+    free(ctx->write_buf);
+    ctx->write_buf = NULL;
+    free(ctx->src_cache);
+    ctx->src_cache = NULL;
     free(ctx->apply_patch);
     ctx->apply_patch = NULL;
     free(ctx);
@@ -0,0 +1,182 @@
+/*
+ * SPDX-License-Identifier: Apache 2.0 License
+ *
+ * SPDX-FileCopyrightText: 2023 Espressif Systems (Shanghai) CO LTD
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "esp_err.h"
+#include "esp_log.h"
+
+#include "esp_delta_ota.h"
+
+static const char *TAG = "esp_delta_ota_pipeline";
+
+typedef struct esp_delta_ota_pipeline_ctx {
+    esp_delta_ota_handle_t patcher;
+    esp_delta_ota_stage_t stages[ESP_DELTA_OTA_PIPELINE_MAX_STAGES];
+    size_t num_stages;
+    size_t buffer_size;
+    uint8_t *bufs;              // output buffer of stage i at bufs + i * buffer_size, followed by the header
+    uint8_t *header;
+    size_t header_size;
+    size_t header_len;
+    esp_delta_ota_header_cb_t header_cb;
+    void *user_data;
+} esp_delta_ota_pipeline_ctx;
+
+// Takes the header off the output of the last stage, and applies the rest
+static esp_err_t sink(esp_delta_ota_pipeline_ctx *ctx, const uint8_t *in, size_t in_len)
+{
+    if (in_len == 0) {
+        return ESP_OK;
+    }
+    if (ctx->header_len < ctx->header_size) {
+        size_t len = ctx->header_size - ctx->header_len;
+        if (len > in_len) {
+            len = in_len;
+        }
+        memcpy(ctx->header + ctx->header_len, in, len);
+        ctx->header_len += len;
+        in += len;
+        in_len -= len;
+        if (ctx->header_len == ctx->header_size && ctx->header_cb) {
+            esp_err_t err = ctx->header_cb(ctx->header, ctx->header_size, ctx->user_data);
+            if (err != ESP_OK) {
+                ESP_LOGE(TAG, "Patch header rejected: %s", esp_err_to_name(err));
+                return err;
+            }
+        }
+    }
+    if (in_len == 0) {
+        return ESP_OK;
+    }
+    return esp_delta_ota_feed_patch(ctx->patcher, in, in_len);
+}
+
+// Passes the input through stage i and the following ones, until all of it has been consumed. The output buffer of a
+// stage is always consumed completely by the following stages before the stage runs again.
+static esp_err_t run_stage(esp_delta_ota_pipeline_ctx *ctx, size_t i, const uint8_t *in, size_t in_len, bool end)
+{
+    if (i == ctx->num_stages) {
+        return sink(ctx, in, in_len);
+    }
+    esp_delta_ota_stage_t *stage = &ctx->stages[i];
+    uint8_t *out = ctx->bufs + i * ctx->buffer_size;
+    while (in_len > 0 || end) {
+        size_t in_used = 0;
+        size_t out_len = 0;
+        esp_err_t err = stage->process(stage->ctx, in, in_len, &in_used, out, ctx->buffer_size, &out_len);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Error in stage %u: %s", (unsigned)i, esp_err_to_name(err));
+            return err;
+        }
+        if (in_used > in_len || out_len > ctx->buffer_size) {
+            ESP_LOGE(TAG, "Stage %u reported more data than it was given", (unsigned)i);
+            return ESP_FAIL;
+        }
+        if (out_len == 0 && in_used == 0) {
+            if (end) {
+                break;
+            }
+            ESP_LOGE(TAG, "Stage %u made no progress", (unsigned)i);
+            return ESP_FAIL;
+        }
+        in += in_used;
+        in_len -= in_used;
+        if (out_len > 0) {
+            err = run_stage(ctx, i + 1, out, out_len, false);
+            if (err != ESP_OK) {
+                return err;
+            }
+        }
+    }
+    if (end) {
+        return run_stage(ctx, i + 1, NULL, 0, true);
+    }
+    return ESP_OK;
+}
+
+esp_delta_ota_pipeline_handle_t esp_delta_ota_pipeline_init(const esp_delta_ota_pipeline_cfg_t *cfg)
+{
+    if (cfg == NULL || cfg->patcher == NULL) {
+        ESP_LOGE(TAG, "Invalid argument");
+        return NULL;
+    }
+    esp_delta_ota_pipeline_ctx *ctx = calloc(1, sizeof(esp_delta_ota_pipeline_ctx));
+    if (!ctx) {
+        ESP_LOGE(TAG, "Unable to allocate memory");
+        return NULL;
+    }
+    ctx->patcher = cfg->patcher;
+    for (size_t i = 0; i < ESP_DELTA_OTA_PIPELINE_MAX_STAGES; i++) {
+        if (cfg->stages[i].process) {
+            ctx->stages[ctx->num_stages++] = cfg->stages[i];
+        }
+    }
+    ctx->buffer_size = cfg->buffer_size ? cfg->buffer_size : ESP_DELTA_OTA_PIPELINE_BUFFER_SIZE;
+    ctx->header_size = cfg->header_size;
+    ctx->header_cb = cfg->header_cb;
+    ctx->user_data = cfg->user_data;
+
+    size_t size = ctx->num_stages * ctx->buffer_size + ctx->header_size;
+    if (size > 0) {
+        ctx->bufs = malloc(size);
+        if (!ctx->bufs) {
+            ESP_LOGE(TAG, "Unable to allocate memory");
+            free(ctx);
+            return NULL;
+        }
+        ctx->header = ctx->bufs + ctx->num_stages * ctx->buffer_size;
+    }
+    return (esp_delta_ota_pipeline_handle_t)ctx;
+}
+
+esp_err_t esp_delta_ota_pipeline_feed(esp_delta_ota_pipeline_handle_t handle, const uint8_t *buf, size_t size)
+{
+    if (handle == NULL || (buf == NULL && size > 0)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    esp_delta_ota_pipeline_ctx *ctx = (esp_delta_ota_pipeline_ctx *)handle;
+
+    if (size == 0) {
+        return ESP_OK;
+    }
+    return run_stage(ctx, 0, buf, size, false);
+}
+
+esp_err_t esp_delta_ota_pipeline_finalize(esp_delta_ota_pipeline_handle_t handle)
+{
+    if (handle == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    esp_delta_ota_pipeline_ctx *ctx = (esp_delta_ota_pipeline_ctx *)handle;
+
+    esp_err_t err = run_stage(ctx, 0, NULL, 0, true);
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (ctx->header_len != ctx->header_size) {
+        ESP_LOGE(TAG, "Patch header not received");
+        return ESP_FAIL;
+    }
+    return esp_delta_ota_finalize(ctx->patcher);
+}
+
+esp_err_t esp_delta_ota_pipeline_deinit(esp_delta_ota_pipeline_handle_t handle)
+{
+    if (handle == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    esp_delta_ota_pipeline_ctx *ctx = (esp_delta_ota_pipeline_ctx *)handle;
+
+    free(ctx->bufs);
+    ctx->bufs = NULL;
+    free(ctx);
+    ctx = NULL;
+    return ESP_OK;
+}
@@ -5,6 +5,7 @@
  */
 
 #include <stdio.h>
+#include <stdbool.h>
 #include <string.h>
 #include <freertos/FreeRTOS.h>
 
@@ -116,3 +117,170 @@ TEST_CASE("Sending 1 byte of patch at once", "[esp_delta_ota]")
 
     TEST_ASSERT_EQUAL_INT(0, memcmp(new_bin_start, output_buffer, output_index));
 }
+
+static int read_cb_calls = 0;
+static esp_err_t counting_read_cb(uint8_t *buf_p, size_t size, int src_offset)
+{
+    read_cb_calls++;
+    // Like a partition read, reads past the end of the image return whatever follows it
+    size_t base_len = base_bin_end - base_bin_start;
+    size_t len = (size_t)src_offset < base_len ? base_len - src_offset : 0;
+    len = len < size ? len : size;
+    memcpy(buf_p, base_bin_start + src_offset, len);
+    memset(buf_p + len, 0xFF, size - len);
+    return ESP_OK;
+}
+
+TEST_CASE("Source reads are served from the cache", "[esp_delta_ota]")
+{
+    memset(output_buffer, 0, 1000);
+    output_index = 0;
+    read_cb_calls = 0;
+    esp_delta_ota_cfg_t cfg = {
+        .read_cb = &counting_read_cb,
+        .write_cb = &write_cb,
+    };
+
+    esp_delta_ota_handle_t handle = esp_delta_ota_init(&cfg);
+    TEST_ASSERT_NOT_NULL(handle);
+
+    esp_err_t err = esp_delta_ota_feed_patch(handle, patch_bin_start, patch_bin_end - patch_bin_start);
+    TEST_ESP_OK(err);
+    err = esp_delta_ota_finalize(handle);
+    TEST_ESP_OK(err);
+
+    esp_delta_ota_stats_t stats;
+    TEST_ESP_OK(esp_delta_ota_get_stats(handle, &stats));
+    TEST_ASSERT_EQUAL_UINT32(read_cb_calls, stats.src_cb_calls);
+    TEST_ASSERT_GREATER_THAN_UINT32(0, stats.src_read_calls);
+#if CONFIG_ESP_DELTA_OTA_SRC_CACHE_SECTORS > 0
+    // The whole base image fits into one window
+    TEST_ASSERT_EQUAL_UINT32(1, stats.src_cb_calls);
+    TEST_ASSERT_EQUAL_UINT32(stats.src_read_calls - 1, stats.src_cache_hits);
+#else
+    TEST_ASSERT_EQUAL_UINT32(stats.src_read_calls, stats.src_cb_calls);
+#endif
+
+    err = esp_delta_ota_deinit(handle);
+    TEST_ESP_OK(err);
+
+    TEST_ASSERT_EQUAL_INT(0, memcmp(new_bin_start, output_buffer, new_bin_end - new_bin_start));
+}
+
+static int write_cb_calls = 0;
+static esp_err_t counting_write_cb(const uint8_t *buf_p, size_t size, void *user_data)
+{
+    write_cb_calls++;
+    return write_cb(buf_p, size);
+}
+
+TEST_CASE("Output is passed on in whole buffers", "[esp_delta_ota]")
+{
+    memset(output_buffer, 0, 1000);
+    output_index = 0;
+    write_cb_calls = 0;
+    int user_data = 0;
+    esp_delta_ota_cfg_t cfg = {
+        .user_data = &user_data,
+        .read_cb = &read_cb,
+        .write_cb_with_user_data = &counting_write_cb,
+    };
+
+    esp_delta_ota_handle_t handle = esp_delta_ota_init(&cfg);
+    TEST_ASSERT_NOT_NULL(handle);
+
+    for (int i = 0; i < patch_bin_end - patch_bin_start; i++) {
+        TEST_ESP_OK(esp_delta_ota_feed_patch(handle, patch_bin_start + i, 1));
+    }
+#if CONFIG_ESP_DELTA_OTA_WRITE_BUFFER_SECTORS > 0
+    // The new image is smaller than the buffer, it is written by finalize
+    TEST_ASSERT_EQUAL_INT(0, write_cb_calls);
+#endif
+    TEST_ESP_OK(esp_delta_ota_finalize(handle));
+
+    esp_delta_ota_stats_t stats;
+    TEST_ESP_OK(esp_delta_ota_get_stats(handle, &stats));
+    TEST_ASSERT_EQUAL_UINT32(write_cb_calls, stats.write_cb_calls);
+    TEST_ASSERT_EQUAL_UINT32(new_bin_end - new_bin_start, stats.bytes_written);
+#if CONFIG_ESP_DELTA_OTA_WRITE_BUFFER_SECTORS > 0
+    TEST_ASSERT_EQUAL_INT(1, write_cb_calls);
+    TEST_ASSERT_GREATER_THAN_UINT32(1, stats.write_calls);
+#endif
+    TEST_ESP_OK(esp_delta_ota_deinit(handle));
+
+    TEST_ASSERT_EQUAL_INT(0, memcmp(new_bin_start, output_buffer, new_bin_end - new_bin_start));
+}
+
+// Passes the data on unchanged, at most 7 bytes per call, and holds back the last byte until the end of the stream
+typedef struct {
+    bool held;
+    uint8_t byte;
+    int end_calls;
+} trickle_stage_t;
+
+static esp_err_t trickle_stage(void *stage_ctx, const uint8_t *in, size_t in_len, size_t *in_used,
+                               uint8_t *out, size_t out_size, size_t *out_len)
+{
+    trickle_stage_t *stage = (trickle_stage_t *)stage_ctx;
+    size_t used = 0;
+    size_t len = 0;
+    if (out_size > 7) {
+        out_size = 7;
+    }
+    if (in == NULL) {
+        if (stage->held) {
+            out[len++] = stage->byte;
+            stage->held = false;
+        } else {
+            stage->end_calls++;
+        }
+    }
+    while (used < in_len && len < out_size) {
+        if (stage->held) {
+            out[len++] = stage->byte;
+        }
+        stage->byte = in[used++];
+        stage->held = true;
+    }
+    *in_used = used;
+    *out_len = len;
+    return ESP_OK;
+}
+
+TEST_CASE("Patch is applied through a pipeline of stages", "[esp_delta_ota]")
+{
+    memset(output_buffer, 0, 1000);
+    output_index = 0;
+    esp_delta_ota_cfg_t cfg = {
+        .read_cb = &read_cb,
+        .write_cb = &write_cb,
+    };
+    esp_delta_ota_handle_t handle = esp_delta_ota_init(&cfg);
+    TEST_ASSERT_NOT_NULL(handle);
+
+    trickle_stage_t first = { 0 };
+    trickle_stage_t second = { 0 };
+    esp_delta_ota_pipeline_cfg_t pipeline_cfg = {
+        .patcher = handle,
+        .stages = {
+            { .process = &trickle_stage, .ctx = &first },
+            { .process = &trickle_stage, .ctx = &second },
+        },
+        .buffer_size = 16,
+    };
+    esp_delta_ota_pipeline_handle_t pipeline = esp_delta_ota_pipeline_init(&pipeline_cfg);
+    TEST_ASSERT_NOT_NULL(pipeline);
+
+    const size_t patch_len = patch_bin_end - patch_bin_start;
+    for (size_t i = 0; i < patch_len; i += 100) {
+        TEST_ESP_OK(esp_delta_ota_pipeline_feed(pipeline, patch_bin_start + i, patch_len - i < 100 ? patch_len - i : 100));
+    }
+    TEST_ESP_OK(esp_delta_ota_pipeline_finalize(pipeline));
+    TEST_ASSERT_EQUAL_INT(1, first.end_calls);
+    TEST_ASSERT_EQUAL_INT(1, second.end_calls);
+
+    TEST_ESP_OK(esp_delta_ota_pipeline_deinit(pipeline));
+    TEST_ESP_OK(esp_delta_ota_deinit(handle));
+
+    TEST_ASSERT_EQUAL_INT(0, memcmp(new_bin_start, output_buffer, new_bin_end - new_bin_start));
+}
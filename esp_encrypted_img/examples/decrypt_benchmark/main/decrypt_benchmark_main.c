@@ -0,0 +1,277 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+/* Pre encrypted image decryption benchmark
+
+   Measures the throughput and CPU usage of esp_encrypted_img_decrypt_data and esp_encrypted_img_decrypt_data_to_buf
+   over a sweep of image and chunk sizes. Results are printed as one JSON object per line, prefixed with "BENCH ".
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <sys/param.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_check.h"
+#include "esp_timer.h"
+#include "esp_random.h"
+#include "esp_encrypted_img.h"
+#include "mbedtls/pk.h"
+#include "mbedtls/gcm.h"
+
+static const char *TAG = "decrypt_benchmark";
+
+extern const char rsa_private_pem_start[] asm("_binary_private_pem_start");
+extern const char rsa_private_pem_end[]   asm("_binary_private_pem_end");
+
+// Image header, see pre_enc_bin_header in esp_encrypted_img.c and tools/esp_enc_img_gen.py
+#define MAGIC               0x0788b6cf
+#define GCM_KEY_SIZE        32
+#define ENC_GCM_KEY_SIZE    384
+#define IV_SIZE             16
+#define AUTH_SIZE           16
+#define ENC_KEY_OFFSET      4
+#define IV_OFFSET           (ENC_KEY_OFFSET + ENC_GCM_KEY_SIZE)
+#define BIN_SIZE_OFFSET     (IV_OFFSET + IV_SIZE)
+#define AUTH_OFFSET         (BIN_SIZE_OFFSET + 4)
+
+typedef enum {
+    BENCH_API_DECRYPT_DATA,     // esp_encrypted_img_decrypt_data, allocates the output of every call
+    BENCH_API_TO_BUF,           // esp_encrypted_img_decrypt_data_to_buf, in place
+} bench_api_t;
+
+static const char *api_names[] = {"decrypt_data", "to_buf"};
+
+typedef struct {
+    mbedtls_pk_context pk;
+    uint8_t *header;            // esp_encrypted_img_get_header_size() bytes
+    uint8_t gcm_key[GCM_KEY_SIZE];
+    mbedtls_gcm_context gcm;    // encrypts the image chunk by chunk, outside of the timed calls
+    uint32_t image_len;
+    uint8_t *buf;               // chunk of the image, of the largest chunk size
+    size_t buf_size;
+} bench_ctx_t;
+
+typedef struct {
+    int64_t header_us;          // esp_encrypted_img_decrypt_start and the header, i.e. the RSA decryption of the key
+    int64_t body_us;            // decryption of the body, up to the check of the authentication tag
+    int64_t idle_us;            // time the idle task ran during body_us
+    uint32_t calls;
+} bench_result_t;
+
+static int fill_random(void *ctx, unsigned char *buf, size_t len)
+{
+    esp_fill_random(buf, len);
+    return 0;
+}
+
+static uint32_t idle_time_us(void)
+{
+#if CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+    return ulTaskGetIdleRunTimeCounter();
+#else
+    return 0;
+#endif
+}
+
+// Plain text of the image, cheap to generate at any offset
+static void fill_plain(uint8_t *buf, uint32_t offset, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        buf[i] = (uint8_t)((offset + i) * 7 + ((offset + i) >> 8));
+    }
+}
+
+static esp_err_t start_encryption(bench_ctx_t *ctx)
+{
+    mbedtls_gcm_free(&ctx->gcm);
+    mbedtls_gcm_init(&ctx->gcm);
+    ESP_RETURN_ON_FALSE(mbedtls_gcm_setkey(&ctx->gcm, MBEDTLS_CIPHER_ID_AES, ctx->gcm_key, GCM_KEY_SIZE * 8) == 0,
+                        ESP_FAIL, TAG, "mbedtls_gcm_setkey failed");
+    ESP_RETURN_ON_FALSE(mbedtls_gcm_starts(&ctx->gcm, MBEDTLS_GCM_ENCRYPT, ctx->header + IV_OFFSET, IV_SIZE) == 0,
+                        ESP_FAIL, TAG, "mbedtls_gcm_starts failed");
+    return ESP_OK;
+}
+
+// Encrypts the next len bytes of the body into ctx->buf
+static esp_err_t encrypt_chunk(bench_ctx_t *ctx, uint32_t offset, size_t len)
+{
+    size_t olen;
+    fill_plain(ctx->buf, offset, len);
+    ESP_RETURN_ON_FALSE(mbedtls_gcm_update(&ctx->gcm, ctx->buf, len, ctx->buf, len, &olen) == 0 && olen == len,
+                        ESP_FAIL, TAG, "mbedtls_gcm_update failed");
+    return ESP_OK;
+}
+
+// Generates the header of an image with a random key, including the authentication tag, which takes an encryption
+// of the whole body
+static esp_err_t make_header(bench_ctx_t *ctx, uint32_t image_len)
+{
+    size_t olen;
+    uint32_t magic = MAGIC;
+
+    memset(ctx->header, 0, esp_encrypted_img_get_header_size());
+    memcpy(ctx->header, &magic, sizeof(magic));
+    esp_fill_random(ctx->gcm_key, GCM_KEY_SIZE);
+    ESP_RETURN_ON_FALSE(mbedtls_pk_encrypt(&ctx->pk, ctx->gcm_key, GCM_KEY_SIZE, ctx->header + ENC_KEY_OFFSET, &olen,
+                                           ENC_GCM_KEY_SIZE, fill_random, NULL) == 0 && olen == ENC_GCM_KEY_SIZE,
+                        ESP_FAIL, TAG, "mbedtls_pk_encrypt failed");
+    esp_fill_random(ctx->header + IV_OFFSET, IV_SIZE);
+    memcpy(ctx->header + BIN_SIZE_OFFSET, &image_len, sizeof(image_len));
+
+    ESP_RETURN_ON_ERROR(start_encryption(ctx), TAG, "");
+    for (uint32_t offset = 0; offset < image_len; offset += ctx->buf_size) {
+        ESP_RETURN_ON_ERROR(encrypt_chunk(ctx, offset, MIN(ctx->buf_size, image_len - offset)), TAG, "");
+    }
+    ESP_RETURN_ON_FALSE(mbedtls_gcm_finish(&ctx->gcm, NULL, 0, &olen, ctx->header + AUTH_OFFSET, AUTH_SIZE) == 0,
+                        ESP_FAIL, TAG, "mbedtls_gcm_finish failed");
+    ctx->image_len = image_len;
+    return ESP_OK;
+}
+
+static esp_err_t decrypt(bench_api_t api, esp_decrypt_handle_t handle, uint8_t *data, size_t len)
+{
+    if (api == BENCH_API_DECRYPT_DATA) {
+        pre_enc_decrypt_arg_t args = {
+            .data_in = (const char *)data,
+            .data_in_len = len,
+        };
+        esp_err_t err = esp_encrypted_img_decrypt_data(handle, &args);
+        free(args.data_out);
+        return err == ESP_ERR_NOT_FINISHED ? ESP_OK : err;
+    }
+    while (len > 0) {
+        size_t in_used, out_len;
+        ESP_RETURN_ON_ERROR(esp_encrypted_img_decrypt_data_to_buf(handle, data, len, &in_used, data, len, &out_len), TAG, "");
+        data += in_used;
+        len -= in_used;
+    }
+    return ESP_OK;
+}
+
+// Checks the authentication tag. With mbedtls 3 there is no output left at the end of the image.
+static esp_err_t decrypt_end(bench_api_t api, esp_decrypt_handle_t handle, uint8_t *buf, size_t buf_size)
+{
+    if (api == BENCH_API_TO_BUF) {
+        size_t in_used, out_len;
+        ESP_RETURN_ON_ERROR(esp_encrypted_img_decrypt_data_to_buf(handle, NULL, 0, &in_used, buf, buf_size, &out_len), TAG, "");
+    }
+    return esp_encrypted_img_decrypt_end(handle);
+}
+
+static esp_err_t bench_run(bench_ctx_t *ctx, bench_api_t api, size_t chunk, bench_result_t *result)
+{
+    esp_decrypt_cfg_t cfg = {
+        .rsa_priv_key = rsa_private_pem_start,
+        .rsa_priv_key_len = rsa_private_pem_end - rsa_private_pem_start,
+    };
+    memset(result, 0, sizeof(*result));
+    ESP_RETURN_ON_ERROR(start_encryption(ctx), TAG, "");
+
+    int64_t start = esp_timer_get_time();
+    esp_decrypt_handle_t handle = esp_encrypted_img_decrypt_start(&cfg);
+    ESP_RETURN_ON_FALSE(handle != NULL, ESP_FAIL, TAG, "esp_encrypted_img_decrypt_start failed");
+    memcpy(ctx->buf, ctx->header, esp_encrypted_img_get_header_size());
+    esp_err_t err = decrypt(api, handle, ctx->buf, esp_encrypted_img_get_header_size());
+    result->header_us = esp_timer_get_time() - start;
+
+    for (uint32_t offset = 0; err == ESP_OK && offset < ctx->image_len; offset += chunk) {
+        size_t len = MIN(chunk, ctx->image_len - offset);
+        err = encrypt_chunk(ctx, offset, len);
+        if (err != ESP_OK) {
+            break;
+        }
+        uint32_t idle_start = idle_time_us();
+        start = esp_timer_get_time();
+        err = decrypt(api, handle, ctx->buf, len);
+        result->body_us += esp_timer_get_time() - start;
+        result->idle_us += idle_time_us() - idle_start;
+        result->calls++;
+    }
+    if (err != ESP_OK) {
+        esp_encrypted_img_decrypt_abort(handle);
+        ESP_LOGE(TAG, "Decryption failed: %s", esp_err_to_name(err));
+        return err;
+    }
+    start = esp_timer_get_time();
+    err = decrypt_end(api, handle, ctx->buf, ctx->buf_size);
+    result->body_us += esp_timer_get_time() - start;
+    ESP_RETURN_ON_ERROR(err, TAG, "Authentication failed");
+    return ESP_OK;
+}
+
+static esp_err_t bench_image(bench_ctx_t *ctx, uint32_t image_len)
+{
+    ESP_RETURN_ON_ERROR(make_header(ctx, image_len), TAG, "");
+
+    const char *list = CONFIG_BENCHMARK_CHUNK_SIZES;
+    char *end;
+    for (long chunk = strtol(list, &end, 10); end != list; chunk = strtol(list, &end, 10)) {
+        list = end;
+        ESP_RETURN_ON_FALSE(chunk > 0 && (size_t)chunk <= ctx->buf_size, ESP_ERR_INVALID_ARG, TAG, "invalid chunk size %ld", chunk);
+        for (bench_api_t api = BENCH_API_DECRYPT_DATA; api <= BENCH_API_TO_BUF; api++) {
+            bench_result_t r;
+            ESP_RETURN_ON_ERROR(bench_run(ctx, api, chunk, &r), TAG, "%s failed", api_names[api]);
+#if CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+            int cpu_pct = (int)(100 - r.idle_us * 100 / r.body_us);
+#else
+            int cpu_pct = -1;
+#endif
+
+            // One JSON object per line, prefixed so it can be picked out of the log. Bytes per us is MB/s.
+            printf("BENCH {\"api\":\"%s\",\"image_kb\":%"PRIu32",\"chunk\":%ld,\"calls\":%"PRIu32","
+                   "\"header_us\":%"PRId64",\"body_us\":%"PRId64",\"mbps\":%.2f,\"cycles_per_byte\":%.1f,\"cpu_pct\":%d}\n",
+                   api_names[api], image_len / 1024, chunk, r.calls, r.header_us, r.body_us,
+                   (float)image_len / r.body_us, (float)r.body_us * CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ / image_len, cpu_pct);
+            fflush(stdout);
+        }
+    }
+    return ESP_OK;
+}
+
+static esp_err_t bench_all(bench_ctx_t *ctx)
+{
+    const char *list = CONFIG_BENCHMARK_CHUNK_SIZES;
+    char *end;
+    for (long chunk = strtol(list, &end, 10); end != list; chunk = strtol(list, &end, 10)) {
+        list = end;
+        ctx->buf_size = MAX(ctx->buf_size, chunk);
+    }
+    ctx->buf_size = MAX(ctx->buf_size, esp_encrypted_img_get_header_size());
+    ctx->buf = malloc(ctx->buf_size);
+    ctx->header = malloc(esp_encrypted_img_get_header_size());
+    ESP_RETURN_ON_FALSE(ctx->buf && ctx->header, ESP_ERR_NO_MEM, TAG, "nomem");
+
+    ESP_RETURN_ON_FALSE(mbedtls_pk_parse_key(&ctx->pk, (const unsigned char *)rsa_private_pem_start,
+                                             rsa_private_pem_end - rsa_private_pem_start, NULL, 0, fill_random, NULL) == 0,
+                        ESP_FAIL, TAG, "mbedtls_pk_parse_key failed");
+
+    list = CONFIG_BENCHMARK_IMAGE_SIZES_KB;
+    for (long image_kb = strtol(list, &end, 10); end != list; image_kb = strtol(list, &end, 10)) {
+        list = end;
+        ESP_RETURN_ON_FALSE(image_kb > 0 && image_kb <= 16384, ESP_ERR_INVALID_ARG, TAG, "invalid image size %ld", image_kb);
+        ESP_LOGI(TAG, "Image of %ld kB", image_kb);
+        ESP_RETURN_ON_ERROR(bench_image(ctx, image_kb * 1024), TAG, "");
+    }
+    return ESP_OK;
+}
+
+void app_main(void)
+{
+    bench_ctx_t ctx = {0};
+
+    mbedtls_pk_init(&ctx.pk);
+    mbedtls_gcm_init(&ctx.gcm);
+    esp_err_t err = bench_all(&ctx);
+    mbedtls_gcm_free(&ctx.gcm);
+    mbedtls_pk_free(&ctx.pk);
+    free(ctx.header);
+    free(ctx.buf);
+    ESP_ERROR_CHECK(err);
+    printf("Benchmark done\n");
+}
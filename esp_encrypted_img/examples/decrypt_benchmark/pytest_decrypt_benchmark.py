@@ -0,0 +1,20 @@
+# SPDX-FileCopyrightText: 2024 Espressif Systems (Shanghai) CO LTD
+# SPDX-License-Identifier: Unlicense OR CC0-1.0
+
+import json
+
+import pytest
+from pytest_embedded import Dut
+
+
+@pytest.mark.generic
+def test_decrypt_benchmark(dut: Dut) -> None:
+    results = []
+    while True:
+        match = dut.expect(r'BENCH (\{.*\})|Benchmark done', timeout=600)
+        if match.group(1) is None:
+            break
+        results.append(json.loads(match.group(1).decode()))
+    assert {r['api'] for r in results} == {'decrypt_data', 'to_buf'}
+    for r in results:
+        assert r['calls'] > 0 and r['body_us'] > 0 and r['mbps'] > 0
@@ -13,12 +13,14 @@
 */
 
 #include <string.h>
+#include <inttypes.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/event_groups.h"
 #include "esp_system.h"
 #include "esp_event.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "esp_ota_ops.h"
 #include "esp_http_client.h"
 #include "esp_https_ota.h"
@@ -102,6 +104,142 @@ static esp_err_t _decrypt_cb(decrypt_cb_arg_t *args, void *user_ctx)
     return ESP_OK;
 }
 
+#if CONFIG_EXAMPLE_DECRYPT_PIPELINE
+typedef struct {
+    esp_ota_handle_t ota_handle;
+    bool is_image_verified;
+} ota_write_ctx_t;
+
+// Called by the write task of the pipeline with the decrypted image
+static esp_err_t ota_write_cb(const uint8_t *data, size_t len, void *user_ctx)
+{
+    ota_write_ctx_t *ctx = (ota_write_ctx_t *)user_ctx;
+    if (!ctx->is_image_verified) {
+        ctx->is_image_verified = true;
+        const int app_desc_offset = sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t);
+        // The first buffer of the pipeline holds the App Descriptor
+        if (len < app_desc_offset + sizeof(esp_app_desc_t)) {
+            ESP_LOGE(TAG, "App Descriptor not found in the first %d bytes", (int)len);
+            return ESP_ERR_INVALID_SIZE;
+        }
+        esp_err_t err = validate_image_header((esp_app_desc_t *)&data[app_desc_offset]);
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+    return esp_ota_write(ctx->ota_handle, data, len);
+}
+
+// Downloads the image into the OTA partition, and ends the decryption session
+static esp_err_t pipelined_ota(esp_http_client_config_t *config, esp_decrypt_handle_t decrypt_handle)
+{
+    const esp_partition_t *update_partition = esp_ota_get_next_update_partition(NULL);
+    if (update_partition == NULL) {
+        ESP_LOGE(TAG, "No OTA partition found");
+        esp_encrypted_img_decrypt_abort(decrypt_handle);
+        return ESP_FAIL;
+    }
+    esp_http_client_handle_t client = esp_http_client_init(config);
+    if (client == NULL) {
+        esp_encrypted_img_decrypt_abort(decrypt_handle);
+        return ESP_FAIL;
+    }
+    esp_err_t err = esp_http_client_open(client, 0);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to open HTTP connection: %s", esp_err_to_name(err));
+        esp_http_client_cleanup(client);
+        esp_encrypted_img_decrypt_abort(decrypt_handle);
+        return err;
+    }
+    esp_http_client_fetch_headers(client);
+
+    ota_write_ctx_t ctx = {};
+    err = esp_ota_begin(update_partition, OTA_WITH_SEQUENTIAL_WRITES, &ctx.ota_handle);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "esp_ota_begin failed: %s", esp_err_to_name(err));
+        esp_http_client_cleanup(client);
+        esp_encrypted_img_decrypt_abort(decrypt_handle);
+        return err;
+    }
+
+    esp_encrypted_img_pipeline_cfg_t pipeline_cfg = ESP_ENCRYPTED_IMG_PIPELINE_DEFAULT_CFG();
+    pipeline_cfg.decrypt_handle = decrypt_handle;
+    pipeline_cfg.write_cb = ota_write_cb;
+    pipeline_cfg.user_ctx = &ctx;
+    pipeline_cfg.queue_depth = CONFIG_EXAMPLE_DECRYPT_PIPELINE_QUEUE_DEPTH;
+#if !CONFIG_FREERTOS_UNICORE
+    // The Wi-Fi and lwIP tasks run on core 0 by default, decryption gets core 1 to itself
+    pipeline_cfg.decrypt_task_core = 1;
+    pipeline_cfg.write_task_core = 0;
+#endif
+    esp_encrypted_img_pipeline_handle_t pipeline;
+    err = esp_encrypted_img_pipeline_start(&pipeline_cfg, &pipeline);
+    if (err != ESP_OK) {
+        esp_ota_abort(ctx.ota_handle);
+        esp_http_client_cleanup(client);
+        esp_encrypted_img_decrypt_abort(decrypt_handle);
+        return err;
+    }
+
+    int64_t start = esp_timer_get_time();
+    char buf[1024];
+    while (1) {
+        int len = esp_http_client_read(client, buf, sizeof(buf));
+        if (len < 0) {
+            ESP_LOGE(TAG, "Error while reading the image");
+            err = ESP_FAIL;
+            break;
+        }
+        if (len == 0) {
+            if (!esp_http_client_is_complete_data_received(client)) {
+                ESP_LOGE(TAG, "Complete data was not received.");
+                err = ESP_FAIL;
+            }
+            break;
+        }
+        err = esp_encrypted_img_pipeline_feed(pipeline, buf, len);
+        if (err != ESP_OK) {
+            break;
+        }
+    }
+    if (err == ESP_OK) {
+        err = esp_encrypted_img_pipeline_finish(pipeline);
+    }
+    int64_t elapsed_us = esp_timer_get_time() - start;
+
+    esp_encrypted_img_pipeline_stats_t stats;
+    esp_encrypted_img_pipeline_get_stats(pipeline, &stats);
+    esp_encrypted_img_pipeline_delete(pipeline);
+    esp_http_client_cleanup(client);
+    ESP_LOGI(TAG, "%" PRIu32 " bytes in %" PRId64 " ms", stats.bytes_in, elapsed_us / 1000);
+    ESP_LOGI(TAG, "receive: waited %" PRId64 " ms for buffers, decrypt queue max %" PRIu32,
+             stats.feed_wait_us / 1000, stats.decrypt_queue_max);
+    ESP_LOGI(TAG, "decrypt: busy %" PRId64 " ms, waited %" PRId64 " ms, write queue max %" PRIu32,
+             stats.decrypt_us / 1000, stats.decrypt_wait_us / 1000, stats.write_queue_max);
+    ESP_LOGI(TAG, "write: busy %" PRId64 " ms, waited %" PRId64 " ms",
+             stats.write_us / 1000, stats.write_wait_us / 1000);
+
+    if (err != ESP_OK) {
+        esp_ota_abort(ctx.ota_handle);
+        esp_encrypted_img_decrypt_abort(decrypt_handle);
+        return err;
+    }
+    err = esp_encrypted_img_decrypt_end(decrypt_handle);
+    if (err != ESP_OK) {
+        esp_ota_abort(ctx.ota_handle);
+        return err;
+    }
+    err = esp_ota_end(ctx.ota_handle);
+    if (err != ESP_OK) {
+        if (err == ESP_ERR_OTA_VALIDATE_FAILED) {
+            ESP_LOGE(TAG, "Image validation failed, image is corrupted");
+        }
+        return err;
+    }
+    return esp_ota_set_boot_partition(update_partition);
+}
+#endif // CONFIG_EXAMPLE_DECRYPT_PIPELINE
+
 void pre_encrypted_ota_task(void *pvParameter)
 {
     ESP_LOGI(TAG, "Starting Pre Encrypted OTA example");
@@ -138,6 +276,17 @@ void pre_encrypted_ota_task(void *pvParameter)
     config.skip_cert_common_name_check = true;
 #endif
 
+#if CONFIG_EXAMPLE_DECRYPT_PIPELINE
+    esp_err_t pipeline_err = pipelined_ota(&config, decrypt_handle);
+    if (pipeline_err == ESP_OK) {
+        ESP_LOGI(TAG, "Pipelined OTA upgrade successful. Rebooting ...");
+        vTaskDelay(1000 / portTICK_PERIOD_MS);
+        esp_restart();
+    }
+    ESP_LOGE(TAG, "Pipelined OTA upgrade failed 0x%x", pipeline_err);
+    vTaskDelete(NULL);
+#endif
+
     esp_https_ota_config_t ota_config = {
         .http_config = &config,
 #ifdef CONFIG_EXAMPLE_ENABLE_PARTIAL_HTTP_DOWNLOAD
@@ -6,6 +6,7 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <esp_err.h>
 #include <esp_idf_version.h>
 
@@ -51,6 +52,7 @@ extern "C" {
 #endif
 
 typedef void *esp_decrypt_handle_t;
+typedef void *esp_decrypt_key_handle_t;
 
 typedef struct {
     union {
@@ -65,6 +67,8 @@ typedef struct {
                                                              but it is not accurate (meaning wise) and hence it would
                                                              be removed in the next major release */
     };
+    esp_decrypt_key_handle_t key;                       /*!< Key parsed with esp_encrypted_img_key_create(), used instead
+                                                             of rsa_priv_key if not NULL */
 } esp_decrypt_cfg_t;
 
 #undef DEPRECATED_ATTRIBUTE
@@ -77,6 +81,38 @@ typedef struct {
 } pre_enc_decrypt_arg_t;
 
 
+/**
+* @brief  Parse a private key once, for use by several decryption sessions.
+*
+* Setting up a session with rsa_priv_key in esp_decrypt_cfg_t seeds a random generator and parses the PEM key for every
+* image. Sessions started with the returned handle as the key of esp_decrypt_cfg_t skip both. The key may be used by
+* one session at a time, and must not be deleted before the sessions using it have ended.
+*
+* The key is a 3072 bit RSA key, for images encrypted with its public key, or, with mbedtls 3 (ESP-IDF v5.0 or later),
+* a P-256 or X25519 key for images with an ECDH key wrap. Unwrapping the GCM key of such an image takes one ECDH
+* computation instead of an RSA-3072 private key operation. X25519 keys in PEM format require mbedtls 3.5 (ESP-IDF
+* v5.2) or later.
+*
+* @param[in]   priv_key       private key in PEM format
+* @param[in]   priv_key_len   length of the buffer pointed to by priv_key, including the terminating NUL
+*
+* @return
+*    - NULL    On failure
+*    - esp_decrypt_key_handle_t handle
+*/
+esp_decrypt_key_handle_t esp_encrypted_img_key_create(const char *priv_key, size_t priv_key_len);
+
+/**
+* @brief  Delete a key created with esp_encrypted_img_key_create().
+*
+* @param[in]   key   esp_decrypt_key_handle_t handle
+*
+* @return
+*    - ESP_ERR_INVALID_ARG  Invalid argument
+*    - ESP_OK               Success
+*/
+esp_err_t esp_encrypted_img_key_delete(esp_decrypt_key_handle_t key);
+
 /**
 * @brief  This function returns esp_decrypt_handle_t handle.
 *
@@ -109,6 +145,37 @@ esp_decrypt_handle_t esp_encrypted_img_decrypt_start(const esp_decrypt_cfg_t *cf
 */
 esp_err_t esp_encrypted_img_decrypt_data(esp_decrypt_handle_t ctx, pre_enc_decrypt_arg_t *args);
 
+/**
+* @brief  This function performs decryption on input data into a buffer provided by the caller.
+*
+* Unlike esp_encrypted_img_decrypt_data(), no memory is allocated. The function consumes as much of the input as
+* fits into the output buffer, and must be called again with the rest of the input, in_used tells how much that is.
+* Header bytes are consumed without producing output. The output may be the input buffer itself, out == in, to
+* decrypt in place (this requires mbedtls 3, i.e. ESP-IDF v5.0 or later). Otherwise the buffers must not overlap.
+*
+* Once the whole image has been passed, call this function with in == NULL and in_len == 0 until it produces no
+* more output, the last call checks the authentication tag. The signature matches esp_delta_ota_stage_process_cb_t,
+* so the function can be used as a stage of an esp_delta_ota pipeline, with the handle as its ctx.
+*
+* @note Use either this function or esp_encrypted_img_decrypt_data() for an image, not both.
+*
+* @param[in]    ctx         esp_decrypt_handle_t handle
+* @param[in]    in          encrypted data, NULL at the end of the image
+* @param[in]    in_len      length of the encrypted data
+* @param[out]   in_used     bytes of the input consumed
+* @param[out]   out         output buffer for the decrypted data
+* @param[in]    out_size    size of the output buffer, at least 16 bytes with mbedtls 2
+* @param[out]   out_len     bytes written to the output buffer
+*
+* @return
+*    - ESP_FAIL                         On failure, e.g. invalid magic, incomplete image or wrong authentication tag
+*    - ESP_ERR_INVALID_ARG              Invalid arguments, or input and output buffers which overlap without out == in
+*    - ESP_ERR_NOT_SUPPORTED            In place decryption with mbedtls 2
+*    - ESP_OK                           Success
+*/
+esp_err_t esp_encrypted_img_decrypt_data_to_buf(esp_decrypt_handle_t ctx, const uint8_t *in, size_t in_len, size_t *in_used,
+        uint8_t *out, size_t out_size, size_t *out_len);
+
 
 /**
 * @brief  Clean-up decryption process.
@@ -163,6 +230,130 @@ esp_err_t esp_encrypted_img_decrypt_abort(esp_decrypt_handle_t ctx);
 */
 uint16_t esp_encrypted_img_get_header_size(void);
 
+typedef void *esp_encrypted_img_pipeline_handle_t;
+
+// Callback for the decrypted data, e.g. esp_ota_write(), called by the write task of a pipeline in order
+typedef esp_err_t (*esp_encrypted_img_write_cb_t)(const uint8_t *data, size_t len, void *user_ctx);
+
+#define ESP_ENCRYPTED_IMG_PIPELINE_BUFFER_SIZE      4096
+#define ESP_ENCRYPTED_IMG_PIPELINE_QUEUE_DEPTH      2
+#define ESP_ENCRYPTED_IMG_PIPELINE_TASK_STACK_SIZE  4096
+#define ESP_ENCRYPTED_IMG_PIPELINE_TASK_PRIORITY    5
+
+typedef struct {
+    esp_decrypt_handle_t decrypt_handle;    /*!< Started decryption session, fed through esp_encrypted_img_decrypt_data_to_buf() */
+    esp_encrypted_img_write_cb_t write_cb;  /*!< Callback for the decrypted data */
+    void *user_ctx;                         /*!< Passed to write_cb */
+    size_t buffer_size;                     /*!< Size of each buffer, at least 16, 0 for ESP_ENCRYPTED_IMG_PIPELINE_BUFFER_SIZE */
+    size_t queue_depth;                     /*!< Buffers queued for each of the tasks, 0 for ESP_ENCRYPTED_IMG_PIPELINE_QUEUE_DEPTH */
+    int decrypt_task_core;                  /*!< Core of the decrypt task, -1 for no affinity */
+    int write_task_core;                    /*!< Core of the write task, -1 for no affinity */
+    unsigned task_priority;                 /*!< Priority of both tasks, 0 for ESP_ENCRYPTED_IMG_PIPELINE_TASK_PRIORITY */
+    size_t task_stack_size;                 /*!< Stack size of both tasks, 0 for ESP_ENCRYPTED_IMG_PIPELINE_TASK_STACK_SIZE */
+} esp_encrypted_img_pipeline_cfg_t;
+
+#define ESP_ENCRYPTED_IMG_PIPELINE_DEFAULT_CFG() { \
+    .decrypt_task_core = -1, \
+    .write_task_core = -1, \
+}
+
+/**
+* @brief  Statistics of a pipeline
+*
+* Each stage is busy for its _us time and blocked for its _wait_us time. The slowest stage waits the least, and the
+* pipeline is as fast as that stage. Times are counted while the pipeline runs, and are exact after it has finished.
+*/
+typedef struct {
+    uint32_t bytes_in;              /*!< Encrypted bytes fed to the pipeline */
+    uint32_t bytes_out;             /*!< Decrypted bytes passed to write_cb */
+    int64_t feed_wait_us;           /*!< Time esp_encrypted_img_pipeline_feed() waited for a free buffer */
+    int64_t decrypt_us;             /*!< Time the decrypt task spent decrypting */
+    int64_t decrypt_wait_us;        /*!< Time the decrypt task waited for encrypted data or for a free buffer */
+    int64_t write_us;               /*!< Time spent in write_cb */
+    int64_t write_wait_us;          /*!< Time the write task waited for decrypted data */
+    uint32_t decrypt_queue_max;     /*!< Most buffers queued for the decrypt task at once */
+    uint32_t write_queue_max;       /*!< Most buffers queued for the write task at once */
+} esp_encrypted_img_pipeline_stats_t;
+
+/**
+* @brief  Starts a pipeline which decrypts the image in one task and passes the decrypted data to write_cb in another
+*
+* The task calling esp_encrypted_img_pipeline_feed(), e.g. while receiving the image, the decrypt task and the write
+* task run concurrently, each on a different buffer. On dual core chips, with the two tasks on different cores, the
+* image is processed at the speed of the slowest stage instead of the sum of all of them.
+*
+* 2 * queue_depth + 2 buffers of buffer_size bytes are allocated here.
+*
+* @note The decryption session is not ended by the pipeline. Call esp_encrypted_img_decrypt_end() or
+*       esp_encrypted_img_decrypt_abort() once the pipeline has finished.
+*
+* @param[in]   cfg         pointer to esp_encrypted_img_pipeline_cfg_t structure
+* @param[out]  handle      pipeline handle
+*
+* @return
+*    - ESP_ERR_INVALID_ARG      Invalid arguments
+*    - ESP_ERR_NO_MEM           Out of memory
+*    - ESP_OK                   Success
+*/
+esp_err_t esp_encrypted_img_pipeline_start(const esp_encrypted_img_pipeline_cfg_t *cfg, esp_encrypted_img_pipeline_handle_t *handle);
+
+/**
+* @brief  Passes encrypted data to the pipeline
+*
+* The data is copied into the buffers of the pipeline, and each buffer is passed to the decrypt task once it is full,
+* so the data may be fed in pieces of any size. This function blocks while all buffers are in use.
+*
+* @param[in]   handle      pipeline handle
+* @param[in]   data        encrypted data
+* @param[in]   len         length of the data
+*
+* @return
+*    - ESP_ERR_INVALID_ARG      Invalid arguments
+*    - ESP_ERR_INVALID_STATE    The pipeline has finished
+*    - ESP_OK                   Success
+*    - the error of a stage, e.g. of write_cb, which stops the pipeline
+*/
+esp_err_t esp_encrypted_img_pipeline_feed(esp_encrypted_img_pipeline_handle_t handle, const void *data, size_t len);
+
+/**
+* @brief  Ends the image, and waits until it has been decrypted and passed to write_cb
+*
+* The authentication tag of the image is checked, and both tasks exit.
+*
+* @param[in]   handle      pipeline handle
+*
+* @return
+*    - ESP_ERR_INVALID_ARG      Invalid arguments
+*    - ESP_ERR_INVALID_STATE    The pipeline has already finished
+*    - ESP_OK                   Success
+*    - the first error of a stage, e.g. ESP_FAIL for a wrong authentication tag
+*/
+esp_err_t esp_encrypted_img_pipeline_finish(esp_encrypted_img_pipeline_handle_t handle);
+
+/**
+* @brief  Get the statistics of a pipeline
+*
+* @param[in]   handle      pipeline handle
+* @param[out]  stats       statistics since esp_encrypted_img_pipeline_start
+*
+* @return
+*    - ESP_ERR_INVALID_ARG      Invalid arguments
+*    - ESP_OK                   Success
+*/
+esp_err_t esp_encrypted_img_pipeline_get_stats(esp_encrypted_img_pipeline_handle_t handle, esp_encrypted_img_pipeline_stats_t *stats);
+
+/**
+* @brief  Clean-up a pipeline. A pipeline which has not finished is stopped, the data which has not been written yet
+*         is dropped.
+*
+* @param[in]   handle      pipeline handle
+*
+* @return
+*    - ESP_ERR_INVALID_ARG      Invalid argument
+*    - ESP_OK                   Success
+*/
+esp_err_t esp_encrypted_img_pipeline_delete(esp_encrypted_img_pipeline_handle_t handle);
+
 #ifdef __cplusplus
 }
 #endif
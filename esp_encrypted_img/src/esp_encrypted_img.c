@@ -5,6 +5,7 @@
  */
 
 #include <string.h>
+#include <stdint.h>
 #include "esp_encrypted_img.h"
 #include <errno.h>
 #include <esp_log.h>
@@ -15,6 +16,11 @@
 #include "mbedtls/entropy.h"
 #include "mbedtls/ctr_drbg.h"
 #include "mbedtls/gcm.h"
+#if !(MBEDTLS_VERSION_NUMBER < 0x03000000)
+#include "mbedtls/ecdh.h"
+#include "mbedtls/sha256.h"
+#include "mbedtls/platform_util.h"
+#endif
 #include "sys/param.h"
 
 static const char *TAG = "esp_encrypted_img";
@@ -37,9 +43,34 @@ typedef enum {
 #define AUTH_SIZE           16
 #define RESERVED_HEADER     88
 
+// Key wrap of ECDH images, in place of the RSA encrypted GCM key: the GCM key encrypted with AES-256-GCM under a key
+// derived from the ECDH shared secret, its tag, and the ephemeral public key of the image
+#define WRAP_TAG_OFFSET     GCM_KEY_SIZE
+#define WRAP_TAG_SIZE       16
+#define WRAP_IV_SIZE        12
+#define EPHEMERAL_KEY_OFFSET (WRAP_TAG_OFFSET + WRAP_TAG_SIZE)
+#define EPHEMERAL_KEY_MAX   65
+
+#if (MBEDTLS_VERSION_NUMBER < 0x03000000)
+// Room for a block collected in cache_buf, see decrypt_body_to_buf
+#define MIN_OUT_SIZE        16
+#else
+#define MIN_OUT_SIZE        1
+#endif
+
+struct esp_encrypted_img_key {
+    mbedtls_pk_context pk;
+    mbedtls_entropy_context entropy;
+    mbedtls_ctr_drbg_context ctr_drbg;
+};
+
+typedef struct esp_encrypted_img_key esp_encrypted_img_key_t;
+
 struct esp_encrypted_img_handle {
     char *rsa_pem;
     size_t rsa_len;
+    esp_encrypted_img_key_t *key;   // parsed key of the caller, or NULL to parse rsa_pem
+    bool ecdh;                      // the GCM key is wrapped with ECDH, not encrypted with RSA
     uint32_t binary_file_len;
     uint32_t binary_file_read;
     char gcm_key[GCM_KEY_SIZE];
@@ -49,6 +80,7 @@ struct esp_encrypted_img_handle {
     mbedtls_gcm_context gcm_ctx;
     size_t cache_buf_len;
     char *cache_buf;
+    bool auth_verified;
 };
 
 typedef struct {
@@ -63,65 +95,212 @@ typedef struct {
 
 // Magic Byte is created using command: echo -n "esp_encrypted_img" | sha256sum
 static uint32_t esp_enc_img_magic = 0x0788b6cf;
+// Magic Byte of images with an ECDH key wrap: echo -n "esp_encrypted_img_ecdh" | sha256sum
+static uint32_t esp_enc_img_ecdh_magic = 0x2b737f66;
 
 typedef struct esp_encrypted_img_handle esp_encrypted_img_t;
 
-static int decipher_gcm_key(const char *enc_gcm, esp_encrypted_img_t *handle)
+esp_decrypt_key_handle_t esp_encrypted_img_key_create(const char *priv_key, size_t priv_key_len)
 {
-    int ret = 1;
-    size_t olen = 0;
-    mbedtls_pk_context pk;
-    mbedtls_entropy_context entropy;
-    mbedtls_ctr_drbg_context ctr_drbg;
+    int ret;
     const char *pers = "mbedtls_pk_encrypt";
 
-    mbedtls_ctr_drbg_init( &ctr_drbg );
-    mbedtls_entropy_init( &entropy );
-    mbedtls_pk_init( &pk );
+    if (priv_key == NULL) {
+        ESP_LOGE(TAG, "esp_encrypted_img_key_create : Invalid argument");
+        return NULL;
+    }
+    esp_encrypted_img_key_t *key = calloc(1, sizeof(esp_encrypted_img_key_t));
+    if (!key) {
+        ESP_LOGE(TAG, "Couldn't allocate memory to key");
+        return NULL;
+    }
+    mbedtls_ctr_drbg_init( &key->ctr_drbg );
+    mbedtls_entropy_init( &key->entropy );
+    mbedtls_pk_init( &key->pk );
 
-    if ((ret = mbedtls_ctr_drbg_seed( &ctr_drbg, mbedtls_entropy_func,
-                                      &entropy, (const unsigned char *) pers,
+    if ((ret = mbedtls_ctr_drbg_seed( &key->ctr_drbg, mbedtls_entropy_func,
+                                      &key->entropy, (const unsigned char *) pers,
                                       strlen(pers))) != 0) {
         ESP_LOGE(TAG, "failed\n  ! mbedtls_ctr_drbg_seed returned -0x%04x\n", (unsigned int) - ret);
-        goto exit;
+        goto failure;
     }
 
-    ESP_LOGI(TAG, "Reading RSA private key");
+    ESP_LOGI(TAG, "Reading private key");
 
 #if (MBEDTLS_VERSION_NUMBER < 0x03000000)
-    if ( (ret = mbedtls_pk_parse_key(&pk, (const unsigned char *) handle->rsa_pem, handle->rsa_len, NULL, 0)) != 0) {
+    if ( (ret = mbedtls_pk_parse_key(&key->pk, (const unsigned char *) priv_key, priv_key_len, NULL, 0)) != 0) {
 #else
-    if ( (ret = mbedtls_pk_parse_key(&pk, (const unsigned char *) handle->rsa_pem, handle->rsa_len, NULL, 0, mbedtls_ctr_drbg_random, &ctr_drbg)) != 0) {
+    if ( (ret = mbedtls_pk_parse_key(&key->pk, (const unsigned char *) priv_key, priv_key_len, NULL, 0, mbedtls_ctr_drbg_random, &key->ctr_drbg)) != 0) {
 #endif
         ESP_LOGE(TAG, "failed\n  ! mbedtls_pk_parse_keyfile returned -0x%04x\n", (unsigned int) - ret );
+        goto failure;
+    }
+    if (mbedtls_pk_get_type(&key->pk) == MBEDTLS_PK_RSA) {
+        if (mbedtls_pk_get_bitlen(&key->pk) != ENC_GCM_KEY_SIZE * 8) {
+            ESP_LOGE(TAG, "RSA key is not a 3072 bit key");
+            goto failure;
+        }
+#if !(MBEDTLS_VERSION_NUMBER < 0x03000000)
+    } else if (mbedtls_pk_get_type(&key->pk) == MBEDTLS_PK_ECKEY) {
+        mbedtls_ecp_keypair *ec = mbedtls_pk_ec(key->pk);
+        if (ec->MBEDTLS_PRIVATE(grp).id != MBEDTLS_ECP_DP_SECP256R1 && ec->MBEDTLS_PRIVATE(grp).id != MBEDTLS_ECP_DP_CURVE25519) {
+            ESP_LOGE(TAG, "Only P-256 and X25519 keys are supported");
+            goto failure;
+        }
+#endif
+    } else {
+        ESP_LOGE(TAG, "Unsupported key type");
+        goto failure;
+    }
+    return (esp_decrypt_key_handle_t)key;
+
+failure:
+    esp_encrypted_img_key_delete(key);
+    return NULL;
+}
+
+esp_err_t esp_encrypted_img_key_delete(esp_decrypt_key_handle_t key_handle)
+{
+    esp_encrypted_img_key_t *key = (esp_encrypted_img_key_t *)key_handle;
+    if (key == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    mbedtls_pk_free( &key->pk );
+    mbedtls_entropy_free( &key->entropy );
+    mbedtls_ctr_drbg_free( &key->ctr_drbg );
+    free(key);
+    return ESP_OK;
+}
+
+#if !(MBEDTLS_VERSION_NUMBER < 0x03000000)
+// Derives the key encryption key from the ECDH shared secret of the device key and the ephemeral key of the image, with
+// the ANSI X9.63 KDF over SHA-256, and decrypts the GCM key with it
+static int unwrap_gcm_key(esp_encrypted_img_key_t *key, const char *wrap, char *gcm_key)
+{
+    int ret;
+    mbedtls_ecp_keypair *ec = mbedtls_pk_ec(key->pk);
+    mbedtls_ecp_group *grp = &ec->MBEDTLS_PRIVATE(grp);
+    mbedtls_ecp_point eph;
+    mbedtls_mpi z;
+    mbedtls_sha256_context sha;
+    mbedtls_gcm_context gcm;
+    unsigned char secret[32];
+    unsigned char kek[32];
+    const unsigned char counter[4] = {0, 0, 0, 1};
+    const unsigned char iv[WRAP_IV_SIZE] = {0};
+    size_t plen = mbedtls_mpi_size(&grp->P);
+    bool montgomery = mbedtls_ecp_get_type(grp) == MBEDTLS_ECP_TYPE_MONTGOMERY;
+    // Raw X25519 key, or uncompressed point
+    size_t eph_len = montgomery ? plen : 2 * plen + 1;
+
+    mbedtls_ecp_point_init(&eph);
+    mbedtls_mpi_init(&z);
+    mbedtls_sha256_init(&sha);
+    mbedtls_gcm_init(&gcm);
+
+    if (plen > sizeof(secret) || eph_len > EPHEMERAL_KEY_MAX) {
+        ret = -1;
+        goto exit;
+    }
+    if ((ret = mbedtls_ecp_point_read_binary(grp, &eph, (const unsigned char *)wrap + EPHEMERAL_KEY_OFFSET, eph_len)) != 0 ||
+            (ret = mbedtls_ecp_check_pubkey(grp, &eph)) != 0) {
+        ESP_LOGE(TAG, "failed\n  ! invalid ephemeral key -0x%04x\n", (unsigned int) - ret);
+        goto exit;
+    }
+    if ((ret = mbedtls_ecdh_compute_shared(grp, &z, &eph, &ec->MBEDTLS_PRIVATE(d), mbedtls_ctr_drbg_random, &key->ctr_drbg)) != 0) {
+        ESP_LOGE(TAG, "failed\n  ! mbedtls_ecdh_compute_shared returned -0x%04x\n", (unsigned int) - ret);
+        goto exit;
+    }
+    // X25519 shared secrets are little endian, see RFC 7748
+    ret = montgomery ? mbedtls_mpi_write_binary_le(&z, secret, plen) : mbedtls_mpi_write_binary(&z, secret, plen);
+    if (ret != 0) {
         goto exit;
     }
+    if ((ret = mbedtls_sha256_starts(&sha, 0)) != 0 ||
+            (ret = mbedtls_sha256_update(&sha, secret, plen)) != 0 ||
+            (ret = mbedtls_sha256_update(&sha, counter, sizeof(counter))) != 0 ||
+            (ret = mbedtls_sha256_update(&sha, (const unsigned char *)wrap + EPHEMERAL_KEY_OFFSET, eph_len)) != 0 ||
+            (ret = mbedtls_sha256_finish(&sha, kek)) != 0) {
+        goto exit;
+    }
+    // Every image has its own ephemeral key, and so its own key encryption key, a fixed IV is never reused with a key
+    if ((ret = mbedtls_gcm_setkey(&gcm, MBEDTLS_CIPHER_ID_AES, kek, sizeof(kek) * 8)) != 0 ||
+            (ret = mbedtls_gcm_auth_decrypt(&gcm, GCM_KEY_SIZE, iv, sizeof(iv), NULL, 0,
+                                            (const unsigned char *)wrap + WRAP_TAG_OFFSET, WRAP_TAG_SIZE,
+                                            (const unsigned char *)wrap, (unsigned char *)gcm_key)) != 0) {
+        ESP_LOGE(TAG, "failed\n  ! GCM key unwrap returned -0x%04x\n", (unsigned int) - ret);
+        goto exit;
+    }
+
+exit:
+    mbedtls_platform_zeroize(secret, sizeof(secret));
+    mbedtls_platform_zeroize(kek, sizeof(kek));
+    mbedtls_gcm_free(&gcm);
+    mbedtls_sha256_free(&sha);
+    mbedtls_mpi_free(&z);
+    mbedtls_ecp_point_free(&eph);
+    return ret;
+}
+#endif
+
+static int decipher_gcm_key(const char *enc_gcm, esp_encrypted_img_t *handle)
+{
+    int ret = 1;
+    size_t olen = 0;
+    esp_encrypted_img_key_t *key = handle->key;
 
-    if (( ret = mbedtls_pk_decrypt( &pk, (const unsigned char *)enc_gcm, ENC_GCM_KEY_SIZE, (unsigned char *)handle->gcm_key, &olen, GCM_KEY_SIZE,
-                                    mbedtls_ctr_drbg_random, &ctr_drbg ) ) != 0 ) {
-        ESP_LOGE(TAG, "failed\n  ! mbedtls_pk_decrypt returned -0x%04x\n", (unsigned int) - ret );
+    if (key == NULL) {
+        key = esp_encrypted_img_key_create(handle->rsa_pem, handle->rsa_len);
+        free(handle->rsa_pem);
+        handle->rsa_pem = NULL;
+        if (key == NULL) {
+            return ret;
+        }
+    }
+
+    if (handle->ecdh) {
+#if (MBEDTLS_VERSION_NUMBER < 0x03000000)
+        ESP_LOGE(TAG, "ECDH key wrap requires mbedtls 3");
         goto exit;
+#else
+        if (mbedtls_pk_get_type(&key->pk) != MBEDTLS_PK_ECKEY) {
+            ESP_LOGE(TAG, "ECDH image requires an EC key");
+            goto exit;
+        }
+        if ((ret = unwrap_gcm_key(key, enc_gcm, handle->gcm_key)) != 0) {
+            goto exit;
+        }
+#endif
+    } else {
+        if (mbedtls_pk_get_type(&key->pk) != MBEDTLS_PK_RSA) {
+            ESP_LOGE(TAG, "RSA image requires an RSA key");
+            goto exit;
+        }
+        if (( ret = mbedtls_pk_decrypt( &key->pk, (const unsigned char *)enc_gcm, ENC_GCM_KEY_SIZE, (unsigned char *)handle->gcm_key, &olen, GCM_KEY_SIZE,
+                                        mbedtls_ctr_drbg_random, &key->ctr_drbg ) ) != 0 ) {
+            ESP_LOGE(TAG, "failed\n  ! mbedtls_pk_decrypt returned -0x%04x\n", (unsigned int) - ret );
+            goto exit;
+        }
     }
     handle->cache_buf = realloc(handle->cache_buf, 16);
     if (!handle->cache_buf) {
-        return ESP_ERR_NO_MEM;
+        ret = ESP_ERR_NO_MEM;
+        goto exit;
     }
     handle->state = ESP_PRE_ENC_IMG_READ_IV;
     handle->binary_file_read = 0;
     handle->cache_buf_len = 0;
 exit:
-    mbedtls_pk_free( &pk );
-    mbedtls_entropy_free( &entropy );
-    mbedtls_ctr_drbg_free( &ctr_drbg );
-    free(handle->rsa_pem);
-    handle->rsa_pem = NULL;
+    if (key != handle->key) {
+        esp_encrypted_img_key_delete(key);
+    }
 
     return (ret);
 }
 
 esp_decrypt_handle_t esp_encrypted_img_decrypt_start(const esp_decrypt_cfg_t *cfg)
 {
-    if (cfg == NULL || cfg->rsa_priv_key == NULL) {
+    if (cfg == NULL || (cfg->rsa_priv_key == NULL && cfg->key == NULL)) {
         ESP_LOGE(TAG, "esp_encrypted_img_decrypt_start : Invalid argument");
         return NULL;
     }
@@ -133,10 +312,16 @@ esp_decrypt_handle_t esp_encrypted_img_decrypt_start(const esp_decrypt_cfg_t *cf
         goto failure;
     }
 
-    handle->rsa_pem = calloc(1, cfg->rsa_priv_key_len);
-    if (!handle->rsa_pem) {
-        ESP_LOGE(TAG, "Couldn't allocate memory to handle->rsa_pem");
-        goto failure;
+    if (cfg->key) {
+        handle->key = (esp_encrypted_img_key_t *)cfg->key;
+    } else {
+        handle->rsa_pem = calloc(1, cfg->rsa_priv_key_len);
+        if (!handle->rsa_pem) {
+            ESP_LOGE(TAG, "Couldn't allocate memory to handle->rsa_pem");
+            goto failure;
+        }
+        memcpy(handle->rsa_pem, cfg->rsa_priv_key, cfg->rsa_priv_key_len);
+        handle->rsa_len = cfg->rsa_priv_key_len;
     }
 
     handle->cache_buf = calloc(1, ENC_GCM_KEY_SIZE);
@@ -145,8 +330,6 @@ esp_decrypt_handle_t esp_encrypted_img_decrypt_start(const esp_decrypt_cfg_t *cf
         goto failure;
     }
 
-    memcpy(handle->rsa_pem, cfg->rsa_priv_key, cfg->rsa_priv_key_len);
-    handle->rsa_len = cfg->rsa_priv_key_len;
     handle->state = ESP_PRE_ENC_IMG_READ_MAGIC;
 
     esp_decrypt_handle_t ctx = (esp_decrypt_handle_t)handle;
@@ -162,11 +345,10 @@ failure:
 
 static esp_err_t process_bin(esp_encrypted_img_t *handle, pre_enc_decrypt_arg_t *args, int curr_index)
 {
+#if (MBEDTLS_VERSION_NUMBER < 0x03000000)
+    // Before mbedtls 3, only the last update may be a partial block, the rest of a chunk is kept in cache_buf
     size_t data_len = args->data_in_len;
     size_t data_out_size = args->data_out_len;
-#if !(MBEDTLS_VERSION_NUMBER < 0x03000000)
-    size_t olen;
-#endif
     handle->binary_file_read += data_len - curr_index;
     int dec_len = 0;
     if (handle->binary_file_read != handle->binary_file_len) {
@@ -187,11 +369,7 @@ static esp_err_t process_bin(esp_encrypted_img_t *handle, pre_enc_decrypt_arg_t
                 args->data_out_len = 0;
                 return ESP_ERR_NOT_FINISHED;
             }
-#if (MBEDTLS_VERSION_NUMBER < 0x03000000)
             if (mbedtls_gcm_update(&handle->gcm_ctx, 16, (const unsigned char *)handle->cache_buf, (unsigned char *) args->data_out) != 0) {
-#else
-            if (mbedtls_gcm_update(&handle->gcm_ctx, (const unsigned char *)handle->cache_buf, 16, (unsigned char *) args->data_out, data_out_size, &olen) != 0) {
-#endif
                 return ESP_FAIL;
             }
             dec_len = 16;
@@ -203,11 +381,7 @@ static esp_err_t process_bin(esp_encrypted_img_t *handle, pre_enc_decrypt_arg_t
         }
 
         if (data_len - copy_len - curr_index > 0) {
-#if (MBEDTLS_VERSION_NUMBER < 0x03000000)
             if (mbedtls_gcm_update(&handle->gcm_ctx, data_len - copy_len - curr_index, (const unsigned char *)args->data_in + curr_index + copy_len, (unsigned char *)args->data_out + dec_len) != 0) {
-#else
-            if (mbedtls_gcm_update(&handle->gcm_ctx, (const unsigned char *)args->data_in + curr_index + copy_len, data_len - copy_len - curr_index, (unsigned char *)args->data_out + dec_len, data_out_size - dec_len, &olen) != 0) {
-#endif
                 return ESP_FAIL;
             }
         }
@@ -224,19 +398,11 @@ static esp_err_t process_bin(esp_encrypted_img_t *handle, pre_enc_decrypt_arg_t
     copy_len = MIN(16 - handle->cache_buf_len, data_len - curr_index);
     memcpy(handle->cache_buf + handle->cache_buf_len, args->data_in + curr_index, copy_len);
     handle->cache_buf_len += copy_len;
-#if (MBEDTLS_VERSION_NUMBER < 0x03000000)
     if (mbedtls_gcm_update(&handle->gcm_ctx, handle->cache_buf_len, (const unsigned char *)handle->cache_buf, (unsigned char *)args->data_out) != 0) {
-#else
-    if (mbedtls_gcm_update(&handle->gcm_ctx,  (const unsigned char *)handle->cache_buf, handle->cache_buf_len, (unsigned char *)args->data_out, data_out_size, &olen) != 0) {
-#endif
         return ESP_FAIL;
     }
     if (data_len - curr_index - copy_len > 0) {
-#if (MBEDTLS_VERSION_NUMBER < 0x03000000)
         if (mbedtls_gcm_update(&handle->gcm_ctx, data_len - curr_index - copy_len, (const unsigned char *)(args->data_in + curr_index + copy_len), (unsigned char *)(args->data_out + 16)) != 0) {
-#else
-        if (mbedtls_gcm_update(&handle->gcm_ctx,  (const unsigned char *)(args->data_in + curr_index + copy_len), data_len - curr_index - copy_len, (unsigned char *)(args->data_out + 16), data_out_size - 16, &olen) != 0) {
-#endif
             return ESP_FAIL;
         }
     }
@@ -245,6 +411,25 @@ static esp_err_t process_bin(esp_encrypted_img_t *handle, pre_enc_decrypt_arg_t
     handle->cache_buf_len = 0;
 
     return ESP_OK;
+#else
+    // GCM is a stream mode in mbedtls 3, so the chunk is decrypted with a single update, straight from the input. With
+    // hardware AES, every update sets up the peripheral, fewer and larger updates keep the setup cost down.
+    size_t len = MIN(args->data_in_len - curr_index, handle->binary_file_len - handle->binary_file_read);
+    args->data_out_len = 0;
+    if (len > 0) {
+        args->data_out = realloc(args->data_out, len);
+        if (!args->data_out) {
+            return ESP_ERR_NO_MEM;
+        }
+        size_t olen = 0;
+        if (mbedtls_gcm_update(&handle->gcm_ctx, (const unsigned char *)args->data_in + curr_index, len, (unsigned char *)args->data_out, len, &olen) != 0) {
+            return ESP_FAIL;
+        }
+        handle->binary_file_read += len;
+        args->data_out_len = olen;
+    }
+    return handle->binary_file_read == handle->binary_file_len ? ESP_OK : ESP_ERR_NOT_FINISHED;
+#endif
 }
 
 static void read_and_cache_data(esp_encrypted_img_t *handle, pre_enc_decrypt_arg_t *args, int *curr_index, int data_size)
@@ -264,26 +449,26 @@ static void read_and_cache_data(esp_encrypted_img_t *handle, pre_enc_decrypt_arg
     handle->binary_file_read += MIN(args->data_in_len - temp, data_left);
 }
 
-esp_err_t esp_encrypted_img_decrypt_data(esp_decrypt_handle_t ctx, pre_enc_decrypt_arg_t *args)
+// Accepts the magic of RSA and of ECDH images, the key wrap of the image follows from it
+static bool check_magic(esp_encrypted_img_t *handle, uint32_t recv_magic)
 {
-    if (ctx == NULL || args == NULL || args->data_in == NULL) {
-        return ESP_ERR_INVALID_ARG;
-    }
-    esp_encrypted_img_t *handle = (esp_encrypted_img_t *)ctx;
-    if (handle == NULL) {
-        ESP_LOGE(TAG, "esp_encrypted_img_decrypt_data: Invalid argument");
-        return ESP_ERR_INVALID_ARG;
-    }
+    handle->ecdh = recv_magic == esp_enc_img_ecdh_magic;
+    return recv_magic == esp_enc_img_magic || handle->ecdh;
+}
 
+// Consumes the header from args->data_in, starting at *curr_index_p. Returns ESP_OK once the encrypted data follows, at
+// the updated *curr_index_p, or ESP_ERR_NOT_FINISHED after consuming all of the input.
+static esp_err_t read_header(esp_encrypted_img_t *handle, pre_enc_decrypt_arg_t *args, int *curr_index_p)
+{
     esp_err_t err;
-    int curr_index = 0;
+    int curr_index = *curr_index_p;
 
     switch (handle->state) {
     case ESP_PRE_ENC_IMG_READ_MAGIC:
         if (handle->cache_buf_len == 0 && (args->data_in_len - curr_index) >= MAGIC_SIZE) {
             uint32_t recv_magic = *(uint32_t *)args->data_in;
 
-            if (recv_magic != esp_enc_img_magic) {
+            if (!check_magic(handle, recv_magic)) {
                 ESP_LOGE(TAG, "Magic Verification failed");
                 free(handle->rsa_pem);
                 handle->rsa_pem = NULL;
@@ -295,7 +480,7 @@ esp_err_t esp_encrypted_img_decrypt_data(esp_decrypt_handle_t ctx, pre_enc_decry
             if (handle->binary_file_read == MAGIC_SIZE) {
                 uint32_t recv_magic = *(uint32_t *)handle->cache_buf;
 
-                if (recv_magic != esp_enc_img_magic) {
+                if (!check_magic(handle, recv_magic)) {
                     ESP_LOGE(TAG, "Magic Verification failed");
                     free(handle->rsa_pem);
                     handle->rsa_pem = NULL;
@@ -404,12 +589,191 @@ esp_err_t esp_encrypted_img_decrypt_data(esp_decrypt_handle_t ctx, pre_enc_decry
     }
 /* falls through */
     case ESP_PRE_ENC_DATA_DECODE_STATE:
-        err = process_bin(handle, args, curr_index);
+        break;
+    }
+    *curr_index_p = curr_index;
+    return ESP_OK;
+}
+
+esp_err_t esp_encrypted_img_decrypt_data(esp_decrypt_handle_t ctx, pre_enc_decrypt_arg_t *args)
+{
+    if (ctx == NULL || args == NULL || args->data_in == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    esp_encrypted_img_t *handle = (esp_encrypted_img_t *)ctx;
+    if (handle == NULL) {
+        ESP_LOGE(TAG, "esp_encrypted_img_decrypt_data: Invalid argument");
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    int curr_index = 0;
+    esp_err_t err = read_header(handle, args, &curr_index);
+    if (err != ESP_OK) {
         return err;
     }
+    return process_bin(handle, args, curr_index);
+}
+
+static esp_err_t verify_auth(esp_encrypted_img_t *handle)
+{
+    if (handle->auth_verified) {
+        return ESP_OK;
+    }
+    unsigned char got_auth[AUTH_SIZE] = {0};
+#if (MBEDTLS_VERSION_NUMBER < 0x03000000)
+    int ret = mbedtls_gcm_finish(&handle->gcm_ctx, got_auth, AUTH_SIZE);
+#else
+    size_t olen;
+    int ret = mbedtls_gcm_finish(&handle->gcm_ctx, NULL, 0, &olen, got_auth, AUTH_SIZE);
+#endif
+    if (ret != 0) {
+        ESP_LOGE(TAG, "Error: %d", ret);
+        return ESP_FAIL;
+    }
+    if (memcmp(got_auth, handle->auth_tag, AUTH_SIZE) != 0) {
+        ESP_LOGE(TAG, "Invalid Auth");
+        return ESP_FAIL;
+    }
+    handle->auth_verified = true;
     return ESP_OK;
 }
 
+static bool buffers_overlap(const uint8_t *a, size_t a_len, const uint8_t *b, size_t b_len)
+{
+    return (uintptr_t)a < (uintptr_t)b + b_len && (uintptr_t)b < (uintptr_t)a + a_len;
+}
+
+// Decrypts encrypted data which follows the header into out, see esp_encrypted_img_decrypt_data_to_buf
+static esp_err_t decrypt_body_to_buf(esp_encrypted_img_t *handle, const uint8_t *in, size_t in_len, size_t *in_used,
+                                     uint8_t *out, size_t out_size, size_t *out_len)
+{
+    size_t len = MIN(in_len, handle->binary_file_len - handle->binary_file_read);
+#if (MBEDTLS_VERSION_NUMBER < 0x03000000)
+    // Before mbedtls 3, only the last update may be a partial block. Partial blocks are collected in cache_buf, so the
+    // output may run ahead of the input, and it can not be decrypted in place.
+    if (buffers_overlap(in, len, out, out_size)) {
+        ESP_LOGE(TAG, "In place decryption requires mbedtls 3");
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    size_t used = 0;
+    size_t produced = 0;
+    if (handle->cache_buf_len != 0) {
+        size_t copy_len = MIN(16 - handle->cache_buf_len, len);
+        memcpy(handle->cache_buf + handle->cache_buf_len, in, copy_len);
+        handle->cache_buf_len += copy_len;
+        handle->binary_file_read += copy_len;
+        used = copy_len;
+        if (handle->cache_buf_len != 16 && handle->binary_file_read != handle->binary_file_len) {
+            *in_used = used;
+            *out_len = 0;
+            return ESP_OK;
+        }
+        if (mbedtls_gcm_update(&handle->gcm_ctx, handle->cache_buf_len, (const unsigned char *)handle->cache_buf, out) != 0) {
+            return ESP_FAIL;
+        }
+        produced = handle->cache_buf_len;
+        handle->cache_buf_len = 0;
+    }
+    size_t block_len = MIN(len - used, out_size - produced);
+    if (handle->binary_file_read + block_len != handle->binary_file_len) {
+        block_len -= block_len % 16;
+    }
+    if (block_len > 0) {
+        if (mbedtls_gcm_update(&handle->gcm_ctx, block_len, in + used, out + produced) != 0) {
+            return ESP_FAIL;
+        }
+        handle->binary_file_read += block_len;
+        used += block_len;
+        produced += block_len;
+    }
+    if (len - used > 0 && len - used < 16) {
+        memcpy(handle->cache_buf, in + used, len - used);
+        handle->cache_buf_len = len - used;
+        handle->binary_file_read += len - used;
+        used = len;
+    }
+    *in_used = used;
+    *out_len = produced;
+#else
+    // GCM is a stream mode in mbedtls 3, any length is decrypted with a single update. The output may be the input
+    // buffer itself. When the caller's chunk started with header bytes, the data follows them, ahead of the output,
+    // and is moved back to it first. Nothing after the data is overwritten, so the unconsumed input stays intact.
+    len = MIN(len, out_size);
+    size_t olen = 0;
+    if (len > 0) {
+        if (in != out && buffers_overlap(in, len, out, len)) {
+            memmove(out, in, len);
+            in = out;
+        }
+        if (mbedtls_gcm_update(&handle->gcm_ctx, in, len, out, out_size, &olen) != 0) {
+            return ESP_FAIL;
+        }
+        handle->binary_file_read += len;
+    }
+    *in_used = len;
+    *out_len = olen;
+#endif
+    return ESP_OK;
+}
+
+// Called at the end of the stream, see esp_encrypted_img_decrypt_data_to_buf
+static esp_err_t end_of_stream(esp_encrypted_img_t *handle, uint8_t *out, size_t *out_len)
+{
+    if (handle->state != ESP_PRE_ENC_DATA_DECODE_STATE || handle->binary_file_read != handle->binary_file_len) {
+        ESP_LOGE(TAG, "Image is incomplete");
+        return ESP_FAIL;
+    }
+#if (MBEDTLS_VERSION_NUMBER < 0x03000000)
+    if (handle->cache_buf_len != 0) {
+        if (mbedtls_gcm_update(&handle->gcm_ctx, handle->cache_buf_len, (const unsigned char *)handle->cache_buf, out) != 0) {
+            return ESP_FAIL;
+        }
+        *out_len = handle->cache_buf_len;
+        handle->cache_buf_len = 0;
+        return ESP_OK;
+    }
+#endif
+    return verify_auth(handle);
+}
+
+esp_err_t esp_encrypted_img_decrypt_data_to_buf(esp_decrypt_handle_t ctx, const uint8_t *in, size_t in_len, size_t *in_used,
+        uint8_t *out, size_t out_size, size_t *out_len)
+{
+    if (ctx == NULL || in_used == NULL || out == NULL || out_len == NULL || out_size < MIN_OUT_SIZE || (in == NULL && in_len > 0)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    // Only out == in is decrypted in place, output at another offset would overwrite input which is not consumed yet
+    if (in != NULL && in != out && buffers_overlap(in, in_len, out, out_size)) {
+        ESP_LOGE(TAG, "Input and output buffers overlap");
+        return ESP_ERR_INVALID_ARG;
+    }
+    esp_encrypted_img_t *handle = (esp_encrypted_img_t *)ctx;
+
+    *in_used = 0;
+    *out_len = 0;
+    if (in == NULL) {
+        return end_of_stream(handle, out, out_len);
+    }
+    int curr_index = 0;
+    if (handle->state != ESP_PRE_ENC_DATA_DECODE_STATE) {
+        pre_enc_decrypt_arg_t args = {
+            .data_in = (const char *)in,
+            .data_in_len = in_len,
+        };
+        esp_err_t err = read_header(handle, &args, &curr_index);
+        if (err == ESP_ERR_NOT_FINISHED) {
+            *in_used = in_len;
+            return ESP_OK;
+        } else if (err != ESP_OK) {
+            return err;
+        }
+    }
+    size_t used = 0;
+    esp_err_t err = decrypt_body_to_buf(handle, in + curr_index, in_len - curr_index, &used, out, out_size, out_len);
+    *in_used = curr_index + used;
+    return err;
+}
+
 esp_err_t esp_encrypted_img_decrypt_end(esp_decrypt_handle_t ctx)
 {
     if (ctx == NULL) {
@@ -427,22 +791,8 @@ esp_err_t esp_encrypted_img_decrypt_end(esp_decrypt_handle_t ctx)
             err = ESP_FAIL;
             goto exit;
         }
-
-        unsigned char got_auth[AUTH_SIZE] = {0};
-#if (MBEDTLS_VERSION_NUMBER < 0x03000000)
-        err = mbedtls_gcm_finish(&handle->gcm_ctx, got_auth, AUTH_SIZE);
-#else
-        size_t olen;
-        err = mbedtls_gcm_finish(&handle->gcm_ctx, NULL, 0, &olen, got_auth, AUTH_SIZE);
-#endif
-        if (err != 0) {
-            ESP_LOGE(TAG, "Error: %d", err);
-            err = ESP_FAIL;
-            goto exit;
-        }
-        if (memcmp(got_auth, handle->auth_tag, AUTH_SIZE) != 0) {
-            ESP_LOGE(TAG, "Invalid Auth");
-            err = ESP_FAIL;
+        err = verify_auth(handle);
+        if (err != ESP_OK) {
             goto exit;
         }
     }
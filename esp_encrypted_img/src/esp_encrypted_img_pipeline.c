@@ -0,0 +1,403 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <esp_log.h>
+#include <esp_err.h>
+#include <esp_timer.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_encrypted_img.h"
+#include "sys/param.h"
+
+static const char *TAG = "esp_encrypted_img_pipeline";
+
+typedef struct {
+    uint8_t *data;
+    size_t len;
+} pipeline_buf_t;
+
+// Buffers go round from free_queue to the feeding task, which fills them, through decrypt_queue to the decrypt task, which decrypts each
+// of them into another free buffer, through write_queue to the write task, and back to free_queue. A NULL item in
+// decrypt_queue and write_queue ends the image.
+typedef struct {
+    esp_decrypt_handle_t decrypt_handle;
+    esp_encrypted_img_write_cb_t write_cb;
+    void *user_ctx;
+    size_t buffer_size;
+    size_t num_bufs;
+    pipeline_buf_t *bufs;
+    uint8_t *mem;
+    QueueHandle_t free_queue;
+    QueueHandle_t decrypt_queue;
+    QueueHandle_t write_queue;
+    pipeline_buf_t *filling;        // buffer being filled by esp_encrypted_img_pipeline_feed()
+    SemaphoreHandle_t exited;
+    size_t running_tasks;
+    bool finished;
+    esp_err_t err;
+    esp_encrypted_img_pipeline_stats_t stats;
+    portMUX_TYPE lock;
+} esp_encrypted_img_pipeline_t;
+
+static esp_err_t get_err(esp_encrypted_img_pipeline_t *pipe)
+{
+    portENTER_CRITICAL(&pipe->lock);
+    esp_err_t err = pipe->err;
+    portEXIT_CRITICAL(&pipe->lock);
+    return err;
+}
+
+// Keeps the first error, the stages skip their work from then on
+static void set_err(esp_encrypted_img_pipeline_t *pipe, esp_err_t err)
+{
+    portENTER_CRITICAL(&pipe->lock);
+    if (pipe->err == ESP_OK) {
+        pipe->err = err;
+    }
+    portEXIT_CRITICAL(&pipe->lock);
+}
+
+static void update_queue_max(esp_encrypted_img_pipeline_t *pipe, QueueHandle_t queue, uint32_t *max)
+{
+    uint32_t waiting = uxQueueMessagesWaiting(queue);
+    portENTER_CRITICAL(&pipe->lock);
+    if (waiting > *max) {
+        *max = waiting;
+    }
+    portEXIT_CRITICAL(&pipe->lock);
+}
+
+static void add_time(esp_encrypted_img_pipeline_t *pipe, int64_t *total, int64_t since)
+{
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&pipe->lock);
+    *total += now - since;
+    portEXIT_CRITICAL(&pipe->lock);
+}
+
+static pipeline_buf_t *take_free_buf(esp_encrypted_img_pipeline_t *pipe, int64_t *wait_us)
+{
+    pipeline_buf_t *buf;
+    int64_t start = esp_timer_get_time();
+    xQueueReceive(pipe->free_queue, &buf, portMAX_DELAY);
+    add_time(pipe, wait_us, start);
+    buf->len = 0;
+    return buf;
+}
+
+static void send_to_writer(esp_encrypted_img_pipeline_t *pipe, pipeline_buf_t *buf)
+{
+    int64_t start = esp_timer_get_time();
+    xQueueSend(pipe->write_queue, &buf, portMAX_DELAY);
+    add_time(pipe, &pipe->stats.decrypt_wait_us, start);
+    update_queue_max(pipe, pipe->write_queue, &pipe->stats.write_queue_max);
+}
+
+// Decrypts in into out, passing out on to the write task and replacing it with a free buffer each time it holds data.
+// in == NULL ends the image.
+static esp_err_t decrypt_buf(esp_encrypted_img_pipeline_t *pipe, const pipeline_buf_t *in, pipeline_buf_t **out)
+{
+    const uint8_t *data = in ? in->data : NULL;
+    size_t len = in ? in->len : 0;
+    while (len > 0 || in == NULL) {
+        size_t in_used = 0;
+        size_t out_len = 0;
+        int64_t start = esp_timer_get_time();
+        esp_err_t err = esp_encrypted_img_decrypt_data_to_buf(pipe->decrypt_handle, data, len, &in_used,
+                        (*out)->data, pipe->buffer_size, &out_len);
+        add_time(pipe, &pipe->stats.decrypt_us, start);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Decryption failed: %s", esp_err_to_name(err));
+            return err;
+        }
+        if (in_used > len || out_len > pipe->buffer_size) {
+            ESP_LOGE(TAG, "Decryption reported more data than it was given");
+            return ESP_FAIL;
+        }
+        data += in_used;
+        len -= in_used;
+        if (out_len == 0) {
+            if (in == NULL) {
+                break;
+            }
+            if (in_used == 0) {
+                ESP_LOGE(TAG, "Decryption made no progress");
+                return ESP_FAIL;
+            }
+            continue;
+        }
+        (*out)->len = out_len;
+        send_to_writer(pipe, *out);
+        *out = take_free_buf(pipe, &pipe->stats.decrypt_wait_us);
+    }
+    return ESP_OK;
+}
+
+static void decrypt_task(void *arg)
+{
+    esp_encrypted_img_pipeline_t *pipe = (esp_encrypted_img_pipeline_t *)arg;
+    pipeline_buf_t *out = take_free_buf(pipe, &pipe->stats.decrypt_wait_us);
+
+    while (true) {
+        pipeline_buf_t *in;
+        int64_t start = esp_timer_get_time();
+        xQueueReceive(pipe->decrypt_queue, &in, portMAX_DELAY);
+        add_time(pipe, &pipe->stats.decrypt_wait_us, start);
+        // After an error the buffers are only given back, so that a blocked feed or finish returns
+        if (get_err(pipe) == ESP_OK) {
+            esp_err_t err = decrypt_buf(pipe, in, &out);
+            if (err != ESP_OK) {
+                set_err(pipe, err);
+            }
+        }
+        if (in == NULL) {
+            break;
+        }
+        xQueueSend(pipe->free_queue, &in, portMAX_DELAY);
+    }
+    xQueueSend(pipe->free_queue, &out, portMAX_DELAY);
+    out = NULL;
+    xQueueSend(pipe->write_queue, &out, portMAX_DELAY);
+
+    xSemaphoreGive(pipe->exited);
+    vTaskDelete(NULL);
+}
+
+static void write_task(void *arg)
+{
+    esp_encrypted_img_pipeline_t *pipe = (esp_encrypted_img_pipeline_t *)arg;
+
+    while (true) {
+        pipeline_buf_t *buf;
+        int64_t start = esp_timer_get_time();
+        xQueueReceive(pipe->write_queue, &buf, portMAX_DELAY);
+        add_time(pipe, &pipe->stats.write_wait_us, start);
+        if (buf == NULL) {
+            break;
+        }
+        if (get_err(pipe) == ESP_OK) {
+            start = esp_timer_get_time();
+            esp_err_t err = pipe->write_cb(buf->data, buf->len, pipe->user_ctx);
+            add_time(pipe, &pipe->stats.write_us, start);
+            if (err != ESP_OK) {
+                ESP_LOGE(TAG, "Write callback failed: %s", esp_err_to_name(err));
+                set_err(pipe, err);
+            } else {
+                portENTER_CRITICAL(&pipe->lock);
+                pipe->stats.bytes_out += buf->len;
+                portEXIT_CRITICAL(&pipe->lock);
+            }
+        }
+        xQueueSend(pipe->free_queue, &buf, portMAX_DELAY);
+    }
+
+    xSemaphoreGive(pipe->exited);
+    vTaskDelete(NULL);
+}
+
+static void send_to_decrypt(esp_encrypted_img_pipeline_t *pipe, pipeline_buf_t *buf)
+{
+    int64_t start = esp_timer_get_time();
+    xQueueSend(pipe->decrypt_queue, &buf, portMAX_DELAY);
+    add_time(pipe, &pipe->stats.feed_wait_us, start);
+    update_queue_max(pipe, pipe->decrypt_queue, &pipe->stats.decrypt_queue_max);
+}
+
+// Passes on the partly filled buffer, ends the image and waits for both tasks to exit
+static void stop_tasks(esp_encrypted_img_pipeline_t *pipe)
+{
+    if (pipe->filling) {
+        if (pipe->filling->len > 0) {
+            send_to_decrypt(pipe, pipe->filling);
+        } else {
+            xQueueSend(pipe->free_queue, &pipe->filling, portMAX_DELAY);
+        }
+        pipe->filling = NULL;
+    }
+    // The decrypt task passes the end on to the write task
+    pipeline_buf_t *end = NULL;
+    if (pipe->running_tasks > 0) {
+        xQueueSend(pipe->decrypt_queue, &end, portMAX_DELAY);
+    }
+    for (size_t i = 0; i < pipe->running_tasks; i++) {
+        xSemaphoreTake(pipe->exited, portMAX_DELAY);
+    }
+    pipe->running_tasks = 0;
+    pipe->finished = true;
+}
+
+static void pipeline_free(esp_encrypted_img_pipeline_t *pipe)
+{
+    if (pipe->free_queue) {
+        vQueueDelete(pipe->free_queue);
+    }
+    if (pipe->decrypt_queue) {
+        vQueueDelete(pipe->decrypt_queue);
+    }
+    if (pipe->write_queue) {
+        vQueueDelete(pipe->write_queue);
+    }
+    if (pipe->exited) {
+        vSemaphoreDelete(pipe->exited);
+    }
+    free(pipe->mem);
+    free(pipe->bufs);
+    free(pipe);
+}
+
+static BaseType_t task_core(int core)
+{
+    return core < 0 ? tskNO_AFFINITY : (BaseType_t)core;
+}
+
+esp_err_t esp_encrypted_img_pipeline_start(const esp_encrypted_img_pipeline_cfg_t *cfg, esp_encrypted_img_pipeline_handle_t *handle)
+{
+    if (cfg == NULL || handle == NULL || cfg->decrypt_handle == NULL || cfg->write_cb == NULL ||
+            (cfg->buffer_size != 0 && cfg->buffer_size < 16) ||
+            cfg->decrypt_task_core >= portNUM_PROCESSORS || cfg->write_task_core >= portNUM_PROCESSORS) {
+        ESP_LOGE(TAG, "esp_encrypted_img_pipeline_start: Invalid argument");
+        return ESP_ERR_INVALID_ARG;
+    }
+    esp_encrypted_img_pipeline_t *pipe = calloc(1, sizeof(esp_encrypted_img_pipeline_t));
+    if (!pipe) {
+        ESP_LOGE(TAG, "Couldn't allocate memory to pipeline handle");
+        return ESP_ERR_NO_MEM;
+    }
+    portMUX_INITIALIZE(&pipe->lock);
+    pipe->decrypt_handle = cfg->decrypt_handle;
+    pipe->write_cb = cfg->write_cb;
+    pipe->user_ctx = cfg->user_ctx;
+    pipe->buffer_size = cfg->buffer_size ? cfg->buffer_size : ESP_ENCRYPTED_IMG_PIPELINE_BUFFER_SIZE;
+    size_t queue_depth = cfg->queue_depth ? cfg->queue_depth : ESP_ENCRYPTED_IMG_PIPELINE_QUEUE_DEPTH;
+    size_t stack_size = cfg->task_stack_size ? cfg->task_stack_size : ESP_ENCRYPTED_IMG_PIPELINE_TASK_STACK_SIZE;
+    unsigned priority = cfg->task_priority ? cfg->task_priority : ESP_ENCRYPTED_IMG_PIPELINE_TASK_PRIORITY;
+
+    // Besides the queued buffers, the feeding task, the write task and the decrypt task (input and output) hold one each.
+    // Buffers which are not queued for the decrypt task always come back through the write task, so the decrypt task
+    // gets its output buffers even when the feeding task has filled decrypt_queue.
+    pipe->num_bufs = 2 * queue_depth + 2;
+    pipe->bufs = calloc(pipe->num_bufs, sizeof(pipeline_buf_t));
+    pipe->mem = malloc(pipe->num_bufs * pipe->buffer_size);
+    pipe->free_queue = xQueueCreate(pipe->num_bufs, sizeof(pipeline_buf_t *));
+    pipe->decrypt_queue = xQueueCreate(queue_depth, sizeof(pipeline_buf_t *));
+    pipe->write_queue = xQueueCreate(queue_depth + 1, sizeof(pipeline_buf_t *));
+    pipe->exited = xSemaphoreCreateCounting(2, 0);
+    if (!pipe->bufs || !pipe->mem || !pipe->free_queue || !pipe->decrypt_queue || !pipe->write_queue || !pipe->exited) {
+        ESP_LOGE(TAG, "Couldn't allocate memory for the pipeline buffers");
+        pipeline_free(pipe);
+        return ESP_ERR_NO_MEM;
+    }
+    for (size_t i = 0; i < pipe->num_bufs; i++) {
+        pipeline_buf_t *buf = &pipe->bufs[i];
+        buf->data = pipe->mem + i * pipe->buffer_size;
+        xQueueSend(pipe->free_queue, &buf, 0);
+    }
+
+    if (xTaskCreatePinnedToCore(decrypt_task, "enc_img_decrypt", stack_size, pipe, priority, NULL,
+                                task_core(cfg->decrypt_task_core)) != pdPASS) {
+        ESP_LOGE(TAG, "Couldn't create the decrypt task");
+        pipeline_free(pipe);
+        return ESP_ERR_NO_MEM;
+    }
+    pipe->running_tasks = 1;
+    if (xTaskCreatePinnedToCore(write_task, "enc_img_write", stack_size, pipe, priority, NULL,
+                                task_core(cfg->write_task_core)) != pdPASS) {
+        ESP_LOGE(TAG, "Couldn't create the write task");
+        set_err(pipe, ESP_ERR_NO_MEM);
+        stop_tasks(pipe);
+        pipeline_free(pipe);
+        return ESP_ERR_NO_MEM;
+    }
+    pipe->running_tasks = 2;
+    *handle = (esp_encrypted_img_pipeline_handle_t)pipe;
+    return ESP_OK;
+}
+
+esp_err_t esp_encrypted_img_pipeline_feed(esp_encrypted_img_pipeline_handle_t handle, const void *data, size_t len)
+{
+    if (handle == NULL || (data == NULL && len > 0)) {
+        ESP_LOGE(TAG, "esp_encrypted_img_pipeline_feed: Invalid argument");
+        return ESP_ERR_INVALID_ARG;
+    }
+    esp_encrypted_img_pipeline_t *pipe = (esp_encrypted_img_pipeline_t *)handle;
+    if (pipe->finished) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    const uint8_t *in = (const uint8_t *)data;
+    while (len > 0) {
+        esp_err_t err = get_err(pipe);
+        if (err != ESP_OK) {
+            return err;
+        }
+        if (pipe->filling == NULL) {
+            pipe->filling = take_free_buf(pipe, &pipe->stats.feed_wait_us);
+        }
+        pipeline_buf_t *buf = pipe->filling;
+        size_t copy_len = MIN(len, pipe->buffer_size - buf->len);
+        memcpy(buf->data + buf->len, in, copy_len);
+        buf->len += copy_len;
+        in += copy_len;
+        len -= copy_len;
+        portENTER_CRITICAL(&pipe->lock);
+        pipe->stats.bytes_in += copy_len;
+        portEXIT_CRITICAL(&pipe->lock);
+
+        if (buf->len == pipe->buffer_size) {
+            pipe->filling = NULL;
+            send_to_decrypt(pipe, buf);
+        }
+    }
+    return get_err(pipe);
+}
+
+esp_err_t esp_encrypted_img_pipeline_finish(esp_encrypted_img_pipeline_handle_t handle)
+{
+    if (handle == NULL) {
+        ESP_LOGE(TAG, "esp_encrypted_img_pipeline_finish: Invalid argument");
+        return ESP_ERR_INVALID_ARG;
+    }
+    esp_encrypted_img_pipeline_t *pipe = (esp_encrypted_img_pipeline_t *)handle;
+    if (pipe->finished) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    stop_tasks(pipe);
+    return get_err(pipe);
+}
+
+esp_err_t esp_encrypted_img_pipeline_get_stats(esp_encrypted_img_pipeline_handle_t handle, esp_encrypted_img_pipeline_stats_t *stats)
+{
+    if (handle == NULL || stats == NULL) {
+        ESP_LOGE(TAG, "esp_encrypted_img_pipeline_get_stats: Invalid argument");
+        return ESP_ERR_INVALID_ARG;
+    }
+    esp_encrypted_img_pipeline_t *pipe = (esp_encrypted_img_pipeline_t *)handle;
+    portENTER_CRITICAL(&pipe->lock);
+    *stats = pipe->stats;
+    portEXIT_CRITICAL(&pipe->lock);
+    return ESP_OK;
+}
+
+esp_err_t esp_encrypted_img_pipeline_delete(esp_encrypted_img_pipeline_handle_t handle)
+{
+    if (handle == NULL) {
+        ESP_LOGE(TAG, "esp_encrypted_img_pipeline_delete: Invalid argument");
+        return ESP_ERR_INVALID_ARG;
+    }
+    esp_encrypted_img_pipeline_t *pipe = (esp_encrypted_img_pipeline_t *)handle;
+    if (!pipe->finished) {
+        set_err(pipe, ESP_FAIL);
+        stop_tasks(pipe);
+    }
+    pipeline_free(pipe);
+    return ESP_OK;
+}
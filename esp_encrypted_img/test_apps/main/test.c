@@ -4,7 +4,10 @@
  * SPDX-License-Identifier: Unlicense OR CC0-1.0
  */
 #include <stdio.h>
+#include <string.h>
+#include <sys/param.h>
 #include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
 
 #include "unity.h"
 #if __has_include("esp_random.h")
@@ -20,6 +23,12 @@ extern const uint8_t rsa_private_pem_end[]   asm("_binary_test_rsa_private_key_p
 extern const uint8_t bin_start[] asm("_binary_image_bin_start");
 extern const uint8_t bin_end[]   asm("_binary_image_bin_end");
 
+extern const uint8_t ecdh_private_pem_start[] asm("_binary_test_ecdh_p256_private_key_pem_start");
+extern const uint8_t ecdh_private_pem_end[]   asm("_binary_test_ecdh_p256_private_key_pem_end");
+
+extern const uint8_t ecdh_bin_start[] asm("_binary_image_ecdh_bin_start");
+extern const uint8_t ecdh_bin_end[]   asm("_binary_image_ecdh_bin_end");
+
 TEST_CASE("Sending all data at once", "[encrypted_img]")
 {
     esp_decrypt_cfg_t cfg = {
@@ -357,3 +366,215 @@ TEST_CASE("Test canceling decryption frees memory", "[encrypted_img]")
     // +/- 16 bytes to allow for some small fluctuations
     TEST_ASSERT(abs(free_bytes_start - free_bytes_end) <= 16);
 }
+
+TEST_CASE("Decrypting into a caller buffer", "[encrypted_img]")
+{
+    esp_decrypt_cfg_t cfg = {
+        .rsa_priv_key = (char *)rsa_private_pem_start,
+        .rsa_priv_key_len = rsa_private_pem_end - rsa_private_pem_start,
+    };
+
+    // Reference output of esp_encrypted_img_decrypt_data
+    esp_decrypt_handle_t ctx = esp_encrypted_img_decrypt_start(&cfg);
+    TEST_ASSERT_NOT_NULL(ctx);
+    pre_enc_decrypt_arg_t args = {
+        .data_in = (char *)bin_start,
+        .data_in_len = bin_end - bin_start,
+    };
+    TEST_ESP_OK(esp_encrypted_img_decrypt_data(ctx, &args));
+    TEST_ESP_OK(esp_encrypted_img_decrypt_end(ctx));
+
+    ctx = esp_encrypted_img_decrypt_start(&cfg);
+    TEST_ASSERT_NOT_NULL(ctx);
+    uint8_t *decrypted = calloc(1, args.data_out_len);
+    TEST_ASSERT_NOT_NULL(decrypted);
+    uint8_t buf[100];
+    size_t decrypted_len = 0;
+    // Output which overlaps the input at another offset would overwrite input which is not consumed yet
+    size_t unused_in, unused_out;
+    memcpy(buf, bin_start, sizeof(buf));
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, esp_encrypted_img_decrypt_data_to_buf(ctx, buf, sizeof(buf) - 16, &unused_in,
+                      buf + 16, sizeof(buf) - 16, &unused_out));
+    for (size_t i = 0; i < bin_end - bin_start; i += sizeof(buf)) {
+        size_t len = MIN(sizeof(buf), (bin_end - bin_start) - i);
+        memcpy(buf, bin_start + i, len);
+        const uint8_t *in = buf;
+        while (len > 0) {
+            size_t in_used = 0;
+            size_t out_len = 0;
+#if (ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0))
+            // In place
+            uint8_t *out = buf + (in - buf);
+            size_t out_size = len;
+#else
+            uint8_t out[16];
+            size_t out_size = sizeof(out);
+#endif
+            TEST_ESP_OK(esp_encrypted_img_decrypt_data_to_buf(ctx, in, len, &in_used, out, out_size, &out_len));
+            TEST_ASSERT(in_used > 0 || out_len > 0);
+            TEST_ASSERT(decrypted_len + out_len <= args.data_out_len);
+            memcpy(decrypted + decrypted_len, out, out_len);
+            decrypted_len += out_len;
+            in += in_used;
+            len -= in_used;
+        }
+    }
+    TEST_ASSERT_TRUE(esp_encrypted_img_is_complete_data_received(ctx));
+    size_t in_used = 0;
+    size_t out_len = 0;
+    do {
+        TEST_ESP_OK(esp_encrypted_img_decrypt_data_to_buf(ctx, NULL, 0, &in_used, buf, sizeof(buf), &out_len));
+        memcpy(decrypted + decrypted_len, buf, out_len);
+        decrypted_len += out_len;
+    } while (out_len > 0);
+    TEST_ESP_OK(esp_encrypted_img_decrypt_end(ctx));
+
+    TEST_ASSERT_EQUAL_UINT32(args.data_out_len, decrypted_len);
+    TEST_ASSERT_EQUAL_MEMORY(args.data_out, decrypted, decrypted_len);
+    free(decrypted);
+    free(args.data_out);
+}
+
+TEST_CASE("Reusing a parsed key", "[encrypted_img]")
+{
+    esp_decrypt_key_handle_t key = esp_encrypted_img_key_create((const char *)rsa_private_pem_start,
+                                   rsa_private_pem_end - rsa_private_pem_start);
+    TEST_ASSERT_NOT_NULL(key);
+    esp_decrypt_cfg_t cfg = {
+        .key = key,
+    };
+    pre_enc_decrypt_arg_t args[2] = {0};
+    for (int i = 0; i < 2; i++) {
+        esp_decrypt_handle_t ctx = esp_encrypted_img_decrypt_start(&cfg);
+        TEST_ASSERT_NOT_NULL(ctx);
+        args[i].data_in = (char *)bin_start;
+        args[i].data_in_len = bin_end - bin_start;
+        TEST_ESP_OK(esp_encrypted_img_decrypt_data(ctx, &args[i]));
+        TEST_ESP_OK(esp_encrypted_img_decrypt_end(ctx));
+    }
+    TEST_ASSERT_EQUAL_UINT32(args[0].data_out_len, args[1].data_out_len);
+    TEST_ASSERT_EQUAL_MEMORY(args[0].data_out, args[1].data_out, args[0].data_out_len);
+    free(args[0].data_out);
+    free(args[1].data_out);
+    TEST_ESP_OK(esp_encrypted_img_key_delete(key));
+}
+
+typedef struct {
+    uint8_t *buf;
+    size_t size;
+    size_t len;
+} pipeline_output_t;
+
+static esp_err_t pipeline_write_cb(const uint8_t *data, size_t len, void *user_ctx)
+{
+    pipeline_output_t *output = (pipeline_output_t *)user_ctx;
+    if (output->len + len > output->size) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    memcpy(output->buf + output->len, data, len);
+    output->len += len;
+    return ESP_OK;
+}
+
+TEST_CASE("Decrypting through a pipeline", "[encrypted_img]")
+{
+    esp_decrypt_cfg_t cfg = {
+        .rsa_priv_key = (char *)rsa_private_pem_start,
+        .rsa_priv_key_len = rsa_private_pem_end - rsa_private_pem_start,
+    };
+
+    // Reference output of esp_encrypted_img_decrypt_data
+    esp_decrypt_handle_t ctx = esp_encrypted_img_decrypt_start(&cfg);
+    TEST_ASSERT_NOT_NULL(ctx);
+    pre_enc_decrypt_arg_t args = {
+        .data_in = (char *)bin_start,
+        .data_in_len = bin_end - bin_start,
+    };
+    TEST_ESP_OK(esp_encrypted_img_decrypt_data(ctx, &args));
+    TEST_ESP_OK(esp_encrypted_img_decrypt_end(ctx));
+
+    pipeline_output_t output = {
+        .buf = calloc(1, args.data_out_len),
+        .size = args.data_out_len,
+    };
+    TEST_ASSERT_NOT_NULL(output.buf);
+    ctx = esp_encrypted_img_decrypt_start(&cfg);
+    TEST_ASSERT_NOT_NULL(ctx);
+    esp_encrypted_img_pipeline_cfg_t pipeline_cfg = ESP_ENCRYPTED_IMG_PIPELINE_DEFAULT_CFG();
+    pipeline_cfg.decrypt_handle = ctx;
+    pipeline_cfg.write_cb = pipeline_write_cb;
+    pipeline_cfg.user_ctx = &output;
+    pipeline_cfg.buffer_size = 256;
+#if CONFIG_FREERTOS_UNICORE == 0
+    pipeline_cfg.decrypt_task_core = 1;
+    pipeline_cfg.write_task_core = 0;
+#endif
+    esp_encrypted_img_pipeline_handle_t pipeline;
+    TEST_ESP_OK(esp_encrypted_img_pipeline_start(&pipeline_cfg, &pipeline));
+    for (size_t i = 0; i < bin_end - bin_start; i += 100) {
+        TEST_ESP_OK(esp_encrypted_img_pipeline_feed(pipeline, bin_start + i, MIN(100, (bin_end - bin_start) - i)));
+    }
+    TEST_ESP_OK(esp_encrypted_img_pipeline_finish(pipeline));
+    esp_encrypted_img_pipeline_stats_t stats;
+    TEST_ESP_OK(esp_encrypted_img_pipeline_get_stats(pipeline, &stats));
+    TEST_ESP_OK(esp_encrypted_img_pipeline_delete(pipeline));
+    TEST_ESP_OK(esp_encrypted_img_decrypt_end(ctx));
+
+    TEST_ASSERT_EQUAL_UINT32(bin_end - bin_start, stats.bytes_in);
+    TEST_ASSERT_EQUAL_UINT32(args.data_out_len, stats.bytes_out);
+    TEST_ASSERT_EQUAL_UINT32(args.data_out_len, output.len);
+    TEST_ASSERT_EQUAL_MEMORY(args.data_out, output.buf, output.len);
+
+    // A wrong authentication tag fails the pipeline
+    uint8_t *corrupted = malloc(bin_end - bin_start);
+    TEST_ASSERT_NOT_NULL(corrupted);
+    memcpy(corrupted, bin_start, bin_end - bin_start);
+    corrupted[(bin_end - bin_start) - 1] ^= 1;
+    output.len = 0;
+    ctx = esp_encrypted_img_decrypt_start(&cfg);
+    TEST_ASSERT_NOT_NULL(ctx);
+    TEST_ESP_OK(esp_encrypted_img_pipeline_start(&pipeline_cfg, &pipeline));
+    TEST_ESP_OK(esp_encrypted_img_pipeline_feed(pipeline, corrupted, bin_end - bin_start));
+    TEST_ESP_ERR(ESP_FAIL, esp_encrypted_img_pipeline_finish(pipeline));
+    TEST_ESP_OK(esp_encrypted_img_pipeline_delete(pipeline));
+    TEST_ESP_OK(esp_encrypted_img_decrypt_abort(ctx));
+
+    free(corrupted);
+    free(output.buf);
+    free(args.data_out);
+    // Let the idle task free the stacks of the pipeline tasks
+    vTaskDelay(pdMS_TO_TICKS(10));
+}
+
+#if (ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0))
+TEST_CASE("Image with an ECDH key wrap", "[encrypted_img]")
+{
+    esp_decrypt_key_handle_t key = esp_encrypted_img_key_create((const char *)ecdh_private_pem_start,
+                                   ecdh_private_pem_end - ecdh_private_pem_start);
+    TEST_ASSERT_NOT_NULL(key);
+    esp_decrypt_cfg_t cfg = {
+        .key = key,
+    };
+    esp_decrypt_handle_t ctx = esp_encrypted_img_decrypt_start(&cfg);
+    TEST_ASSERT_NOT_NULL(ctx);
+    pre_enc_decrypt_arg_t args = {
+        .data_in = (char *)ecdh_bin_start,
+        .data_in_len = ecdh_bin_end - ecdh_bin_start,
+    };
+    TEST_ESP_OK(esp_encrypted_img_decrypt_data(ctx, &args));
+    TEST_ESP_OK(esp_encrypted_img_decrypt_end(ctx));
+    TEST_ASSERT_EQUAL_UINT32(4096, args.data_out_len);
+    free(args.data_out);
+
+    // The key does not match the key wrap of the RSA image
+    ctx = esp_encrypted_img_decrypt_start(&cfg);
+    TEST_ASSERT_NOT_NULL(ctx);
+    args = (pre_enc_decrypt_arg_t) {
+        .data_in = (char *)bin_start,
+        .data_in_len = bin_end - bin_start,
+    };
+    TEST_ESP_ERR(ESP_FAIL, esp_encrypted_img_decrypt_data(ctx, &args));
+    TEST_ESP_OK(esp_encrypted_img_decrypt_abort(ctx));
+    TEST_ESP_OK(esp_encrypted_img_key_delete(key));
+}
+#endif
@@ -1,21 +1,28 @@
 #!/usr/bin/env python
 #
 # Encrypted image generation tool. This tool helps in generating encrypted binary image
-# in pre-defined format with assistance of RSA-3072 bit key.
+# in pre-defined format with assistance of RSA-3072 bit key, or of a P-256 or X25519 key
+# for an ECDH key wrap.
 #
-# SPDX-FileCopyrightText: 2022-2023 Espressif Systems (Shanghai) CO LTD
+# SPDX-FileCopyrightText: 2022-2024 Espressif Systems (Shanghai) CO LTD
 # SPDX-License-Identifier: Apache-2.0
 
 import argparse
 import os
 import sys
 
+from cryptography.hazmat.primitives import hashes
 from cryptography.hazmat.primitives import serialization
+from cryptography.hazmat.primitives.asymmetric import ec
 from cryptography.hazmat.primitives.asymmetric import padding
+from cryptography.hazmat.primitives.asymmetric import x25519
 from cryptography.hazmat.primitives.ciphers.aead import AESGCM
+from cryptography.hazmat.primitives.kdf.x963kdf import X963KDF
 
 # Magic Byte is created using command: echo -n "esp_encrypted_img" | sha256sum
 esp_enc_img_magic = 0x0788b6cf
+# Magic Byte of images with an ECDH key wrap: echo -n "esp_encrypted_img_ecdh" | sha256sum
+esp_enc_img_ecdh_magic = 0x2b737f66
 
 GCM_KEY_SIZE = 32
 MAGIC_SIZE = 4
@@ -25,6 +32,10 @@ BIN_SIZE_DATA = 4
 AUTH_SIZE = 16
 RESERVED_HEADER = (512 - (MAGIC_SIZE + ENC_GCM_KEY_SIZE + IV_SIZE + BIN_SIZE_DATA + AUTH_SIZE))
 
+# ECDH key wrap, in place of the RSA encrypted GCM key: wrapped GCM key, its tag, ephemeral public key
+WRAP_TAG_SIZE = 16
+WRAP_IV = bytes(12)
+
 
 def generate_key_GCM(size: int) -> bytes:
     return os.urandom(int(size))
@@ -40,6 +51,51 @@ def encrypt_binary(plaintext: bytes, key: bytes, IV: bytes) -> tuple:
     return ct[:len(plaintext)], ct[len(plaintext):]
 
 
+def derive_kek(shared_secret: bytes, ephemeral_public_key: bytes) -> bytes:
+    return X963KDF(algorithm=hashes.SHA256(), length=GCM_KEY_SIZE, sharedinfo=ephemeral_public_key).derive(shared_secret)
+
+
+def wrap_gcm_key(gcm_key: bytes, public_key) -> bytes:  # type: ignore
+    if isinstance(public_key, x25519.X25519PublicKey):
+        ephemeral_key = x25519.X25519PrivateKey.generate()
+        shared_secret = ephemeral_key.exchange(public_key)
+        ephemeral_public_key = ephemeral_key.public_key().public_bytes(serialization.Encoding.Raw,
+                                                                       serialization.PublicFormat.Raw)
+    else:
+        ephemeral_key = ec.generate_private_key(public_key.curve)
+        shared_secret = ephemeral_key.exchange(ec.ECDH(), public_key)
+        ephemeral_public_key = ephemeral_key.public_key().public_bytes(serialization.Encoding.X962,
+                                                                       serialization.PublicFormat.UncompressedPoint)
+    # Every image has its own ephemeral key, and so its own key encryption key, the fixed IV is never reused with a key
+    wrapped_key = AESGCM(derive_kek(shared_secret, ephemeral_public_key)).encrypt(WRAP_IV, gcm_key, None)
+    wrap = wrapped_key + ephemeral_public_key
+    return wrap + bytes(ENC_GCM_KEY_SIZE - len(wrap))
+
+
+def unwrap_gcm_key(wrap: bytes, private_key) -> bytes:  # type: ignore
+    wrapped_key = wrap[:GCM_KEY_SIZE + WRAP_TAG_SIZE]
+    ephemeral_public_key = wrap[GCM_KEY_SIZE + WRAP_TAG_SIZE:]
+    if isinstance(private_key, x25519.X25519PrivateKey):
+        ephemeral_public_key = ephemeral_public_key[:32]
+        shared_secret = private_key.exchange(x25519.X25519PublicKey.from_public_bytes(ephemeral_public_key))
+    else:
+        ephemeral_public_key = ephemeral_public_key[:65]
+        peer = ec.EllipticCurvePublicKey.from_encoded_point(private_key.curve, ephemeral_public_key)
+        shared_secret = private_key.exchange(ec.ECDH(), peer)
+    return AESGCM(derive_kek(shared_secret, ephemeral_public_key)).decrypt(WRAP_IV, wrapped_key, None)
+
+
+def is_ecdh_key(key) -> bool:  # type: ignore
+    if isinstance(key, (x25519.X25519PrivateKey, x25519.X25519PublicKey)):
+        return True
+    if isinstance(key, (ec.EllipticCurvePrivateKey, ec.EllipticCurvePublicKey)):
+        if not isinstance(key.curve, ec.SECP256R1):
+            print('Error: Only P-256 elliptic curve keys are supported', file=sys.stderr)
+            raise SystemExit(1)
+        return True
+    return False
+
+
 def encrypt(input_file: str, rsa_key_file_name: str, output_file: str) -> None:
     print('Encrypting image ...')
     with open(input_file, 'rb') as image:
@@ -47,7 +103,7 @@ def encrypt(input_file: str, rsa_key_file_name: str, output_file: str) -> None:
 
     with open(rsa_key_file_name, 'rb') as key_file:
         key_data = key_file.read()
-        if b"-BEGIN RSA PRIVATE KEY" in key_data or b"-BEGIN PRIVATE KEY" in key_data:
+        if b"-BEGIN RSA PRIVATE KEY" in key_data or b"-BEGIN EC PRIVATE KEY" in key_data or b"-BEGIN PRIVATE KEY" in key_data:
             private_key = serialization.load_pem_private_key(key_data, password=None)
             public_key = private_key.public_key()
         elif b"-BEGIN PUBLIC KEY" in key_data:
@@ -59,11 +115,16 @@ def encrypt(input_file: str, rsa_key_file_name: str, output_file: str) -> None:
     gcm_key = generate_key_GCM(GCM_KEY_SIZE)
     iv = generate_IV_GCM()
 
-    encrypted_gcm_key = public_key.encrypt(gcm_key, padding.PKCS1v15())
+    if is_ecdh_key(public_key):
+        magic = esp_enc_img_ecdh_magic
+        encrypted_gcm_key = wrap_gcm_key(gcm_key, public_key)
+    else:
+        magic = esp_enc_img_magic
+        encrypted_gcm_key = public_key.encrypt(gcm_key, padding.PKCS1v15())
     ciphertext, authtag = encrypt_binary(data, gcm_key, iv)
 
     with open(output_file, 'wb') as image:
-        image.write(esp_enc_img_magic.to_bytes(MAGIC_SIZE, 'little'))
+        image.write(magic.to_bytes(MAGIC_SIZE, 'little'))
         image.write((encrypted_gcm_key))
         image.write((iv))
         image.write(len(ciphertext).to_bytes(BIN_SIZE_DATA, 'little'))
@@ -86,14 +147,20 @@ def decrypt(input_file: str, rsa_key: str, output_file: str) -> None:
         private_key = serialization.load_pem_private_key(key_file.read(), password=None)
 
     with open(input_file, 'rb') as file:
-        recv_magic = file.read(MAGIC_SIZE)
-        if(int.from_bytes(recv_magic, 'little') != esp_enc_img_magic):
+        recv_magic = int.from_bytes(file.read(MAGIC_SIZE), 'little')
+        if(recv_magic != esp_enc_img_magic and recv_magic != esp_enc_img_ecdh_magic):
             print('Error: Magic Verification Failed', file=sys.stderr)
             raise SystemExit(1)
         print('Magic verified successfully')
+        if (recv_magic == esp_enc_img_ecdh_magic) != is_ecdh_key(private_key):
+            print('Error: Key type does not match the image', file=sys.stderr)
+            raise SystemExit(1)
 
         encrypted_gcm_key = file.read(ENC_GCM_KEY_SIZE)
-        gcm_key = private_key.decrypt(encrypted_gcm_key, padding.PKCS1v15())
+        if recv_magic == esp_enc_img_ecdh_magic:
+            gcm_key = unwrap_gcm_key(encrypted_gcm_key, private_key)
+        else:
+            gcm_key = private_key.decrypt(encrypted_gcm_key, padding.PKCS1v15())
 
         iv = file.read(IV_SIZE)
         bin_size = int.from_bytes(file.read(BIN_SIZE_DATA), 'little')
@@ -115,7 +182,8 @@ def main() -> None:
     subparsers.add_parser('encrypt', help='Encrypt an binary')
     subparsers.add_parser('decrypt', help='Decrypt an encrypted image')
     parser.add_argument('input_file')
-    parser.add_argument('RSA_key', help='Private key for decryption and Private/Public key for encryption')
+    parser.add_argument('RSA_key', help='Private key for decryption and Private/Public key for encryption, '
+                        'RSA-3072, or P-256 or X25519 for an ECDH key wrap')
     parser.add_argument('output_file_name')
 
     args = parser.parse_args()
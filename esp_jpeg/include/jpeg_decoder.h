@@ -32,6 +32,31 @@ typedef enum {
     JPEG_IMAGE_FORMAT_RGB565,       /*!< Format RGB565 */
 } esp_jpeg_image_format_t;
 
+/**
+ * @brief Blocks of the image passed to the block callback
+ *
+ */
+typedef enum {
+    JPEG_IMAGE_BLOCK_MCU_ROW = 0,   /*!< Rows of MCUs across the full width of the image (8 or 16 px high, scaled) */
+    JPEG_IMAGE_BLOCK_MCU,           /*!< Single MCUs (8x8 to 16x16 px, scaled) */
+} esp_jpeg_image_block_t;
+
+/**
+ * @brief Callback for a decoded block of the image, e.g. to pass it to esp_lcd_panel_draw_bitmap()
+ *
+ * @param data: Pixels of the block in the output format, row by row, width pixels per row
+ * @param x: Left column of the block in the output image
+ * @param y: Top row of the block in the output image
+ * @param width: Width of the block
+ * @param height: Height of the block
+ * @param user_data: User data from the configuration
+ *
+ * @return
+ *      - ESP_OK            to continue decoding
+ *      - an error code, which stops decoding and is returned by esp_jpeg_decode()
+ */
+typedef esp_err_t (*esp_jpeg_image_block_cb_t)(const uint8_t *data, uint16_t x, uint16_t y, uint16_t width, uint16_t height, void *user_data);
+
 /**
  * @brief JPEG Configuration Type
  *
@@ -56,7 +81,21 @@ typedef struct esp_jpeg_image_cfg_s {
     } advanced;
 
     struct {
-        uint32_t read;  /*!< Internal count of read bytes */
+        esp_jpeg_image_block_cb_t block_cb; /*!< If set, the image is passed to this callback in blocks instead of being written to outbuf */
+        void *user_data;                    /*!< Passed to block_cb */
+        esp_jpeg_image_block_t block;       /*!< Blocks passed to block_cb.
+                                                 JPEG_IMAGE_BLOCK_MCU_ROW: rows are collected in outbuf, which holds one or more rows
+                                                 and is used round robin. If outbuf is NULL, a buffer for one row is allocated.
+                                                 JPEG_IMAGE_BLOCK_MCU: MCUs are passed from the working buffer, outbuf is not used. */
+    } stream;
+
+    struct {
+        uint32_t read;          /*!< Internal count of read bytes */
+        uint8_t *row_buf;       /*!< Internal buffer of the current MCU row */
+        uint32_t row_size;      /*!< Internal size of an MCU row in bytes */
+        uint32_t rows;          /*!< Internal number of MCU rows in outbuf */
+        uint32_t row_index;     /*!< Internal index of the current MCU row in outbuf */
+        esp_err_t block_err;    /*!< Internal error returned by block_cb */
     } priv;
 } esp_jpeg_image_cfg_t;
 
@@ -72,6 +111,9 @@ typedef struct esp_jpeg_image_output_s {
 /**
  * @brief Decode JPEG image
  *
+ * The decoded image is written to outbuf, which must hold the whole output image. If stream.block_cb is set, the image
+ * is passed to the callback in blocks instead, so that only one MCU row, or no buffer at all, is needed.
+ *
  * @note This function is blocking.
  *
  * @param cfg: Configuration structure
@@ -79,8 +121,9 @@ typedef struct esp_jpeg_image_output_s {
  *
  * @return
  *      - ESP_OK            on success
- *      - ESP_ERR_NO_MEM    if there is no memory for allocating main structure
+ *      - ESP_ERR_NO_MEM    if there is no memory for allocating main structure, or outbuf is too small
  *      - ESP_FAIL          if there is an error in decoding JPEG
+ *      - the error returned by stream.block_cb
  */
 esp_err_t esp_jpeg_decode(esp_jpeg_image_cfg_t *cfg, esp_jpeg_image_output_t *img);
 
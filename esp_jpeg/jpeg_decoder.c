@@ -33,6 +33,8 @@ typedef int jpeg_decode_out_t;
 
 static const char *TAG = "JPEG";
 
+typedef jpeg_decode_out_t (*jpeg_decode_out_cb_t)(JDEC *, void *, JRECT *);
+
 #define LOBYTE(u16)     ((uint8_t)(((uint16_t)(u16)) & 0xff))
 #define HIBYTE(u16)     ((uint8_t)((((uint16_t)(u16))>>8) & 0xff))
 
@@ -65,6 +67,8 @@ static uint8_t jpeg_get_color_bytes(esp_jpeg_image_format_t format);
 
 static unsigned int jpeg_decode_in_cb(JDEC *jd, uint8_t *buff, unsigned int nbyte);
 static jpeg_decode_out_t jpeg_decode_out_cb(JDEC *jd, void *bitmap, JRECT *rect);
+static jpeg_decode_out_t jpeg_decode_row_cb(JDEC *jd, void *bitmap, JRECT *rect);
+static jpeg_decode_out_t jpeg_decode_mcu_cb(JDEC *jd, void *bitmap, JRECT *rect);
 /*******************************************************************************
 * Public API functions
 *******************************************************************************/
@@ -73,6 +77,7 @@ esp_err_t esp_jpeg_decode(esp_jpeg_image_cfg_t *cfg, esp_jpeg_image_output_t *im
 {
     esp_err_t ret = ESP_OK;
     uint8_t *workbuf = NULL;
+    uint8_t *rowbuf = NULL;
     JRESULT res;
     JDEC JDEC;
 
@@ -91,6 +96,7 @@ esp_err_t esp_jpeg_decode(esp_jpeg_image_cfg_t *cfg, esp_jpeg_image_output_t *im
 
 
     cfg->priv.read = 0;
+    cfg->priv.block_err = ESP_OK;
 
     /* Prepare image */
     res = jd_prepare(&JDEC, jpeg_decode_in_cb, workbuf, workbuf_size, cfg);
@@ -99,22 +105,48 @@ esp_err_t esp_jpeg_decode(esp_jpeg_image_cfg_t *cfg, esp_jpeg_image_output_t *im
     uint8_t scale_div = jpeg_get_div_by_scale(cfg->out_scale);
     uint8_t out_color_bytes = jpeg_get_color_bytes(cfg->out_format);
 
-    /* Size of output image */
-    uint32_t outsize = (JDEC.height / scale_div) * (JDEC.width / scale_div) * out_color_bytes;
-    ESP_GOTO_ON_FALSE((outsize <= cfg->outbuf_size), ESP_ERR_NO_MEM, err, TAG, "Not enough size in output buffer!");
+    jpeg_decode_out_cb_t out_cb = jpeg_decode_out_cb;
+    if (cfg->stream.block_cb == NULL) {
+        /* Size of output image */
+        uint32_t outsize = (JDEC.height / scale_div) * (JDEC.width / scale_div) * out_color_bytes;
+        ESP_GOTO_ON_FALSE((outsize <= cfg->outbuf_size), ESP_ERR_NO_MEM, err, TAG, "Not enough size in output buffer!");
+    } else if (cfg->stream.block == JPEG_IMAGE_BLOCK_MCU_ROW) {
+        /* Size of one MCU row of output image */
+        cfg->priv.row_size = (JDEC.msy * 8 / scale_div) * (JDEC.width / scale_div) * out_color_bytes;
+        cfg->priv.row_index = 0;
+        if (cfg->outbuf == NULL) {
+            /* DMA capable, so that rows can be passed to esp_lcd_panel_draw_bitmap() */
+            rowbuf = heap_caps_malloc(cfg->priv.row_size, MALLOC_CAP_DMA);
+            ESP_GOTO_ON_FALSE(rowbuf, ESP_ERR_NO_MEM, err, TAG, "no mem for JPEG row buffer");
+            cfg->priv.row_buf = rowbuf;
+            cfg->priv.rows = 1;
+        } else {
+            ESP_GOTO_ON_FALSE((cfg->priv.row_size <= cfg->outbuf_size), ESP_ERR_NO_MEM, err, TAG, "Not enough size in output buffer for an MCU row!");
+            cfg->priv.row_buf = cfg->outbuf;
+            cfg->priv.rows = cfg->outbuf_size / cfg->priv.row_size;
+        }
+        out_cb = jpeg_decode_row_cb;
+    } else {
+        out_cb = jpeg_decode_mcu_cb;
+    }
 
     /* Size of output image */
     img->height = JDEC.height / scale_div;
     img->width = JDEC.width / scale_div;
 
     /* Decode JPEG */
-    res = jd_decomp(&JDEC, jpeg_decode_out_cb, cfg->out_scale);
+    res = jd_decomp(&JDEC, out_cb, cfg->out_scale);
+    ESP_GOTO_ON_FALSE((res != JDR_INTR || cfg->priv.block_err == ESP_OK), cfg->priv.block_err, err, TAG, "Decoding stopped by block callback! %d", cfg->priv.block_err);
     ESP_GOTO_ON_FALSE((res == JDR_OK), ESP_FAIL, err, TAG, "Error in decoding JPEG image! %d", res);
 
 err:
     if (workbuf && allocate_buffer) {
         free(workbuf);
     }
+    if (rowbuf) {
+        free(rowbuf);
+    }
+    cfg->priv.row_buf = NULL;
 
     return ret;
 }
@@ -147,33 +179,30 @@ static unsigned int jpeg_decode_in_cb(JDEC *dec, uint8_t *buff, unsigned int nby
     return to_read;
 }
 
-static jpeg_decode_out_t jpeg_decode_out_cb(JDEC *dec, void *bitmap, JRECT *rect)
+/* Converts the pixels of rect from the TJPGD format to the output format, and writes them to dst, which holds the area of
+ * the output image starting at column left and row top, line pixels per row. dst may be the bitmap itself. */
+static void jpeg_write_rect(const esp_jpeg_image_cfg_t *cfg, const uint8_t *in, const JRECT *rect, uint8_t *dst,
+                            uint32_t line, uint16_t left, uint16_t top)
 {
     uint16_t color = 0;
-    assert(dec != NULL);
-
-    esp_jpeg_image_cfg_t *cfg = (esp_jpeg_image_cfg_t *)dec->device;
-    assert(cfg != NULL);
-    assert(bitmap != NULL);
-    assert(rect != NULL);
-
-    uint8_t scale_div = jpeg_get_div_by_scale(cfg->out_scale);
     uint8_t out_color_bytes = jpeg_get_color_bytes(cfg->out_format);
 
-    /* Copy decoded image data to output buffer */
-    uint8_t *in = (uint8_t *)bitmap;
-    uint32_t line = dec->width / scale_div;
-    uint8_t *dst = (uint8_t *)cfg->outbuf;
     for (int y = rect->top; y <= rect->bottom; y++) {
+        uint8_t *d = dst + ((y - top) * line + (rect->left - left)) * out_color_bytes;
         for (int x = rect->left; x <= rect->right; x++) {
             if ( (JD_FORMAT == 0 && cfg->out_format == JPEG_IMAGE_FORMAT_RGB888) ||
                     (JD_FORMAT == 1 && cfg->out_format == JPEG_IMAGE_FORMAT_RGB565) ) {
                 /* Output image format is same as set in TJPGD */
-                for (int b = 0; b < ESP_JPEG_COLOR_BYTES; b++) {
-                    if (cfg->flags.swap_color_bytes) {
-                        dst[(y * line * out_color_bytes) + x * out_color_bytes + b] = in[out_color_bytes - b - 1];
-                    } else {
-                        dst[(y * line * out_color_bytes) + x * out_color_bytes + b] = in[b];
+                if (cfg->flags.swap_color_bytes) {
+                    /* Copy the pixel first, d and in may be the same */
+                    uint8_t pixel[ESP_JPEG_COLOR_BYTES];
+                    memcpy(pixel, in, ESP_JPEG_COLOR_BYTES);
+                    for (int b = 0; b < ESP_JPEG_COLOR_BYTES; b++) {
+                        d[b] = pixel[out_color_bytes - b - 1];
+                    }
+                } else {
+                    for (int b = 0; b < ESP_JPEG_COLOR_BYTES; b++) {
+                        d[b] = in[b];
                     }
                 }
             } else if (JD_FORMAT == 0 && cfg->out_format == JPEG_IMAGE_FORMAT_RGB565) {
@@ -184,23 +213,87 @@ static jpeg_decode_out_t jpeg_decode_out_cb(JDEC *dec, void *bitmap, JRECT *rect
                 color |= (in[2] >> 3);
 
                 if (cfg->flags.swap_color_bytes) {
-                    dst[(y * line * out_color_bytes) + (x * out_color_bytes)] = HIBYTE(color);
-                    dst[(y * line * out_color_bytes) + (x * out_color_bytes) + 1] = LOBYTE(color);
+                    d[0] = HIBYTE(color);
+                    d[1] = LOBYTE(color);
                 } else {
-                    dst[(y * line * out_color_bytes) + (x * out_color_bytes) + 1] = HIBYTE(color);
-                    dst[(y * line * out_color_bytes) + (x * out_color_bytes)] = LOBYTE(color);
+                    d[1] = HIBYTE(color);
+                    d[0] = LOBYTE(color);
                 }
             } else {
                 ESP_LOGE(TAG, "Selected output format is not supported!");
                 assert(0);
             }
             in += ESP_JPEG_COLOR_BYTES;
+            d += out_color_bytes;
+        }
+    }
+}
+
+static jpeg_decode_out_t jpeg_decode_out_cb(JDEC *dec, void *bitmap, JRECT *rect)
+{
+    assert(dec != NULL);
+
+    esp_jpeg_image_cfg_t *cfg = (esp_jpeg_image_cfg_t *)dec->device;
+    assert(cfg != NULL);
+    assert(bitmap != NULL);
+    assert(rect != NULL);
+
+    uint8_t scale_div = jpeg_get_div_by_scale(cfg->out_scale);
+
+    /* Copy decoded image data to output buffer */
+    jpeg_write_rect(cfg, (uint8_t *)bitmap, rect, cfg->outbuf, dec->width / scale_div, 0, 0);
+
+    return 1;
+}
+
+/* Collects the MCUs of a row in the row buffer, and passes the row on once its last MCU has been decoded */
+static jpeg_decode_out_t jpeg_decode_row_cb(JDEC *dec, void *bitmap, JRECT *rect)
+{
+    assert(dec != NULL);
+
+    esp_jpeg_image_cfg_t *cfg = (esp_jpeg_image_cfg_t *)dec->device;
+    assert(cfg != NULL);
+    assert(bitmap != NULL);
+    assert(rect != NULL);
+
+    uint8_t scale_div = jpeg_get_div_by_scale(cfg->out_scale);
+    uint32_t line = dec->width / scale_div;
+    uint16_t row_top = rect->top;  /* All MCUs of a row have the same top */
+    uint8_t *row = cfg->priv.row_buf + cfg->priv.row_index * cfg->priv.row_size;
+
+    jpeg_write_rect(cfg, (uint8_t *)bitmap, rect, row, line, 0, row_top);
+
+    /* The last MCU of a row ends at the right edge of the output image */
+    if (rect->right == line - 1) {
+        cfg->priv.block_err = cfg->stream.block_cb(row, 0, row_top, line, rect->bottom - row_top + 1, cfg->stream.user_data);
+        if (cfg->priv.block_err != ESP_OK) {
+            return 0;
         }
+        cfg->priv.row_index = (cfg->priv.row_index + 1) % cfg->priv.rows;
     }
 
     return 1;
 }
 
+/* Converts an MCU in place, the output format never takes more bytes per pixel than the TJPGD format */
+static jpeg_decode_out_t jpeg_decode_mcu_cb(JDEC *dec, void *bitmap, JRECT *rect)
+{
+    assert(dec != NULL);
+
+    esp_jpeg_image_cfg_t *cfg = (esp_jpeg_image_cfg_t *)dec->device;
+    assert(cfg != NULL);
+    assert(bitmap != NULL);
+    assert(rect != NULL);
+
+    uint16_t width = rect->right - rect->left + 1;
+    uint16_t height = rect->bottom - rect->top + 1;
+
+    jpeg_write_rect(cfg, (uint8_t *)bitmap, rect, (uint8_t *)bitmap, width, rect->left, rect->top);
+    cfg->priv.block_err = cfg->stream.block_cb((uint8_t *)bitmap, rect->left, rect->top, width, height, cfg->stream.user_data);
+
+    return cfg->priv.block_err == ESP_OK;
+}
+
 static uint8_t jpeg_get_div_by_scale(esp_jpeg_image_scale_t scale)
 {
     switch (scale) {
@@ -138,6 +138,165 @@ TEST_CASE("Test JPEG decompression library: User defined working buffer", "[esp_
     free(decoded);
 }
 
+typedef struct {
+    uint8_t *image;
+    int blocks;
+    const uint8_t *outbuf;      /* Output buffer passed to the decoder, rows are expected in it round-robin */
+    size_t outbuf_size;
+    size_t row_size;
+    int fail_at;                /* Block for which the callback returns an error, 0 for none */
+} test_stream_t;
+
+static esp_err_t test_block_cb(const uint8_t *data, uint16_t x, uint16_t y, uint16_t width, uint16_t height, void *user_data)
+{
+    test_stream_t *stream = (test_stream_t *)user_data;
+    TEST_ASSERT_LESS_OR_EQUAL(TESTW, x + width);
+    TEST_ASSERT_LESS_OR_EQUAL(TESTH, y + height);
+    if (stream->outbuf) {
+        /* The first row has the full MCU row height */
+        if (stream->row_size == 0) {
+            stream->row_size = width * height * 3;
+        }
+        const size_t rows = stream->outbuf_size / stream->row_size;
+        TEST_ASSERT_EQUAL_PTR(stream->outbuf + (stream->blocks % rows) * stream->row_size, data);
+    }
+    for (int row = 0; row < height; row++) {
+        memcpy(stream->image + ((y + row) * TESTW + x) * 3, data + row * width * 3, width * 3);
+    }
+    stream->blocks++;
+    if (stream->blocks == stream->fail_at) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    return ESP_OK;
+}
+
+TEST_CASE("Test JPEG decompression library: Streaming MCU rows and MCUs", "[esp_jpeg]")
+{
+    const esp_jpeg_image_block_t blocks[] = {JPEG_IMAGE_BLOCK_MCU_ROW, JPEG_IMAGE_BLOCK_MCU};
+    test_stream_t stream = {
+        .image = calloc(1, TESTW * TESTH * 3),
+    };
+    TEST_ASSERT_NOT_NULL(stream.image);
+
+    for (int i = 0; i < sizeof(blocks) / sizeof(blocks[0]); i++) {
+        stream.blocks = 0;
+        /* JPEG decode, no output buffer */
+        esp_jpeg_image_cfg_t jpeg_cfg = {
+            .indata = (uint8_t *)logo_jpg,
+            .indata_size = logo_jpg_len,
+            .out_format = JPEG_IMAGE_FORMAT_RGB888,
+            .out_scale = JPEG_IMAGE_SCALE_0,
+            .stream = {
+                .block_cb = test_block_cb,
+                .user_data = &stream,
+                .block = blocks[i],
+            },
+        };
+        esp_jpeg_image_output_t outimg;
+        esp_err_t err = esp_jpeg_decode(&jpeg_cfg, &outimg);
+        TEST_ASSERT_EQUAL(err, ESP_OK);
+        TEST_ASSERT_GREATER_THAN(1, stream.blocks);
+
+        /* Decoded image size */
+        TEST_ASSERT_EQUAL(outimg.width, TESTW);
+        TEST_ASSERT_EQUAL(outimg.height, TESTH);
+
+        const unsigned char *p = stream.image;
+        const unsigned char *o = logo_rgb888;
+        for (int x = 0; x < outimg.width * outimg.height; x++) {
+            /* The color can be +- 2 */
+            TEST_ASSERT_UINT8_WITHIN(2, o[0], p[0]);
+            TEST_ASSERT_UINT8_WITHIN(2, o[1], p[1]);
+            TEST_ASSERT_UINT8_WITHIN(2, o[2], p[2]);
+
+            p += 3;
+            o += 3;
+        }
+    }
+
+    free(stream.image);
+}
+
+TEST_CASE("Test JPEG decompression library: Streaming MCU rows through a caller buffer", "[esp_jpeg]")
+{
+    /* Room for two MCU rows of 16 lines or four of 8 lines, which are filled in turn. The rest is not used. */
+    const size_t outbuf_size = 2 * 16 * TESTW * 3 + 100;
+    uint8_t *outbuf = malloc(outbuf_size);
+    TEST_ASSERT_NOT_NULL(outbuf);
+    test_stream_t stream = {
+        .image = calloc(1, TESTW * TESTH * 3),
+        .outbuf = outbuf,
+        .outbuf_size = outbuf_size,
+    };
+    TEST_ASSERT_NOT_NULL(stream.image);
+
+    esp_jpeg_image_cfg_t jpeg_cfg = {
+        .indata = (uint8_t *)logo_jpg,
+        .indata_size = logo_jpg_len,
+        .outbuf = outbuf,
+        .outbuf_size = outbuf_size,
+        .out_format = JPEG_IMAGE_FORMAT_RGB888,
+        .out_scale = JPEG_IMAGE_SCALE_0,
+        .stream = {
+            .block_cb = test_block_cb,
+            .user_data = &stream,
+            .block = JPEG_IMAGE_BLOCK_MCU_ROW,
+        },
+    };
+    esp_jpeg_image_output_t outimg;
+    esp_err_t err = esp_jpeg_decode(&jpeg_cfg, &outimg);
+    TEST_ASSERT_EQUAL(err, ESP_OK);
+    /* More rows than fit into the buffer, so the first one was reused */
+    TEST_ASSERT_GREATER_THAN(outbuf_size / stream.row_size, stream.blocks);
+
+    const unsigned char *p = stream.image;
+    const unsigned char *o = logo_rgb888;
+    for (int x = 0; x < outimg.width * outimg.height; x++) {
+        /* The color can be +- 2 */
+        TEST_ASSERT_UINT8_WITHIN(2, o[0], p[0]);
+        TEST_ASSERT_UINT8_WITHIN(2, o[1], p[1]);
+        TEST_ASSERT_UINT8_WITHIN(2, o[2], p[2]);
+
+        p += 3;
+        o += 3;
+    }
+
+    free(stream.image);
+    free(outbuf);
+}
+
+TEST_CASE("Test JPEG decompression library: Streaming stops on a block callback error", "[esp_jpeg]")
+{
+    const esp_jpeg_image_block_t blocks[] = {JPEG_IMAGE_BLOCK_MCU_ROW, JPEG_IMAGE_BLOCK_MCU};
+    test_stream_t stream = {
+        .image = calloc(1, TESTW * TESTH * 3),
+        .fail_at = 2,
+    };
+    TEST_ASSERT_NOT_NULL(stream.image);
+
+    for (int i = 0; i < sizeof(blocks) / sizeof(blocks[0]); i++) {
+        stream.blocks = 0;
+        esp_jpeg_image_cfg_t jpeg_cfg = {
+            .indata = (uint8_t *)logo_jpg,
+            .indata_size = logo_jpg_len,
+            .out_format = JPEG_IMAGE_FORMAT_RGB888,
+            .out_scale = JPEG_IMAGE_SCALE_0,
+            .stream = {
+                .block_cb = test_block_cb,
+                .user_data = &stream,
+                .block = blocks[i],
+            },
+        };
+        esp_jpeg_image_output_t outimg;
+        esp_err_t err = esp_jpeg_decode(&jpeg_cfg, &outimg);
+        /* The error of the callback is returned, and no further blocks are passed */
+        TEST_ASSERT_EQUAL(ESP_ERR_INVALID_STATE, err);
+        TEST_ASSERT_EQUAL(stream.fail_at, stream.blocks);
+    }
+
+    free(stream.image);
+}
+
 #if CONFIG_JD_DEFAULT_HUFFMAN
 #include "test_usb_camera_jpg.h"
 #include "test_usb_camera_rgb888.h"
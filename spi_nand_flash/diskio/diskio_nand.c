@@ -33,16 +33,11 @@ DRESULT ff_nand_read(BYTE pdrv, BYTE *buff, DWORD sector, UINT count)
     ESP_LOGV(TAG, "ff_nand_read - pdrv=%i, sector=%i, count=%i", (unsigned int) pdrv, (unsigned int) sector,
              (unsigned int) count);
     esp_err_t ret;
-    uint32_t sector_size;
     spi_nand_flash_device_t *dev = ff_nand_handles[pdrv];
     assert(dev);
 
-    ESP_GOTO_ON_ERROR(spi_nand_flash_get_sector_size(dev, &sector_size), fail, TAG, "");
-
-    for (int i = 0; i < count; i++) {
-        ESP_GOTO_ON_ERROR(spi_nand_flash_read_sector(dev, buff + i * sector_size, sector + i),
-                          fail, TAG, "spi_nand_flash_read failed");
-    }
+    ESP_GOTO_ON_ERROR(spi_nand_flash_read_sectors(dev, buff, sector, count),
+                      fail, TAG, "spi_nand_flash_read_sectors failed");
 
     return RES_OK;
 
@@ -56,16 +51,11 @@ DRESULT ff_nand_write(BYTE pdrv, const BYTE *buff, DWORD sector, UINT count)
     ESP_LOGV(TAG, "ff_nand_write - pdrv=%i, sector=%i, count=%i", (unsigned int) pdrv, (unsigned int) sector,
              (unsigned int) count);
     esp_err_t ret;
-    uint32_t sector_size;
     spi_nand_flash_device_t *dev = ff_nand_handles[pdrv];
     assert(dev);
 
-    ESP_GOTO_ON_ERROR(spi_nand_flash_get_sector_size(dev, &sector_size), fail, TAG, "");
-
-    for (int i = 0; i < count; i++) {
-        ESP_GOTO_ON_ERROR(spi_nand_flash_write_sector(dev, buff + i * sector_size, sector + i),
-                          fail, TAG, "spi_nand_flash_write failed");
-    }
+    ESP_GOTO_ON_ERROR(spi_nand_flash_write_sectors(dev, buff, sector, count),
+                      fail, TAG, "spi_nand_flash_write_sectors failed");
     return RES_OK;
 
 fail:
@@ -77,20 +67,18 @@ fail:
 DRESULT ff_nand_trim(BYTE pdrv, DWORD start_sector, DWORD sector_count)
 {
     esp_err_t ret;
-    uint32_t sector_size;
+    uint32_t capacity;
     spi_nand_flash_device_t *dev = ff_nand_handles[pdrv];
     assert(dev);
 
-    ESP_GOTO_ON_ERROR(spi_nand_flash_get_sector_size(dev, &sector_size), fail, TAG, "");
+    ESP_GOTO_ON_ERROR(spi_nand_flash_get_capacity(dev, &capacity), fail, TAG, "");
 
-    if ((start_sector > sector_size) || ((start_sector + sector_count) > sector_size)) {
+    if ((start_sector > capacity) || (sector_count > capacity - start_sector)) {
         return RES_PARERR;
     }
 
-    for (int i = 0; i < sector_count; i++) {
-        ESP_GOTO_ON_ERROR(spi_nand_flash_trim(dev, start_sector + i),
-                          fail, TAG, "spi_nand_flash_trim failed");
-    }
+    ESP_GOTO_ON_ERROR(spi_nand_flash_trim_range(dev, start_sector, sector_count),
+                      fail, TAG, "spi_nand_flash_trim_range failed");
     return RES_OK;
 
 fail:
@@ -133,11 +121,12 @@ DRESULT ff_nand_ioctl(BYTE pdrv, BYTE cmd, void *buff)
         break;
     }
 #if FF_USE_TRIM
-    case CTRL_TRIM:
+    case CTRL_TRIM: {
         DWORD start_sector = *((DWORD *)buff);
         DWORD end_sector = *((DWORD *)buff + 1) + 1;
         DWORD sector_count = end_sector - start_sector;
         return ff_nand_trim(pdrv, start_sector, sector_count);
+    }
 #endif //FF_USE_TRIM
     default:
         return RES_ERROR;
@@ -0,0 +1,490 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <assert.h>
+#include <sys/param.h>
+
+#include "esp_log.h"
+#include "esp_check.h"
+#include "ff.h"
+#include "diskio_impl.h"
+#include "diskio_nand.h"
+#include "spi_nand_flash.h"
+#include "nand_diag_api.h"
+#include "nand_private/nand_impl_wrap.h"
+
+#if CONFIG_IDF_TARGET_LINUX
+#include <time.h>
+#include "spi_nand_emul.h"
+#else
+#include "soc/spi_pins.h"
+#include "esp_timer.h"
+#include "esp_vfs_fat_nand.h"
+#endif
+
+#define EXAMPLE_FLASH_FREQ_KHZ      40000
+#define BENCH_IO_SIZE               4096
+#define PATTERN_SEED                0x12345678
+
+static const char *TAG = "benchmark";
+
+#if !CONFIG_IDF_TARGET_LINUX
+// Pin mapping
+// ESP32 (VSPI)
+#ifdef CONFIG_IDF_TARGET_ESP32
+#define HOST_ID  SPI3_HOST
+#define PIN_MOSI SPI3_IOMUX_PIN_NUM_MOSI
+#define PIN_MISO SPI3_IOMUX_PIN_NUM_MISO
+#define PIN_CLK  SPI3_IOMUX_PIN_NUM_CLK
+#define PIN_CS   SPI3_IOMUX_PIN_NUM_CS
+#define PIN_WP   SPI3_IOMUX_PIN_NUM_WP
+#define PIN_HD   SPI3_IOMUX_PIN_NUM_HD
+#define SPI_DMA_CHAN SPI_DMA_CH_AUTO
+#else // Other chips (SPI2/HSPI)
+#define HOST_ID  SPI2_HOST
+#define PIN_MOSI SPI2_IOMUX_PIN_NUM_MOSI
+#define PIN_MISO SPI2_IOMUX_PIN_NUM_MISO
+#define PIN_CLK  SPI2_IOMUX_PIN_NUM_CLK
+#define PIN_CS   SPI2_IOMUX_PIN_NUM_CS
+#define PIN_WP   SPI2_IOMUX_PIN_NUM_WP
+#define PIN_HD   SPI2_IOMUX_PIN_NUM_HD
+#define SPI_DMA_CHAN SPI_DMA_CH_AUTO
+#endif
+
+// Mount path for the partition
+static const char *base_path = "/nandflash";
+#endif
+
+typedef enum {
+    BENCH_SEQ_WRITE,
+    BENCH_SEQ_READ,
+    BENCH_RAND_WRITE,
+    BENCH_RAND_READ,
+} bench_pattern_t;
+
+static const char *pattern_names[] = {
+    [BENCH_SEQ_WRITE] = "seq_write",
+    [BENCH_SEQ_READ] = "seq_read",
+    [BENCH_RAND_WRITE] = "rand_write",
+    [BENCH_RAND_READ] = "rand_read",
+};
+
+typedef struct bench_ctx bench_ctx_t;
+
+// Reads or writes the 4 kB unit with the given index of the working set
+typedef esp_err_t (*bench_io_fn_t)(bench_ctx_t *ctx, uint32_t unit, uint8_t *buf, bool write);
+
+struct bench_ctx {
+    spi_nand_flash_device_t *flash;
+    const char *layer;
+    uint8_t gc_factor;
+    uint32_t sector_size;
+    uint32_t page_size;             // differs from sector_size with CONFIG_NAND_FLASH_SUBPAGE_SECTORS
+    uint32_t pages_per_block;
+    uint32_t program_size;          // bytes written by one page program of the layer under test
+    uint32_t num_units;             // 4 kB units in the working set
+    uint32_t *good_blocks;          // raw layer: blocks holding the working set
+    uint32_t num_good_blocks;
+    bench_io_fn_t io;
+    esp_err_t (*finish)(bench_ctx_t *ctx, bool write); // run after the timed operations, e.g. sync or close
+    spi_device_handle_t device;     // SPI device, or the emulated chip on linux
+#if CONFIG_IDF_TARGET_LINUX
+    FIL file;                       // The VFS is not available on linux, so files are accessed through FatFs directly
+#else
+    FILE *file;
+#endif
+    uint32_t *latencies_us;
+    uint8_t *buf;
+};
+
+static int64_t now_us(void)
+{
+#if CONFIG_IDF_TARGET_LINUX
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+    return esp_timer_get_time();
+#endif
+}
+
+static uint32_t xorshift32(uint32_t *state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+static void fill_buffer(uint32_t seed, uint8_t *dst, size_t count)
+{
+    srand(seed);
+    for (size_t i = 0; i < count; ++i) {
+        uint32_t val = rand();
+        memcpy(dst + i * sizeof(uint32_t), &val, sizeof(val));
+    }
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static esp_err_t raw_io(bench_ctx_t *ctx, uint32_t unit, uint8_t *buf, bool write)
+{
+    const uint32_t pages_per_unit = BENCH_IO_SIZE / ctx->page_size;
+    for (uint32_t i = 0; i < pages_per_unit; i++) {
+        uint32_t index = unit * pages_per_unit + i;
+        uint32_t page = ctx->good_blocks[index / ctx->pages_per_block] * ctx->pages_per_block + index % ctx->pages_per_block;
+        uint8_t *data = buf + i * ctx->page_size;
+        if (write) {
+            ESP_RETURN_ON_ERROR(nand_wrap_prog(ctx->flash, page, data), TAG, "");
+        } else {
+            ESP_RETURN_ON_ERROR(nand_wrap_read(ctx->flash, page, 0, ctx->page_size, data), TAG, "");
+        }
+    }
+    return ESP_OK;
+}
+
+static esp_err_t dhara_io(bench_ctx_t *ctx, uint32_t unit, uint8_t *buf, bool write)
+{
+    const uint32_t sectors_per_unit = BENCH_IO_SIZE / ctx->sector_size;
+    for (uint32_t i = 0; i < sectors_per_unit; i++) {
+        uint32_t sector = unit * sectors_per_unit + i;
+        uint8_t *data = buf + i * ctx->sector_size;
+        if (write) {
+            ESP_RETURN_ON_ERROR(spi_nand_flash_write_sector(ctx->flash, data, sector), TAG, "");
+        } else {
+            ESP_RETURN_ON_ERROR(spi_nand_flash_read_sector(ctx->flash, data, sector), TAG, "");
+        }
+    }
+    return ESP_OK;
+}
+
+static esp_err_t dhara_finish(bench_ctx_t *ctx, bool write)
+{
+    return write ? spi_nand_flash_sync(ctx->flash) : ESP_OK;
+}
+
+#if CONFIG_IDF_TARGET_LINUX
+static esp_err_t file_open(bench_ctx_t *ctx, bool create)
+{
+    BYTE mode = FA_READ | FA_WRITE | (create ? FA_CREATE_ALWAYS : FA_OPEN_EXISTING);
+    ESP_RETURN_ON_FALSE(f_open(&ctx->file, "0:/bench.bin", mode) == FR_OK, ESP_FAIL, TAG, "failed to open file");
+    return ESP_OK;
+}
+
+static esp_err_t file_io(bench_ctx_t *ctx, uint32_t unit, uint8_t *buf, bool write)
+{
+    UINT done = 0;
+    ESP_RETURN_ON_FALSE(f_lseek(&ctx->file, (FSIZE_t)unit * BENCH_IO_SIZE) == FR_OK, ESP_FAIL, TAG, "seek failed");
+    FRESULT res = write ? f_write(&ctx->file, buf, BENCH_IO_SIZE, &done) : f_read(&ctx->file, buf, BENCH_IO_SIZE, &done);
+    ESP_RETURN_ON_FALSE(res == FR_OK && done == BENCH_IO_SIZE, ESP_FAIL, TAG, "file %s failed (%d)", write ? "write" : "read", res);
+    return ESP_OK;
+}
+
+static esp_err_t file_finish(bench_ctx_t *ctx, bool write)
+{
+    ESP_RETURN_ON_FALSE(f_close(&ctx->file) == FR_OK, ESP_FAIL, TAG, "failed to close file");
+    return ESP_OK;
+}
+#else
+static esp_err_t file_open(bench_ctx_t *ctx, bool create)
+{
+    char path[32];
+    snprintf(path, sizeof(path), "%s/bench.bin", base_path);
+    ctx->file = fopen(path, create ? "w+b" : "r+b");
+    ESP_RETURN_ON_FALSE(ctx->file != NULL, ESP_FAIL, TAG, "failed to open %s", path);
+    return ESP_OK;
+}
+
+static esp_err_t file_io(bench_ctx_t *ctx, uint32_t unit, uint8_t *buf, bool write)
+{
+    ESP_RETURN_ON_FALSE(fseek(ctx->file, (long)unit * BENCH_IO_SIZE, SEEK_SET) == 0, ESP_FAIL, TAG, "seek failed");
+    size_t done = write ? fwrite(buf, 1, BENCH_IO_SIZE, ctx->file) : fread(buf, 1, BENCH_IO_SIZE, ctx->file);
+    ESP_RETURN_ON_FALSE(done == BENCH_IO_SIZE, ESP_FAIL, TAG, "file %s failed", write ? "write" : "read");
+    return ESP_OK;
+}
+
+static esp_err_t file_finish(bench_ctx_t *ctx, bool write)
+{
+    ESP_RETURN_ON_FALSE(fclose(ctx->file) == 0, ESP_FAIL, TAG, "failed to close file");
+    ctx->file = NULL;
+    return ESP_OK;
+}
+#endif
+
+/* Times ops 4 kB operations and prints one result line. Sequential tests wrap around the working set, random tests
+ * pick units with a fixed seed, so every layer and gc_factor sees the same access sequence.
+ * The program and erase counts of the driver give the write amplification: pages programmed per page written. */
+static esp_err_t run_pattern(bench_ctx_t *ctx, bench_pattern_t pattern, uint32_t ops)
+{
+    const bool write = (pattern == BENCH_SEQ_WRITE || pattern == BENCH_RAND_WRITE);
+    const bool random = (pattern == BENCH_RAND_WRITE || pattern == BENCH_RAND_READ);
+    uint32_t rand_state = PATTERN_SEED;
+    nand_wait_stats_t before, after;
+
+    ESP_RETURN_ON_ERROR(nand_get_wait_stats(ctx->flash, &before), TAG, "");
+    int64_t start = now_us();
+    for (uint32_t i = 0; i < ops; i++) {
+        uint32_t unit = random ? xorshift32(&rand_state) % ctx->num_units : i % ctx->num_units;
+        int64_t op_start = now_us();
+        ESP_RETURN_ON_ERROR(ctx->io(ctx, unit, ctx->buf, write), TAG, "%s %s failed at unit %"PRIu32,
+                            ctx->layer, pattern_names[pattern], unit);
+        ctx->latencies_us[i] = now_us() - op_start;
+    }
+    if (ctx->finish) {
+        ESP_RETURN_ON_ERROR(ctx->finish(ctx, write), TAG, "");
+    }
+    int64_t total_us = now_us() - start;
+    ESP_RETURN_ON_ERROR(nand_get_wait_stats(ctx->flash, &after), TAG, "");
+
+    qsort(ctx->latencies_us, ops, sizeof(uint32_t), compare_u32);
+    uint32_t programs = after.page_programs - before.page_programs;
+    uint32_t erases = after.block_erases - before.block_erases;
+    float write_amp = write ? (float)programs * ctx->program_size / ((float)ops * BENCH_IO_SIZE) : 0;
+
+    // One JSON object per line, prefixed so it can be picked out of the log
+    printf("BENCH {\"layer\":\"%s\",\"test\":\"%s\",\"gc_factor\":%u,\"io_size\":%d,\"ops\":%"PRIu32","
+           "\"total_us\":%"PRId64",\"iops\":%.1f,\"kbps\":%.1f,"
+           "\"lat_us\":{\"p50\":%"PRIu32",\"p90\":%"PRIu32",\"p99\":%"PRIu32",\"max\":%"PRIu32"},"
+           "\"page_programs\":%"PRIu32",\"block_erases\":%"PRIu32",\"write_amp\":%.2f}\n",
+           ctx->layer, pattern_names[pattern], ctx->gc_factor, BENCH_IO_SIZE, ops,
+           total_us, ops * 1e6 / total_us, (float)ops * BENCH_IO_SIZE / 1.024f / total_us * 1000,
+           ctx->latencies_us[(ops - 1) * 50 / 100], ctx->latencies_us[(ops - 1) * 90 / 100],
+           ctx->latencies_us[(ops - 1) * 99 / 100], ctx->latencies_us[ops - 1],
+           programs, erases, write_amp);
+    fflush(stdout);
+    return ESP_OK;
+}
+
+static esp_err_t bench_raw(bench_ctx_t *ctx)
+{
+    uint32_t num_blocks;
+    ESP_RETURN_ON_ERROR(spi_nand_flash_get_block_num(ctx->flash, &num_blocks), TAG, "");
+
+    // Pages can only be programmed once after an erase, so the raw layer has no random write test. The erases are not
+    // part of the timed write, their cost shows up in the Dhara results.
+    ctx->num_good_blocks = 0;
+    uint32_t needed = ctx->num_units * (BENCH_IO_SIZE / ctx->page_size) / ctx->pages_per_block;
+    for (uint32_t block = 0; block < num_blocks && ctx->num_good_blocks < needed; block++) {
+        bool is_bad;
+        ESP_RETURN_ON_ERROR(nand_wrap_is_bad(ctx->flash, block, &is_bad), TAG, "");
+        if (!is_bad) {
+            ESP_RETURN_ON_ERROR(nand_wrap_erase_block(ctx->flash, block), TAG, "");
+            ctx->good_blocks[ctx->num_good_blocks++] = block;
+        }
+    }
+    ESP_RETURN_ON_FALSE(ctx->num_good_blocks == needed, ESP_ERR_INVALID_SIZE, TAG, "not enough good blocks");
+
+    ctx->layer = "raw";
+    ctx->program_size = ctx->page_size;
+    ctx->io = raw_io;
+    ctx->finish = NULL;
+    ESP_RETURN_ON_ERROR(run_pattern(ctx, BENCH_SEQ_WRITE, ctx->num_units), TAG, "");
+    ESP_RETURN_ON_ERROR(run_pattern(ctx, BENCH_SEQ_READ, CONFIG_BENCHMARK_OPS), TAG, "");
+    return run_pattern(ctx, BENCH_RAND_READ, CONFIG_BENCHMARK_OPS);
+}
+
+static esp_err_t bench_dhara(bench_ctx_t *ctx)
+{
+    ctx->layer = "dhara";
+    ctx->program_size = ctx->sector_size;
+    ctx->io = dhara_io;
+    ctx->finish = dhara_finish;
+    // The first pass fills the working set, so the random tests hit mapped sectors
+    ESP_RETURN_ON_ERROR(run_pattern(ctx, BENCH_SEQ_WRITE, ctx->num_units), TAG, "");
+    ESP_RETURN_ON_ERROR(run_pattern(ctx, BENCH_SEQ_READ, CONFIG_BENCHMARK_OPS), TAG, "");
+    ESP_RETURN_ON_ERROR(run_pattern(ctx, BENCH_RAND_WRITE, CONFIG_BENCHMARK_OPS), TAG, "");
+    return run_pattern(ctx, BENCH_RAND_READ, CONFIG_BENCHMARK_OPS);
+}
+
+static esp_err_t bench_fatfs(bench_ctx_t *ctx)
+{
+    static const bench_pattern_t patterns[] = {BENCH_SEQ_WRITE, BENCH_SEQ_READ, BENCH_RAND_WRITE, BENCH_RAND_READ};
+
+    ctx->layer = "fatfs";
+    ctx->program_size = ctx->sector_size;
+    ctx->io = file_io;
+    ctx->finish = file_finish;
+    for (size_t i = 0; i < sizeof(patterns) / sizeof(patterns[0]); i++) {
+        // Opening is not timed, closing is, since it writes back the FAT and directory entry
+        ESP_RETURN_ON_ERROR(file_open(ctx, patterns[i] == BENCH_SEQ_WRITE), TAG, "");
+        uint32_t ops = patterns[i] == BENCH_SEQ_WRITE ? ctx->num_units : CONFIG_BENCHMARK_OPS;
+        ESP_RETURN_ON_ERROR(run_pattern(ctx, patterns[i], ops), TAG, "");
+    }
+    return ESP_OK;
+}
+
+#if CONFIG_IDF_TARGET_LINUX
+static esp_err_t mount_fatfs(bench_ctx_t *ctx, FATFS **out_fs)
+{
+    esp_err_t ret = ESP_OK;
+    BYTE pdrv = 0xFF;
+    void *workbuf = NULL;
+    FATFS *fs = NULL;
+
+    ESP_RETURN_ON_ERROR(ff_diskio_get_drive(&pdrv), TAG, "no free drive");
+    ESP_RETURN_ON_FALSE(pdrv == 0, ESP_ERR_INVALID_STATE, TAG, "expected drive 0");
+    ESP_RETURN_ON_ERROR(ff_diskio_register_nand(pdrv, ctx->flash), TAG, "");
+
+    fs = calloc(1, sizeof(FATFS));
+    workbuf = malloc(BENCH_IO_SIZE);
+    ESP_GOTO_ON_FALSE(fs != NULL && workbuf != NULL, ESP_ERR_NO_MEM, fail, TAG, "nomem");
+    const MKFS_PARM opt = {(BYTE)FM_ANY, 0, 0, 0, 16 * 1024};
+    ESP_GOTO_ON_FALSE(f_mkfs("0:", &opt, workbuf, BENCH_IO_SIZE) == FR_OK, ESP_FAIL, fail, TAG, "f_mkfs failed");
+    ESP_GOTO_ON_FALSE(f_mount(fs, "0:", 1) == FR_OK, ESP_FAIL, fail, TAG, "f_mount failed");
+    free(workbuf);
+    *out_fs = fs;
+    return ESP_OK;
+
+fail:
+    free(workbuf);
+    free(fs);
+    ff_diskio_unregister(pdrv);
+    return ret;
+}
+
+static void unmount_fatfs(bench_ctx_t *ctx, FATFS *fs)
+{
+    f_mount(NULL, "0:", 0);
+    ff_diskio_unregister(ff_diskio_get_pdrv_nand(ctx->flash));
+    ff_diskio_clear_pdrv_nand(ctx->flash);
+    free(fs);
+}
+#endif
+
+static esp_err_t bench_fatfs_mounted(bench_ctx_t *ctx)
+{
+    esp_err_t ret;
+#if CONFIG_IDF_TARGET_LINUX
+    FATFS *fs;
+    ESP_RETURN_ON_ERROR(mount_fatfs(ctx, &fs), TAG, "");
+    ret = bench_fatfs(ctx);
+    unmount_fatfs(ctx, fs);
+#else
+    // The chip was erased before, so the mount always formats a fresh file system
+    esp_vfs_fat_mount_config_t config = {
+        .max_files = 4,
+        .format_if_mount_failed = true,
+        .allocation_unit_size = 16 * 1024
+    };
+    ESP_RETURN_ON_ERROR(esp_vfs_fat_nand_mount(base_path, ctx->flash, &config), TAG, "");
+    ret = bench_fatfs(ctx);
+    esp_vfs_fat_nand_unmount(base_path, ctx->flash);
+#endif
+    return ret;
+}
+
+static esp_err_t init_nand_flash(bench_ctx_t *ctx, uint8_t gc_factor, spi_nand_flash_device_t **out_handle)
+{
+    spi_nand_flash_config_t nand_flash_config = {
+        .device_handle = ctx->device,
+        .gc_factor = gc_factor,
+    };
+    return spi_nand_flash_init_device(&nand_flash_config, out_handle);
+}
+
+static esp_err_t run_benchmarks(bench_ctx_t *ctx)
+{
+    uint32_t block_size;
+
+    // The raw layer does not depend on gc_factor, so it runs once, on the default configuration
+    ESP_RETURN_ON_ERROR(init_nand_flash(ctx, 0, &ctx->flash), TAG, "");
+    ESP_RETURN_ON_ERROR(spi_nand_flash_get_sector_size(ctx->flash, &ctx->sector_size), TAG, "");
+    ESP_RETURN_ON_ERROR(spi_nand_flash_get_page_size(ctx->flash, &ctx->page_size), TAG, "");
+    ESP_RETURN_ON_ERROR(spi_nand_flash_get_block_size(ctx->flash, &block_size), TAG, "");
+    ESP_RETURN_ON_FALSE(ctx->page_size <= BENCH_IO_SIZE, ESP_ERR_NOT_SUPPORTED, TAG, "page size above 4 kB");
+    ctx->pages_per_block = block_size / ctx->page_size;
+    ctx->num_units = CONFIG_BENCHMARK_WORKING_SET_KB * 1024 / BENCH_IO_SIZE;
+    ctx->good_blocks = calloc(ctx->num_units * BENCH_IO_SIZE / block_size + 1, sizeof(uint32_t));
+    ESP_RETURN_ON_FALSE(ctx->good_blocks != NULL, ESP_ERR_NO_MEM, TAG, "nomem");
+    ctx->gc_factor = 0;
+    ESP_RETURN_ON_ERROR(bench_raw(ctx), TAG, "raw benchmark failed");
+    ESP_RETURN_ON_ERROR(spi_nand_erase_chip(ctx->flash), TAG, "");
+    ESP_RETURN_ON_ERROR(spi_nand_flash_deinit_device(ctx->flash), TAG, "");
+
+    const char *list = CONFIG_BENCHMARK_GC_FACTORS;
+    char *end;
+    for (long gc_factor = strtol(list, &end, 10); end != list; gc_factor = strtol(list, &end, 10)) {
+        list = end;
+        ESP_RETURN_ON_FALSE(gc_factor > 0 && gc_factor <= UINT8_MAX, ESP_ERR_INVALID_ARG, TAG, "invalid gc_factor %ld", gc_factor);
+        ESP_LOGI(TAG, "gc_factor %ld", gc_factor);
+        ctx->gc_factor = gc_factor;
+        ESP_RETURN_ON_ERROR(init_nand_flash(ctx, gc_factor, &ctx->flash), TAG, "");
+        ESP_RETURN_ON_ERROR(bench_dhara(ctx), TAG, "Dhara benchmark failed");
+        ESP_RETURN_ON_ERROR(spi_nand_erase_chip(ctx->flash), TAG, "");
+        ESP_RETURN_ON_ERROR(bench_fatfs_mounted(ctx), TAG, "FATFS benchmark failed");
+        ESP_RETURN_ON_ERROR(spi_nand_erase_chip(ctx->flash), TAG, "");
+        ESP_RETURN_ON_ERROR(spi_nand_flash_deinit_device(ctx->flash), TAG, "");
+    }
+    return ESP_OK;
+}
+
+void app_main(void)
+{
+    bench_ctx_t ctx = {0};
+
+#if CONFIG_IDF_TARGET_LINUX
+    spi_nand_emul_config_t emul_config = {
+        .file_path = NULL,
+        .timing_scale_percent = CONFIG_BENCHMARK_EMUL_TIMING_SCALE,
+    };
+    ESP_ERROR_CHECK(spi_nand_emul_init(&emul_config, &ctx.device));
+#else
+    const spi_bus_config_t bus_config = {
+        .mosi_io_num = PIN_MOSI,
+        .miso_io_num = PIN_MISO,
+        .sclk_io_num = PIN_CLK,
+        .quadhd_io_num = PIN_HD,
+        .quadwp_io_num = PIN_WP,
+        .max_transfer_sz = 4096 * 2,
+    };
+    ESP_ERROR_CHECK(spi_bus_initialize(HOST_ID, &bus_config, SPI_DMA_CHAN));
+
+    spi_device_interface_config_t devcfg = {
+        .clock_speed_hz = EXAMPLE_FLASH_FREQ_KHZ * 1000,
+        .mode = 0,
+        .spics_io_num = PIN_CS,
+        .queue_size = 10,
+        .flags = SPI_DEVICE_HALFDUPLEX,
+    };
+    ESP_ERROR_CHECK(spi_bus_add_device(HOST_ID, &devcfg, &ctx.device));
+#endif
+
+    ctx.latencies_us = malloc(MAX(CONFIG_BENCHMARK_OPS, CONFIG_BENCHMARK_WORKING_SET_KB * 1024 / BENCH_IO_SIZE) * sizeof(uint32_t));
+    ctx.buf = malloc(BENCH_IO_SIZE);
+    assert(ctx.latencies_us != NULL && ctx.buf != NULL);
+    fill_buffer(PATTERN_SEED, ctx.buf, BENCH_IO_SIZE / sizeof(uint32_t));
+
+    esp_err_t ret = run_benchmarks(&ctx);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Benchmark failed (%s)", esp_err_to_name(ret));
+    }
+
+    free(ctx.good_blocks);
+    free(ctx.latencies_us);
+    free(ctx.buf);
+#if CONFIG_IDF_TARGET_LINUX
+    ESP_ERROR_CHECK(spi_nand_emul_deinit(ctx.device));
+    printf("Benchmark done\n");
+    fflush(stdout);
+    // The main task does not end the process on linux
+    exit(ret == ESP_OK ? 0 : 1);
+#else
+    ESP_ERROR_CHECK(spi_bus_remove_device(ctx.device));
+    ESP_ERROR_CHECK(spi_bus_free(HOST_ID));
+    printf("Benchmark done\n");
+#endif
+}
@@ -0,0 +1,36 @@
+# SPDX-FileCopyrightText: 2024 Espressif Systems (Shanghai) CO LTD
+# SPDX-License-Identifier: Unlicense OR CC0-1.0
+
+import json
+
+import pytest
+from pytest_embedded import Dut
+
+
+def collect_results(dut: Dut) -> list:
+    results = []
+    while True:
+        match = dut.expect(r'BENCH (\{.*\})|Benchmark done', timeout=1200)
+        if match.group(1) is None:
+            return results
+        results.append(json.loads(match.group(1).decode()))
+
+
+def check_results(results: list) -> None:
+    assert {r['layer'] for r in results} == {'raw', 'dhara', 'fatfs'}
+    for r in results:
+        assert r['ops'] > 0 and r['total_us'] > 0
+        if r['test'].endswith('write') and r['layer'] != 'fatfs':
+            # Every written page has to be programmed at least once
+            assert r['write_amp'] >= 1.0
+
+
+@pytest.mark.spi_nand_flash
+def test_nand_flash_benchmark(dut: Dut) -> None:
+    check_results(collect_results(dut))
+
+
+@pytest.mark.linux
+@pytest.mark.host_test
+def test_nand_flash_benchmark_linux(dut: Dut) -> None:
+    check_results(collect_results(dut))
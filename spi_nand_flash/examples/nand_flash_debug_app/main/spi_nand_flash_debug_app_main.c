@@ -101,19 +101,22 @@ static esp_err_t read_write_sectors_tp(spi_nand_flash_device_t *flash, uint32_t
     esp_err_t ret = ESP_OK;
     uint8_t *temp_buf = NULL;
     uint8_t *pattern_buf = NULL;
-    uint32_t sector_size, sector_num;
+    uint32_t sector_size, page_size, sector_num;
 
     ESP_ERROR_CHECK(spi_nand_flash_get_capacity(flash, &sector_num));
     ESP_ERROR_CHECK(spi_nand_flash_get_sector_size(flash, &sector_size));
+    ESP_ERROR_CHECK(spi_nand_flash_get_page_size(flash, &page_size));
+    // Raw accesses work on whole pages, which hold several sectors with CONFIG_NAND_FLASH_SUBPAGE_SECTORS
+    const uint32_t io_size = get_raw_tp ? page_size : sector_size;
 
     ESP_RETURN_ON_FALSE((start_sec + sec_count) < sector_num, ESP_ERR_INVALID_ARG, TAG, "invalid argument");
 
-    pattern_buf = (uint8_t *)heap_caps_malloc(sector_size, MALLOC_CAP_DEFAULT);
+    pattern_buf = (uint8_t *)heap_caps_malloc(io_size, MALLOC_CAP_DEFAULT);
     ESP_RETURN_ON_FALSE(pattern_buf != NULL, ESP_ERR_NO_MEM, TAG, "nomem");
-    temp_buf = (uint8_t *)heap_caps_malloc(sector_size, MALLOC_CAP_DEFAULT);
+    temp_buf = (uint8_t *)heap_caps_malloc(io_size, MALLOC_CAP_DEFAULT);
     ESP_RETURN_ON_FALSE(temp_buf != NULL, ESP_ERR_NO_MEM, TAG, "nomem");
 
-    fill_buffer(PATTERN_SEED, pattern_buf, sector_size / sizeof(uint32_t));
+    fill_buffer(PATTERN_SEED, pattern_buf, io_size / sizeof(uint32_t));
 
     int64_t read_time = 0;
     int64_t write_time = 0;
@@ -127,11 +130,11 @@ static esp_err_t read_write_sectors_tp(spi_nand_flash_device_t *flash, uint32_t
         }
         write_time += esp_timer_get_time() - start;
 
-        memset((void *)temp_buf, 0x00, sector_size);
+        memset((void *)temp_buf, 0x00, io_size);
 
         start = esp_timer_get_time();
         if (get_raw_tp) {
-            ESP_ERROR_CHECK(nand_wrap_read(flash, i, 0, sector_size, temp_buf));
+            ESP_ERROR_CHECK(nand_wrap_read(flash, i, 0, io_size, temp_buf));
         } else {
             ESP_ERROR_CHECK(spi_nand_flash_read_sector(flash, temp_buf, i));
         }
@@ -140,8 +143,8 @@ static esp_err_t read_write_sectors_tp(spi_nand_flash_device_t *flash, uint32_t
     free(pattern_buf);
     free(temp_buf);
 
-    ESP_LOGI(TAG, "Wrote %" PRIu32 " bytes in %" PRId64 " us, avg %.2f kB/s", sector_size * sec_count, write_time, (float)sector_size * sec_count / write_time * 1000);
-    ESP_LOGI(TAG, "Read %" PRIu32 " bytes in %" PRId64 " us, avg %.2f kB/s\n", sector_size * sec_count, read_time, (float)sector_size * sec_count / read_time * 1000);
+    ESP_LOGI(TAG, "Wrote %" PRIu32 " bytes in %" PRId64 " us, avg %.2f kB/s", io_size * sec_count, write_time, (float)io_size * sec_count / write_time * 1000);
+    ESP_LOGI(TAG, "Read %" PRIu32 " bytes in %" PRId64 " us, avg %.2f kB/s\n", io_size * sec_count, read_time, (float)io_size * sec_count / read_time * 1000);
     return ret;
 }
 
@@ -0,0 +1,1030 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <vector>
+#include <algorithm>
+#include "spi_nand_flash.h"
+#include "spi_nand_emul.h"
+#include "nand_private/nand_impl_wrap.h"
+#include "nand_diag_api.h"
+
+#include <catch2/catch_test_macros.hpp>
+
+#define PATTERN_SEED    0x12345678
+
+static void fill_buffer(uint32_t seed, uint8_t *dst, size_t count)
+{
+    srand(seed);
+    for (size_t i = 0; i < count; ++i) {
+        uint32_t val = rand();
+        memcpy(dst + i * sizeof(uint32_t), &val, sizeof(val));
+    }
+}
+
+static void setup_nand_flash(const spi_nand_emul_config_t *emul_config, spi_device_handle_t *emul, spi_nand_flash_device_t **flash)
+{
+    REQUIRE(spi_nand_emul_init(emul_config, emul) == ESP_OK);
+    spi_nand_flash_config_t nand_flash_config = {
+        .device_handle = *emul,
+    };
+    REQUIRE(spi_nand_flash_init_device(&nand_flash_config, flash) == ESP_OK);
+}
+
+static void deinit_nand_flash(spi_device_handle_t emul, spi_nand_flash_device_t *flash)
+{
+    REQUIRE(spi_nand_flash_deinit_device(flash) == ESP_OK);
+    REQUIRE(spi_nand_emul_deinit(emul) == ESP_OK);
+}
+
+TEST_CASE("write and read sectors through dhara", "[spi_nand_flash]")
+{
+    spi_nand_emul_config_t emul_config = {};
+    spi_device_handle_t emul;
+    spi_nand_flash_device_t *flash;
+    setup_nand_flash(&emul_config, &emul, &flash);
+
+    uint32_t sector_num, sector_size;
+    REQUIRE(spi_nand_flash_get_capacity(flash, &sector_num) == ESP_OK);
+    REQUIRE(spi_nand_flash_get_sector_size(flash, &sector_size) == ESP_OK);
+#if CONFIG_NAND_FLASH_SUBPAGE_SECTORS
+    // W25N01GV takes four programs of a page
+    REQUIRE(sector_size == 512);
+#else
+    REQUIRE(sector_size == 2048);
+#endif
+
+    std::vector<uint8_t> pattern(sector_size);
+    std::vector<uint8_t> temp(sector_size);
+    for (uint32_t sector = 0; sector < 256; sector++) {
+        fill_buffer(PATTERN_SEED + sector, pattern.data(), sector_size / sizeof(uint32_t));
+        REQUIRE(spi_nand_flash_write_sector(flash, pattern.data(), sector) == ESP_OK);
+    }
+    REQUIRE(spi_nand_flash_sync(flash) == ESP_OK);
+    for (uint32_t sector = 0; sector < 256; sector++) {
+        fill_buffer(PATTERN_SEED + sector, pattern.data(), sector_size / sizeof(uint32_t));
+        REQUIRE(spi_nand_flash_read_sector(flash, temp.data(), sector) == ESP_OK);
+        REQUIRE(pattern == temp);
+    }
+
+    spi_nand_emul_stats_t stats;
+    REQUIRE(spi_nand_emul_get_stats(emul, &stats) == ESP_OK);
+    REQUIRE(stats.page_programs >= 256);
+    REQUIRE(stats.page_reads >= 256);
+
+    deinit_nand_flash(emul, flash);
+}
+
+TEST_CASE("content persists in the backing file", "[spi_nand_flash]")
+{
+    char path[] = "/tmp/spi_nand_host_test_XXXXXX";
+    int fd = mkstemp(path);
+    REQUIRE(fd >= 0);
+    close(fd);
+
+    spi_nand_emul_config_t emul_config = {
+        .file_path = path,
+        .keep_file = true,
+    };
+    spi_device_handle_t emul;
+    spi_nand_flash_device_t *flash;
+    uint32_t sector_size;
+    setup_nand_flash(&emul_config, &emul, &flash);
+    REQUIRE(spi_nand_flash_get_sector_size(flash, &sector_size) == ESP_OK);
+
+    std::vector<uint8_t> pattern(sector_size);
+    std::vector<uint8_t> temp(sector_size);
+    fill_buffer(PATTERN_SEED, pattern.data(), sector_size / sizeof(uint32_t));
+    REQUIRE(spi_nand_flash_write_sector(flash, pattern.data(), 7) == ESP_OK);
+    REQUIRE(spi_nand_flash_sync(flash) == ESP_OK);
+    deinit_nand_flash(emul, flash);
+
+    emul_config.keep_file = false;
+    setup_nand_flash(&emul_config, &emul, &flash);
+    REQUIRE(spi_nand_flash_read_sector(flash, temp.data(), 7) == ESP_OK);
+    REQUIRE(pattern == temp);
+    deinit_nand_flash(emul, flash);
+}
+
+TEST_CASE("injected bad blocks are reported", "[spi_nand_flash]")
+{
+    spi_nand_emul_config_t emul_config = {};
+    spi_device_handle_t emul;
+    spi_nand_flash_device_t *flash;
+    setup_nand_flash(&emul_config, &emul, &flash);
+
+    bool is_bad = true;
+    REQUIRE(nand_wrap_is_bad(flash, 16, &is_bad) == ESP_OK);
+    REQUIRE(is_bad == false);
+    // Markers are cached once read, so inject before the driver first looks at the block
+    REQUIRE(spi_nand_emul_set_bad_block(emul, 17) == ESP_OK);
+    REQUIRE(nand_wrap_is_bad(flash, 17, &is_bad) == ESP_OK);
+    REQUIRE(is_bad == true);
+
+    REQUIRE(nand_wrap_mark_bad(flash, 18) == ESP_OK);
+    uint32_t bad_block_count;
+    REQUIRE(nand_get_bad_block_stats(flash, &bad_block_count) == ESP_OK);
+    REQUIRE(bad_block_count == 2);
+
+    deinit_nand_flash(emul, flash);
+}
+
+TEST_CASE("injected ECC, program and erase failures are reported", "[spi_nand_flash]")
+{
+    spi_nand_emul_config_t emul_config = {};
+    spi_device_handle_t emul;
+    spi_nand_flash_device_t *flash;
+    setup_nand_flash(&emul_config, &emul, &flash);
+
+    uint32_t page_size, block_size;
+    REQUIRE(spi_nand_flash_get_page_size(flash, &page_size) == ESP_OK);
+    REQUIRE(spi_nand_flash_get_block_size(flash, &block_size) == ESP_OK);
+    uint32_t pages_per_block = block_size / page_size;
+    std::vector<uint8_t> pattern(page_size);
+    fill_buffer(PATTERN_SEED, pattern.data(), page_size / sizeof(uint32_t));
+
+    uint32_t test_page = 20 * pages_per_block;
+    REQUIRE(nand_wrap_prog(flash, test_page, pattern.data()) == ESP_OK);
+    REQUIRE(spi_nand_emul_inject_ecc_status(emul, test_page, 2) == ESP_OK);
+    REQUIRE(nand_wrap_read(flash, test_page, 0, page_size, pattern.data()) != ESP_OK);
+    REQUIRE(spi_nand_emul_clear_faults(emul) == ESP_OK);
+    REQUIRE(nand_wrap_read(flash, test_page, 0, page_size, pattern.data()) == ESP_OK);
+
+    REQUIRE(spi_nand_emul_inject_program_fail(emul, 21, true) == ESP_OK);
+    REQUIRE(nand_wrap_prog(flash, 21 * pages_per_block, pattern.data()) == ESP_ERR_NOT_FINISHED);
+
+    REQUIRE(spi_nand_emul_inject_erase_fail(emul, 22, true) == ESP_OK);
+    REQUIRE(nand_wrap_erase_block(flash, 22) == ESP_ERR_NOT_FINISHED);
+
+    deinit_nand_flash(emul, flash);
+}
+
+TEST_CASE("timing model accounts for chip delays", "[spi_nand_flash]")
+{
+    spi_nand_emul_config_t emul_config = {
+        .timing_scale_percent = 100,
+    };
+    spi_device_handle_t emul;
+    spi_nand_flash_device_t *flash;
+    setup_nand_flash(&emul_config, &emul, &flash);
+
+    REQUIRE(spi_nand_emul_reset_stats(emul) == ESP_OK);
+    REQUIRE(nand_wrap_erase_block(flash, 30) == ESP_OK);
+    spi_nand_emul_stats_t stats;
+    REQUIRE(spi_nand_emul_get_stats(emul, &stats) == ESP_OK);
+    REQUIRE(stats.block_erases == 1);
+    // W25N01GV block erase time
+    REQUIRE(stats.busy_time_us == 2500);
+
+    deinit_nand_flash(emul, flash);
+}
+
+TEST_CASE("read and write sector ranges", "[spi_nand_flash]")
+{
+    spi_nand_emul_config_t emul_config = {};
+    spi_device_handle_t emul;
+    spi_nand_flash_device_t *flash;
+    setup_nand_flash(&emul_config, &emul, &flash);
+
+    uint32_t sector_size;
+    REQUIRE(spi_nand_flash_get_sector_size(flash, &sector_size) == ESP_OK);
+    const uint32_t sector_count = 32;
+    std::vector<uint8_t> pattern(sector_size * sector_count);
+    std::vector<uint8_t> temp(sector_size * sector_count);
+    fill_buffer(PATTERN_SEED, pattern.data(), pattern.size() / sizeof(uint32_t));
+
+    REQUIRE(spi_nand_flash_write_sectors(flash, pattern.data(), 100, sector_count) == ESP_OK);
+    REQUIRE(spi_nand_flash_read_sectors(flash, temp.data(), 100, sector_count) == ESP_OK);
+    REQUIRE(pattern == temp);
+
+    // Sectors read one by one return the same data
+    for (uint32_t i = 0; i < sector_count; i++) {
+        REQUIRE(spi_nand_flash_read_sector(flash, temp.data() + i * sector_size, 100 + i) == ESP_OK);
+    }
+    REQUIRE(pattern == temp);
+
+    // Never written sectors read as erased
+    REQUIRE(spi_nand_flash_read_sectors(flash, temp.data(), 1000, 2) == ESP_OK);
+    REQUIRE(std::all_of(temp.begin(), temp.begin() + 2 * sector_size, [](uint8_t b) {
+        return b == 0xFF;
+    }));
+
+    deinit_nand_flash(emul, flash);
+}
+
+TEST_CASE("sector ranges are read with sequential cache reads", "[spi_nand_flash]")
+{
+    // MT29F1G01ABAFD supports PAGE READ CACHE SEQUENTIAL
+    spi_nand_emul_config_t emul_config = {
+        .manufacturer_id = 0x2C,
+        .device_id = 0x14,
+        .timing_scale_percent = 100,
+    };
+    spi_device_handle_t emul;
+    spi_nand_flash_device_t *flash;
+    setup_nand_flash(&emul_config, &emul, &flash);
+
+    uint32_t sector_size;
+    REQUIRE(spi_nand_flash_get_sector_size(flash, &sector_size) == ESP_OK);
+    const uint32_t sector_count = 48;
+    std::vector<uint8_t> pattern(sector_size * sector_count);
+    std::vector<uint8_t> temp(sector_size * sector_count);
+    fill_buffer(PATTERN_SEED, pattern.data(), pattern.size() / sizeof(uint32_t));
+
+    REQUIRE(spi_nand_flash_write_sectors(flash, pattern.data(), 10, sector_count) == ESP_OK);
+    REQUIRE(spi_nand_emul_reset_stats(emul) == ESP_OK);
+    REQUIRE(spi_nand_flash_read_sectors(flash, temp.data(), 10, sector_count) == ESP_OK);
+    REQUIRE(pattern == temp);
+
+    spi_nand_emul_stats_t range_stats;
+    REQUIRE(spi_nand_emul_get_stats(emul, &range_stats) == ESP_OK);
+
+    // The chip is left idle after a range read, so single page operations keep working and load the same pages
+    REQUIRE(spi_nand_emul_reset_stats(emul) == ESP_OK);
+    std::fill(temp.begin(), temp.end(), 0);
+    for (uint32_t i = 0; i < sector_count; i++) {
+        REQUIRE(spi_nand_flash_read_sector(flash, temp.data() + i * sector_size, 10 + i) == ESP_OK);
+    }
+    REQUIRE(pattern == temp);
+    spi_nand_emul_stats_t single_stats;
+    REQUIRE(spi_nand_emul_get_stats(emul, &single_stats) == ESP_OK);
+#if CONFIG_NAND_FLASH_SUBPAGE_SECTORS
+    // A range loads each page once, single reads load the page of every sector
+    REQUIRE(range_stats.page_reads < single_stats.page_reads);
+#else
+    REQUIRE(range_stats.page_reads == single_stats.page_reads);
+#endif
+
+    deinit_nand_flash(emul, flash);
+}
+
+TEST_CASE("dual and quad io modes transfer page data", "[spi_nand_flash]")
+{
+    struct {
+        uint8_t manufacturer_id;
+        uint16_t device_id;
+        spi_nand_io_mode_t io_mode;
+    } configs[] = {
+        {0, 0, SPI_NAND_IO_MODE_DOUT},                  // W25N01GV
+        {0, 0, SPI_NAND_IO_MODE_QOUT},                  // W25N01GV
+        {0xC8, 0x51, SPI_NAND_IO_MODE_QOUT},            // GD5F1GQ5, needs the QE bit
+    };
+
+    for (auto &cfg : configs) {
+        spi_nand_emul_config_t emul_config = {};
+        emul_config.manufacturer_id = cfg.manufacturer_id;
+        emul_config.device_id = cfg.device_id;
+        spi_device_handle_t emul;
+        REQUIRE(spi_nand_emul_init(&emul_config, &emul) == ESP_OK);
+        spi_nand_flash_config_t nand_flash_config = {
+            .device_handle = emul,
+            .io_mode = cfg.io_mode,
+        };
+        spi_nand_flash_device_t *flash;
+        REQUIRE(spi_nand_flash_init_device(&nand_flash_config, &flash) == ESP_OK);
+
+        uint32_t sector_size;
+        REQUIRE(spi_nand_flash_get_sector_size(flash, &sector_size) == ESP_OK);
+        const uint32_t sector_count = 8;
+        std::vector<uint8_t> pattern(sector_size * sector_count);
+        std::vector<uint8_t> temp(sector_size * sector_count);
+        fill_buffer(PATTERN_SEED, pattern.data(), pattern.size() / sizeof(uint32_t));
+
+        REQUIRE(spi_nand_flash_write_sectors(flash, pattern.data(), 0, sector_count) == ESP_OK);
+        REQUIRE(spi_nand_flash_read_sectors(flash, temp.data(), 0, sector_count) == ESP_OK);
+        REQUIRE(pattern == temp);
+
+        deinit_nand_flash(emul, flash);
+    }
+}
+
+TEST_CASE("stacked dies and planes are addressed per page", "[spi_nand_flash]")
+{
+    struct {
+        uint8_t manufacturer_id;
+        uint16_t device_id;
+    } configs[] = {
+        {0xEF, 0xAB21},                                 // W25M02GV, two stacked dies
+        {0x52, 0x2E},                                   // AS5F32G04SND, two planes
+    };
+
+    for (auto &cfg : configs) {
+        spi_nand_emul_config_t emul_config = {};
+        emul_config.manufacturer_id = cfg.manufacturer_id;
+        emul_config.device_id = cfg.device_id;
+        spi_device_handle_t emul;
+        spi_nand_flash_device_t *flash;
+        setup_nand_flash(&emul_config, &emul, &flash);
+
+        uint32_t page_size, block_size, num_blocks;
+        REQUIRE(spi_nand_flash_get_page_size(flash, &page_size) == ESP_OK);
+        REQUIRE(spi_nand_flash_get_block_size(flash, &block_size) == ESP_OK);
+        REQUIRE(spi_nand_flash_get_block_num(flash, &num_blocks) == ESP_OK);
+        REQUIRE(num_blocks == 2048);
+        const uint32_t pages_per_block = block_size / page_size;
+
+        // The emulator rejects page addresses beyond a die and columns selecting the wrong plane
+        const uint32_t src = 10 * pages_per_block;
+        std::vector<uint8_t> pattern(page_size);
+        std::vector<uint8_t> temp(page_size);
+        fill_buffer(PATTERN_SEED, pattern.data(), page_size / sizeof(uint32_t));
+        REQUIRE(nand_wrap_erase_block(flash, 10) == ESP_OK);
+        REQUIRE(nand_wrap_prog(flash, src, pattern.data()) == ESP_OK);
+
+        // Copies to the other plane, to the same plane, and to the second die
+        for (uint32_t block : {
+                    11U, 12U, num_blocks - 2
+                }) {
+            const uint32_t dst = block * pages_per_block + 1;
+            REQUIRE(nand_wrap_erase_block(flash, block) == ESP_OK);
+            REQUIRE(nand_wrap_copy(flash, src, dst) == ESP_OK);
+            REQUIRE(nand_wrap_read(flash, dst, 0, page_size, temp.data()) == ESP_OK);
+            REQUIRE(pattern == temp);
+            bool is_free = true;
+            REQUIRE(nand_wrap_is_free(flash, dst, &is_free) == ESP_OK);
+            REQUIRE(is_free == false);
+        }
+
+        // Erasing the chip erases the blocks of every die
+        nand_wait_stats_t before, after;
+        REQUIRE(nand_get_wait_stats(flash, &before) == ESP_OK);
+        REQUIRE(spi_nand_erase_chip(flash) == ESP_OK);
+        REQUIRE(nand_get_wait_stats(flash, &after) == ESP_OK);
+        REQUIRE(after.block_erases - before.block_erases == num_blocks);
+        bool is_free = false;
+        REQUIRE(nand_wrap_is_free(flash, (num_blocks - 2) * pages_per_block + 1, &is_free) == ESP_OK);
+        REQUIRE(is_free == true);
+
+        deinit_nand_flash(emul, flash);
+    }
+}
+
+TEST_CASE("wait statistics track chip operation times", "[spi_nand_flash]")
+{
+    spi_nand_emul_config_t emul_config = {
+        .timing_scale_percent = 100,
+    };
+    spi_device_handle_t emul;
+    spi_nand_flash_device_t *flash;
+    setup_nand_flash(&emul_config, &emul, &flash);
+
+    nand_wait_stats_t before, after;
+    REQUIRE(nand_get_wait_stats(flash, &before) == ESP_OK);
+    for (uint32_t block = 30; block < 40; block++) {
+        REQUIRE(nand_wrap_erase_block(flash, block) == ESP_OK);
+    }
+    REQUIRE(nand_get_wait_stats(flash, &after) == ESP_OK);
+
+    REQUIRE(after.waits - before.waits == 10);
+    REQUIRE(after.block_erases - before.block_erases == 10);
+    REQUIRE(after.page_programs == before.page_programs);
+    REQUIRE(after.status_polls - before.status_polls >= 10);
+    // W25N01GV block erase time is 2500 us, every wait lasts at least that long
+    REQUIRE(after.wait_time_us - before.wait_time_us >= 10 * 2500);
+#if CONFIG_NAND_FLASH_ADAPTIVE_WAIT
+    // The learned erase time stays in the range of the modelled one
+    REQUIRE(after.erase_time_us >= 2500);
+    REQUIRE(after.erase_time_us <= 5000);
+#else
+    REQUIRE(after.erase_time_us == 2500);
+    REQUIRE(after.time_saved_us == 0);
+#endif
+
+    deinit_nand_flash(emul, flash);
+}
+
+TEST_CASE("bad block markers are read from the chip once", "[spi_nand_flash]")
+{
+    spi_nand_emul_config_t emul_config = {};
+    spi_device_handle_t emul;
+    spi_nand_flash_device_t *flash;
+    setup_nand_flash(&emul_config, &emul, &flash);
+
+    REQUIRE(spi_nand_emul_set_bad_block(emul, 40) == ESP_OK);
+    uint32_t bad_block_count;
+    REQUIRE(nand_get_bad_block_stats(flash, &bad_block_count) == ESP_OK);
+    REQUIRE(bad_block_count == 1);
+
+    // A second scan is served from RAM
+    spi_nand_emul_stats_t stats;
+    REQUIRE(spi_nand_emul_reset_stats(emul) == ESP_OK);
+    REQUIRE(nand_get_bad_block_stats(flash, &bad_block_count) == ESP_OK);
+    REQUIRE(bad_block_count == 1);
+    REQUIRE(spi_nand_emul_get_stats(emul, &stats) == ESP_OK);
+    REQUIRE(stats.page_reads == 0);
+
+    // Marking a block bad updates the table, erasing a block reads its marker again
+    REQUIRE(nand_wrap_mark_bad(flash, 41) == ESP_OK);
+    bool is_bad = false;
+    REQUIRE(nand_wrap_is_bad(flash, 41, &is_bad) == ESP_OK);
+    REQUIRE(is_bad == true);
+    REQUIRE(nand_wrap_erase_block(flash, 41) == ESP_OK);
+    REQUIRE(nand_wrap_is_bad(flash, 41, &is_bad) == ESP_OK);
+    REQUIRE(is_bad == false);
+
+    deinit_nand_flash(emul, flash);
+}
+
+#if CONFIG_NAND_FLASH_SECTOR_CACHE_SIZE > 0
+TEST_CASE("sector cache serves repeated reads and follows writes", "[spi_nand_flash]")
+{
+    spi_nand_emul_config_t emul_config = {};
+    spi_device_handle_t emul;
+    spi_nand_flash_device_t *flash;
+    setup_nand_flash(&emul_config, &emul, &flash);
+
+    uint32_t sector_size;
+    REQUIRE(spi_nand_flash_get_sector_size(flash, &sector_size) == ESP_OK);
+    std::vector<uint8_t> pattern(sector_size);
+    std::vector<uint8_t> temp(sector_size);
+    fill_buffer(PATTERN_SEED, pattern.data(), sector_size / sizeof(uint32_t));
+    REQUIRE(spi_nand_flash_write_sector(flash, pattern.data(), 5) == ESP_OK);
+    // Move the sector out of the write-back buffer, so reads go through the cache
+    REQUIRE(spi_nand_flash_sync(flash) == ESP_OK);
+
+    nand_sector_cache_stats_t before, after;
+    REQUIRE(nand_get_sector_cache_stats(flash, &before) == ESP_OK);
+    REQUIRE(before.num_entries == CONFIG_NAND_FLASH_SECTOR_CACHE_SIZE);
+    REQUIRE(spi_nand_flash_read_sector(flash, temp.data(), 5) == ESP_OK);
+    REQUIRE(pattern == temp);
+
+    // The second read does not touch the chip
+    spi_nand_emul_stats_t stats;
+    REQUIRE(spi_nand_emul_reset_stats(emul) == ESP_OK);
+    std::fill(temp.begin(), temp.end(), 0);
+    REQUIRE(spi_nand_flash_read_sector(flash, temp.data(), 5) == ESP_OK);
+    REQUIRE(pattern == temp);
+    REQUIRE(spi_nand_emul_get_stats(emul, &stats) == ESP_OK);
+    REQUIRE(stats.page_reads == 0);
+    REQUIRE(nand_get_sector_cache_stats(flash, &after) == ESP_OK);
+    REQUIRE(after.hits - before.hits == 1);
+    REQUIRE(after.misses - before.misses == 1);
+
+    // Writes and range reads see the same data as single reads
+    fill_buffer(PATTERN_SEED + 1, pattern.data(), sector_size / sizeof(uint32_t));
+    REQUIRE(spi_nand_flash_write_sector(flash, pattern.data(), 5) == ESP_OK);
+    REQUIRE(spi_nand_flash_read_sector(flash, temp.data(), 5) == ESP_OK);
+    REQUIRE(pattern == temp);
+    REQUIRE(spi_nand_flash_read_sectors(flash, temp.data(), 5, 1) == ESP_OK);
+    REQUIRE(pattern == temp);
+
+    // Trimmed sectors read as erased
+    REQUIRE(spi_nand_flash_trim(flash, 5) == ESP_OK);
+    REQUIRE(spi_nand_flash_read_sector(flash, temp.data(), 5) == ESP_OK);
+    REQUIRE(std::all_of(temp.begin(), temp.end(), [](uint8_t b) {
+        return b == 0xFF;
+    }));
+
+    // More sectors than entries evict the least recently used ones
+    for (uint32_t sector = 100; sector < 100 + 2 * CONFIG_NAND_FLASH_SECTOR_CACHE_SIZE; sector++) {
+        REQUIRE(spi_nand_flash_read_sector(flash, temp.data(), sector) == ESP_OK);
+    }
+    REQUIRE(nand_get_sector_cache_stats(flash, &before) == ESP_OK);
+    REQUIRE(spi_nand_flash_read_sector(flash, temp.data(), 100) == ESP_OK);
+    REQUIRE(spi_nand_flash_read_sector(flash, temp.data(), 100 + 2 * CONFIG_NAND_FLASH_SECTOR_CACHE_SIZE - 1) == ESP_OK);
+    REQUIRE(nand_get_sector_cache_stats(flash, &after) == ESP_OK);
+    REQUIRE(after.misses - before.misses == 1);
+    REQUIRE(after.hits - before.hits == 1);
+
+    deinit_nand_flash(emul, flash);
+}
+#endif
+
+TEST_CASE("sectors are read straight into the caller's buffer", "[spi_nand_flash]")
+{
+    spi_nand_emul_config_t emul_config = {};
+    spi_device_handle_t emul;
+    spi_nand_flash_device_t *flash;
+    setup_nand_flash(&emul_config, &emul, &flash);
+
+    uint32_t sector_size;
+    REQUIRE(spi_nand_flash_get_sector_size(flash, &sector_size) == ESP_OK);
+    std::vector<uint8_t> pattern(4 * sector_size);
+    std::vector<uint8_t> temp(4 * sector_size);
+    fill_buffer(PATTERN_SEED, pattern.data(), pattern.size() / sizeof(uint32_t));
+    REQUIRE(spi_nand_flash_write_sectors(flash, pattern.data(), 0, 4) == ESP_OK);
+    REQUIRE(spi_nand_flash_sync(flash) == ESP_OK);
+
+    nand_read_stats_t before, after;
+    REQUIRE(nand_get_read_stats(flash, &before) == ESP_OK);
+    REQUIRE(spi_nand_flash_read_sector(flash, temp.data(), 0) == ESP_OK);
+    REQUIRE(spi_nand_flash_read_sectors(flash, temp.data() + sector_size, 1, 3) == ESP_OK);
+    REQUIRE(pattern == temp);
+    // Any host buffer can be read into, the bounce buffer is only needed on chips
+    REQUIRE(nand_get_read_stats(flash, &after) == ESP_OK);
+    REQUIRE(after.direct_sectors - before.direct_sectors == 4);
+    REQUIRE(after.bounced_sectors == before.bounced_sectors);
+
+    deinit_nand_flash(emul, flash);
+}
+
+#if CONFIG_NAND_FLASH_WRITE_BACK_SIZE > 0
+TEST_CASE("write-back buffer coalesces rewrites until sync", "[spi_nand_flash]")
+{
+    spi_nand_emul_config_t emul_config = {};
+    spi_device_handle_t emul;
+    spi_nand_flash_device_t *flash;
+    setup_nand_flash(&emul_config, &emul, &flash);
+
+    uint32_t sector_size;
+    REQUIRE(spi_nand_flash_get_sector_size(flash, &sector_size) == ESP_OK);
+    std::vector<uint8_t> pattern(sector_size);
+    std::vector<uint8_t> temp(sector_size);
+
+    // Rewriting the same sector does not program the chip, and reads return the latest data
+    spi_nand_emul_stats_t stats;
+    REQUIRE(spi_nand_emul_reset_stats(emul) == ESP_OK);
+    for (uint32_t i = 0; i < 20; i++) {
+        fill_buffer(PATTERN_SEED + i, pattern.data(), sector_size / sizeof(uint32_t));
+        REQUIRE(spi_nand_flash_write_sector(flash, pattern.data(), 7) == ESP_OK);
+        REQUIRE(spi_nand_flash_read_sector(flash, temp.data(), 7) == ESP_OK);
+        REQUIRE(pattern == temp);
+    }
+    REQUIRE(spi_nand_emul_get_stats(emul, &stats) == ESP_OK);
+    REQUIRE(stats.page_programs == 0);
+
+    nand_write_back_stats_t wb_stats;
+    REQUIRE(nand_get_write_back_stats(flash, &wb_stats) == ESP_OK);
+    REQUIRE(wb_stats.num_entries == CONFIG_NAND_FLASH_WRITE_BACK_SIZE);
+    REQUIRE(wb_stats.buffered == 1);
+    REQUIRE(wb_stats.coalesced == 19);
+
+    // Range reads see buffered sectors too
+    std::vector<uint8_t> range(3 * sector_size);
+    REQUIRE(spi_nand_flash_read_sectors(flash, range.data(), 6, 3) == ESP_OK);
+    REQUIRE(memcmp(range.data() + sector_size, pattern.data(), sector_size) == 0);
+
+    // Sync writes the sector once
+    REQUIRE(spi_nand_flash_sync(flash) == ESP_OK);
+    REQUIRE(spi_nand_emul_get_stats(emul, &stats) == ESP_OK);
+    REQUIRE(stats.page_programs >= 1);
+    REQUIRE(nand_get_write_back_stats(flash, &wb_stats) == ESP_OK);
+    REQUIRE(wb_stats.buffered == 0);
+    REQUIRE(wb_stats.flushed_sectors == 1);
+
+    // Filling the buffer writes it back
+    for (uint32_t sector = 10; sector < 10 + CONFIG_NAND_FLASH_WRITE_BACK_SIZE + 1; sector++) {
+        REQUIRE(spi_nand_flash_write_sector(flash, pattern.data(), sector) == ESP_OK);
+    }
+    REQUIRE(nand_get_write_back_stats(flash, &wb_stats) == ESP_OK);
+    REQUIRE(wb_stats.buffered == 1);
+    REQUIRE(wb_stats.flushed_sectors == 1 + CONFIG_NAND_FLASH_WRITE_BACK_SIZE);
+
+    // A trimmed sector is dropped from the buffer
+    REQUIRE(spi_nand_flash_trim(flash, 10 + CONFIG_NAND_FLASH_WRITE_BACK_SIZE) == ESP_OK);
+    REQUIRE(spi_nand_flash_read_sector(flash, temp.data(), 10 + CONFIG_NAND_FLASH_WRITE_BACK_SIZE) == ESP_OK);
+    REQUIRE(std::all_of(temp.begin(), temp.end(), [](uint8_t b) {
+        return b == 0xFF;
+    }));
+
+    deinit_nand_flash(emul, flash);
+}
+#endif
+
+TEST_CASE("trim sector ranges", "[spi_nand_flash]")
+{
+    spi_nand_emul_config_t emul_config = {};
+    spi_device_handle_t emul;
+    spi_nand_flash_device_t *flash;
+    setup_nand_flash(&emul_config, &emul, &flash);
+
+    uint32_t sector_num, sector_size;
+    REQUIRE(spi_nand_flash_get_capacity(flash, &sector_num) == ESP_OK);
+    REQUIRE(spi_nand_flash_get_sector_size(flash, &sector_size) == ESP_OK);
+    const uint32_t sector_count = 16;
+    std::vector<uint8_t> pattern(sector_size * sector_count);
+    std::vector<uint8_t> temp(sector_size * sector_count);
+    fill_buffer(PATTERN_SEED, pattern.data(), pattern.size() / sizeof(uint32_t));
+    REQUIRE(spi_nand_flash_write_sectors(flash, pattern.data(), 0, sector_count) == ESP_OK);
+
+    // Trim the middle of the range, the sectors around it keep their data
+    REQUIRE(spi_nand_flash_trim_range(flash, 4, 8) == ESP_OK);
+    REQUIRE(spi_nand_flash_read_sectors(flash, temp.data(), 0, sector_count) == ESP_OK);
+    REQUIRE(memcmp(temp.data(), pattern.data(), 4 * sector_size) == 0);
+    REQUIRE(std::all_of(temp.begin() + 4 * sector_size, temp.begin() + 12 * sector_size, [](uint8_t b) {
+        return b == 0xFF;
+    }));
+    REQUIRE(memcmp(temp.data() + 12 * sector_size, pattern.data() + 12 * sector_size, 4 * sector_size) == 0);
+
+    REQUIRE(spi_nand_flash_trim_range(flash, sector_num - 1, 2) == ESP_ERR_INVALID_ARG);
+
+    // Trimming everything erases the good blocks instead of trimming sector by sector
+    uint32_t num_blocks;
+    REQUIRE(spi_nand_flash_get_block_num(flash, &num_blocks) == ESP_OK);
+    REQUIRE(spi_nand_emul_set_bad_block(emul, 50) == ESP_OK);
+    spi_nand_emul_stats_t stats;
+    REQUIRE(spi_nand_emul_reset_stats(emul) == ESP_OK);
+    REQUIRE(spi_nand_flash_trim_range(flash, 0, sector_num) == ESP_OK);
+    REQUIRE(spi_nand_emul_get_stats(emul, &stats) == ESP_OK);
+    REQUIRE(stats.block_erases == num_blocks - 1);
+    REQUIRE(stats.page_programs == 0);
+    REQUIRE(spi_nand_flash_read_sectors(flash, temp.data(), 0, sector_count) == ESP_OK);
+    REQUIRE(std::all_of(temp.begin(), temp.end(), [](uint8_t b) {
+        return b == 0xFF;
+    }));
+    bool is_bad = false;
+    REQUIRE(nand_wrap_is_bad(flash, 50, &is_bad) == ESP_OK);
+    REQUIRE(is_bad == true);
+
+    // The device keeps working after the map was cleared
+    REQUIRE(spi_nand_flash_write_sectors(flash, pattern.data(), 0, sector_count) == ESP_OK);
+    REQUIRE(spi_nand_flash_read_sectors(flash, temp.data(), 0, sector_count) == ESP_OK);
+    REQUIRE(pattern == temp);
+
+    deinit_nand_flash(emul, flash);
+}
+
+#if CONFIG_NAND_FLASH_FAST_MOUNT
+TEST_CASE("journal state saved on deinit is restored on mount", "[spi_nand_flash]")
+{
+    char path[] = "/tmp/spi_nand_host_test_XXXXXX";
+    int fd = mkstemp(path);
+    REQUIRE(fd >= 0);
+    close(fd);
+
+    spi_nand_emul_config_t emul_config = {
+        .file_path = path,
+        .keep_file = true,
+    };
+    spi_device_handle_t emul;
+    spi_nand_flash_device_t *flash;
+    setup_nand_flash(&emul_config, &emul, &flash);
+
+    nand_mount_stats_t mount_stats;
+    REQUIRE(nand_get_mount_stats(flash, &mount_stats) == ESP_OK);
+    REQUIRE(mount_stats.fast_mount == false);
+
+    uint32_t sector_size, page_size, block_size, num_blocks;
+    REQUIRE(spi_nand_flash_get_sector_size(flash, &sector_size) == ESP_OK);
+    REQUIRE(spi_nand_flash_get_page_size(flash, &page_size) == ESP_OK);
+    REQUIRE(spi_nand_flash_get_block_size(flash, &block_size) == ESP_OK);
+    REQUIRE(spi_nand_flash_get_block_num(flash, &num_blocks) == ESP_OK);
+    std::vector<uint8_t> pattern(sector_size);
+    std::vector<uint8_t> temp(sector_size);
+    fill_buffer(PATTERN_SEED, pattern.data(), sector_size / sizeof(uint32_t));
+    REQUIRE(spi_nand_flash_write_sector(flash, pattern.data(), 7) == ESP_OK);
+    deinit_nand_flash(emul, flash);
+
+    setup_nand_flash(&emul_config, &emul, &flash);
+    REQUIRE(nand_get_mount_stats(flash, &mount_stats) == ESP_OK);
+    REQUIRE(mount_stats.fast_mount == true);
+    REQUIRE(spi_nand_flash_read_sector(flash, temp.data(), 7) == ESP_OK);
+    REQUIRE(pattern == temp);
+
+    // The first write marks the saved state as stale, once
+    spi_nand_emul_stats_t stats;
+    REQUIRE(spi_nand_emul_reset_stats(emul) == ESP_OK);
+    REQUIRE(spi_nand_flash_write_sector(flash, pattern.data(), 8) == ESP_OK);
+    REQUIRE(spi_nand_flash_sync(flash) == ESP_OK);
+    REQUIRE(spi_nand_emul_get_stats(emul, &stats) == ESP_OK);
+    const uint32_t first_write_programs = stats.page_programs;
+    REQUIRE(spi_nand_emul_reset_stats(emul) == ESP_OK);
+    REQUIRE(spi_nand_flash_write_sector(flash, pattern.data(), 9) == ESP_OK);
+    REQUIRE(spi_nand_flash_sync(flash) == ESP_OK);
+    REQUIRE(spi_nand_emul_get_stats(emul, &stats) == ESP_OK);
+    REQUIRE(first_write_programs == stats.page_programs + 1);
+
+    // The last record in the last block is the stale marker, so a power loss now leads to a full journal search
+    const uint32_t pages_per_block = block_size / page_size;
+    const uint32_t first_hint_page = (num_blocks - 1) * pages_per_block;
+    uint32_t next_page = 0;
+    bool is_free = false;
+    while (next_page < pages_per_block) {
+        REQUIRE(nand_wrap_is_free(flash, first_hint_page + next_page, &is_free) == ESP_OK);
+        if (is_free) {
+            break;
+        }
+        next_page++;
+    }
+    REQUIRE(next_page > 0);
+    uint32_t magic;
+    REQUIRE(nand_wrap_read(flash, first_hint_page + next_page - 1, 0, sizeof(magic), (uint8_t *)&magic) == ESP_OK);
+    REQUIRE(magic == 0x454c5453);
+    deinit_nand_flash(emul, flash);
+
+    // Unmounting saved the new state
+    emul_config.keep_file = false;
+    setup_nand_flash(&emul_config, &emul, &flash);
+    REQUIRE(nand_get_mount_stats(flash, &mount_stats) == ESP_OK);
+    REQUIRE(mount_stats.fast_mount == true);
+    for (uint32_t sector = 7; sector <= 9; sector++) {
+        REQUIRE(spi_nand_flash_read_sector(flash, temp.data(), sector) == ESP_OK);
+        REQUIRE(pattern == temp);
+    }
+    deinit_nand_flash(emul, flash);
+}
+#endif
+
+TEST_CASE("copied pages are marked as used", "[spi_nand_flash]")
+{
+    spi_nand_emul_config_t emul_config = {};
+    spi_device_handle_t emul;
+    spi_nand_flash_device_t *flash;
+    setup_nand_flash(&emul_config, &emul, &flash);
+
+    uint32_t page_size, block_size;
+    REQUIRE(spi_nand_flash_get_page_size(flash, &page_size) == ESP_OK);
+    REQUIRE(spi_nand_flash_get_block_size(flash, &block_size) == ESP_OK);
+    const uint32_t pages_per_block = block_size / page_size;
+    const uint32_t src = 60 * pages_per_block;
+    const uint32_t dst = 61 * pages_per_block;
+    REQUIRE(nand_wrap_erase_block(flash, 60) == ESP_OK);
+    REQUIRE(nand_wrap_erase_block(flash, 61) == ESP_OK);
+
+    std::vector<uint8_t> pattern(page_size);
+    std::vector<uint8_t> temp(page_size);
+    fill_buffer(PATTERN_SEED, pattern.data(), page_size / sizeof(uint32_t));
+    REQUIRE(nand_wrap_prog(flash, src, pattern.data()) == ESP_OK);
+    REQUIRE(nand_wrap_copy(flash, src, dst) == ESP_OK);
+    REQUIRE(nand_wrap_read(flash, dst, 0, page_size, temp.data()) == ESP_OK);
+    REQUIRE(pattern == temp);
+
+    // The used marker is written by the copy itself, not taken over from the source page
+    bool is_free = false;
+    REQUIRE(nand_wrap_is_free(flash, src + 1, &is_free) == ESP_OK);
+    REQUIRE(is_free == true);
+    REQUIRE(nand_wrap_copy(flash, src + 1, dst + 1) == ESP_OK);
+    REQUIRE(nand_wrap_is_free(flash, dst + 1, &is_free) == ESP_OK);
+    REQUIRE(is_free == false);
+
+    deinit_nand_flash(emul, flash);
+}
+
+TEST_CASE("gc steps keep the sector content", "[spi_nand_flash]")
+{
+    spi_nand_emul_config_t emul_config = {};
+    spi_device_handle_t emul;
+    spi_nand_flash_device_t *flash;
+    setup_nand_flash(&emul_config, &emul, &flash);
+
+    uint32_t sector_size;
+    REQUIRE(spi_nand_flash_get_sector_size(flash, &sector_size) == ESP_OK);
+    std::vector<uint8_t> pattern(sector_size);
+    std::vector<uint8_t> temp(sector_size);
+    REQUIRE(spi_nand_flash_gc(flash, 8) == ESP_OK);
+    for (uint32_t sector = 0; sector < 32; sector++) {
+        fill_buffer(PATTERN_SEED + sector, pattern.data(), sector_size / sizeof(uint32_t));
+        REQUIRE(spi_nand_flash_write_sector(flash, pattern.data(), sector) == ESP_OK);
+    }
+    REQUIRE(spi_nand_flash_sync(flash) == ESP_OK);
+    REQUIRE(spi_nand_flash_gc(flash, 64) == ESP_OK);
+    for (uint32_t sector = 0; sector < 32; sector++) {
+        fill_buffer(PATTERN_SEED + sector, pattern.data(), sector_size / sizeof(uint32_t));
+        REQUIRE(spi_nand_flash_read_sector(flash, temp.data(), sector) == ESP_OK);
+        REQUIRE(pattern == temp);
+    }
+
+    deinit_nand_flash(emul, flash);
+}
+
+#if CONFIG_NAND_FLASH_BACKGROUND_GC
+TEST_CASE("background gc collects garbage while idle", "[spi_nand_flash]")
+{
+    spi_nand_emul_config_t emul_config = {};
+    spi_device_handle_t emul;
+    REQUIRE(spi_nand_emul_init(&emul_config, &emul) == ESP_OK);
+    spi_nand_flash_config_t nand_flash_config = {
+        .device_handle = emul,
+        .bg_gc_idle_ms = 10,
+        // More than the chip holds, so the task collects until the journal only holds live sectors
+        .bg_gc_reserve_blocks = UINT16_MAX,
+    };
+    spi_nand_flash_device_t *flash;
+    REQUIRE(spi_nand_flash_init_device(&nand_flash_config, &flash) == ESP_OK);
+
+    uint32_t sector_size;
+    REQUIRE(spi_nand_flash_get_sector_size(flash, &sector_size) == ESP_OK);
+    std::vector<uint8_t> pattern(sector_size);
+    std::vector<uint8_t> temp(sector_size);
+
+    // Rewrites leave garbage behind, nothing is collected while paused
+    REQUIRE(spi_nand_flash_bg_gc_pause(flash) == ESP_OK);
+    for (uint32_t round = 0; round < 8; round++) {
+        for (uint32_t sector = 0; sector < 8; sector++) {
+            fill_buffer(PATTERN_SEED + round * 8 + sector, pattern.data(), sector_size / sizeof(uint32_t));
+            REQUIRE(spi_nand_flash_write_sector(flash, pattern.data(), sector) == ESP_OK);
+        }
+        REQUIRE(spi_nand_flash_sync(flash) == ESP_OK);
+    }
+    usleep(50 * 1000);
+    nand_bg_gc_stats_t paused_stats;
+    REQUIRE(nand_get_bg_gc_stats(flash, &paused_stats) == ESP_OK);
+    REQUIRE(paused_stats.paused);
+    REQUIRE(paused_stats.runs == 0);
+    REQUIRE(paused_stats.free_pages < paused_stats.reserve_pages);
+
+    // Once resumed, the task frees pages until a batch only moves live sectors
+    REQUIRE(spi_nand_flash_bg_gc_resume(flash) == ESP_OK);
+    nand_bg_gc_stats_t stats = {};
+    for (int i = 0; i < 200 && stats.stalls == 0; i++) {
+        usleep(10 * 1000);
+        REQUIRE(nand_get_bg_gc_stats(flash, &stats) == ESP_OK);
+    }
+    REQUIRE(stats.paused == false);
+    REQUIRE(stats.stalls == 1);
+    REQUIRE(stats.runs > 0);
+    REQUIRE(stats.steps <= stats.runs * CONFIG_NAND_FLASH_BACKGROUND_GC_STEPS);
+    REQUIRE(stats.pages_freed > 0);
+    REQUIRE(stats.free_pages == paused_stats.free_pages + stats.pages_freed);
+
+    for (uint32_t sector = 0; sector < 8; sector++) {
+        fill_buffer(PATTERN_SEED + 7 * 8 + sector, pattern.data(), sector_size / sizeof(uint32_t));
+        REQUIRE(spi_nand_flash_read_sector(flash, temp.data(), sector) == ESP_OK);
+        REQUIRE(pattern == temp);
+    }
+
+    deinit_nand_flash(emul, flash);
+}
+#endif
+
+#if CONFIG_NAND_FLASH_REFRESH_QUEUE_SIZE > 0
+TEST_CASE("sectors with corrected bit errors are queued for refresh", "[spi_nand_flash]")
+{
+    spi_nand_emul_config_t emul_config = {};
+    spi_device_handle_t emul;
+    spi_nand_flash_device_t *flash;
+    setup_nand_flash(&emul_config, &emul, &flash);
+#if CONFIG_NAND_FLASH_BACKGROUND_GC
+    // The queue is drained below, not by the task
+    REQUIRE(spi_nand_flash_bg_gc_pause(flash) == ESP_OK);
+#endif
+
+    uint32_t sector_size, page_size, block_size;
+    REQUIRE(spi_nand_flash_get_sector_size(flash, &sector_size) == ESP_OK);
+    REQUIRE(spi_nand_flash_get_page_size(flash, &page_size) == ESP_OK);
+    REQUIRE(spi_nand_flash_get_block_size(flash, &block_size) == ESP_OK);
+    uint32_t pages_per_block = block_size / page_size;
+    std::vector<uint8_t> pattern(sector_size);
+    std::vector<uint8_t> temp(sector_size);
+    for (uint32_t sector = 0; sector < 16; sector++) {
+        fill_buffer(PATTERN_SEED + sector, pattern.data(), sector_size / sizeof(uint32_t));
+        REQUIRE(spi_nand_flash_write_sector(flash, pattern.data(), sector) == ESP_OK);
+    }
+    REQUIRE(spi_nand_flash_sync(flash) == ESP_OK);
+
+    // 4 to 6 corrected bits, at the default refresh threshold, on every page the sectors may be stored in
+    for (uint32_t page = 0; page < 2 * pages_per_block; page++) {
+        REQUIRE(spi_nand_emul_inject_ecc_status(emul, page, 3) == ESP_OK);
+    }
+    nand_refresh_stats_t stats;
+    REQUIRE(spi_nand_flash_read_sector(flash, temp.data(), 3) == ESP_OK);
+    REQUIRE(spi_nand_flash_read_sector(flash, temp.data(), 3) == ESP_OK);
+    fill_buffer(PATTERN_SEED + 3, pattern.data(), sector_size / sizeof(uint32_t));
+    REQUIRE(pattern == temp);
+    REQUIRE(nand_get_refresh_stats(flash, &stats) == ESP_OK);
+    // The second read is served by the sector cache
+    REQUIRE(stats.sectors_queued == 1);
+    REQUIRE(stats.pending_sectors == 1);
+    REQUIRE(stats.sectors_refreshed == 0);
+
+    REQUIRE(spi_nand_emul_clear_faults(emul) == ESP_OK);
+    REQUIRE(spi_nand_flash_refresh(flash) == ESP_OK);
+    REQUIRE(nand_get_refresh_stats(flash, &stats) == ESP_OK);
+    REQUIRE(stats.pending_sectors == 0);
+    REQUIRE(stats.sectors_refreshed == 1);
+
+    // A full queue is drained by the read which finds it full
+    for (uint32_t page = 0; page < 2 * pages_per_block; page++) {
+        REQUIRE(spi_nand_emul_inject_ecc_status(emul, page, 3) == ESP_OK);
+    }
+    const uint32_t first = 8;
+    for (uint32_t sector = first; sector <= first + CONFIG_NAND_FLASH_REFRESH_QUEUE_SIZE; sector++) {
+        REQUIRE(spi_nand_flash_read_sectors(flash, temp.data(), sector, 1) == ESP_OK);
+    }
+    REQUIRE(nand_get_refresh_stats(flash, &stats) == ESP_OK);
+    REQUIRE(stats.queue_full == 1);
+    REQUIRE(stats.sectors_refreshed == 1 + CONFIG_NAND_FLASH_REFRESH_QUEUE_SIZE);
+    REQUIRE(stats.pending_sectors == 1);
+
+    // Trimmed sectors are dropped from the queue instead of being written again
+    REQUIRE(spi_nand_emul_clear_faults(emul) == ESP_OK);
+    REQUIRE(spi_nand_flash_trim(flash, first + CONFIG_NAND_FLASH_REFRESH_QUEUE_SIZE) == ESP_OK);
+    REQUIRE(spi_nand_flash_refresh(flash) == ESP_OK);
+    REQUIRE(nand_get_refresh_stats(flash, &stats) == ESP_OK);
+    REQUIRE(stats.pending_sectors == 0);
+    REQUIRE(spi_nand_flash_read_sector(flash, temp.data(), first + CONFIG_NAND_FLASH_REFRESH_QUEUE_SIZE) == ESP_OK);
+    REQUIRE(std::all_of(temp.begin(), temp.end(), [](uint8_t b) {
+        return b == 0xFF;
+    }));
+
+    for (uint32_t sector = first; sector < first + CONFIG_NAND_FLASH_REFRESH_QUEUE_SIZE; sector++) {
+        fill_buffer(PATTERN_SEED + sector, pattern.data(), sector_size / sizeof(uint32_t));
+        REQUIRE(spi_nand_flash_read_sector(flash, temp.data(), sector) == ESP_OK);
+        REQUIRE(pattern == temp);
+    }
+
+    deinit_nand_flash(emul, flash);
+}
+#endif
+
+#if CONFIG_NAND_FLASH_READ_DISTURB_THRESHOLD > 0
+TEST_CASE("blocks are refreshed after many reads", "[spi_nand_flash]")
+{
+    spi_nand_emul_config_t emul_config = {};
+    spi_device_handle_t emul;
+    spi_nand_flash_device_t *flash;
+    setup_nand_flash(&emul_config, &emul, &flash);
+#if CONFIG_NAND_FLASH_BACKGROUND_GC
+    REQUIRE(spi_nand_flash_bg_gc_pause(flash) == ESP_OK);
+#endif
+
+    uint32_t sector_size, block_size;
+    REQUIRE(spi_nand_flash_get_sector_size(flash, &sector_size) == ESP_OK);
+    REQUIRE(spi_nand_flash_get_block_size(flash, &block_size) == ESP_OK);
+    uint32_t sectors_per_block = block_size / sector_size;
+    std::vector<uint8_t> pattern(sector_size);
+    std::vector<uint8_t> temp(sector_size);
+    // The journal of a blank chip starts in block 0
+    for (uint32_t sector = 0; sector < 2 * sectors_per_block; sector++) {
+        fill_buffer(PATTERN_SEED + sector, pattern.data(), sector_size / sizeof(uint32_t));
+        REQUIRE(spi_nand_flash_write_sector(flash, pattern.data(), sector) == ESP_OK);
+    }
+    REQUIRE(spi_nand_flash_sync(flash) == ESP_OK);
+
+    nand_refresh_stats_t stats;
+    REQUIRE(nand_get_refresh_stats(flash, &stats) == ESP_OK);
+    REQUIRE(stats.blocks_due == 0);
+    // Mounting and writing have read block 0 a few times already
+    for (uint32_t i = 0; i < CONFIG_NAND_FLASH_READ_DISTURB_THRESHOLD && stats.blocks_due == 0; i++) {
+        REQUIRE(nand_wrap_read(flash, 0, 0, sector_size, temp.data()) == ESP_OK);
+        REQUIRE(nand_get_refresh_stats(flash, &stats) == ESP_OK);
+    }
+    REQUIRE(stats.blocks_due == 1);
+    REQUIRE(stats.pending_blocks == 1);
+    REQUIRE(stats.max_block_reads == CONFIG_NAND_FLASH_READ_DISTURB_THRESHOLD);
+
+    REQUIRE(spi_nand_flash_refresh(flash) == ESP_OK);
+    REQUIRE(nand_get_refresh_stats(flash, &stats) == ESP_OK);
+    REQUIRE(stats.pending_blocks == 0);
+    REQUIRE(stats.blocks_refreshed == 1);
+    REQUIRE(stats.block_sectors_moved > 0);
+    REQUIRE(stats.block_sectors_moved < sectors_per_block);
+
+    for (uint32_t sector = 0; sector < 2 * sectors_per_block; sector++) {
+        fill_buffer(PATTERN_SEED + sector, pattern.data(), sector_size / sizeof(uint32_t));
+        REQUIRE(spi_nand_flash_read_sectors(flash, temp.data(), sector, 1) == ESP_OK);
+        REQUIRE(pattern == temp);
+    }
+
+    deinit_nand_flash(emul, flash);
+}
+#endif
+
+#if CONFIG_NAND_FLASH_SUBPAGE_SECTORS
+TEST_CASE("512 byte sectors are programmed as partial pages", "[spi_nand_flash]")
+{
+    spi_nand_emul_config_t emul_config = {};
+    spi_device_handle_t emul;
+    spi_nand_flash_device_t *flash;
+    setup_nand_flash(&emul_config, &emul, &flash);
+
+    uint32_t sector_size, page_size, block_size;
+    REQUIRE(spi_nand_flash_get_sector_size(flash, &sector_size) == ESP_OK);
+    REQUIRE(spi_nand_flash_get_page_size(flash, &page_size) == ESP_OK);
+    REQUIRE(spi_nand_flash_get_block_size(flash, &block_size) == ESP_OK);
+    REQUIRE(sector_size == 512);
+    REQUIRE(page_size == 2048);
+
+    const uint32_t num_sectors = 30;
+    std::vector<uint8_t> pattern(num_sectors * sector_size);
+    std::vector<uint8_t> temp(num_sectors * sector_size);
+    fill_buffer(PATTERN_SEED, pattern.data(), pattern.size() / sizeof(uint32_t));
+    REQUIRE(spi_nand_emul_reset_stats(emul) == ESP_OK);
+    for (uint32_t i = 0; i < num_sectors; i++) {
+        REQUIRE(spi_nand_flash_write_sector(flash, pattern.data() + i * sector_size, i) == ESP_OK);
+    }
+    REQUIRE(spi_nand_flash_sync(flash) == ESP_OK);
+    // Only the sectors and their journal metadata are loaded into the chip, not whole pages
+    spi_nand_emul_stats_t stats;
+    REQUIRE(spi_nand_emul_get_stats(emul, &stats) == ESP_OK);
+    REQUIRE(stats.bytes_loaded < num_sectors * page_size);
+
+    for (uint32_t i = 0; i < num_sectors; i++) {
+        REQUIRE(spi_nand_flash_read_sector(flash, temp.data() + i * sector_size, i) == ESP_OK);
+    }
+    REQUIRE(pattern == temp);
+    std::fill(temp.begin(), temp.end(), 0);
+    REQUIRE(spi_nand_flash_read_sectors(flash, temp.data(), 0, num_sectors) == ESP_OK);
+    REQUIRE(pattern == temp);
+
+    // Rewrites fill the journal and collect garbage, which copies sectors between partially programmed pages. The
+    // emulated chip rejects a fifth program of a page.
+    const uint32_t rewrites = 4 * block_size / sector_size;
+    for (uint32_t i = 0; i < rewrites; i++) {
+        fill_buffer(PATTERN_SEED + i, pattern.data(), sector_size / sizeof(uint32_t));
+        REQUIRE(spi_nand_flash_write_sector(flash, pattern.data(), 1) == ESP_OK);
+    }
+    REQUIRE(spi_nand_flash_gc(flash, 64) == ESP_OK);
+    REQUIRE(spi_nand_flash_sync(flash) == ESP_OK);
+    REQUIRE(spi_nand_flash_read_sectors(flash, temp.data(), 0, num_sectors) == ESP_OK);
+    REQUIRE(memcmp(temp.data() + sector_size, pattern.data(), sector_size) == 0);
+    fill_buffer(PATTERN_SEED, pattern.data(), pattern.size() / sizeof(uint32_t));
+    REQUIRE(memcmp(temp.data() + 2 * sector_size, pattern.data() + 2 * sector_size, (num_sectors - 2) * sector_size) == 0);
+
+    deinit_nand_flash(emul, flash);
+}
+#endif
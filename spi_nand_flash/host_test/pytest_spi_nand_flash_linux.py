@@ -0,0 +1,18 @@
+# SPDX-FileCopyrightText: 2024 Espressif Systems (Shanghai) CO LTD
+# SPDX-License-Identifier: Unlicense OR CC0-1.0
+
+import pytest
+from pytest_embedded import Dut
+
+
+@pytest.mark.linux
+@pytest.mark.host_test
+def test_spi_nand_flash_linux(dut: Dut) -> None:
+    dut.expect_exact('All tests passed', timeout=120)
+
+
+@pytest.mark.linux
+@pytest.mark.host_test
+@pytest.mark.parametrize('config', ['subpage_sectors'], indirect=True)
+def test_spi_nand_flash_linux_subpage_sectors(dut: Dut) -> None:
+    dut.expect_exact('All tests passed', timeout=120)
@@ -7,6 +7,7 @@
 #pragma once
 
 #include <stdint.h>
+#include <stdbool.h>
 #include "esp_err.h"
 #include "spi_nand_flash.h"
 
@@ -16,6 +17,79 @@ extern "C" {
 
 // These API used for diagnostic purpose of SPI NAND Flash
 
+/** @brief Statistics of the waits for page read, program and erase operations to complete. */
+typedef struct {
+    uint32_t waits;                 ///< Number of waits for the chip to become ready
+    uint32_t status_polls;          ///< Number of status register reads while waiting
+    uint64_t wait_time_us;          ///< Total time spent waiting
+    int64_t time_saved_us;          ///< Estimated wait time saved compared to fixed delays and tick sleeps.
+    ///< Always 0 unless CONFIG_NAND_FLASH_ADAPTIVE_WAIT is enabled
+    uint32_t read_time_us;          ///< Learned page read time, or the datasheet time without adaptive wait
+    uint32_t program_time_us;       ///< Learned page program time, or the datasheet time without adaptive wait
+    uint32_t erase_time_us;         ///< Learned block erase time, or the datasheet time without adaptive wait
+    uint32_t page_programs;         ///< Number of page programs, including internal data moves
+    uint32_t block_erases;          ///< Number of block erases
+} nand_wait_stats_t;
+
+/** @brief Statistics of the sector read cache. */
+typedef struct {
+    uint32_t num_entries;           ///< Number of sectors the cache holds, CONFIG_NAND_FLASH_SECTOR_CACHE_SIZE
+    uint32_t hits;                  ///< Sector reads served from the cache
+    uint32_t misses;                ///< Sector reads which went to the flash
+} nand_sector_cache_stats_t;
+
+/** @brief Statistics of the write-back buffer. */
+typedef struct {
+    uint32_t num_entries;           ///< Number of sectors the buffer holds, CONFIG_NAND_FLASH_WRITE_BACK_SIZE
+    uint32_t buffered;              ///< Number of sectors buffered at the moment
+    uint32_t writes;                ///< Sector writes which went into the buffer
+    uint32_t coalesced;             ///< Writes which replaced a buffered sector, saving a page program
+    uint32_t flushes;               ///< Number of times the buffer was written back
+    uint32_t flushed_sectors;       ///< Sectors written back to flash
+} nand_write_back_stats_t;
+
+/** @brief Statistics of sector reads from flash, i.e. reads which were not served by the sector cache or the write-back
+ * buffer. */
+typedef struct {
+    uint32_t direct_sectors;        ///< Sectors read straight into the caller's buffer
+    uint32_t bounced_sectors;       ///< Sectors read into an internal buffer and copied, because the caller's buffer was
+    ///< not DMA capable or not word aligned
+} nand_read_stats_t;
+
+/** @brief Statistics of the last mount, i.e. the Dhara map resume in spi_nand_flash_init_device. */
+typedef struct {
+    uint32_t mount_time_us;         ///< Time spent resuming the map
+    uint32_t page_reads;            ///< Page reads while resuming, excluding bad block and free page checks
+    uint32_t free_checks;           ///< Free page checks while resuming, each one reads a page
+    uint32_t bad_block_checks;      ///< Bad block checks while resuming, read from the chip the first time only
+    bool fast_mount;                ///< The journal state was restored from a mount hint, see CONFIG_NAND_FLASH_FAST_MOUNT
+} nand_mount_stats_t;
+
+/** @brief Statistics of the background garbage collection task, see CONFIG_NAND_FLASH_BACKGROUND_GC. */
+typedef struct {
+    uint32_t runs;                  ///< Batches of garbage collection steps run by the task
+    uint32_t steps;                 ///< Garbage collection steps run by the task
+    uint32_t pages_freed;           ///< Journal pages freed by the task
+    uint32_t stalls;                ///< Batches which freed nothing, because the tail of the journal only held live sectors
+    uint32_t free_pages;            ///< Pages which can be written before writes have to collect garbage
+    uint32_t reserve_pages;         ///< Free pages the task keeps, bg_gc_reserve_blocks in pages
+    bool paused;                    ///< The task is paused by spi_nand_flash_bg_gc_pause
+} nand_bg_gc_stats_t;
+
+/** @brief Statistics of data refresh, see CONFIG_NAND_FLASH_REFRESH_QUEUE_SIZE and CONFIG_NAND_FLASH_READ_DISTURB_THRESHOLD. */
+typedef struct {
+    uint32_t sectors_queued;        ///< Sector reads which corrected ecc_data_refresh_threshold bits or more
+    uint32_t sectors_refreshed;     ///< Sectors rewritten because of corrected bits
+    uint32_t queue_full;            ///< Times a read found the queue full and rewrote the queued sectors itself
+    uint32_t blocks_due;            ///< Blocks which reached CONFIG_NAND_FLASH_READ_DISTURB_THRESHOLD page reads
+    uint32_t blocks_refreshed;      ///< Due blocks whose live sectors were moved to the head of the journal
+    uint32_t block_sectors_moved;   ///< Live sectors moved out of due blocks
+    uint32_t pending_sectors;       ///< Sectors waiting in the queue
+    uint32_t pending_blocks;        ///< Due blocks waiting to be refreshed
+    uint32_t max_block_reads;       ///< Highest page read count of a block since its last erase, 0 without read
+    ///< disturb tracking
+} nand_refresh_stats_t;
+
 /** @brief Get bad block statistics for the NAND Flash.
  *
  * This function scans all the blocks in the NAND Flash and returns the total count of bad blocks.
@@ -35,6 +109,64 @@ esp_err_t nand_get_bad_block_stats(spi_nand_flash_device_t *flash, uint32_t *bad
  */
 esp_err_t nand_get_ecc_stats(spi_nand_flash_device_t *flash);
 
+/** @brief Get statistics of the waits for page read, program and erase operations.
+ *
+ * @param flash The handle to the SPI nand flash chip.
+ * @param[out] stats A pointer of where to put the statistics.
+ * @return ESP_OK on success.
+ */
+esp_err_t nand_get_wait_stats(spi_nand_flash_device_t *flash, nand_wait_stats_t *stats);
+
+/** @brief Get statistics of the sector read cache.
+ *
+ * @param flash The handle to the SPI nand flash chip.
+ * @param[out] stats A pointer of where to put the statistics.
+ * @return ESP_OK on success.
+ */
+esp_err_t nand_get_sector_cache_stats(spi_nand_flash_device_t *flash, nand_sector_cache_stats_t *stats);
+
+/** @brief Get statistics of the write-back buffer.
+ *
+ * @param flash The handle to the SPI nand flash chip.
+ * @param[out] stats A pointer of where to put the statistics.
+ * @return ESP_OK on success.
+ */
+esp_err_t nand_get_write_back_stats(spi_nand_flash_device_t *flash, nand_write_back_stats_t *stats);
+
+/** @brief Get statistics of sector reads from flash.
+ *
+ * @param flash The handle to the SPI nand flash chip.
+ * @param[out] stats A pointer of where to put the statistics.
+ * @return ESP_OK on success.
+ */
+esp_err_t nand_get_read_stats(spi_nand_flash_device_t *flash, nand_read_stats_t *stats);
+
+/** @brief Get statistics of the last mount.
+ *
+ * @param flash The handle to the SPI nand flash chip.
+ * @param[out] stats A pointer of where to put the statistics.
+ * @return ESP_OK on success.
+ */
+esp_err_t nand_get_mount_stats(spi_nand_flash_device_t *flash, nand_mount_stats_t *stats);
+
+/** @brief Get statistics of the background garbage collection task.
+ *
+ * free_pages is reported even if CONFIG_NAND_FLASH_BACKGROUND_GC is disabled, the other counters are 0 then.
+ *
+ * @param flash The handle to the SPI nand flash chip.
+ * @param[out] stats A pointer of where to put the statistics.
+ * @return ESP_OK on success.
+ */
+esp_err_t nand_get_bg_gc_stats(spi_nand_flash_device_t *flash, nand_bg_gc_stats_t *stats);
+
+/** @brief Get statistics of data refresh.
+ *
+ * @param flash The handle to the SPI nand flash chip.
+ * @param[out] stats A pointer of where to put the statistics.
+ * @return ESP_OK on success.
+ */
+esp_err_t nand_get_refresh_stats(spi_nand_flash_device_t *flash, nand_refresh_stats_t *stats);
+
 #ifdef __cplusplus
 }
 #endif
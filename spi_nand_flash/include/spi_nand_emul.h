@@ -0,0 +1,128 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The SPI master driver is not available on the linux target. The emulated chip takes the place of the SPI device,
+// so the NAND layer keeps using the same handle type and transaction flags as on real hardware.
+typedef struct spi_nand_emul_t *spi_device_handle_t;
+
+#define SPI_TRANS_MODE_DIO                  (1 << 0)
+#define SPI_TRANS_MODE_QIO                  (1 << 1)
+#define SPI_TRANS_USE_RXDATA                (1 << 2)
+#define SPI_TRANS_USE_TXDATA                (1 << 3)
+#define SPI_TRANS_MODE_DIOQIO_ADDR          (1 << 4)
+#define SPI_TRANS_VARIABLE_CMD              (1 << 5)
+#define SPI_TRANS_VARIABLE_ADDR             (1 << 6)
+#define SPI_TRANS_VARIABLE_DUMMY            (1 << 7)
+#define SPI_TRANS_DMA_BUFFER_ALIGN_MANUAL   (1 << 11)
+
+/** @brief Configuration of the emulated SPI NAND chip. */
+typedef struct {
+    const char *file_path;          ///< File backing the pages and OOB. If NULL, a temporary file is created and removed on deinit
+    bool keep_file;                 ///< Do not remove the backing file on deinit, so its content survives a re-init
+    uint8_t manufacturer_id;        ///< Manufacturer ID reported by READ ID. 0 selects Winbond
+    uint16_t device_id;             ///< Device ID reported by READ ID. 0 selects W25N01GV (0xAA21)
+    uint32_t timing_scale_percent;  ///< Scale applied to the chip's page read, program and erase times. 0 disables the timing model
+} spi_nand_emul_config_t;
+
+/** @brief Operation counters of the emulated SPI NAND chip. */
+typedef struct {
+    uint32_t page_reads;            ///< Number of PAGE READ operations (array to cache)
+    uint32_t page_programs;         ///< Number of PROGRAM EXECUTE operations (cache to array)
+    uint32_t block_erases;          ///< Number of BLOCK ERASE operations
+    uint32_t transactions;          ///< Total number of SPI transactions
+    uint64_t bytes_read;            ///< Bytes transferred from the cache to the host
+    uint64_t bytes_loaded;          ///< Bytes transferred from the host to the cache
+    uint64_t busy_time_us;          ///< Total array busy time of the modelled chip, independent of timing_scale_percent
+} spi_nand_emul_stats_t;
+
+/** @brief Create an emulated SPI NAND chip.
+ *
+ * The backing file is mapped once the NAND layer has detected the chip geometry in spi_nand_flash_init_device.
+ * The returned handle is passed as device_handle in spi_nand_flash_config_t.
+ *
+ * @param config Pointer to the emulator configuration.
+ * @param[out] handle The handle of the emulated chip is returned in this variable.
+ * @return ESP_OK on success, ESP_ERR_NO_MEM if out of memory.
+ */
+esp_err_t spi_nand_emul_init(const spi_nand_emul_config_t *config, spi_device_handle_t *handle);
+
+/** @brief Release the emulated chip, unmapping and optionally removing the backing file.
+ *
+ * @param handle The handle of the emulated chip.
+ * @return ESP_OK on success, or an error code if unmapping failed.
+ */
+esp_err_t spi_nand_emul_deinit(spi_device_handle_t handle);
+
+/** @brief Write a factory bad block marker into the OOB area of the first page of a block.
+ *
+ * @param handle The handle of the emulated chip.
+ * @param block The block to mark as bad.
+ * @return ESP_OK on success, ESP_ERR_INVALID_ARG if the block is out of range, ESP_ERR_INVALID_STATE if the chip is not attached yet.
+ */
+esp_err_t spi_nand_emul_set_bad_block(spi_device_handle_t handle, uint32_t block);
+
+/** @brief Make every subsequent PAGE READ of a page report the given ECC status, until its block is erased.
+ *
+ * @param handle The handle of the emulated chip.
+ * @param page The page to inject the ECC status into.
+ * @param ecc_status Raw value of the status register ECC field (ECC2:ECC0), e.g. 2 for an uncorrectable error.
+ * @return ESP_OK on success, ESP_ERR_INVALID_ARG if the page or status is out of range, ESP_ERR_INVALID_STATE if the chip is not attached yet.
+ */
+esp_err_t spi_nand_emul_inject_ecc_status(spi_device_handle_t handle, uint32_t page, uint8_t ecc_status);
+
+/** @brief Make PROGRAM EXECUTE fail for every page of a block.
+ *
+ * @param handle The handle of the emulated chip.
+ * @param block The block to fail programs on.
+ * @param fail true to inject the failure, false to remove it.
+ * @return ESP_OK on success, ESP_ERR_INVALID_ARG if the block is out of range, ESP_ERR_INVALID_STATE if the chip is not attached yet.
+ */
+esp_err_t spi_nand_emul_inject_program_fail(spi_device_handle_t handle, uint32_t block, bool fail);
+
+/** @brief Make BLOCK ERASE fail for a block.
+ *
+ * @param handle The handle of the emulated chip.
+ * @param block The block to fail erases on.
+ * @param fail true to inject the failure, false to remove it.
+ * @return ESP_OK on success, ESP_ERR_INVALID_ARG if the block is out of range, ESP_ERR_INVALID_STATE if the chip is not attached yet.
+ */
+esp_err_t spi_nand_emul_inject_erase_fail(spi_device_handle_t handle, uint32_t block, bool fail);
+
+/** @brief Remove all injected ECC, program and erase faults. Bad block markers are kept.
+ *
+ * @param handle The handle of the emulated chip.
+ * @return ESP_OK on success.
+ */
+esp_err_t spi_nand_emul_clear_faults(spi_device_handle_t handle);
+
+/** @brief Retrieve the operation counters of the emulated chip.
+ *
+ * @param handle The handle of the emulated chip.
+ * @param[out] stats A pointer of where to put the counters.
+ * @return ESP_OK on success.
+ */
+esp_err_t spi_nand_emul_get_stats(spi_device_handle_t handle, spi_nand_emul_stats_t *stats);
+
+/** @brief Reset the operation counters of the emulated chip.
+ *
+ * @param handle The handle of the emulated chip.
+ * @return ESP_OK on success.
+ */
+esp_err_t spi_nand_emul_reset_stats(spi_device_handle_t handle);
+
+#ifdef __cplusplus
+}
+#endif
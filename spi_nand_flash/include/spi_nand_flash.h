@@ -10,20 +10,39 @@
 
 #include <stdint.h>
 #include "esp_err.h"
+#include "sdkconfig.h"
+#if CONFIG_IDF_TARGET_LINUX
+#include "spi_nand_emul.h"
+#else
 #include "driver/spi_common.h"
 #include "driver/spi_master.h"
+#endif
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/** @brief Number of data lines used to transfer page data between the host and the chip. */
+typedef enum {
+    SPI_NAND_IO_MODE_SIO = 0,   ///< Single line for command, address and data
+    SPI_NAND_IO_MODE_DOUT,      ///< Reads use two data lines (3Bh). Programs use a single line
+    SPI_NAND_IO_MODE_QOUT,      ///< Reads (6Bh) and program loads (34h) use four data lines
+} spi_nand_io_mode_t;
+
 /** @brief Structure to describe how to configure the nand access layer.
  @note The spi_device_handle_t must be initialized with the flag SPI_DEVICE_HALFDUPLEX
+ @note On the linux target, device_handle is an emulated chip created with spi_nand_emul_init
 */
 struct spi_nand_flash_config_t {
     spi_device_handle_t device_handle;       ///< SPI Device for this nand chip.
     uint8_t gc_factor;                       ///< The gc factor controls the number of blocks to spare block ratio.
     ///< Lower values will reduce the available space but increase performance
+    spi_nand_io_mode_t io_mode;              ///< Data lines used for page transfers. Dual and quad modes need the extra data lines
+    ///< wired and configured on the SPI bus (quadwp_io_num/quadhd_io_num)
+    uint32_t bg_gc_idle_ms;                  ///< Time without reads or writes after which the background GC task starts
+    ///< collecting garbage, 0 selects 100 ms. Only used with CONFIG_NAND_FLASH_BACKGROUND_GC
+    uint16_t bg_gc_reserve_blocks;           ///< Blocks of journal space the background GC task keeps free for foreground
+    ///< writes, 0 selects 8. Only used with CONFIG_NAND_FLASH_BACKGROUND_GC
 };
 
 typedef struct spi_nand_flash_config_t spi_nand_flash_config_t;
@@ -48,6 +67,20 @@ esp_err_t spi_nand_flash_init_device(spi_nand_flash_config_t *config, spi_nand_f
  */
 esp_err_t spi_nand_flash_read_sector(spi_nand_flash_device_t *handle, uint8_t *buffer, uint32_t sector_id);
 
+/** @brief Read a range of consecutive sectors from the nand flash.
+ *
+ * Equivalent to calling spi_nand_flash_read_sector for each sector, but the device is locked once for the whole range.
+ * If the buffer is DMA capable and word aligned, data is read into it directly, and sectors stored in consecutive
+ * pages are read in one go.
+ *
+ * @param handle The handle to the SPI nand flash chip.
+ * @param[out] buffer The output buffer, sector_count times the sector size.
+ * @param start_sector The id of the first sector to read.
+ * @param sector_count The number of sectors to read.
+ * @return ESP_OK on success, or a flash error code if the read failed.
+ */
+esp_err_t spi_nand_flash_read_sectors(spi_nand_flash_device_t *handle, uint8_t *buffer, uint32_t start_sector, uint32_t sector_count);
+
 /** @brief Copy a sector to another sector from the nand flash.
  *
  * @param handle The handle to the SPI nand flash chip.
@@ -66,6 +99,18 @@ esp_err_t spi_nand_flash_copy_sector(spi_nand_flash_device_t *handle, uint32_t s
  */
 esp_err_t spi_nand_flash_write_sector(spi_nand_flash_device_t *handle, const uint8_t *buffer, uint32_t sector_id);
 
+/** @brief Write a range of consecutive sectors to the nand flash.
+ *
+ * Equivalent to calling spi_nand_flash_write_sector for each sector, but the device is locked once for the whole range.
+ *
+ * @param handle The handle to the SPI nand flash chip.
+ * @param buffer The input buffer, sector_count times the sector size.
+ * @param start_sector The id of the first sector to write.
+ * @param sector_count The number of sectors to write.
+ * @return ESP_OK on success, or a flash error code if the write failed.
+ */
+esp_err_t spi_nand_flash_write_sectors(spi_nand_flash_device_t *handle, const uint8_t *buffer, uint32_t start_sector, uint32_t sector_count);
+
 /** @brief Trim sector from the nand flash.
  *
  * This function marks specified sector as free to optimize memory usage
@@ -78,6 +123,61 @@ esp_err_t spi_nand_flash_write_sector(spi_nand_flash_device_t *handle, const uin
  */
 esp_err_t spi_nand_flash_trim(spi_nand_flash_device_t *handle, uint32_t sector_id);
 
+/** @brief Trim a range of consecutive sectors from the nand flash.
+ *
+ * Equivalent to calling spi_nand_flash_trim for each sector, but the device is locked once for the whole range.
+ * Trimming every sector of the device erases all good blocks and starts an empty map, which is much faster than
+ * trimming the sectors one by one.
+ *
+ * @param handle The handle to the SPI nand flash chip.
+ * @param start_sector The id of the first sector to trim.
+ * @param sector_count The number of sectors to trim.
+ * @return ESP_OK on success, ESP_ERR_INVALID_ARG if the range exceeds the capacity, or a flash error code if the trim failed.
+ */
+esp_err_t spi_nand_flash_trim_range(spi_nand_flash_device_t *handle, uint32_t start_sector, uint32_t sector_count);
+
+/** @brief Run garbage collection steps ahead of time.
+ *
+ * Dhara collects garbage while writing, when it runs out of space, which makes some writes much slower than others.
+ * Each step moves one page from the tail of the journal to its head, or drops it if it holds no live data. Running
+ * steps while the application is idle takes that work out of later writes. All steps run with the device locked once.
+ * Steps also move live pages when there is plenty of free space, so they cost page programs and wear.
+ *
+ * @param handle The handle to the SPI nand flash chip.
+ * @param max_steps The number of steps to run. Nothing is done while the map holds no sectors.
+ * @return ESP_OK on success, or a flash error code if a step failed.
+ */
+esp_err_t spi_nand_flash_gc(spi_nand_flash_device_t *handle, uint32_t max_steps);
+
+/** @brief Rewrite the data which is due for a refresh.
+ *
+ * Sectors whose reads corrected many bits are queued when CONFIG_NAND_FLASH_REFRESH_QUEUE_SIZE is not 0, and blocks
+ * which have been read CONFIG_NAND_FLASH_READ_DISTURB_THRESHOLD times are marked for a refresh. The background garbage
+ * collection task rewrites them while the device is idle. Without that task, call this function from time to time,
+ * e.g. while the application is idle. All queued sectors and marked blocks are rewritten with the device locked once.
+ *
+ * @param handle The handle to the SPI nand flash chip.
+ * @return ESP_OK on success, or a flash error code if a rewrite failed. Entries which failed stay queued.
+ */
+esp_err_t spi_nand_flash_refresh(spi_nand_flash_device_t *handle);
+
+/** @brief Pause the background garbage collection task.
+ *
+ * Returns once a batch of steps which is running has finished. Until spi_nand_flash_bg_gc_resume is called, garbage
+ * is only collected by writes and spi_nand_flash_gc, e.g. while the application needs the SPI bus for itself.
+ *
+ * @param handle The handle to the SPI nand flash chip.
+ * @return ESP_OK on success, ESP_ERR_NOT_SUPPORTED if CONFIG_NAND_FLASH_BACKGROUND_GC is disabled.
+ */
+esp_err_t spi_nand_flash_bg_gc_pause(spi_nand_flash_device_t *handle);
+
+/** @brief Resume the background garbage collection task after spi_nand_flash_bg_gc_pause.
+ *
+ * @param handle The handle to the SPI nand flash chip.
+ * @return ESP_OK on success, ESP_ERR_NOT_SUPPORTED if CONFIG_NAND_FLASH_BACKGROUND_GC is disabled.
+ */
+esp_err_t spi_nand_flash_bg_gc_resume(spi_nand_flash_device_t *handle);
+
 /** @brief Synchronizes any cache to the device.
  *
  * After this method is called, the nand flash chip should be synchronized with the results of any previous read/writes.
@@ -103,6 +203,16 @@ esp_err_t spi_nand_flash_get_capacity(spi_nand_flash_device_t *handle, uint32_t
  */
 esp_err_t spi_nand_flash_get_sector_size(spi_nand_flash_device_t *handle, uint32_t *sector_size);
 
+/** @brief Retrieve the size of each page of the chip.
+ *
+ * This is the sector size, unless CONFIG_NAND_FLASH_SUBPAGE_SECTORS splits pages into several sectors.
+ *
+ * @param handle The handle to the SPI nand flash chip.
+ * @param[out] page_size A pointer of where to put the return value
+ * @return ESP_OK on success, or a flash error code if the operation failed.
+ */
+esp_err_t spi_nand_flash_get_page_size(spi_nand_flash_device_t *handle, uint32_t *page_size);
+
 /** @brief Retrieve the size of each block.
  *
  * @param handle The handle to the SPI nand flash chip.
@@ -127,9 +237,11 @@ esp_err_t spi_nand_erase_chip(spi_nand_flash_device_t *handle);
 esp_err_t spi_nand_flash_get_block_num(spi_nand_flash_device_t *handle, uint32_t *number_of_blocks);
 
 /** @brief De-initialize the handle, releasing any resources reserved.
+ *
+ * The handle is released even if an error is returned.
  *
  * @param handle The handle to the SPI nand flash chip.
- * @return ESP_OK on success, or a flash error code if the de-initialization failed.
+ * @return ESP_OK on success, or a flash error code if the buffered writes could not be written back.
  */
 esp_err_t spi_nand_flash_deinit_device(spi_nand_flash_device_t *handle);
 
@@ -10,7 +10,12 @@
 
 #include <stdint.h>
 #include "spi_nand_flash.h"
+#include "nand_diag_api.h"
 #include "freertos/semphr.h"
+#include "freertos/task.h"
+#if !CONFIG_IDF_TARGET_LINUX
+#include "esp_timer.h"
+#endif
 
 #ifdef __cplusplus
 extern "C" {
@@ -35,29 +40,132 @@ typedef struct {
     ecc_status_t ecc_corrected_bits_status;
 } ecc_data_t;
 
+#define NAND_FLAG_READ_CACHE_SEQ    (1 << 0)    // Supports PAGE READ CACHE SEQUENTIAL (31h) and PAGE READ CACHE LAST (3Fh)
+#define NAND_FLAG_IO_DUAL           (1 << 1)    // Supports READ FROM CACHE x2 (3Bh)
+#define NAND_FLAG_IO_QUAD           (1 << 2)    // Supports READ FROM CACHE x4 (6Bh) and RANDOM PROGRAM LOAD x4 (34h)
+#define NAND_FLAG_QUAD_ENABLE       (1 << 3)    // x4 transfers need the QE bit set in the configuration register
+#define NAND_FLAG_PLANE_SELECT      (1 << 4)    // Two planes, cache accesses carry the plane (block address bit 0) in the
+// column address, right above the page and spare area. Internal data moves stay within a plane.
+
 typedef struct {
     uint8_t log2_page_size; //is power of 2, log2_page_size shift (1<<log2_page_size) is stored to page_size
     uint8_t log2_ppb;  //is power of 2, log2_ppb shift ((1<<log2_ppb) * page_size) will be stored in block size
     uint32_t block_size;
     uint32_t page_size;
-    uint32_t num_blocks;
+    uint32_t sector_size;   // logical sector size, page_size unless pages are split into 512 byte sub-page sectors
+    uint8_t log2_sectors_per_page;  // 0 unless CONFIG_NAND_FLASH_SUBPAGE_SECTORS is enabled
+    uint8_t num_partial_programs;   // programs a page takes between two erases (NOP)
+    uint32_t num_blocks;    // blocks of all dies, die n holds blocks n * num_blocks / num_dies onwards
+    uint8_t num_dies;       // dies stacked in the package, selected with SOFTWARE DIE SELECT (C2h)
+    uint8_t selected_die;   // die selected last, UINT8_MAX until the first selection
     uint32_t read_page_delay_us;
     uint32_t erase_block_delay_us;
     uint32_t program_page_delay_us;
+    uint32_t flags;     // NAND_FLAG_* capabilities of the chip
     ecc_data_t ecc_data;
 } spi_nand_chip_t;
 
+// Operations the driver waits for, each with its own learned duration
+typedef enum {
+    NAND_OP_READ = 0,   // PAGE READ, array to cache
+    NAND_OP_PROGRAM,    // PROGRAM EXECUTE, cache to array
+    NAND_OP_ERASE,      // BLOCK ERASE
+    NAND_OP_CACHE,      // cache transfer of sequential cache reads
+    NAND_OP_ERASE_OVERLAPPED,   // BLOCK ERASE which ran while the erase of another die was waited for
+    NAND_OP_MAX,
+} nand_op_t;
+
+typedef struct {
+    uint32_t learned_us[NAND_OP_MAX];   // running average of observed busy times, seeded from the datasheet values
+#if !CONFIG_IDF_TARGET_LINUX
+    esp_timer_handle_t timer;           // one shot timer waking the waiting task up
+    SemaphoreHandle_t wakeup;
+#endif
+    nand_wait_stats_t stats;
+} nand_wait_t;
+
+// RAM copy of the bad block markers, one bit per block. A block's marker is read from the chip the first time it is
+// needed, and kept up to date by nand_mark_bad and erases.
+typedef struct {
+    uint32_t *checked;                  // marker has been read from the chip
+    uint32_t *bad;                      // block is bad, valid where checked is set
+} nand_bad_block_table_t;
+
+typedef struct {
+    uint32_t sector_id;                 // UINT32_MAX when the entry is empty
+    uint32_t last_use;                  // value of use_counter at the last access, 0 when empty
+} nand_sector_cache_entry_t;
+
+// LRU cache of logical sectors in front of the Dhara map, see nand_sector_cache.h
+typedef struct {
+    nand_sector_cache_entry_t *entries;
+    uint8_t *data;                      // one page per entry
+    uint32_t num_entries;
+    uint32_t use_counter;
+    uint32_t hits;
+    uint32_t misses;
+} nand_sector_cache_t;
+
+// Write-back buffer of logical sectors in front of the ops table, see nand_write_back.h
+typedef struct {
+    uint32_t *sector_ids;               // sector held by each slot, UINT32_MAX for free slots
+    uint8_t *data;                      // one page per slot
+    uint32_t num_entries;
+    uint32_t num_used;
+    int64_t oldest_us;                  // time of the first write into the empty buffer
+    uint32_t writes;
+    uint32_t coalesced;
+    uint32_t flushes;
+    uint32_t flushed_sectors;
+} nand_write_back_t;
+
+// Background garbage collection task, see nand_bg_gc.h
+typedef struct {
+#if CONFIG_NAND_FLASH_BACKGROUND_GC
+    TaskHandle_t task;
+    SemaphoreHandle_t exited;           // given by the task right before it deletes itself
+#endif
+    int64_t last_access_us;             // time of the last read or write through the public API
+    uint32_t reserve_pages;             // bg_gc_reserve_blocks in pages
+    bool paused;
+    bool stop;
+    nand_bg_gc_stats_t stats;           // runs, steps, pages_freed and stalls
+} nand_bg_gc_t;
+
+// Sectors and blocks waiting to be rewritten, see nand_refresh.h
+typedef struct {
+    uint32_t *sector_ids;               // queued sectors, UINT32_MAX for free slots
+    uint32_t num_entries;
+    uint32_t num_queued;
+    uint32_t *block_reads;              // page reads of each block since its last erase, NULL if not tracked
+    uint32_t *blocks_due;               // one bit per block whose live sectors have to be moved
+    uint32_t num_blocks_due;
+    nand_refresh_stats_t stats;         // counters, the pending and max_block_reads fields are filled in on request
+} nand_refresh_t;
+
 typedef struct {
     esp_err_t (*init)(spi_nand_flash_device_t *handle);
     esp_err_t (*deinit)(spi_nand_flash_device_t *handle);
     esp_err_t (*read)(spi_nand_flash_device_t *handle, uint8_t *buffer, uint32_t sector_id);
     esp_err_t (*write)(spi_nand_flash_device_t *handle, const uint8_t *buffer, uint32_t sector_id);
+    esp_err_t (*read_sectors)(spi_nand_flash_device_t *handle, uint8_t *buffer, uint32_t start_sector, uint32_t sector_count);
+    esp_err_t (*write_sectors)(spi_nand_flash_device_t *handle, const uint8_t *buffer, uint32_t start_sector, uint32_t sector_count);
     esp_err_t (*erase_chip)(spi_nand_flash_device_t *handle);
     esp_err_t (*erase_block)(spi_nand_flash_device_t *handle, uint32_t block);
     esp_err_t (*trim)(spi_nand_flash_device_t *handle, uint32_t sector_id);
+    esp_err_t (*trim_range)(spi_nand_flash_device_t *handle, uint32_t start_sector, uint32_t sector_count);
     esp_err_t (*sync)(spi_nand_flash_device_t *handle);
     esp_err_t (*copy_sector)(spi_nand_flash_device_t *handle, uint32_t src_sec, uint32_t dst_sec);
     esp_err_t (*get_capacity)(spi_nand_flash_device_t *handle, uint32_t *number_of_sectors);
+    esp_err_t (*unmount)(spi_nand_flash_device_t *handle); // called once before the device is released, may be NULL
+    // Run up to max_steps garbage collection steps, steps_done (may be NULL) is set to the number of steps run
+    esp_err_t (*gc)(spi_nand_flash_device_t *handle, uint32_t max_steps, uint32_t *steps_done);
+    // Number of pages which can be written before writes have to collect garbage
+    esp_err_t (*get_free_pages)(spi_nand_flash_device_t *handle, uint32_t *free_pages);
+    // Rewrite a sector from its current location, nothing is done if it is not mapped anymore
+    esp_err_t (*refresh_sector)(spi_nand_flash_device_t *handle, uint32_t sector_id);
+    // Move the live sectors stored in a block to the head of the journal
+    esp_err_t (*refresh_block)(spi_nand_flash_device_t *handle, uint32_t block, uint32_t *sectors_moved);
 } spi_nand_ops;
 
 struct spi_nand_flash_device_t {
@@ -67,12 +175,26 @@ struct spi_nand_flash_device_t {
     void *ops_priv_data;
     uint8_t *work_buffer;
     uint8_t *read_buffer;
+    uint8_t *verify_buffer;             // two pages, only with CONFIG_NAND_FLASH_VERIFY_WRITE
     SemaphoreHandle_t mutex;
+    nand_wait_t wait;
+    nand_bad_block_table_t bbt;
+    nand_sector_cache_t sector_cache;
+    nand_write_back_t write_back;
+    nand_read_stats_t read_stats;
+    nand_mount_stats_t mount_stats;
+    nand_bg_gc_t bg_gc;
+    nand_refresh_t refresh;
 };
 
 esp_err_t nand_register_dev(spi_nand_flash_device_t *handle);
 esp_err_t nand_unregister_dev(spi_nand_flash_device_t *handle);
 
+#if CONFIG_IDF_TARGET_LINUX
+// Map the emulated chip's backing storage once the geometry and timings of the detected chip are known
+esp_err_t spi_nand_emul_attach_chip(spi_device_handle_t emul, const spi_nand_chip_t *chip);
+#endif
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,37 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "nand.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Background garbage collection, enabled by CONFIG_NAND_FLASH_BACKGROUND_GC. A task runs batches of GC steps through
+// the ops table once the device has been idle for bg_gc_idle_ms, until bg_gc_reserve_blocks blocks of journal space
+// are free or a batch frees nothing. Pending data refresh work, see nand_refresh.h, is done before collecting garbage.
+// Except for init and deinit, all functions are called with the device mutex held, and do nothing when the option is
+// disabled.
+
+esp_err_t nand_bg_gc_init(spi_nand_flash_device_t *handle);
+// Stops the task and waits for it to exit. Called without the device mutex held.
+void nand_bg_gc_deinit(spi_nand_flash_device_t *handle);
+
+// Record an access to the device, which restarts the idle time. Writes also wake the task up, since only writes
+// use up journal space.
+void nand_bg_gc_touch(spi_nand_flash_device_t *handle, bool write);
+
+// Wake the task up, e.g. after data refresh work was queued. It runs once the device has been idle long enough.
+void nand_bg_gc_wake(spi_nand_flash_device_t *handle);
+
+#ifdef __cplusplus
+}
+#endif
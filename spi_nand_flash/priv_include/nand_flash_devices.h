@@ -40,6 +40,7 @@
 #define WINBOND_DI_AA21               0xAA21
 #define WINBOND_DI_BA21               0xBA21
 #define WINBOND_DI_BC21               0xBC21
+#define WINBOND_DI_AB21               0xAB21   //W25M02GV, two stacked W25N01GV dies
 
 #define MICRON_DI_34                  0x34
 #define MICRON_DI_14                  0x14
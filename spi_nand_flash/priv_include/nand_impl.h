@@ -16,16 +16,45 @@
 extern "C" {
 #endif
 
+// Monotonic time in microseconds
+int64_t nand_get_time_us(void);
+
+// Set up and release the resources used to wait for the chip, after the chip timings are known
+esp_err_t nand_wait_init(spi_nand_flash_device_t *handle);
+void nand_wait_deinit(spi_nand_flash_device_t *handle);
+
+// Select a die of a stacked package for the following commands. Does nothing on single die chips, or if the die is
+// already selected.
+esp_err_t nand_select_die(spi_nand_flash_device_t *handle, uint8_t die);
+
+// Allocate and release the RAM bad block table, after the number of blocks is known
+esp_err_t nand_bbt_init(spi_nand_flash_device_t *handle);
+void nand_bbt_deinit(spi_nand_flash_device_t *handle);
+
 esp_err_t nand_is_bad(spi_nand_flash_device_t *handle, uint32_t b, bool *is_bad_status);
 esp_err_t nand_mark_bad(spi_nand_flash_device_t *handle, uint32_t b);
 esp_err_t nand_erase_chip(spi_nand_flash_device_t *handle);
+// Erase all blocks which are not marked bad, and mark blocks whose erase fails as bad
+esp_err_t nand_erase_good_blocks(spi_nand_flash_device_t *handle);
 esp_err_t nand_erase_block(spi_nand_flash_device_t *handle, uint32_t b);
 esp_err_t nand_prog(spi_nand_flash_device_t *handle, uint32_t p, const uint8_t *data);
 esp_err_t nand_is_free(spi_nand_flash_device_t *handle, uint32_t p, bool *is_free_status);
 esp_err_t nand_read(spi_nand_flash_device_t *handle, uint32_t p, size_t offset, size_t length, uint8_t *data);
 esp_err_t nand_copy(spi_nand_flash_device_t *handle, uint32_t src, uint32_t dst);
+
+// Sub-page sectors, see CONFIG_NAND_FLASH_SUBPAGE_SECTORS. Programs sector number sector of the page, chip.sector_size
+// bytes at column sector * chip.sector_size, or checks its used marker. Sector 0 shares its marker with nand_prog.
+esp_err_t nand_prog_subpage(spi_nand_flash_device_t *handle, uint32_t p, uint8_t sector, const uint8_t *data);
+esp_err_t nand_is_free_subpage(spi_nand_flash_device_t *handle, uint32_t p, uint8_t sector, bool *is_free_status);
+
 esp_err_t nand_get_ecc_status(spi_nand_flash_device_t *handle, uint32_t page);
 
+// Read num_pages consecutive whole pages into data. Stops early after a page whose corrected bit count reached the
+// refresh threshold, pages_read tells how many pages were read.
+esp_err_t nand_read_pages(spi_nand_flash_device_t *handle, uint32_t page, uint32_t num_pages, uint8_t *data, uint32_t *pages_read);
+// Whether the ECC status of the last page read requires the data to be rewritten
+bool nand_need_data_refresh(spi_nand_flash_device_t *handle);
+
 #ifdef __cplusplus
 }
 #endif
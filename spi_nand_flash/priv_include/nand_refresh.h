@@ -0,0 +1,45 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "nand.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Data refresh. Sectors whose reads corrected ecc_data_refresh_threshold bits or more are queued, up to
+// CONFIG_NAND_FLASH_REFRESH_QUEUE_SIZE of them, and blocks are marked due once they have been read
+// CONFIG_NAND_FLASH_READ_DISTURB_THRESHOLD times since their last erase. Both are rewritten through the ops table by
+// nand_refresh_run, from the background GC task or spi_nand_flash_refresh. Except for init and deinit, all functions
+// are called with the device mutex held.
+
+esp_err_t nand_refresh_init(spi_nand_flash_device_t *handle);
+void nand_refresh_deinit(spi_nand_flash_device_t *handle);
+
+// Count a page read, i.e. a load of the page from the array into the chip's cache
+void nand_refresh_count_read(spi_nand_flash_device_t *handle, uint32_t page);
+// Restart the read count of an erased block
+void nand_refresh_block_erased(spi_nand_flash_device_t *handle, uint32_t block);
+
+// Called when a read of the sector reported too many corrected bits. data holds the sector as read. Without a queue,
+// the sector is rewritten right away. Otherwise it is queued, and the queue is drained first if it is full.
+esp_err_t nand_refresh_queue_sector(spi_nand_flash_device_t *handle, uint32_t sector_id, const uint8_t *data);
+
+// Whether queued sectors or due blocks are waiting for nand_refresh_run
+bool nand_refresh_pending(spi_nand_flash_device_t *handle);
+
+// Rewrite up to max_steps queued sectors or due blocks, sectors first. A block costs one page move per live sector
+// it holds. Entries which failed stay queued.
+esp_err_t nand_refresh_run(spi_nand_flash_device_t *handle, uint32_t max_steps);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,35 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "nand.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// LRU cache of logical sectors, sized by CONFIG_NAND_FLASH_SECTOR_CACHE_SIZE. All functions are called with the device
+// mutex held, and do nothing when the cache is disabled.
+
+esp_err_t nand_sector_cache_init(spi_nand_flash_device_t *handle);
+void nand_sector_cache_deinit(spi_nand_flash_device_t *handle);
+
+// Copy a cached sector into buffer. Returns false on a miss.
+bool nand_sector_cache_read(spi_nand_flash_device_t *handle, uint32_t sector_id, uint8_t *buffer);
+// Insert a sector which was read from flash, evicting the least recently used one if the cache is full
+void nand_sector_cache_insert(spi_nand_flash_device_t *handle, uint32_t sector_id, const uint8_t *data);
+// Refresh a cached sector with data which was written to flash. Sectors which are not cached stay uncached.
+void nand_sector_cache_update(spi_nand_flash_device_t *handle, uint32_t sector_id, const uint8_t *data);
+void nand_sector_cache_invalidate(spi_nand_flash_device_t *handle, uint32_t sector_id);
+void nand_sector_cache_clear(spi_nand_flash_device_t *handle);
+
+#ifdef __cplusplus
+}
+#endif
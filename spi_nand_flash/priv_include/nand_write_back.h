@@ -0,0 +1,39 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "nand.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Write-back buffer of logical sectors, sized by CONFIG_NAND_FLASH_WRITE_BACK_SIZE. Rewrites of a buffered sector
+// only replace the buffered data. Buffered sectors are written through the ops table when the buffer is full, when
+// the oldest one is older than CONFIG_NAND_FLASH_WRITE_BACK_MAX_AGE_MS, and on flush. All functions are called with
+// the device mutex held, and pass writes straight through when the buffer is disabled.
+
+esp_err_t nand_write_back_init(spi_nand_flash_device_t *handle);
+void nand_write_back_deinit(spi_nand_flash_device_t *handle);
+
+// Copy a buffered sector into buffer. Returns false if the sector is not buffered.
+bool nand_write_back_read(spi_nand_flash_device_t *handle, uint32_t sector_id, uint8_t *buffer);
+// Copy the buffered sectors of a range over data read from flash
+void nand_write_back_overlay(spi_nand_flash_device_t *handle, uint8_t *buffer, uint32_t start_sector, uint32_t sector_count);
+esp_err_t nand_write_back_write(spi_nand_flash_device_t *handle, const uint8_t *data, uint32_t sector_id);
+esp_err_t nand_write_back_write_sectors(spi_nand_flash_device_t *handle, const uint8_t *data, uint32_t start_sector, uint32_t sector_count);
+// Drop a buffered sector, e.g. because it is trimmed
+void nand_write_back_discard(spi_nand_flash_device_t *handle, uint32_t sector_id);
+void nand_write_back_discard_all(spi_nand_flash_device_t *handle);
+esp_err_t nand_write_back_flush(spi_nand_flash_device_t *handle);
+
+#ifdef __cplusplus
+}
+#endif
@@ -10,7 +10,12 @@
 
 #include <stdint.h>
 #include <esp_err.h>
+#include "sdkconfig.h"
+#if CONFIG_IDF_TARGET_LINUX
+#include "spi_nand_emul.h"
+#else
 #include <driver/spi_master.h>
+#endif
 
 #ifdef __cplusplus
 extern "C" {
@@ -35,18 +40,25 @@ typedef struct spi_nand_transaction_t spi_nand_transaction_t;
 #define CMD_WRITE_ENABLE    0x06
 #define CMD_READ_ID         0x9F
 #define CMD_PAGE_READ       0x13
+#define CMD_PAGE_READ_CACHE_SEQ     0x31
+#define CMD_PAGE_READ_CACHE_LAST    0x3F
 #define CMD_PROGRAM_EXECUTE 0x10
 #define CMD_PROGRAM_LOAD    0x84
 #define CMD_PROGRAM_LOAD_X4 0x34
+#define CMD_PROGRAM_LOAD_RESET      0x02    // like CMD_PROGRAM_LOAD, but sets the rest of the cache to 0xFF first
+#define CMD_PROGRAM_LOAD_RESET_X4   0x32
 #define CMD_READ_FAST       0x0B
 #define CMD_READ_X2         0x3B
 #define CMD_READ_X4         0x6B
 #define CMD_ERASE_BLOCK     0xD8
+#define CMD_DIE_SELECT      0xC2
 
 #define REG_PROTECT         0xA0
 #define REG_CONFIG          0xB0
 #define REG_STATUS          0xC0
 
+#define CONFIG_QUAD_ENABLE  1 << 0   // QE bit of the configuration register, on chips which have NAND_FLAG_QUAD_ENABLE
+
 #define STAT_BUSY           1 << 0
 #define STAT_WRITE_ENABLED  1 << 1
 #define STAT_ERASE_FAILED   1 << 2
@@ -61,10 +73,18 @@ esp_err_t spi_nand_read_register(spi_device_handle_t device, uint8_t reg, uint8_
 esp_err_t spi_nand_write_register(spi_device_handle_t device, uint8_t reg, uint8_t val);
 esp_err_t spi_nand_write_enable(spi_device_handle_t device);
 esp_err_t spi_nand_read_page(spi_device_handle_t device, uint32_t page);
+esp_err_t spi_nand_read_page_cache_seq(spi_device_handle_t device);
+esp_err_t spi_nand_read_page_cache_last(spi_device_handle_t device);
 esp_err_t spi_nand_read(spi_device_handle_t device, uint8_t *data, uint16_t column, uint16_t length);
+esp_err_t spi_nand_read_x2(spi_device_handle_t device, uint8_t *data, uint16_t column, uint16_t length);
+esp_err_t spi_nand_read_x4(spi_device_handle_t device, uint8_t *data, uint16_t column, uint16_t length);
 esp_err_t spi_nand_program_execute(spi_device_handle_t device, uint32_t page);
 esp_err_t spi_nand_program_load(spi_device_handle_t device, const uint8_t *data, uint16_t column, uint16_t length);
+esp_err_t spi_nand_program_load_x4(spi_device_handle_t device, const uint8_t *data, uint16_t column, uint16_t length);
+esp_err_t spi_nand_program_load_reset(spi_device_handle_t device, const uint8_t *data, uint16_t column, uint16_t length);
+esp_err_t spi_nand_program_load_reset_x4(spi_device_handle_t device, const uint8_t *data, uint16_t column, uint16_t length);
 esp_err_t spi_nand_erase_block(spi_device_handle_t device, uint32_t page);
+esp_err_t spi_nand_die_select(spi_device_handle_t device, uint8_t die);
 
 #ifdef __cplusplus
 }
@@ -6,23 +6,267 @@
  * SPDX-FileContributor: 2015-2024 Espressif Systems (Shanghai) CO LTD
  */
 
+#include <stddef.h>
 #include <string.h>
-#include <sys/lock.h>
 #include "dhara/nand.h"
 #include "dhara/map.h"
 #include "dhara/error.h"
+#include "dhara/bytes.h"
 #include "esp_check.h"
 #include "esp_err.h"
+#include "esp_heap_caps.h"
 #include "spi_nand_oper.h"
 #include "nand_impl.h"
 #include "nand.h"
+#include "nand_sector_cache.h"
+#include "nand_refresh.h"
+#if !CONFIG_IDF_TARGET_LINUX
+#include "esp_memory_utils.h"
+#endif
+
+#ifndef __containerof
+// Not provided by the C library on the linux target
+#define __containerof(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
+#endif
+
+static const char *TAG = "dhara_glue";
+
+// Dhara pages are sectors. With CONFIG_NAND_FLASH_SUBPAGE_SECTORS, a chip page holds several of them, and Dhara page p
+// is sector number page_sector(p) of chip page chip_page(p). Otherwise both are the same.
+static inline uint32_t chip_page(const spi_nand_flash_device_t *handle, dhara_page_t p)
+{
+    return p >> handle->chip.log2_sectors_per_page;
+}
+
+static inline uint8_t page_sector(const spi_nand_flash_device_t *handle, dhara_page_t p)
+{
+    return p & ((1 << handle->chip.log2_sectors_per_page) - 1);
+}
 
 typedef struct {
     struct dhara_nand dhara_nand;
     struct dhara_map dhara_map;
     spi_nand_flash_device_t *parent_handle;
+    bool mounting;                      // chip accesses are counted in mount_stats
+#if CONFIG_NAND_FLASH_FAST_MOUNT
+    uint32_t hint_block;                // block holding the mount hints, UINT32_MAX if hints are not used
+    uint32_t hint_next_page;            // first free page of hint_block
+    bool hint_is_current;               // the last record in hint_block is a saved state, which writes make stale
+#endif
 } spi_nand_flash_dhara_priv_data_t;
 
+#if CONFIG_NAND_FLASH_FAST_MOUNT
+/* Mount hints. Resuming the map searches the journal for its last checkpoint, which reads pages in several blocks.
+ * On unmount, the journal is checkpointed and its state is appended to the last block of the chip, which is kept out
+ * of the map, and the next mount restores that state without searching. Before the journal is changed after that,
+ * a stale record is appended, so a power loss never leaves a saved state behind which does not match the journal. */
+
+#define HINT_MAGIC_STATE    0x544e4d46  // "FMNT"
+#define HINT_MAGIC_STALE    0x454c5453  // "STLE"
+#define HINT_BLOCK_NONE     UINT32_MAX
+
+typedef struct {
+    uint32_t magic;
+    uint32_t num_blocks;
+    uint8_t log2_page_size;
+    uint8_t log2_ppb;
+    uint8_t log2_ppc;
+    uint8_t epoch;
+    uint32_t bb_current;
+    uint32_t bb_last;
+    uint32_t tail;
+    uint32_t head;
+    uint32_t root;
+    uint32_t count;
+    uint32_t crc;                       // CRC-32 of the fields above
+} mount_hint_t;
+
+static uint32_t hint_crc(const mount_hint_t *hint)
+{
+    const uint8_t *data = (const uint8_t *)hint;
+    uint32_t crc = UINT32_MAX;
+    for (size_t i = 0; i < offsetof(mount_hint_t, crc); i++) {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+        }
+    }
+    return ~crc;
+}
+
+// Records are programmed in page order, so the first free page is found with a binary search
+static esp_err_t hint_find_next_page(spi_nand_flash_dhara_priv_data_t *priv)
+{
+    spi_nand_flash_device_t *handle = priv->parent_handle;
+    const uint32_t first_page = priv->hint_block << handle->chip.log2_ppb;
+    uint32_t low = 0;
+    uint32_t high = 1 << handle->chip.log2_ppb;
+
+    while (low < high) {
+        uint32_t mid = (low + high) / 2;
+        bool is_free;
+        ESP_RETURN_ON_ERROR(nand_is_free(handle, first_page + mid, &is_free), TAG, "");
+        handle->mount_stats.free_checks++;
+        if (is_free) {
+            high = mid;
+        } else {
+            low = mid + 1;
+        }
+    }
+    priv->hint_next_page = low;
+    return ESP_OK;
+}
+
+static esp_err_t hint_append(spi_nand_flash_dhara_priv_data_t *priv, const mount_hint_t *hint)
+{
+    spi_nand_flash_device_t *handle = priv->parent_handle;
+    esp_err_t ret = ESP_OK;
+
+    if (priv->hint_next_page == (1 << handle->chip.log2_ppb)) {
+        ESP_RETURN_ON_ERROR(nand_erase_block(handle, priv->hint_block), TAG, "");
+        priv->hint_next_page = 0;
+    }
+
+    // Not the work buffer, which holds the journal's metadata
+    uint8_t *page = heap_caps_malloc(handle->chip.page_size, MALLOC_CAP_DMA | MALLOC_CAP_8BIT);
+    ESP_RETURN_ON_FALSE(page != NULL, ESP_ERR_NO_MEM, TAG, "nomem");
+    memset(page, 0xFF, handle->chip.page_size);
+    memcpy(page, hint, sizeof(*hint));
+    ret = nand_prog(handle, (priv->hint_block << handle->chip.log2_ppb) + priv->hint_next_page, page);
+    // A failed program may still have changed the page
+    priv->hint_next_page++;
+    free(page);
+    return ret;
+}
+
+// Makes the saved state stale before the journal is changed for the first time after it was saved or restored
+static esp_err_t hint_invalidate(spi_nand_flash_dhara_priv_data_t *priv)
+{
+    if (!priv->hint_is_current) {
+        return ESP_OK;
+    }
+
+    const mount_hint_t stale = {
+        .magic = HINT_MAGIC_STALE,
+    };
+    esp_err_t ret = hint_append(priv, &stale);
+    if (ret != ESP_OK) {
+        // The saved state must not survive, erasing the block drops it as well
+        ret = nand_erase_block(priv->parent_handle, priv->hint_block);
+        priv->hint_next_page = 0;
+    }
+    if (ret == ESP_OK) {
+        priv->hint_is_current = false;
+    }
+    return ret;
+}
+
+static esp_err_t hint_save(spi_nand_flash_dhara_priv_data_t *priv)
+{
+    spi_nand_flash_device_t *handle = priv->parent_handle;
+    const struct dhara_journal *j = &priv->dhara_map.journal;
+    dhara_error_t err;
+
+    if (priv->hint_block == HINT_BLOCK_NONE) {
+        return ESP_OK;
+    }
+    if (priv->hint_is_current && handle->mount_stats.fast_mount) {
+        // Restored and not changed since, the saved state is still the current one
+        return ESP_OK;
+    }
+    // The state is only complete at a checkpoint
+    if (dhara_map_sync(&priv->dhara_map, &err)) {
+        return ESP_ERR_FLASH_BASE + err;
+    }
+    ESP_RETURN_ON_ERROR(hint_invalidate(priv), TAG, "");
+
+    mount_hint_t hint = {
+        .magic = HINT_MAGIC_STATE,
+        .num_blocks = priv->dhara_nand.num_blocks,
+        .log2_page_size = priv->dhara_nand.log2_page_size,
+        .log2_ppb = priv->dhara_nand.log2_ppb,
+        .log2_ppc = j->log2_ppc,
+        .epoch = j->epoch,
+        .bb_current = j->bb_current,
+        .bb_last = j->bb_last,
+        .tail = j->tail,
+        .head = j->head,
+        .root = j->root,
+        .count = priv->dhara_map.count,
+    };
+    hint.crc = hint_crc(&hint);
+    ESP_RETURN_ON_ERROR(hint_append(priv, &hint), TAG, "");
+    priv->hint_is_current = true;
+    return ESP_OK;
+}
+
+// Restores the journal state from the last saved state, if it is still current. Otherwise the map is resumed as usual.
+static bool hint_restore(spi_nand_flash_dhara_priv_data_t *priv)
+{
+    spi_nand_flash_device_t *handle = priv->parent_handle;
+    struct dhara_journal *j = &priv->dhara_map.journal;
+    mount_hint_t hint;
+    bool is_bad;
+
+    if (nand_is_bad(handle, priv->hint_block, &is_bad) != ESP_OK || is_bad) {
+        ESP_LOGW(TAG, "mount hint block %"PRIu32" is bad, fast mount disabled", priv->hint_block);
+        priv->hint_block = HINT_BLOCK_NONE;
+        return false;
+    }
+    handle->mount_stats.bad_block_checks++;
+    if (hint_find_next_page(priv) != ESP_OK || priv->hint_next_page == 0) {
+        return false;
+    }
+    handle->mount_stats.page_reads++;
+    uint32_t page = (priv->hint_block << handle->chip.log2_ppb) + priv->hint_next_page - 1;
+    if (nand_read(handle, page, 0, sizeof(hint), (uint8_t *)&hint) != ESP_OK ||
+            hint.magic != HINT_MAGIC_STATE || hint.crc != hint_crc(&hint)) {
+        return false;
+    }
+    // From here on, a saved state is the last record, make it stale before the journal changes even if it is not used
+    priv->hint_is_current = true;
+    if (hint.num_blocks != priv->dhara_nand.num_blocks || hint.log2_page_size != priv->dhara_nand.log2_page_size ||
+            hint.log2_ppb != priv->dhara_nand.log2_ppb || hint.log2_ppc != j->log2_ppc) {
+        return false;
+    }
+    // Nothing can have been written at the head since the state was saved
+    bool is_free = false;
+    handle->mount_stats.free_checks++;
+    if (nand_is_free_subpage(handle, chip_page(handle, hint.head), page_sector(handle, hint.head), &is_free) != ESP_OK ||
+            !is_free) {
+        return false;
+    }
+
+    // The same state as dhara_map_resume leaves behind after finding the checkpoint
+    j->epoch = hint.epoch;
+    j->bb_current = hint.bb_current;
+    j->bb_last = hint.bb_last;
+    j->tail = hint.tail;
+    j->tail_sync = hint.tail;
+    j->head = hint.head;
+    j->root = hint.root;
+    j->flags = 0;
+    j->recover_next = DHARA_PAGE_NONE;
+    j->recover_root = DHARA_PAGE_NONE;
+    j->recover_meta = DHARA_PAGE_NONE;
+    priv->dhara_map.count = hint.count;
+    // The cookie of a checkpoint holds the sector count, checkpoints written before the next sector write take it
+    // from the work buffer
+    dhara_w32(dhara_journal_cookie(j), hint.count);
+    return true;
+}
+#endif //CONFIG_NAND_FLASH_FAST_MOUNT
+
+// The hint block was erased, so it holds no saved state any more
+static void hint_forget(spi_nand_flash_device_t *handle)
+{
+#if CONFIG_NAND_FLASH_FAST_MOUNT
+    spi_nand_flash_dhara_priv_data_t *dhara_priv_data = (spi_nand_flash_dhara_priv_data_t *)handle->ops_priv_data;
+    dhara_priv_data->hint_next_page = 0;
+    dhara_priv_data->hint_is_current = false;
+#endif
+}
+
 static esp_err_t dhara_init(spi_nand_flash_device_t *handle)
 {
     // create a holder structure for dhara context
@@ -32,13 +276,28 @@ static esp_err_t dhara_init(spi_nand_flash_device_t *handle)
     // store the pointer back to device structure in the holder stucture
     dhara_priv_data->parent_handle = handle;
 
-    dhara_priv_data->dhara_nand.log2_page_size = handle->chip.log2_page_size;
-    dhara_priv_data->dhara_nand.log2_ppb = handle->chip.log2_ppb;
+    dhara_priv_data->dhara_nand.log2_page_size = handle->chip.log2_page_size - handle->chip.log2_sectors_per_page;
+    dhara_priv_data->dhara_nand.log2_ppb = handle->chip.log2_ppb + handle->chip.log2_sectors_per_page;
     dhara_priv_data->dhara_nand.num_blocks = handle->chip.num_blocks;
+#if CONFIG_NAND_FLASH_FAST_MOUNT
+    dhara_priv_data->dhara_nand.num_blocks--;
+    dhara_priv_data->hint_block = handle->chip.num_blocks - 1;
+#endif
 
     dhara_map_init(&dhara_priv_data->dhara_map, &dhara_priv_data->dhara_nand, handle->work_buffer, handle->config.gc_factor);
-    dhara_error_t ignored;
-    dhara_map_resume(&dhara_priv_data->dhara_map, &ignored);
+
+    memset(&handle->mount_stats, 0, sizeof(handle->mount_stats));
+    const int64_t start_us = nand_get_time_us();
+    dhara_priv_data->mounting = true;
+#if CONFIG_NAND_FLASH_FAST_MOUNT
+    handle->mount_stats.fast_mount = hint_restore(dhara_priv_data);
+#endif
+    if (!handle->mount_stats.fast_mount) {
+        dhara_error_t ignored;
+        dhara_map_resume(&dhara_priv_data->dhara_map, &ignored);
+    }
+    dhara_priv_data->mounting = false;
+    handle->mount_stats.mount_time_us = nand_get_time_us() - start_us;
 
     return ESP_OK;
 }
@@ -49,17 +308,41 @@ static esp_err_t dhara_deinit(spi_nand_flash_device_t *handle)
     // clear dhara map
     dhara_map_init(&dhara_priv_data->dhara_map, &dhara_priv_data->dhara_nand, handle->work_buffer, handle->config.gc_factor);
     dhara_map_clear(&dhara_priv_data->dhara_map);
+    nand_sector_cache_clear(handle);
     return ESP_OK;
 }
 
+// Whether the SPI driver can read into the buffer without a bounce buffer
+static bool s_is_direct_read_capable(const uint8_t *buffer)
+{
+#if CONFIG_IDF_TARGET_LINUX
+    return true;
+#else
+    return esp_ptr_dma_capable(buffer) && ((uintptr_t)buffer % 4) == 0;
+#endif
+}
+
 static esp_err_t dhara_read(spi_nand_flash_device_t *handle, uint8_t *buffer, dhara_sector_t sector_id)
 {
     spi_nand_flash_dhara_priv_data_t *dhara_priv_data = (spi_nand_flash_dhara_priv_data_t *)handle->ops_priv_data;
     dhara_error_t err;
-    if (dhara_map_read(&dhara_priv_data->dhara_map, sector_id, handle->read_buffer, &err)) {
+    if (nand_sector_cache_read(handle, sector_id, buffer)) {
+        // Nothing was read from flash, so there is nothing to refresh either
+        handle->chip.ecc_data.ecc_corrected_bits_status = STAT_ECC_OK;
+        return ESP_OK;
+    }
+    const bool direct = s_is_direct_read_capable(buffer);
+    uint8_t *dst = direct ? buffer : handle->read_buffer;
+    if (dhara_map_read(&dhara_priv_data->dhara_map, sector_id, dst, &err)) {
         return ESP_ERR_FLASH_BASE + err;
     }
-    memcpy(buffer, handle->read_buffer, handle->chip.page_size);
+    if (direct) {
+        handle->read_stats.direct_sectors++;
+    } else {
+        memcpy(buffer, handle->read_buffer, handle->chip.sector_size);
+        handle->read_stats.bounced_sectors++;
+    }
+    nand_sector_cache_insert(handle, sector_id, dst);
     return ESP_OK;
 }
 
@@ -68,8 +351,102 @@ static esp_err_t dhara_write(spi_nand_flash_device_t *handle, const uint8_t *buf
     spi_nand_flash_dhara_priv_data_t *dhara_priv_data = (spi_nand_flash_dhara_priv_data_t *)handle->ops_priv_data;
     dhara_error_t err;
     if (dhara_map_write(&dhara_priv_data->dhara_map, sector_id, buffer, &err)) {
+        nand_sector_cache_invalidate(handle, sector_id);
         return ESP_ERR_FLASH_BASE + err;
     }
+    nand_sector_cache_update(handle, sector_id, buffer);
+    return ESP_OK;
+}
+
+static esp_err_t dhara_read_sectors(spi_nand_flash_device_t *handle, uint8_t *buffer, dhara_sector_t start_sector, uint32_t sector_count)
+{
+    spi_nand_flash_dhara_priv_data_t *dhara_priv_data = (spi_nand_flash_dhara_priv_data_t *)handle->ops_priv_data;
+    const uint32_t sector_size = handle->chip.sector_size;
+    const uint32_t pages_per_block = 1 << dhara_priv_data->dhara_nand.log2_ppb;
+    // Sub-page sectors are read one chip page at a time, so runs stop at the end of a chip page
+    const uint32_t run_boundary = handle->chip.log2_sectors_per_page ? 1 << handle->chip.log2_sectors_per_page : pages_per_block;
+    const bool direct = s_is_direct_read_capable(buffer);
+    dhara_error_t err;
+    uint32_t i = 0;
+
+    while (i < sector_count) {
+        // Range reads use cached sectors, but do not insert into the cache, so a long sequential read does not evict
+        // the sectors which are read over and over
+        if (nand_sector_cache_read(handle, start_sector + i, buffer + i * sector_size)) {
+            i++;
+            continue;
+        }
+
+        dhara_page_t page;
+        if (dhara_map_find(&dhara_priv_data->dhara_map, start_sector + i, &page, &err)) {
+            if (err != DHARA_E_NOT_FOUND) {
+                return ESP_ERR_FLASH_BASE + err;
+            }
+            // Never written or trimmed sector
+            memset(buffer + i * sector_size, 0xFF, sector_size);
+            i++;
+            continue;
+        }
+
+        // Extend the run while the following sectors are stored in the following pages of the same block
+        uint32_t run = 1;
+        while (direct && i + run < sector_count && (page + run) % run_boundary != 0) {
+            dhara_page_t next_page;
+            if (dhara_map_find(&dhara_priv_data->dhara_map, start_sector + i + run, &next_page, &err) ||
+                    next_page != page + run) {
+                break;
+            }
+            run++;
+        }
+
+        uint8_t *dst = direct ? buffer + i * sector_size : handle->read_buffer;
+        uint32_t pages_read = run;
+        esp_err_t ret;
+        if (handle->chip.log2_sectors_per_page) {
+            ret = nand_read(handle, chip_page(handle, page), page_sector(handle, page) * sector_size, run * sector_size, dst);
+        } else {
+            ret = nand_read_pages(handle, page, run, dst, &pages_read);
+        }
+        if (ret != ESP_OK) {
+            if (handle->chip.ecc_data.ecc_corrected_bits_status == STAT_ECC_NOT_CORRECTED) {
+                return ESP_ERR_FLASH_BASE + DHARA_E_ECC;
+            }
+            return ret;
+        }
+        if (direct) {
+            handle->read_stats.direct_sectors += pages_read;
+        } else {
+            memcpy(buffer + i * sector_size, handle->read_buffer, sector_size);
+            handle->read_stats.bounced_sectors++;
+        }
+        i += pages_read;
+
+        // nand_read_pages stops after a page with too many corrected bits, queue it for a refresh. The rewrite happens
+        // in nand_refresh_run, from the background garbage collection, spi_nand_flash_refresh or deinit, or right away
+        // when the queue is full or disabled. The following sectors are looked up again, as the rewrite may move them.
+        // The status of a chip page covers all of its sub-page sectors which were read.
+        if (nand_need_data_refresh(handle)) {
+            const uint32_t first = handle->chip.log2_sectors_per_page ? i - pages_read : i - 1;
+            for (uint32_t k = first; k < i; k++) {
+                ESP_RETURN_ON_ERROR(nand_refresh_queue_sector(handle, start_sector + k, buffer + k * sector_size), TAG, "");
+            }
+        }
+    }
+    return ESP_OK;
+}
+
+static esp_err_t dhara_write_sectors(spi_nand_flash_device_t *handle, const uint8_t *buffer, dhara_sector_t start_sector, uint32_t sector_count)
+{
+    spi_nand_flash_dhara_priv_data_t *dhara_priv_data = (spi_nand_flash_dhara_priv_data_t *)handle->ops_priv_data;
+    dhara_error_t err;
+    for (uint32_t i = 0; i < sector_count; i++) {
+        const uint8_t *data = buffer + i * handle->chip.sector_size;
+        if (dhara_map_write(&dhara_priv_data->dhara_map, start_sector + i, data, &err)) {
+            nand_sector_cache_invalidate(handle, start_sector + i);
+            return ESP_ERR_FLASH_BASE + err;
+        }
+        nand_sector_cache_update(handle, start_sector + i, data);
+    }
     return ESP_OK;
 }
 
@@ -77,6 +454,7 @@ static esp_err_t dhara_copy_sector(spi_nand_flash_device_t *handle, dhara_sector
 {
     spi_nand_flash_dhara_priv_data_t *dhara_priv_data = (spi_nand_flash_dhara_priv_data_t *)handle->ops_priv_data;
     dhara_error_t err;
+    nand_sector_cache_invalidate(handle, dst_sec);
     if (dhara_map_copy_sector(&dhara_priv_data->dhara_map, src_sec, dst_sec, &err)) {
         return ESP_ERR_FLASH_BASE + err;
     }
@@ -87,12 +465,38 @@ static esp_err_t dhara_trim(spi_nand_flash_device_t *handle, dhara_sector_t sect
 {
     spi_nand_flash_dhara_priv_data_t *dhara_priv_data = (spi_nand_flash_dhara_priv_data_t *)handle->ops_priv_data;
     dhara_error_t err;
+    nand_sector_cache_invalidate(handle, sector_id);
     if (dhara_map_trim(&dhara_priv_data->dhara_map, sector_id, &err)) {
         return ESP_ERR_FLASH_BASE + err;
     }
     return ESP_OK;
 }
 
+static esp_err_t dhara_trim_range(spi_nand_flash_device_t *handle, dhara_sector_t start_sector, uint32_t sector_count)
+{
+    spi_nand_flash_dhara_priv_data_t *dhara_priv_data = (spi_nand_flash_dhara_priv_data_t *)handle->ops_priv_data;
+    dhara_error_t err;
+
+    if (start_sector == 0 && sector_count == dhara_map_capacity(&dhara_priv_data->dhara_map)) {
+        // Dhara trims every sector with a journal update, and sectors are spread over blocks which also hold journal
+        // metadata, so blocks can only be erased when nothing stays mapped. Then the good blocks are erased and the
+        // map starts empty, like after spi_nand_erase_chip.
+        nand_sector_cache_clear(handle);
+        hint_forget(handle);
+        ESP_RETURN_ON_ERROR(nand_erase_good_blocks(handle), TAG, "");
+        dhara_map_clear(&dhara_priv_data->dhara_map);
+        return ESP_OK;
+    }
+
+    for (uint32_t i = 0; i < sector_count; i++) {
+        nand_sector_cache_invalidate(handle, start_sector + i);
+        if (dhara_map_trim(&dhara_priv_data->dhara_map, start_sector + i, &err)) {
+            return ESP_ERR_FLASH_BASE + err;
+        }
+    }
+    return ESP_OK;
+}
+
 static esp_err_t dhara_sync(spi_nand_flash_device_t *handle)
 {
     spi_nand_flash_dhara_priv_data_t *dhara_priv_data = (spi_nand_flash_dhara_priv_data_t *)handle->ops_priv_data;
@@ -103,6 +507,92 @@ static esp_err_t dhara_sync(spi_nand_flash_device_t *handle)
     return ESP_OK;
 }
 
+static esp_err_t dhara_gc(spi_nand_flash_device_t *handle, uint32_t max_steps, uint32_t *steps_done)
+{
+    spi_nand_flash_dhara_priv_data_t *dhara_priv_data = (spi_nand_flash_dhara_priv_data_t *)handle->ops_priv_data;
+    dhara_error_t err;
+    esp_err_t ret = ESP_OK;
+    uint32_t i;
+    // Steps relocate live sectors, but do not change their content, so the sector cache stays valid
+    for (i = 0; i < max_steps && dhara_map_size(&dhara_priv_data->dhara_map) > 0; i++) {
+        if (dhara_map_gc(&dhara_priv_data->dhara_map, &err)) {
+            ret = ESP_ERR_FLASH_BASE + err;
+            break;
+        }
+    }
+    if (steps_done) {
+        *steps_done = i;
+    }
+    return ret;
+}
+
+static esp_err_t dhara_get_free_pages(spi_nand_flash_device_t *handle, uint32_t *free_pages)
+{
+    spi_nand_flash_dhara_priv_data_t *dhara_priv_data = (spi_nand_flash_dhara_priv_data_t *)handle->ops_priv_data;
+    // Dhara starts collecting garbage inside writes once the journal holds as many pages as the map capacity
+    const dhara_page_t used = dhara_journal_size(&dhara_priv_data->dhara_map.journal);
+    const dhara_sector_t capacity = dhara_map_capacity(&dhara_priv_data->dhara_map);
+    *free_pages = used < capacity ? capacity - used : 0;
+    return ESP_OK;
+}
+
+static esp_err_t dhara_refresh_sector(spi_nand_flash_device_t *handle, uint32_t sector_id)
+{
+    spi_nand_flash_dhara_priv_data_t *dhara_priv_data = (spi_nand_flash_dhara_priv_data_t *)handle->ops_priv_data;
+    dhara_error_t err;
+    dhara_page_t page;
+    if (dhara_map_find(&dhara_priv_data->dhara_map, sector_id, &page, &err)) {
+        // Trimmed since it was queued, rewriting it would bring it back
+        return err == DHARA_E_NOT_FOUND ? ESP_OK : ESP_ERR_FLASH_BASE + err;
+    }
+    // The chip corrects the page while loading it into its cache, so an internal data move writes the corrected data.
+    // The content does not change, the sector cache stays valid. A page which can not be corrected anymore is left
+    // alone, its reads keep reporting the error.
+    if (dhara_map_copy_page(&dhara_priv_data->dhara_map, page, sector_id, &err) && err != DHARA_E_ECC) {
+        return ESP_ERR_FLASH_BASE + err;
+    }
+    return ESP_OK;
+}
+
+static esp_err_t dhara_refresh_block(spi_nand_flash_device_t *handle, uint32_t block, uint32_t *sectors_moved)
+{
+    spi_nand_flash_dhara_priv_data_t *dhara_priv_data = (spi_nand_flash_dhara_priv_data_t *)handle->ops_priv_data;
+    struct dhara_map *map = &dhara_priv_data->dhara_map;
+    const dhara_page_t ppc_mask = (1 << map->journal.log2_ppc) - 1;
+    uint8_t meta[DHARA_META_SIZE];
+    dhara_error_t err;
+
+    *sectors_moved = 0;
+    if (block >= dhara_priv_data->dhara_nand.num_blocks) {
+        // Not part of the journal, e.g. the mount hint block
+        return ESP_OK;
+    }
+    const uint8_t log2_ppb = dhara_priv_data->dhara_nand.log2_ppb;
+    for (dhara_page_t page = block << log2_ppb; page < (block + 1) << log2_ppb; page++) {
+        if ((page & ppc_mask) == ppc_mask) {
+            // Last page of a checkpoint group, it holds the journal metadata of the group
+            continue;
+        }
+        if (dhara_journal_read_meta(&map->journal, page, meta, &err)) {
+            return ESP_ERR_FLASH_BASE + err;
+        }
+        // The metadata names the sector a page was written for. Only pages the map still points to are live.
+        const dhara_sector_t sector_id = dhara_r32(meta);
+        dhara_page_t found;
+        if (sector_id == DHARA_SECTOR_NONE || dhara_map_find(map, sector_id, &found, &err) || found != page) {
+            continue;
+        }
+        if (dhara_map_copy_page(map, page, sector_id, &err)) {
+            if (err == DHARA_E_ECC) {
+                continue;
+            }
+            return ESP_ERR_FLASH_BASE + err;
+        }
+        (*sectors_moved)++;
+    }
+    return ESP_OK;
+}
+
 static esp_err_t dhara_get_capacity(spi_nand_flash_device_t *handle, dhara_sector_t *number_of_sectors)
 {
     spi_nand_flash_dhara_priv_data_t *dhara_priv_data = (spi_nand_flash_dhara_priv_data_t *)handle->ops_priv_data;
@@ -112,26 +602,55 @@ static esp_err_t dhara_get_capacity(spi_nand_flash_device_t *handle, dhara_secto
 
 static esp_err_t dhara_erase_chip(spi_nand_flash_device_t *handle)
 {
+    nand_sector_cache_clear(handle);
+    hint_forget(handle);
     return nand_erase_chip(handle);
 }
 
 static esp_err_t dhara_erase_block(spi_nand_flash_device_t *handle, uint32_t block)
 {
+    // The sectors stored in the block are not known here
+    nand_sector_cache_clear(handle);
+#if CONFIG_NAND_FLASH_FAST_MOUNT
+    spi_nand_flash_dhara_priv_data_t *dhara_priv_data = (spi_nand_flash_dhara_priv_data_t *)handle->ops_priv_data;
+    if (block == dhara_priv_data->hint_block) {
+        hint_forget(handle);
+    } else {
+        ESP_RETURN_ON_ERROR(hint_invalidate(dhara_priv_data), TAG, "");
+    }
+#endif
     return nand_erase_block(handle, block);
 }
 
+static esp_err_t dhara_unmount(spi_nand_flash_device_t *handle)
+{
+#if CONFIG_NAND_FLASH_FAST_MOUNT
+    return hint_save((spi_nand_flash_dhara_priv_data_t *)handle->ops_priv_data);
+#else
+    return ESP_OK;
+#endif
+}
+
 
 const spi_nand_ops dhara_nand_ops = {
     .init = &dhara_init,
     .deinit = &dhara_deinit,
     .read = &dhara_read,
     .write = &dhara_write,
+    .read_sectors = &dhara_read_sectors,
+    .write_sectors = &dhara_write_sectors,
     .erase_chip = &dhara_erase_chip,
     .erase_block = &dhara_erase_block,
     .trim = &dhara_trim,
+    .trim_range = &dhara_trim_range,
     .sync = &dhara_sync,
     .copy_sector = &dhara_copy_sector,
     .get_capacity = &dhara_get_capacity,
+    .unmount = &dhara_unmount,
+    .gc = &dhara_gc,
+    .get_free_pages = &dhara_get_free_pages,
+    .refresh_sector = &dhara_refresh_sector,
+    .refresh_block = &dhara_refresh_block,
 };
 
 esp_err_t nand_register_dev(spi_nand_flash_device_t *handle)
@@ -161,6 +680,9 @@ int dhara_nand_is_bad(const struct dhara_nand *n, dhara_block_t b)
     spi_nand_flash_dhara_priv_data_t *dhara_priv_data = __containerof(n, spi_nand_flash_dhara_priv_data_t, dhara_nand);
     spi_nand_flash_device_t *dev_handle = dhara_priv_data->parent_handle;
     bool is_bad_status = false;
+    if (dhara_priv_data->mounting) {
+        dev_handle->mount_stats.bad_block_checks++;
+    }
     if (nand_is_bad(dev_handle, b, &is_bad_status)) {
         return 1;
     }
@@ -182,6 +704,11 @@ int dhara_nand_erase(const struct dhara_nand *n, dhara_block_t b, dhara_error_t
 {
     spi_nand_flash_dhara_priv_data_t *dhara_priv_data = __containerof(n, spi_nand_flash_dhara_priv_data_t, dhara_nand);
     spi_nand_flash_device_t *dev_handle = dhara_priv_data->parent_handle;
+#if CONFIG_NAND_FLASH_FAST_MOUNT
+    if (hint_invalidate(dhara_priv_data) != ESP_OK) {
+        return -1;
+    }
+#endif
     esp_err_t ret = nand_erase_block(dev_handle, b);
     if (ret) {
         if (ret == ESP_ERR_NOT_FINISHED) {
@@ -196,7 +723,17 @@ int dhara_nand_prog(const struct dhara_nand *n, dhara_page_t p, const uint8_t *d
 {
     spi_nand_flash_dhara_priv_data_t *dhara_priv_data = __containerof(n, spi_nand_flash_dhara_priv_data_t, dhara_nand);
     spi_nand_flash_device_t *dev_handle = dhara_priv_data->parent_handle;
-    esp_err_t ret = nand_prog(dev_handle, p, data);
+#if CONFIG_NAND_FLASH_FAST_MOUNT
+    if (hint_invalidate(dhara_priv_data) != ESP_OK) {
+        return -1;
+    }
+#endif
+    esp_err_t ret;
+    if (dev_handle->chip.log2_sectors_per_page) {
+        ret = nand_prog_subpage(dev_handle, chip_page(dev_handle, p), page_sector(dev_handle, p), data);
+    } else {
+        ret = nand_prog(dev_handle, p, data);
+    }
     if (ret) {
         if (ret == ESP_ERR_NOT_FINISHED) {
             dhara_set_error(err, DHARA_E_BAD_BLOCK);
@@ -211,7 +748,10 @@ int dhara_nand_is_free(const struct dhara_nand *n, dhara_page_t p)
     spi_nand_flash_dhara_priv_data_t *dhara_priv_data = __containerof(n, spi_nand_flash_dhara_priv_data_t, dhara_nand);
     spi_nand_flash_device_t *dev_handle = dhara_priv_data->parent_handle;
     bool is_free_status = true;
-    if (nand_is_free(dev_handle, p, &is_free_status)) {
+    if (dhara_priv_data->mounting) {
+        dev_handle->mount_stats.free_checks++;
+    }
+    if (nand_is_free_subpage(dev_handle, chip_page(dev_handle, p), page_sector(dev_handle, p), &is_free_status)) {
         return 0;
     }
     if (is_free_status == true) {
@@ -225,7 +765,11 @@ int dhara_nand_read(const struct dhara_nand *n, dhara_page_t p, size_t offset, s
 {
     spi_nand_flash_dhara_priv_data_t *dhara_priv_data = __containerof(n, spi_nand_flash_dhara_priv_data_t, dhara_nand);
     spi_nand_flash_device_t *dev_handle = dhara_priv_data->parent_handle;
-    if (nand_read(dev_handle, p, offset, length, data)) {
+    if (dhara_priv_data->mounting) {
+        dev_handle->mount_stats.page_reads++;
+    }
+    const size_t column = page_sector(dev_handle, p) * dev_handle->chip.sector_size + offset;
+    if (nand_read(dev_handle, chip_page(dev_handle, p), column, length, data)) {
         if (dev_handle->chip.ecc_data.ecc_corrected_bits_status == STAT_ECC_NOT_CORRECTED) {
             dhara_set_error(err, DHARA_E_ECC);
         }
@@ -238,7 +782,22 @@ int dhara_nand_copy(const struct dhara_nand *n, dhara_page_t src, dhara_page_t d
 {
     spi_nand_flash_dhara_priv_data_t *dhara_priv_data = __containerof(n, spi_nand_flash_dhara_priv_data_t, dhara_nand);
     spi_nand_flash_device_t *dev_handle = dhara_priv_data->parent_handle;
-    esp_err_t ret = nand_copy(dev_handle, src, dst);
+#if CONFIG_NAND_FLASH_FAST_MOUNT
+    if (hint_invalidate(dhara_priv_data) != ESP_OK) {
+        return -1;
+    }
+#endif
+    esp_err_t ret;
+    if (dev_handle->chip.log2_sectors_per_page) {
+        // An internal data move programs a whole page, sub-page sectors are copied through RAM
+        ret = nand_read(dev_handle, chip_page(dev_handle, src), page_sector(dev_handle, src) * dev_handle->chip.sector_size,
+                        dev_handle->chip.sector_size, dev_handle->read_buffer);
+        if (ret == ESP_OK) {
+            ret = nand_prog_subpage(dev_handle, chip_page(dev_handle, dst), page_sector(dev_handle, dst), dev_handle->read_buffer);
+        }
+    } else {
+        ret = nand_copy(dev_handle, src, dst);
+    }
     if (ret) {
         if (dev_handle->chip.ecc_data.ecc_corrected_bits_status == STAT_ECC_NOT_CORRECTED) {
             dhara_set_error(err, DHARA_E_ECC);
@@ -14,7 +14,10 @@
 #include "nand.h"
 #include "nand_flash_devices.h"
 #include "nand_flash_chip.h"
-#include "esp_vfs_fat_nand.h"
+#include "nand_sector_cache.h"
+#include "nand_write_back.h"
+#include "nand_bg_gc.h"
+#include "nand_refresh.h"
 
 static const char *TAG = "nand_flash";
 
@@ -61,6 +64,49 @@ static esp_err_t unprotect_chip(spi_nand_flash_device_t *dev)
     return ret;
 }
 
+static esp_err_t setup_io_mode(spi_nand_flash_device_t *dev)
+{
+    switch (dev->config.io_mode) {
+    case SPI_NAND_IO_MODE_SIO:
+        return ESP_OK;
+    case SPI_NAND_IO_MODE_DOUT:
+        ESP_RETURN_ON_FALSE(dev->chip.flags & NAND_FLAG_IO_DUAL, ESP_ERR_NOT_SUPPORTED, TAG, "chip does not support dual output");
+        return ESP_OK;
+    case SPI_NAND_IO_MODE_QOUT:
+        ESP_RETURN_ON_FALSE(dev->chip.flags & NAND_FLAG_IO_QUAD, ESP_ERR_NOT_SUPPORTED, TAG, "chip does not support quad output");
+        break;
+    default:
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (!(dev->chip.flags & NAND_FLAG_QUAD_ENABLE)) {
+        return ESP_OK;
+    }
+    uint8_t config;
+    ESP_RETURN_ON_ERROR(spi_nand_read_register(dev->config.device_handle, REG_CONFIG, &config), TAG, "");
+    if (!(config & CONFIG_QUAD_ENABLE)) {
+        ESP_RETURN_ON_ERROR(spi_nand_write_register(dev->config.device_handle, REG_CONFIG, config | CONFIG_QUAD_ENABLE), TAG, "");
+    }
+    return ESP_OK;
+}
+
+#if CONFIG_NAND_FLASH_SUBPAGE_SECTORS
+#define SUBPAGE_MIN_LOG2_SECTOR_SIZE 9
+
+// Splits pages into sectors of 512 bytes, or larger ones if the chip does not allow enough partial page programs,
+// which are programmed one at a time. Sector sizes are a multiple of the 512 bytes (plus spare bytes) which the on-die
+// ECC covers as a unit, so ECC stays valid when the rest of the page is programmed later.
+static void setup_subpage_sectors(spi_nand_flash_device_t *dev)
+{
+    uint8_t log2_sectors_per_page = dev->chip.log2_page_size - SUBPAGE_MIN_LOG2_SECTOR_SIZE;
+    while ((1 << log2_sectors_per_page) > dev->chip.num_partial_programs) {
+        log2_sectors_per_page--;
+    }
+    dev->chip.log2_sectors_per_page = log2_sectors_per_page;
+    dev->chip.sector_size = dev->chip.page_size >> log2_sectors_per_page;
+}
+#endif
+
 esp_err_t spi_nand_flash_init_device(spi_nand_flash_config_t *config, spi_nand_flash_device_t **handle)
 {
     ESP_RETURN_ON_FALSE(config->device_handle != NULL, ESP_ERR_INVALID_ARG, TAG, "Spi device pointer can not be NULL");
@@ -68,6 +114,12 @@ esp_err_t spi_nand_flash_init_device(spi_nand_flash_config_t *config, spi_nand_f
     if (!config->gc_factor) {
         config->gc_factor = 45;
     }
+    if (!config->bg_gc_idle_ms) {
+        config->bg_gc_idle_ms = 100;
+    }
+    if (!config->bg_gc_reserve_blocks) {
+        config->bg_gc_reserve_blocks = 8;
+    }
 
     *handle = calloc(1, sizeof(spi_nand_flash_device_t));
     if (*handle == NULL) {
@@ -80,14 +132,35 @@ esp_err_t spi_nand_flash_init_device(spi_nand_flash_config_t *config, spi_nand_f
     (*handle)->chip.ecc_data.ecc_data_refresh_threshold = 4;
     (*handle)->chip.log2_ppb = 6;         // 64 pages per block is standard
     (*handle)->chip.log2_page_size = 11;  // 2048 bytes per page is fairly standard
+    (*handle)->chip.num_partial_programs = 4;   // NOP of SLC SPI NAND, enough for four 512 byte sectors per page
+    (*handle)->chip.num_dies = 1;
+    (*handle)->chip.selected_die = UINT8_MAX;
 
     esp_err_t ret = ESP_OK;
 
     ESP_GOTO_ON_ERROR(detect_chip(*handle), fail, TAG, "Failed to detect nand chip");
-    ESP_GOTO_ON_ERROR(unprotect_chip(*handle), fail, TAG, "Failed to clear protection register");
-
     (*handle)->chip.page_size = 1 << (*handle)->chip.log2_page_size;
     (*handle)->chip.block_size = (1 << (*handle)->chip.log2_ppb) * (*handle)->chip.page_size;
+    (*handle)->chip.sector_size = (*handle)->chip.page_size;
+#if CONFIG_NAND_FLASH_SUBPAGE_SECTORS
+    setup_subpage_sectors(*handle);
+#endif
+
+#if CONFIG_IDF_TARGET_LINUX
+    ESP_GOTO_ON_ERROR(spi_nand_emul_attach_chip(config->device_handle, &(*handle)->chip), fail, TAG, "Failed to attach emulated nand chip");
+#endif
+
+    // Every die has its own protection and configuration registers
+    for (uint8_t die = 0; die < (*handle)->chip.num_dies; die++) {
+        ESP_GOTO_ON_ERROR(nand_select_die(*handle, die), fail, TAG, "Failed to select die %d", die);
+        ESP_GOTO_ON_ERROR(unprotect_chip(*handle), fail, TAG, "Failed to clear protection register");
+        ESP_GOTO_ON_ERROR(setup_io_mode(*handle), fail, TAG, "Failed to set up io mode");
+    }
+    ESP_GOTO_ON_ERROR(nand_wait_init(*handle), fail, TAG, "Failed to set up wait");
+    ESP_GOTO_ON_ERROR(nand_bbt_init(*handle), fail, TAG, "Failed to allocate bad block table");
+    ESP_GOTO_ON_ERROR(nand_sector_cache_init(*handle), fail, TAG, "Failed to allocate sector cache");
+    ESP_GOTO_ON_ERROR(nand_write_back_init(*handle), fail, TAG, "Failed to allocate write-back buffer");
+    ESP_GOTO_ON_ERROR(nand_refresh_init(*handle), fail, TAG, "Failed to allocate refresh queue");
 
     (*handle)->work_buffer = heap_caps_malloc((*handle)->chip.page_size, MALLOC_CAP_DMA | MALLOC_CAP_8BIT);
     ESP_GOTO_ON_FALSE((*handle)->work_buffer != NULL, ESP_ERR_NO_MEM, fail, TAG, "nomem");
@@ -95,6 +168,12 @@ esp_err_t spi_nand_flash_init_device(spi_nand_flash_config_t *config, spi_nand_f
     (*handle)->read_buffer = heap_caps_malloc((*handle)->chip.page_size, MALLOC_CAP_DMA | MALLOC_CAP_8BIT);
     ESP_GOTO_ON_FALSE((*handle)->read_buffer != NULL, ESP_ERR_NO_MEM, fail, TAG, "nomem");
 
+#if CONFIG_NAND_FLASH_VERIFY_WRITE
+    // Allocated once, so verifying writes and copies does not allocate on every call
+    (*handle)->verify_buffer = heap_caps_malloc(2 * (*handle)->chip.page_size, MALLOC_CAP_DMA | MALLOC_CAP_8BIT);
+    ESP_GOTO_ON_FALSE((*handle)->verify_buffer != NULL, ESP_ERR_NO_MEM, fail, TAG, "nomem");
+#endif
+
     (*handle)->mutex = xSemaphoreCreateMutex();
     if (!(*handle)->mutex) {
         ret = ESP_ERR_NO_MEM;
@@ -110,11 +189,24 @@ esp_err_t spi_nand_flash_init_device(spi_nand_flash_config_t *config, spi_nand_f
     }
     (*handle)->ops->init(*handle);
 
+    ret = nand_bg_gc_init(*handle);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to start background garbage collection");
+        nand_unregister_dev(*handle);
+        goto fail;
+    }
+
     return ret;
 
 fail:
+    nand_wait_deinit(*handle);
+    nand_bbt_deinit(*handle);
+    nand_sector_cache_deinit(*handle);
+    nand_write_back_deinit(*handle);
+    nand_refresh_deinit(*handle);
     free((*handle)->work_buffer);
     free((*handle)->read_buffer);
+    free((*handle)->verify_buffer);
     vSemaphoreDelete((*handle)->mutex);
     free(*handle);
     return ret;
@@ -126,6 +218,8 @@ esp_err_t spi_nand_erase_chip(spi_nand_flash_device_t *handle)
     esp_err_t ret = ESP_OK;
 
     xSemaphoreTake(handle->mutex, portMAX_DELAY);
+    nand_bg_gc_touch(handle, true);
+    nand_write_back_discard_all(handle);
     ret = handle->ops->erase_chip(handle);
     if (ret) {
         goto end;
@@ -137,38 +231,45 @@ end:
     return ret;
 }
 
-static bool s_need_data_refresh(spi_nand_flash_device_t *handle)
-{
-    uint8_t min_bits_corrected = 0;
-    bool ret = false;
-    if (handle->chip.ecc_data.ecc_corrected_bits_status == STAT_ECC_1_TO_3_BITS_CORRECTED) {
-        min_bits_corrected = 1;
-    } else if (handle->chip.ecc_data.ecc_corrected_bits_status == STAT_ECC_4_TO_6_BITS_CORRECTED) {
-        min_bits_corrected = 4;
-    } else if (handle->chip.ecc_data.ecc_corrected_bits_status == STAT_ECC_7_8_BITS_CORRECTED) {
-        min_bits_corrected = 7;
-    }
-
-    // if number of corrected bits is greater than refresh threshold then rewite the sector
-    if (min_bits_corrected >= handle->chip.ecc_data.ecc_data_refresh_threshold) {
-        ret = true;
-    }
-    return ret;
-}
-
 esp_err_t spi_nand_flash_read_sector(spi_nand_flash_device_t *handle, uint8_t *buffer, uint32_t sector_id)
 {
     esp_err_t ret = ESP_OK;
 
     xSemaphoreTake(handle->mutex, portMAX_DELAY);
+    nand_bg_gc_touch(handle, false);
+    if (nand_write_back_read(handle, sector_id, buffer)) {
+        xSemaphoreGive(handle->mutex);
+        return ESP_OK;
+    }
     ret = handle->ops->read(handle, buffer, sector_id);
     // After a successful read operation, check the ECC corrected bit status; if the read fails, return an error
     if (ret == ESP_OK && handle->chip.ecc_data.ecc_corrected_bits_status) {
         // This indicates a soft ECC error, we rewrite the sector to recover if corrected bits are greater than refresh threshold
-        if (s_need_data_refresh(handle)) {
-            ret = handle->ops->write(handle, buffer, sector_id);
+        if (nand_need_data_refresh(handle)) {
+            ret = nand_refresh_queue_sector(handle, sector_id, buffer);
         }
     }
+    if (nand_refresh_pending(handle)) {
+        nand_bg_gc_wake(handle);
+    }
+    xSemaphoreGive(handle->mutex);
+
+    return ret;
+}
+
+esp_err_t spi_nand_flash_read_sectors(spi_nand_flash_device_t *handle, uint8_t *buffer, uint32_t start_sector, uint32_t sector_count)
+{
+    esp_err_t ret = ESP_OK;
+
+    xSemaphoreTake(handle->mutex, portMAX_DELAY);
+    nand_bg_gc_touch(handle, false);
+    ret = handle->ops->read_sectors(handle, buffer, start_sector, sector_count);
+    if (ret == ESP_OK) {
+        nand_write_back_overlay(handle, buffer, start_sector, sector_count);
+    }
+    if (nand_refresh_pending(handle)) {
+        nand_bg_gc_wake(handle);
+    }
     xSemaphoreGive(handle->mutex);
 
     return ret;
@@ -179,7 +280,12 @@ esp_err_t spi_nand_flash_copy_sector(spi_nand_flash_device_t *handle, uint32_t s
     esp_err_t ret = ESP_OK;
 
     xSemaphoreTake(handle->mutex, portMAX_DELAY);
-    ret = handle->ops->copy_sector(handle, src_sec, dst_sec);
+    nand_bg_gc_touch(handle, true);
+    // The source may only be buffered, and the copy replaces a buffered destination
+    ret = nand_write_back_flush(handle);
+    if (ret == ESP_OK) {
+        ret = handle->ops->copy_sector(handle, src_sec, dst_sec);
+    }
     xSemaphoreGive(handle->mutex);
 
     return ret;
@@ -190,7 +296,20 @@ esp_err_t spi_nand_flash_write_sector(spi_nand_flash_device_t *handle, const uin
     esp_err_t ret = ESP_OK;
 
     xSemaphoreTake(handle->mutex, portMAX_DELAY);
-    ret = handle->ops->write(handle, buffer, sector_id);
+    nand_bg_gc_touch(handle, true);
+    ret = nand_write_back_write(handle, buffer, sector_id);
+    xSemaphoreGive(handle->mutex);
+
+    return ret;
+}
+
+esp_err_t spi_nand_flash_write_sectors(spi_nand_flash_device_t *handle, const uint8_t *buffer, uint32_t start_sector, uint32_t sector_count)
+{
+    esp_err_t ret = ESP_OK;
+
+    xSemaphoreTake(handle->mutex, portMAX_DELAY);
+    nand_bg_gc_touch(handle, true);
+    ret = nand_write_back_write_sectors(handle, buffer, start_sector, sector_count);
     xSemaphoreGive(handle->mutex);
 
     return ret;
@@ -201,23 +320,98 @@ esp_err_t spi_nand_flash_trim(spi_nand_flash_device_t *handle, uint32_t sector_i
     esp_err_t ret = ESP_OK;
 
     xSemaphoreTake(handle->mutex, portMAX_DELAY);
+    nand_bg_gc_touch(handle, true);
+    nand_write_back_discard(handle, sector_id);
     ret = handle->ops->trim(handle, sector_id);
     xSemaphoreGive(handle->mutex);
 
     return ret;
 }
 
+esp_err_t spi_nand_flash_trim_range(spi_nand_flash_device_t *handle, uint32_t start_sector, uint32_t sector_count)
+{
+    esp_err_t ret = ESP_OK;
+    uint32_t capacity;
+
+    ESP_RETURN_ON_ERROR(handle->ops->get_capacity(handle, &capacity), TAG, "");
+    ESP_RETURN_ON_FALSE(start_sector <= capacity && sector_count <= capacity - start_sector, ESP_ERR_INVALID_ARG, TAG,
+                        "trim range exceeds capacity");
+
+    xSemaphoreTake(handle->mutex, portMAX_DELAY);
+    nand_bg_gc_touch(handle, true);
+    for (uint32_t i = 0; i < sector_count; i++) {
+        nand_write_back_discard(handle, start_sector + i);
+    }
+    ret = handle->ops->trim_range(handle, start_sector, sector_count);
+    xSemaphoreGive(handle->mutex);
+
+    return ret;
+}
+
 esp_err_t spi_nand_flash_sync(spi_nand_flash_device_t *handle)
 {
     esp_err_t ret = ESP_OK;
 
     xSemaphoreTake(handle->mutex, portMAX_DELAY);
-    ret = handle->ops->sync(handle);
+    nand_bg_gc_touch(handle, true);
+    ret = nand_write_back_flush(handle);
+    if (ret == ESP_OK) {
+        ret = handle->ops->sync(handle);
+    }
+    xSemaphoreGive(handle->mutex);
+
+    return ret;
+}
+
+esp_err_t spi_nand_flash_gc(spi_nand_flash_device_t *handle, uint32_t max_steps)
+{
+    esp_err_t ret = ESP_OK;
+
+    xSemaphoreTake(handle->mutex, portMAX_DELAY);
+    ret = handle->ops->gc(handle, max_steps, NULL);
+    xSemaphoreGive(handle->mutex);
+
+    return ret;
+}
+
+esp_err_t spi_nand_flash_refresh(spi_nand_flash_device_t *handle)
+{
+    esp_err_t ret = ESP_OK;
+
+    xSemaphoreTake(handle->mutex, portMAX_DELAY);
+    ret = nand_refresh_run(handle, UINT32_MAX);
     xSemaphoreGive(handle->mutex);
 
     return ret;
 }
 
+esp_err_t spi_nand_flash_bg_gc_pause(spi_nand_flash_device_t *handle)
+{
+#if CONFIG_NAND_FLASH_BACKGROUND_GC
+    // The task runs its batches with the mutex held, so no batch is running once it is taken
+    xSemaphoreTake(handle->mutex, portMAX_DELAY);
+    handle->bg_gc.paused = true;
+    xSemaphoreGive(handle->mutex);
+    return ESP_OK;
+#else
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+esp_err_t spi_nand_flash_bg_gc_resume(spi_nand_flash_device_t *handle)
+{
+#if CONFIG_NAND_FLASH_BACKGROUND_GC
+    xSemaphoreTake(handle->mutex, portMAX_DELAY);
+    handle->bg_gc.paused = false;
+    // The task sleeps until the next write while it is paused
+    xTaskNotifyGive(handle->bg_gc.task);
+    xSemaphoreGive(handle->mutex);
+    return ESP_OK;
+#else
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
 esp_err_t spi_nand_flash_get_capacity(spi_nand_flash_device_t *handle, uint32_t *number_of_sectors)
 {
     return handle->ops->get_capacity(handle, number_of_sectors);
@@ -225,7 +419,13 @@ esp_err_t spi_nand_flash_get_capacity(spi_nand_flash_device_t *handle, uint32_t
 
 esp_err_t spi_nand_flash_get_sector_size(spi_nand_flash_device_t *handle, uint32_t *sector_size)
 {
-    *sector_size = handle->chip.page_size;
+    *sector_size = handle->chip.sector_size;
+    return ESP_OK;
+}
+
+esp_err_t spi_nand_flash_get_page_size(spi_nand_flash_device_t *handle, uint32_t *page_size)
+{
+    *page_size = handle->chip.page_size;
     return ESP_OK;
 }
 
@@ -243,10 +443,36 @@ esp_err_t spi_nand_flash_get_block_num(spi_nand_flash_device_t *handle, uint32_t
 
 esp_err_t spi_nand_flash_deinit_device(spi_nand_flash_device_t *handle)
 {
+    nand_bg_gc_deinit(handle);
+
+    xSemaphoreTake(handle->mutex, portMAX_DELAY);
+    // A failed flush loses data, so it is reported to the caller once the device is torn down
+    const esp_err_t flush_ret = nand_write_back_flush(handle);
+    if (flush_ret != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to write back buffered sectors (0x%x)", flush_ret);
+    }
+    esp_err_t ret = nand_refresh_run(handle, UINT32_MAX);
+    if (ret != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to refresh queued sectors (0x%x)", ret);
+    }
+    if (handle->ops->unmount) {
+        ret = handle->ops->unmount(handle);
+        if (ret != ESP_OK) {
+            ESP_LOGW(TAG, "Failed to save the mount hint (0x%x)", ret);
+        }
+    }
+    xSemaphoreGive(handle->mutex);
+
     nand_unregister_dev(handle);
+    nand_wait_deinit(handle);
+    nand_bbt_deinit(handle);
+    nand_sector_cache_deinit(handle);
+    nand_write_back_deinit(handle);
+    nand_refresh_deinit(handle);
     free(handle->work_buffer);
     free(handle->read_buffer);
+    free(handle->verify_buffer);
     vSemaphoreDelete(handle->mutex);
     free(handle);
-    return ESP_OK;
+    return flush_ret;
 }
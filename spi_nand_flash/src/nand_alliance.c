@@ -27,6 +27,7 @@ esp_err_t spi_nand_alliance_init(spi_nand_flash_device_t *dev)
     spi_nand_execute_transaction(dev->config.device_handle, &t);
     dev->chip.erase_block_delay_us = 3000;
     dev->chip.program_page_delay_us = 630;
+    dev->chip.flags = NAND_FLAG_READ_CACHE_SEQ | NAND_FLAG_IO_DUAL | NAND_FLAG_IO_QUAD;
     ESP_LOGD(TAG, "%s: device_id: %x\n", __func__, device_id);
     switch (device_id) {
     case ALLIANCE_DI_25: //AS5F31G04SND-08LIN
@@ -37,17 +38,20 @@ esp_err_t spi_nand_alliance_init(spi_nand_flash_device_t *dev)
     case ALLIANCE_DI_8E: //AS5F12G04SND-10LIN
         dev->chip.num_blocks = 2048;
         dev->chip.read_page_delay_us = 60;
+        dev->chip.flags |= NAND_FLAG_PLANE_SELECT;
         break;
     case ALLIANCE_DI_2F: //AS5F34G04SND-08LIN
     case ALLIANCE_DI_8F: //AS5F14G04SND-10LIN
         dev->chip.num_blocks = 4096;
         dev->chip.read_page_delay_us = 60;
+        dev->chip.flags |= NAND_FLAG_PLANE_SELECT;
         break;
     case ALLIANCE_DI_2D: //AS5F38G04SND-08LIN
     case ALLIANCE_DI_8D: //AS5F18G04SND-10LIN
         dev->chip.log2_page_size = 12; // 4k pages
         dev->chip.num_blocks = 4096;
         dev->chip.read_page_delay_us = 130; // somewhat slower reads
+        dev->chip.flags |= NAND_FLAG_PLANE_SELECT;
         break;
     default:
         return ESP_ERR_INVALID_RESPONSE;
@@ -0,0 +1,141 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <string.h>
+#include "esp_check.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "nand.h"
+#include "nand_impl.h"
+#include "nand_bg_gc.h"
+#include "nand_refresh.h"
+
+static const char *TAG = "nand_bg_gc";
+
+#if CONFIG_NAND_FLASH_BACKGROUND_GC
+// Runs one batch if the device is idle and the reserve is used up. Returns how long to wait before the next call,
+// unless a write wakes the task up earlier.
+static TickType_t bg_gc_run(spi_nand_flash_device_t *handle)
+{
+    nand_bg_gc_t *gc = &handle->bg_gc;
+    if (gc->paused) {
+        return portMAX_DELAY;
+    }
+
+    const int64_t idle_ms = (nand_get_time_us() - gc->last_access_us) / 1000;
+    if (idle_ms < handle->config.bg_gc_idle_ms) {
+        return pdMS_TO_TICKS(handle->config.bg_gc_idle_ms - idle_ms) + 1;
+    }
+
+    // Sectors with many corrected bits and blocks with many reads come first, they are at risk of losing data
+    if (nand_refresh_pending(handle)) {
+        esp_err_t ret = nand_refresh_run(handle, CONFIG_NAND_FLASH_BACKGROUND_GC_STEPS);
+        if (ret != ESP_OK) {
+            ESP_LOGW(TAG, "refresh failed (0x%x)", ret);
+            return portMAX_DELAY;
+        }
+        return 0;
+    }
+
+    uint32_t free_before, free_after;
+    if (handle->ops->get_free_pages(handle, &free_before) != ESP_OK || free_before >= gc->reserve_pages) {
+        return portMAX_DELAY;
+    }
+    uint32_t steps;
+    esp_err_t ret = handle->ops->gc(handle, CONFIG_NAND_FLASH_BACKGROUND_GC_STEPS, &steps);
+    if (ret != ESP_OK) {
+        ESP_LOGW(TAG, "garbage collection failed (0x%x)", ret);
+        return portMAX_DELAY;
+    }
+    gc->stats.runs++;
+    // Fewer steps are run once the map holds no sectors
+    gc->stats.steps += steps;
+    if (handle->ops->get_free_pages(handle, &free_after) != ESP_OK || free_after <= free_before) {
+        // The tail of the journal only holds live sectors. Moving them again frees nothing until they are rewritten.
+        gc->stats.stalls++;
+        return portMAX_DELAY;
+    }
+    gc->stats.pages_freed += free_after - free_before;
+    return 0;
+}
+
+static void bg_gc_task(void *arg)
+{
+    spi_nand_flash_device_t *handle = (spi_nand_flash_device_t *)arg;
+    nand_bg_gc_t *gc = &handle->bg_gc;
+    TickType_t wait = 0;
+
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, wait);
+        xSemaphoreTake(handle->mutex, portMAX_DELAY);
+        if (gc->stop) {
+            xSemaphoreGive(handle->mutex);
+            break;
+        }
+        // Foreground accesses waiting for the mutex get it between two batches
+        wait = bg_gc_run(handle);
+        xSemaphoreGive(handle->mutex);
+    }
+
+    xSemaphoreGive(gc->exited);
+    vTaskDelete(NULL);
+}
+#endif // CONFIG_NAND_FLASH_BACKGROUND_GC
+
+esp_err_t nand_bg_gc_init(spi_nand_flash_device_t *handle)
+{
+    nand_bg_gc_t *gc = &handle->bg_gc;
+    memset(gc, 0, sizeof(*gc));
+    // Free space is counted in sectors, which are smaller than pages with sub-page sectors
+    gc->reserve_pages = (uint32_t)handle->config.bg_gc_reserve_blocks << (handle->chip.log2_ppb + handle->chip.log2_sectors_per_page);
+    gc->last_access_us = nand_get_time_us();
+#if CONFIG_NAND_FLASH_BACKGROUND_GC
+    gc->exited = xSemaphoreCreateBinary();
+    ESP_RETURN_ON_FALSE(gc->exited != NULL, ESP_ERR_NO_MEM, TAG, "nomem");
+    if (xTaskCreate(bg_gc_task, "nand_bg_gc", CONFIG_NAND_FLASH_BACKGROUND_GC_TASK_STACK_SIZE, handle,
+                    CONFIG_NAND_FLASH_BACKGROUND_GC_TASK_PRIORITY, &gc->task) != pdPASS) {
+        vSemaphoreDelete(gc->exited);
+        gc->exited = NULL;
+        return ESP_ERR_NO_MEM;
+    }
+#endif
+    return ESP_OK;
+}
+
+void nand_bg_gc_deinit(spi_nand_flash_device_t *handle)
+{
+#if CONFIG_NAND_FLASH_BACKGROUND_GC
+    nand_bg_gc_t *gc = &handle->bg_gc;
+    if (gc->task == NULL) {
+        return;
+    }
+    xSemaphoreTake(handle->mutex, portMAX_DELAY);
+    gc->stop = true;
+    xSemaphoreGive(handle->mutex);
+    xTaskNotifyGive(gc->task);
+    xSemaphoreTake(gc->exited, portMAX_DELAY);
+    vSemaphoreDelete(gc->exited);
+    gc->task = NULL;
+    gc->exited = NULL;
+#endif
+}
+
+void nand_bg_gc_touch(spi_nand_flash_device_t *handle, bool write)
+{
+    handle->bg_gc.last_access_us = nand_get_time_us();
+    if (write) {
+        nand_bg_gc_wake(handle);
+    }
+}
+
+void nand_bg_gc_wake(spi_nand_flash_device_t *handle)
+{
+#if CONFIG_NAND_FLASH_BACKGROUND_GC
+    if (handle->bg_gc.task != NULL) {
+        xTaskNotifyGive(handle->bg_gc.task);
+    }
+#endif
+}
@@ -95,3 +95,96 @@ esp_err_t nand_get_ecc_stats(spi_nand_flash_device_t *flash)
              ecc_err_total_count, ecc_err_not_corrected_count, flash->chip.ecc_data.ecc_data_refresh_threshold, ecc_err_exceeding_threshold_count);
     return ret;
 }
+
+esp_err_t nand_get_wait_stats(spi_nand_flash_device_t *flash, nand_wait_stats_t *stats)
+{
+    ESP_RETURN_ON_FALSE(stats != NULL, ESP_ERR_INVALID_ARG, TAG, "stats can not be NULL");
+
+    xSemaphoreTake(flash->mutex, portMAX_DELAY);
+    *stats = flash->wait.stats;
+    stats->read_time_us = flash->wait.learned_us[NAND_OP_READ];
+    stats->program_time_us = flash->wait.learned_us[NAND_OP_PROGRAM];
+    stats->erase_time_us = flash->wait.learned_us[NAND_OP_ERASE];
+    xSemaphoreGive(flash->mutex);
+    return ESP_OK;
+}
+
+esp_err_t nand_get_sector_cache_stats(spi_nand_flash_device_t *flash, nand_sector_cache_stats_t *stats)
+{
+    ESP_RETURN_ON_FALSE(stats != NULL, ESP_ERR_INVALID_ARG, TAG, "stats can not be NULL");
+
+    xSemaphoreTake(flash->mutex, portMAX_DELAY);
+    stats->num_entries = flash->sector_cache.num_entries;
+    stats->hits = flash->sector_cache.hits;
+    stats->misses = flash->sector_cache.misses;
+    xSemaphoreGive(flash->mutex);
+    return ESP_OK;
+}
+
+esp_err_t nand_get_write_back_stats(spi_nand_flash_device_t *flash, nand_write_back_stats_t *stats)
+{
+    ESP_RETURN_ON_FALSE(stats != NULL, ESP_ERR_INVALID_ARG, TAG, "stats can not be NULL");
+
+    xSemaphoreTake(flash->mutex, portMAX_DELAY);
+    stats->num_entries = flash->write_back.num_entries;
+    stats->buffered = flash->write_back.num_used;
+    stats->writes = flash->write_back.writes;
+    stats->coalesced = flash->write_back.coalesced;
+    stats->flushes = flash->write_back.flushes;
+    stats->flushed_sectors = flash->write_back.flushed_sectors;
+    xSemaphoreGive(flash->mutex);
+    return ESP_OK;
+}
+
+esp_err_t nand_get_read_stats(spi_nand_flash_device_t *flash, nand_read_stats_t *stats)
+{
+    ESP_RETURN_ON_FALSE(stats != NULL, ESP_ERR_INVALID_ARG, TAG, "stats can not be NULL");
+
+    xSemaphoreTake(flash->mutex, portMAX_DELAY);
+    *stats = flash->read_stats;
+    xSemaphoreGive(flash->mutex);
+    return ESP_OK;
+}
+
+esp_err_t nand_get_mount_stats(spi_nand_flash_device_t *flash, nand_mount_stats_t *stats)
+{
+    ESP_RETURN_ON_FALSE(stats != NULL, ESP_ERR_INVALID_ARG, TAG, "stats can not be NULL");
+
+    xSemaphoreTake(flash->mutex, portMAX_DELAY);
+    *stats = flash->mount_stats;
+    xSemaphoreGive(flash->mutex);
+    return ESP_OK;
+}
+
+esp_err_t nand_get_bg_gc_stats(spi_nand_flash_device_t *flash, nand_bg_gc_stats_t *stats)
+{
+    ESP_RETURN_ON_FALSE(stats != NULL, ESP_ERR_INVALID_ARG, TAG, "stats can not be NULL");
+
+    xSemaphoreTake(flash->mutex, portMAX_DELAY);
+    *stats = flash->bg_gc.stats;
+    stats->reserve_pages = flash->bg_gc.reserve_pages;
+    stats->paused = flash->bg_gc.paused;
+    esp_err_t ret = flash->ops->get_free_pages(flash, &stats->free_pages);
+    xSemaphoreGive(flash->mutex);
+    return ret;
+}
+
+esp_err_t nand_get_refresh_stats(spi_nand_flash_device_t *flash, nand_refresh_stats_t *stats)
+{
+    ESP_RETURN_ON_FALSE(stats != NULL, ESP_ERR_INVALID_ARG, TAG, "stats can not be NULL");
+
+    xSemaphoreTake(flash->mutex, portMAX_DELAY);
+    *stats = flash->refresh.stats;
+    stats->pending_sectors = flash->refresh.num_queued;
+    stats->pending_blocks = flash->refresh.num_blocks_due;
+    stats->max_block_reads = 0;
+    if (flash->refresh.block_reads != NULL) {
+        for (uint32_t block = 0; block < flash->chip.num_blocks; block++) {
+            if (flash->refresh.block_reads[block] > stats->max_block_reads) {
+                stats->max_block_reads = flash->refresh.block_reads[block];
+            }
+        }
+    }
+    xSemaphoreGive(flash->mutex);
+    return ESP_OK;
+}
@@ -25,6 +25,7 @@ esp_err_t spi_nand_gigadevice_init(spi_nand_flash_device_t *dev)
     spi_nand_execute_transaction(dev->config.device_handle, &t);
     dev->chip.read_page_delay_us = 25;
     dev->chip.erase_block_delay_us = 3200;
+    dev->chip.flags = NAND_FLAG_IO_DUAL | NAND_FLAG_IO_QUAD | NAND_FLAG_QUAD_ENABLE;
     dev->chip.program_page_delay_us = 380;
     ESP_LOGD(TAG, "%s: device_id: %x\n", __func__, device_id);
     switch (device_id) {
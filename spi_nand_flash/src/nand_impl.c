@@ -6,53 +6,240 @@
  * SPDX-FileContributor: 2015-2024 Espressif Systems (Shanghai) CO LTD
  */
 
+#include <stdlib.h>
 #include <string.h>
+#include <sys/param.h>
 #include "esp_check.h"
 #include "esp_err.h"
 #include "spi_nand_oper.h"
 #include "spi_nand_flash.h"
 #include "nand.h"
+#include "nand_impl.h"
+#include "nand_refresh.h"
+#if CONFIG_IDF_TARGET_LINUX
+#include <time.h>
+#include <unistd.h>
+#endif
 
 #define ROM_WAIT_THRESHOLD_US 1000
 
 static const char *TAG = "spi_nand";
 
+// On two-plane chips, the column address of a cache access selects the plane of the page in the cache
+static inline uint16_t plane_column(spi_nand_flash_device_t *handle, uint32_t page, uint16_t column)
+{
+    if (handle->chip.flags & NAND_FLAG_PLANE_SELECT) {
+        column |= ((page >> handle->chip.log2_ppb) & 1) << (handle->chip.log2_page_size + 1);
+    }
+    return column;
+}
+
+// Transfers between the host and the chip's cache use as many data lines as configured in io_mode. The chip
+// capabilities were checked against io_mode in spi_nand_flash_init_device. page is the page the cache belongs to.
+static esp_err_t read_cache(spi_nand_flash_device_t *handle, uint32_t page, uint8_t *data, uint16_t column, uint16_t length)
+{
+    column = plane_column(handle, page, column);
+    switch (handle->config.io_mode) {
+    case SPI_NAND_IO_MODE_QOUT:
+        return spi_nand_read_x4(handle->config.device_handle, data, column, length);
+    case SPI_NAND_IO_MODE_DOUT:
+        return spi_nand_read_x2(handle->config.device_handle, data, column, length);
+    default:
+        return spi_nand_read(handle->config.device_handle, data, column, length);
+    }
+}
+
+static esp_err_t program_load(spi_nand_flash_device_t *handle, uint32_t page, const uint8_t *data, uint16_t column, uint16_t length)
+{
+    column = plane_column(handle, page, column);
+    // There is no dual line program load, dual output mode only speeds up reads
+    if (handle->config.io_mode == SPI_NAND_IO_MODE_QOUT) {
+        return spi_nand_program_load_x4(handle->config.device_handle, data, column, length);
+    }
+    return spi_nand_program_load(handle->config.device_handle, data, column, length);
+}
+
+// Like program_load, but the chip sets the whole cache to 0xFF first, so the bytes which are not loaded are left
+// unprogrammed
+static esp_err_t program_load_reset(spi_nand_flash_device_t *handle, uint32_t page, const uint8_t *data, uint16_t column, uint16_t length)
+{
+    column = plane_column(handle, page, column);
+    if (handle->config.io_mode == SPI_NAND_IO_MODE_QOUT) {
+        return spi_nand_program_load_reset_x4(handle->config.device_handle, data, column, length);
+    }
+    return spi_nand_program_load_reset(handle->config.device_handle, data, column, length);
+}
+
+// Each sector of a page has its used marker in its own 16 bytes of the spare area, right after the bad block marker
+// for sector 0. Whole page sectors only use the one of sector 0.
+#define SPARE_BYTES_PER_SECTOR  16
+
+static inline uint16_t used_marker_column(spi_nand_flash_device_t *handle, uint8_t sector)
+{
+    return handle->chip.page_size + sector * SPARE_BYTES_PER_SECTOR + 2;
+}
+
 #if CONFIG_NAND_FLASH_VERIFY_WRITE
-static esp_err_t s_verify_write(spi_nand_flash_device_t *handle, const uint8_t *expected_buffer, uint16_t offset, uint16_t length)
+// Uses the first page of verify_buffer
+static esp_err_t s_verify_write(spi_nand_flash_device_t *handle, uint32_t page, const uint8_t *expected_buffer, uint16_t offset, uint16_t length)
 {
-    uint8_t *temp_buf = NULL;
-    temp_buf = heap_caps_malloc(length, MALLOC_CAP_DMA | MALLOC_CAP_8BIT);
-    ESP_RETURN_ON_FALSE(temp_buf != NULL, ESP_ERR_NO_MEM, TAG, "nomem");
-    if (spi_nand_read(handle->config.device_handle, temp_buf, offset, length)) {
+    uint8_t *temp_buf = handle->verify_buffer;
+    assert(length <= handle->chip.page_size);
+    if (read_cache(handle, page, temp_buf, offset, length)) {
         ESP_LOGE(TAG, "%s: Failed to read nand flash to verify previous write", __func__);
-        free(temp_buf);
         return ESP_FAIL;
     }
 
     if (memcmp(temp_buf, expected_buffer, length)) {
         ESP_LOGE(TAG, "%s: Data mismatch detected. The previously written buffer does not match the read buffer.", __func__);
-        free(temp_buf);
         return ESP_FAIL;
     }
-    free(temp_buf);
     return ESP_OK;
 }
 #endif //CONFIG_NAND_FLASH_VERIFY_WRITE
 
-static esp_err_t wait_for_ready(spi_device_handle_t device, uint32_t expected_operation_time_us, uint8_t *status_out)
+#if CONFIG_IDF_TARGET_LINUX
+int64_t nand_get_time_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+#else
+int64_t nand_get_time_us(void)
+{
+    return esp_timer_get_time();
+}
+
+static void wait_timer_cb(void *arg)
+{
+    spi_nand_flash_device_t *dev = (spi_nand_flash_device_t *)arg;
+    xSemaphoreGive(dev->wait.wakeup);
+}
+#endif
+
+static uint32_t datasheet_time_us(spi_nand_flash_device_t *dev, nand_op_t op)
+{
+    switch (op) {
+    case NAND_OP_READ:
+        return dev->chip.read_page_delay_us;
+    case NAND_OP_PROGRAM:
+        return dev->chip.program_page_delay_us;
+    case NAND_OP_ERASE:
+        return dev->chip.erase_block_delay_us;
+    default:
+        return 0;
+    }
+}
+
+esp_err_t nand_wait_init(spi_nand_flash_device_t *handle)
+{
+    for (int op = 0; op < NAND_OP_MAX; op++) {
+        handle->wait.learned_us[op] = datasheet_time_us(handle, op);
+    }
+#if CONFIG_NAND_FLASH_ADAPTIVE_WAIT && !CONFIG_IDF_TARGET_LINUX
+    handle->wait.wakeup = xSemaphoreCreateBinary();
+    ESP_RETURN_ON_FALSE(handle->wait.wakeup != NULL, ESP_ERR_NO_MEM, TAG, "nomem");
+    const esp_timer_create_args_t timer_args = {
+        .callback = wait_timer_cb,
+        .arg = handle,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "nand_wait",
+    };
+    esp_err_t ret = esp_timer_create(&timer_args, &handle->wait.timer);
+    if (ret != ESP_OK) {
+        vSemaphoreDelete(handle->wait.wakeup);
+        handle->wait.wakeup = NULL;
+        return ret;
+    }
+#endif
+    return ESP_OK;
+}
+
+void nand_wait_deinit(spi_nand_flash_device_t *handle)
+{
+#if CONFIG_NAND_FLASH_ADAPTIVE_WAIT && !CONFIG_IDF_TARGET_LINUX
+    if (handle->wait.timer) {
+        esp_timer_delete(handle->wait.timer);
+        handle->wait.timer = NULL;
+    }
+    if (handle->wait.wakeup) {
+        vSemaphoreDelete(handle->wait.wakeup);
+        handle->wait.wakeup = NULL;
+    }
+#endif
+}
+
+#if CONFIG_NAND_FLASH_ADAPTIVE_WAIT
+#define ADAPTIVE_SPIN_THRESHOLD_US  100     // shorter sleeps are not worth a context switch
+#define ADAPTIVE_MIN_POLL_US        5
+
+static esp_err_t wait_sleep_us(spi_nand_flash_device_t *dev, uint32_t sleep_us)
+{
+    if (sleep_us < ADAPTIVE_SPIN_THRESHOLD_US) {
+        esp_rom_delay_us(sleep_us);
+        return ESP_OK;
+    }
+#if CONFIG_IDF_TARGET_LINUX
+    (void)dev;
+    usleep(sleep_us);
+#else
+    // Sleep on a high resolution timer instead of a tick, so the task wakes up close to the end of the operation
+    ESP_RETURN_ON_ERROR(esp_timer_start_once(dev->wait.timer, sleep_us), TAG, "");
+    xSemaphoreTake(dev->wait.wakeup, portMAX_DELAY);
+#endif
+    return ESP_OK;
+}
+
+// How long the wait would have taken with the fixed strategy: busy-wait for the datasheet time, or poll once per tick
+static uint32_t fixed_wait_time_us(uint32_t datasheet_us, uint32_t busy_us)
 {
+    if (datasheet_us < ROM_WAIT_THRESHOLD_US) {
+        return MAX(datasheet_us, busy_us);
+    }
+    const uint32_t tick_us = portTICK_PERIOD_MS * 1000;
+    return (busy_us + tick_us - 1) / tick_us * tick_us;
+}
+#endif //CONFIG_NAND_FLASH_ADAPTIVE_WAIT
+
+static esp_err_t wait_for_ready(spi_nand_flash_device_t *dev, nand_op_t op, uint8_t *status_out)
+{
+    nand_wait_t *wait = &dev->wait;
+    const uint32_t expected_operation_time_us = datasheet_time_us(dev, op);
+    const int64_t start_us = nand_get_time_us();
+    uint8_t status;
+
+#if CONFIG_NAND_FLASH_ADAPTIVE_WAIT
+    // Sleep through most of the learned operation time, then poll in short steps, so the end of the operation is
+    // noticed without waiting for the next tick
+    const uint32_t learned_us = wait->learned_us[op];
+    const uint32_t step_us = MAX(learned_us / 16, ADAPTIVE_MIN_POLL_US);
+    ESP_RETURN_ON_ERROR(wait_sleep_us(dev, learned_us - learned_us / 8), TAG, "");
+
+    while (true) {
+        ESP_RETURN_ON_ERROR(spi_nand_read_register(dev->config.device_handle, REG_STATUS, &status), TAG, "");
+        wait->stats.status_polls++;
+        if ((status & STAT_BUSY) == 0) {
+            break;
+        }
+        ESP_RETURN_ON_ERROR(wait_sleep_us(dev, step_us), TAG, "");
+    }
+
+    const uint32_t elapsed_us = nand_get_time_us() - start_us;
+    // A wait stretched by preemption says little about the chip, so limit how far one sample moves the average
+    const uint32_t sample_us = expected_operation_time_us ? MIN(elapsed_us, 2 * expected_operation_time_us) : elapsed_us;
+    wait->learned_us[op] = (int32_t)learned_us + ((int32_t)sample_us - (int32_t)learned_us) / 4;
+    wait->stats.time_saved_us += (int64_t)fixed_wait_time_us(expected_operation_time_us, elapsed_us) - elapsed_us;
+#else
     if (expected_operation_time_us < ROM_WAIT_THRESHOLD_US) {
         esp_rom_delay_us(expected_operation_time_us);
     }
 
     while (true) {
-        uint8_t status;
-        ESP_RETURN_ON_ERROR(spi_nand_read_register(device, REG_STATUS, &status), TAG, "");
+        ESP_RETURN_ON_ERROR(spi_nand_read_register(dev->config.device_handle, REG_STATUS, &status), TAG, "");
+        wait->stats.status_polls++;
 
         if ((status & STAT_BUSY) == 0) {
-            if (status_out) {
-                *status_out = status;
-            }
             break;
         }
 
@@ -61,21 +248,104 @@ static esp_err_t wait_for_ready(spi_device_handle_t device, uint32_t expected_op
         }
     }
 
+    const uint32_t elapsed_us = nand_get_time_us() - start_us;
+#endif //CONFIG_NAND_FLASH_ADAPTIVE_WAIT
+
+    wait->stats.waits++;
+    wait->stats.wait_time_us += elapsed_us;
+    if (op == NAND_OP_PROGRAM) {
+        wait->stats.page_programs++;
+    } else if (op == NAND_OP_ERASE || op == NAND_OP_ERASE_OVERLAPPED) {
+        wait->stats.block_erases++;
+    }
+    if (status_out) {
+        *status_out = status;
+    }
+    return ESP_OK;
+}
+
+esp_err_t nand_select_die(spi_nand_flash_device_t *handle, uint8_t die)
+{
+    if (handle->chip.num_dies == 1 || die == handle->chip.selected_die) {
+        return ESP_OK;
+    }
+    ESP_RETURN_ON_ERROR(spi_nand_die_select(handle->config.device_handle, die), TAG, "");
+    handle->chip.selected_die = die;
+    return ESP_OK;
+}
+
+// Selects the die holding page. Returns the page address within that die, which is what page commands take.
+static esp_err_t select_page_die(spi_nand_flash_device_t *dev, uint32_t page, uint32_t *row)
+{
+    const uint32_t pages_per_die = (dev->chip.num_blocks / dev->chip.num_dies) << dev->chip.log2_ppb;
+    ESP_RETURN_ON_ERROR(nand_select_die(dev, page / pages_per_die), TAG, "");
+    *row = page % pages_per_die;
     return ESP_OK;
 }
 
 static esp_err_t read_page_and_wait(spi_nand_flash_device_t *dev, uint32_t page, uint8_t *status_out)
 {
-    ESP_RETURN_ON_ERROR(spi_nand_read_page(dev->config.device_handle, page), TAG, "");
+    uint32_t row;
+    ESP_RETURN_ON_ERROR(select_page_die(dev, page, &row), TAG, "");
+    ESP_RETURN_ON_ERROR(spi_nand_read_page(dev->config.device_handle, row), TAG, "");
+    nand_refresh_count_read(dev, page);
 
-    return wait_for_ready(dev->config.device_handle, dev->chip.read_page_delay_us, status_out);
+    return wait_for_ready(dev, NAND_OP_READ, status_out);
 }
 
 static esp_err_t program_execute_and_wait(spi_nand_flash_device_t *dev, uint32_t page, uint8_t *status_out)
 {
-    ESP_RETURN_ON_ERROR(spi_nand_program_execute(dev->config.device_handle, page), TAG, "");
+    uint32_t row;
+    ESP_RETURN_ON_ERROR(select_page_die(dev, page, &row), TAG, "");
+    ESP_RETURN_ON_ERROR(spi_nand_program_execute(dev->config.device_handle, row), TAG, "");
+
+    return wait_for_ready(dev, NAND_OP_PROGRAM, status_out);
+}
+
+// Selects the die of the block and starts erasing it, without waiting for the erase to complete
+static esp_err_t erase_block_start(spi_nand_flash_device_t *dev, uint32_t block)
+{
+    uint32_t row;
+    ESP_RETURN_ON_ERROR(select_page_die(dev, block << dev->chip.log2_ppb, &row), TAG, "");
+    ESP_RETURN_ON_ERROR(spi_nand_write_enable(dev->config.device_handle), TAG, "");
+    nand_refresh_block_erased(dev, block);
+    return spi_nand_erase_block(dev->config.device_handle, row);
+}
+
+#define BBT_WORD(block)     ((block) / 32)
+#define BBT_BIT(block)      (1U << ((block) % 32))
+
+esp_err_t nand_bbt_init(spi_nand_flash_device_t *handle)
+{
+    size_t words = (handle->chip.num_blocks + 31) / 32;
+    uint32_t *bits = calloc(2 * words, sizeof(uint32_t));
+    ESP_RETURN_ON_FALSE(bits != NULL, ESP_ERR_NO_MEM, TAG, "nomem");
+    handle->bbt.checked = bits;
+    handle->bbt.bad = bits + words;
+    return ESP_OK;
+}
+
+void nand_bbt_deinit(spi_nand_flash_device_t *handle)
+{
+    free(handle->bbt.checked);
+    handle->bbt.checked = NULL;
+    handle->bbt.bad = NULL;
+}
+
+static void bbt_set(spi_nand_flash_device_t *handle, uint32_t block, bool is_bad)
+{
+    handle->bbt.checked[BBT_WORD(block)] |= BBT_BIT(block);
+    if (is_bad) {
+        handle->bbt.bad[BBT_WORD(block)] |= BBT_BIT(block);
+    } else {
+        handle->bbt.bad[BBT_WORD(block)] &= ~BBT_BIT(block);
+    }
+}
 
-    return wait_for_ready(dev->config.device_handle, dev->chip.program_page_delay_us, status_out);
+// An erase also erases the marker, so the next check has to read it from the chip again
+static void bbt_forget(spi_nand_flash_device_t *handle, uint32_t block)
+{
+    handle->bbt.checked[BBT_WORD(block)] &= ~BBT_BIT(block);
 }
 
 esp_err_t nand_is_bad(spi_nand_flash_device_t *handle, uint32_t block, bool *is_bad_status)
@@ -84,10 +354,15 @@ esp_err_t nand_is_bad(spi_nand_flash_device_t *handle, uint32_t block, bool *is_
     uint16_t bad_block_indicator;
     esp_err_t ret = ESP_OK;
 
+    if (handle->bbt.checked[BBT_WORD(block)] & BBT_BIT(block)) {
+        *is_bad_status = (handle->bbt.bad[BBT_WORD(block)] & BBT_BIT(block)) != 0;
+        return ESP_OK;
+    }
+
     ESP_GOTO_ON_ERROR(read_page_and_wait(handle, first_block_page, NULL), fail, TAG, "");
 
     // Read the first 2 bytes on the OOB of the first page in the block. This should be 0xFFFF for a good block
-    ESP_GOTO_ON_ERROR(spi_nand_read(handle->config.device_handle, (uint8_t *) &bad_block_indicator, handle->chip.page_size, 2),
+    ESP_GOTO_ON_ERROR(read_cache(handle, first_block_page, (uint8_t *) &bad_block_indicator, handle->chip.page_size, 2),
                       fail, TAG, "");
 
     ESP_LOGD(TAG, "is_bad, block=%"PRIu32", page=%"PRIu32",indicator = %04x", block, first_block_page, bad_block_indicator);
@@ -96,6 +371,7 @@ esp_err_t nand_is_bad(spi_nand_flash_device_t *handle, uint32_t block, bool *is_
     } else {
         *is_bad_status = true;
     }
+    bbt_set(handle, block, *is_bad_status);
     return ret;
 
 fail:
@@ -112,11 +388,12 @@ esp_err_t nand_mark_bad(spi_nand_flash_device_t *handle, uint32_t block)
     uint8_t status;
     ESP_LOGD(TAG, "mark_bad, block=%"PRIu32", page=%"PRIu32",indicator = %04x", block, first_block_page, bad_block_indicator);
 
+    // The block is not used again during this session, even if writing the marker below fails
+    bbt_set(handle, block, true);
+
     ESP_GOTO_ON_ERROR(read_page_and_wait(handle, first_block_page, NULL), fail, TAG, "");
-    ESP_GOTO_ON_ERROR(spi_nand_write_enable(handle->config.device_handle), fail, TAG, "");
-    ESP_GOTO_ON_ERROR(spi_nand_erase_block(handle->config.device_handle, first_block_page),
-                      fail, TAG, "");
-    ESP_GOTO_ON_ERROR(wait_for_ready(handle->config.device_handle, handle->chip.erase_block_delay_us, &status),
+    ESP_GOTO_ON_ERROR(erase_block_start(handle, block), fail, TAG, "");
+    ESP_GOTO_ON_ERROR(wait_for_ready(handle, NAND_OP_ERASE, &status),
                       fail, TAG, "");
     if ((status & STAT_ERASE_FAILED) != 0) {
         ret = ESP_ERR_NOT_FINISHED;
@@ -124,13 +401,13 @@ esp_err_t nand_mark_bad(spi_nand_flash_device_t *handle, uint32_t block)
     }
 
     ESP_GOTO_ON_ERROR(spi_nand_write_enable(handle->config.device_handle), fail, TAG, "");
-    ESP_GOTO_ON_ERROR(spi_nand_program_load(handle->config.device_handle, (const uint8_t *) &bad_block_indicator,
+    ESP_GOTO_ON_ERROR(program_load(handle, first_block_page, (const uint8_t *) &bad_block_indicator,
                                             handle->chip.page_size, 2),
                       fail, TAG, "");
     ESP_GOTO_ON_ERROR(program_execute_and_wait(handle, first_block_page, NULL), fail, TAG, "");
 
 #if CONFIG_NAND_FLASH_VERIFY_WRITE
-    ret = s_verify_write(handle, (uint8_t *)&bad_block_indicator, handle->chip.page_size, 2);
+    ret = s_verify_write(handle, first_block_page, (uint8_t *)&bad_block_indicator, handle->chip.page_size, 2);
     if (ret != ESP_OK) {
         ESP_LOGE(TAG, "%s: mark_bad write verification failed for block=%"PRIu32" and page=%"PRIu32"", __func__, block, first_block_page);
     }
@@ -141,18 +418,54 @@ fail:
     return ret;
 }
 
-esp_err_t nand_erase_chip(spi_nand_flash_device_t *handle)
+// Erases the block at the same offset of every die. The erases are started on all dies before waiting for the first
+// one, so stacked dies erase in parallel. Bad blocks are skipped if skip_bad is set. Sets a bit in failed_dies for
+// each die whose erase failed.
+static esp_err_t erase_die_stripe(spi_nand_flash_device_t *handle, uint32_t offset, bool skip_bad, uint32_t *failed_dies)
 {
-    esp_err_t ret = ESP_OK;
+    const uint32_t blocks_per_die = handle->chip.num_blocks / handle->chip.num_dies;
+    uint32_t started = 0;
     uint8_t status;
 
-    for (int i = 0; i < handle->chip.num_blocks; i++) {
-        ESP_GOTO_ON_ERROR(spi_nand_write_enable(handle->config.device_handle), end, TAG, "");
-        ESP_GOTO_ON_ERROR(spi_nand_erase_block(handle->config.device_handle, i * (1 << handle->chip.log2_ppb)),
-                          end, TAG, "");
-        ESP_GOTO_ON_ERROR(wait_for_ready(handle->config.device_handle, handle->chip.erase_block_delay_us, &status),
-                          end, TAG, "");
+    *failed_dies = 0;
+    for (uint8_t die = 0; die < handle->chip.num_dies; die++) {
+        const uint32_t block = die * blocks_per_die + offset;
+        bool is_bad = false;
+        if (skip_bad) {
+            ESP_RETURN_ON_ERROR(nand_is_bad(handle, block, &is_bad), TAG, "");
+        }
+        if (!is_bad) {
+            bbt_forget(handle, block);
+            ESP_RETURN_ON_ERROR(erase_block_start(handle, block), TAG, "");
+            started |= 1U << die;
+        }
+    }
+
+    bool first = true;
+    for (uint8_t die = 0; die < handle->chip.num_dies; die++) {
+        if (!(started & (1U << die))) {
+            continue;
+        }
+        ESP_RETURN_ON_ERROR(nand_select_die(handle, die), TAG, "");
+        // The erases of the other dies ran while the first one was waited for, so their waits teach nothing about
+        // the erase time
+        ESP_RETURN_ON_ERROR(wait_for_ready(handle, first ? NAND_OP_ERASE : NAND_OP_ERASE_OVERLAPPED, &status), TAG, "");
+        first = false;
         if ((status & STAT_ERASE_FAILED) != 0) {
+            *failed_dies |= 1U << die;
+        }
+    }
+    return ESP_OK;
+}
+
+esp_err_t nand_erase_chip(spi_nand_flash_device_t *handle)
+{
+    esp_err_t ret = ESP_OK;
+    uint32_t failed_dies;
+
+    for (uint32_t i = 0; i < handle->chip.num_blocks / handle->chip.num_dies; i++) {
+        ESP_GOTO_ON_ERROR(erase_die_stripe(handle, i, false, &failed_dies), end, TAG, "");
+        if (failed_dies) {
             ret = ESP_ERR_NOT_FINISHED;
         }
     }
@@ -163,19 +476,31 @@ end:
     return ret;
 }
 
+esp_err_t nand_erase_good_blocks(spi_nand_flash_device_t *handle)
+{
+    const uint32_t blocks_per_die = handle->chip.num_blocks / handle->chip.num_dies;
+    uint32_t failed_dies;
+
+    for (uint32_t i = 0; i < blocks_per_die; i++) {
+        ESP_RETURN_ON_ERROR(erase_die_stripe(handle, i, true, &failed_dies), TAG, "");
+        for (uint8_t die = 0; die < handle->chip.num_dies; die++) {
+            if (failed_dies & (1U << die)) {
+                ESP_RETURN_ON_ERROR(nand_mark_bad(handle, die * blocks_per_die + i), TAG, "");
+            }
+        }
+    }
+    return ESP_OK;
+}
+
 esp_err_t nand_erase_block(spi_nand_flash_device_t *handle, uint32_t block)
 {
     ESP_LOGD(TAG, "erase_block, block=%"PRIu32",", block);
     esp_err_t ret = ESP_OK;
     uint8_t status;
 
-    uint32_t first_block_page = block * (1 << handle->chip.log2_ppb);
-
-    ESP_GOTO_ON_ERROR(spi_nand_write_enable(handle->config.device_handle), fail, TAG, "");
-    ESP_GOTO_ON_ERROR(spi_nand_erase_block(handle->config.device_handle, first_block_page),
-                      fail, TAG, "");
-    ESP_GOTO_ON_ERROR(wait_for_ready(handle->config.device_handle,
-                                     handle->chip.erase_block_delay_us, &status),
+    bbt_forget(handle, block);
+    ESP_GOTO_ON_ERROR(erase_block_start(handle, block), fail, TAG, "");
+    ESP_GOTO_ON_ERROR(wait_for_ready(handle, NAND_OP_ERASE, &status),
                       fail, TAG, "");
 
     if ((status & STAT_ERASE_FAILED) != 0) {
@@ -197,9 +522,9 @@ esp_err_t nand_prog(spi_nand_flash_device_t *handle, uint32_t page, const uint8_
 
     ESP_GOTO_ON_ERROR(read_page_and_wait(handle, page, NULL), fail, TAG, "");
     ESP_GOTO_ON_ERROR(spi_nand_write_enable(handle->config.device_handle), fail, TAG, "");
-    ESP_GOTO_ON_ERROR(spi_nand_program_load(handle->config.device_handle, data, 0, handle->chip.page_size),
+    ESP_GOTO_ON_ERROR(program_load(handle, page, data, 0, handle->chip.page_size),
                       fail, TAG, "");
-    ESP_GOTO_ON_ERROR(spi_nand_program_load(handle->config.device_handle, (uint8_t *)&used_marker,
+    ESP_GOTO_ON_ERROR(program_load(handle, page, (uint8_t *)&used_marker,
                                             handle->chip.page_size + 2, 2),
                       fail, TAG, "");
     ESP_GOTO_ON_ERROR(program_execute_and_wait(handle, page, &status), fail, TAG, "");
@@ -210,11 +535,11 @@ esp_err_t nand_prog(spi_nand_flash_device_t *handle, uint32_t page, const uint8_
     }
 
 #if CONFIG_NAND_FLASH_VERIFY_WRITE
-    ret = s_verify_write(handle, data, 0, handle->chip.page_size);
+    ret = s_verify_write(handle, page, data, 0, handle->chip.page_size);
     if (ret != ESP_OK) {
         ESP_LOGE(TAG, "%s: prog page=%"PRIu32" write verification failed", __func__, page);
     }
-    ret = s_verify_write(handle, (uint8_t *)&used_marker, handle->chip.page_size + 2, 2);
+    ret = s_verify_write(handle, page, (uint8_t *)&used_marker, handle->chip.page_size + 2, 2);
     if (ret != ESP_OK) {
         ESP_LOGE(TAG, "%s: prog page=%"PRIu32" used marker write verification failed", __func__, page);
     }
@@ -226,17 +551,58 @@ fail:
     return ret;
 }
 
+esp_err_t nand_prog_subpage(spi_nand_flash_device_t *handle, uint32_t page, uint8_t sector, const uint8_t *data)
+{
+    ESP_LOGV(TAG, "prog_subpage, page=%"PRIu32", sector=%d", page, sector);
+    esp_err_t ret = ESP_OK;
+    const uint16_t column = sector * handle->chip.sector_size;
+    uint16_t used_marker = 0;
+    uint32_t row;
+    uint8_t status;
+
+    // The page is not read into the cache first, as nand_prog does. The cache is reset to 0xFF instead, so that the
+    // other sectors of the page and their ECC bytes are left as they are.
+    ESP_GOTO_ON_ERROR(select_page_die(handle, page, &row), fail, TAG, "");
+    ESP_GOTO_ON_ERROR(spi_nand_write_enable(handle->config.device_handle), fail, TAG, "");
+    ESP_GOTO_ON_ERROR(program_load_reset(handle, page, data, column, handle->chip.sector_size), fail, TAG, "");
+    ESP_GOTO_ON_ERROR(program_load(handle, page, (uint8_t *)&used_marker, used_marker_column(handle, sector), 2),
+                      fail, TAG, "");
+    ESP_GOTO_ON_ERROR(program_execute_and_wait(handle, page, &status), fail, TAG, "");
+
+    if ((status & STAT_PROGRAM_FAILED) != 0) {
+        ESP_LOGD(TAG, "prog_subpage failed, page=%"PRIu32", sector=%d", page, sector);
+        return ESP_ERR_NOT_FINISHED;
+    }
+
+#if CONFIG_NAND_FLASH_VERIFY_WRITE
+    ret = s_verify_write(handle, page, data, column, handle->chip.sector_size);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "%s: prog page=%"PRIu32" sector=%d write verification failed", __func__, page, sector);
+    }
+#endif //CONFIG_NAND_FLASH_VERIFY_WRITE
+
+    return ret;
+fail:
+    ESP_LOGE(TAG, "Error in nand_prog_subpage %d", ret);
+    return ret;
+}
+
 esp_err_t nand_is_free(spi_nand_flash_device_t *handle, uint32_t page, bool *is_free_status)
+{
+    return nand_is_free_subpage(handle, page, 0, is_free_status);
+}
+
+esp_err_t nand_is_free_subpage(spi_nand_flash_device_t *handle, uint32_t page, uint8_t sector, bool *is_free_status)
 {
     esp_err_t ret = ESP_OK;
     uint16_t used_marker;
 
     ESP_GOTO_ON_ERROR(read_page_and_wait(handle, page, NULL), fail, TAG, "");
-    ESP_GOTO_ON_ERROR(spi_nand_read(handle->config.device_handle, (uint8_t *)&used_marker,
-                                    handle->chip.page_size + 2, 2),
+    ESP_GOTO_ON_ERROR(read_cache(handle, page, (uint8_t *)&used_marker,
+                                    used_marker_column(handle, sector), 2),
                       fail, TAG, "");
 
-    ESP_LOGD(TAG, "is free, page=%"PRIu32", used_marker=%04x,", page, used_marker);
+    ESP_LOGD(TAG, "is free, page=%"PRIu32", sector=%d, used_marker=%04x,", page, sector, used_marker);
     if (used_marker == 0xFFFF) {
         *is_free_status = true;
     } else {
@@ -248,8 +614,8 @@ fail:
     return ret;
 }
 
-#define PACK_2BITS_STATUS(status, bit1, bit0)         ((((status) & (bit1)) << 1) | ((status) & (bit0)))
-#define PACK_3BITS_STATUS(status, bit2, bit1, bit0)   ((((status) & (bit2)) << 2) | (((status) & (bit1)) << 1) | ((status) & (bit0)))
+#define PACK_2BITS_STATUS(status, bit1, bit0)         ((((status) & (bit1)) ? 2 : 0) | (((status) & (bit0)) ? 1 : 0))
+#define PACK_3BITS_STATUS(status, bit2, bit1, bit0)   ((((status) & (bit2)) ? 4 : 0) | PACK_2BITS_STATUS(status, bit1, bit0))
 
 static bool is_ecc_error(spi_nand_flash_device_t *dev, uint8_t status)
 {
@@ -288,7 +654,7 @@ esp_err_t nand_read(spi_nand_flash_device_t *handle, uint32_t page, size_t offse
         return ESP_FAIL;
     }
 
-    ESP_GOTO_ON_ERROR(spi_nand_read(handle->config.device_handle, data, offset, length), fail, TAG, "");
+    ESP_GOTO_ON_ERROR(read_cache(handle, page, data, offset, length), fail, TAG, "");
 
     return ret;
 fail:
@@ -296,15 +662,111 @@ fail:
     return ret;
 }
 
+static esp_err_t end_cache_read(spi_nand_flash_device_t *dev)
+{
+    // Move the page being loaded to the cache without starting another one, leaving the chip idle
+    ESP_RETURN_ON_ERROR(spi_nand_read_page_cache_last(dev->config.device_handle), TAG, "");
+
+    return wait_for_ready(dev, NAND_OP_CACHE, NULL);
+}
+
+// Best effort end of a sequential cache read on an error path, whose error is returned instead
+static void abort_cache_read(spi_nand_flash_device_t *dev)
+{
+    esp_err_t ret = end_cache_read(dev);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to end the sequential cache read %d", ret);
+    }
+}
+
+esp_err_t nand_read_pages(spi_nand_flash_device_t *handle, uint32_t page, uint32_t num_pages, uint8_t *data, uint32_t *pages_read)
+{
+    ESP_LOGV(TAG, "read_pages, page=%"PRIu32", num_pages=%"PRIu32"", page, num_pages);
+    assert(page + num_pages <= handle->chip.num_blocks * (1 << handle->chip.log2_ppb));
+    esp_err_t ret = ESP_OK;
+    uint8_t status;
+    // With sequential cache reads, the array loads the next page while the current one is read out of the cache, so
+    // only the first page pays the full page read time
+    const bool cache_read = num_pages > 1 && (handle->chip.flags & NAND_FLAG_READ_CACHE_SEQ);
+    // Set until the sequential cache read is ended with PAGE READ CACHE LAST
+    bool cache_read_open = cache_read;
+
+    *pages_read = 0;
+    if (cache_read) {
+        ESP_GOTO_ON_ERROR(read_page_and_wait(handle, page, NULL), fail, TAG, "");
+    }
+
+    for (uint32_t i = 0; i < num_pages; i++) {
+        bool last_page = (i == num_pages - 1);
+        if (cache_read) {
+            cache_read_open = !last_page;
+            ESP_GOTO_ON_ERROR(last_page ? spi_nand_read_page_cache_last(handle->config.device_handle)
+                              : spi_nand_read_page_cache_seq(handle->config.device_handle), fail, TAG, "");
+            if (!last_page) {
+                // PAGE READ CACHE SEQUENTIAL loads the next page from the array
+                nand_refresh_count_read(handle, page + i + 1);
+            }
+            // Only waits for the cache transfer, the page read time has overlapped with reading the previous page
+            ESP_GOTO_ON_ERROR(wait_for_ready(handle, NAND_OP_CACHE, &status), fail, TAG, "");
+        } else {
+            ESP_GOTO_ON_ERROR(read_page_and_wait(handle, page + i, &status), fail, TAG, "");
+        }
+
+        if (is_ecc_error(handle, status)) {
+            ESP_LOGD(TAG, "read ecc error, page=%"PRIu32"", page + i);
+            if (cache_read_open) {
+                abort_cache_read(handle);
+            }
+            return ESP_FAIL;
+        }
+
+        ESP_GOTO_ON_ERROR(read_cache(handle, page + i, data + i * handle->chip.page_size, 0, handle->chip.page_size),
+                          fail, TAG, "");
+        *pages_read = i + 1;
+
+        // Stop on a page which needs a refresh, so the caller can rewrite it before reading on
+        if (nand_need_data_refresh(handle)) {
+            if (cache_read_open) {
+                cache_read_open = false;
+                ESP_GOTO_ON_ERROR(end_cache_read(handle), fail, TAG, "");
+            }
+            break;
+        }
+    }
+    return ret;
+fail:
+    ESP_LOGE(TAG, "Error in nand_read_pages %d", ret);
+    if (cache_read_open) {
+        abort_cache_read(handle);
+    }
+    return ret;
+}
+
 esp_err_t nand_copy(spi_nand_flash_device_t *handle, uint32_t src, uint32_t dst)
 {
     ESP_LOGD(TAG, "copy, src=%"PRIu32", dst=%"PRIu32"", src, dst);
     esp_err_t ret = ESP_OK;
+    uint16_t used_marker = 0;
 #if CONFIG_NAND_FLASH_VERIFY_WRITE
-    uint8_t *temp_buf = NULL;
+    // The second page of verify_buffer, the first one is used by s_verify_write
+    uint8_t *temp_buf = handle->verify_buffer + handle->chip.page_size;
 #endif //CONFIG_NAND_FLASH_VERIFY_WRITE
 
     uint8_t status;
+    const uint32_t pages_per_die = (handle->chip.num_blocks / handle->chip.num_dies) << handle->chip.log2_ppb;
+    const bool other_plane = (handle->chip.flags & NAND_FLAG_PLANE_SELECT) &&
+                             ((src ^ dst) >> handle->chip.log2_ppb & 1);
+    if (src / pages_per_die != dst / pages_per_die || other_plane) {
+        // Internal data moves can not leave a die, or a plane on two-plane chips. Move the data through RAM instead,
+        // read_buffer is not in use while Dhara writes.
+        ret = nand_read(handle, src, 0, handle->chip.page_size, handle->read_buffer);
+        if (ret != ESP_OK) {
+            ESP_LOGD(TAG, "copy, read failed");
+            return ret;
+        }
+        return nand_prog(handle, dst, handle->read_buffer);
+    }
+
     ESP_GOTO_ON_ERROR(read_page_and_wait(handle, src, &status), fail, TAG, "");
 
     if (is_ecc_error(handle, status)) {
@@ -312,7 +774,10 @@ esp_err_t nand_copy(spi_nand_flash_device_t *handle, uint32_t src, uint32_t dst)
         return ESP_FAIL;
     }
 
+    // Internal data move: the page stays in the chip's cache. RANDOM PROGRAM LOAD only replaces the used marker in
+    // the spare area, so the destination is marked as used like after nand_prog, whatever the source held.
     ESP_GOTO_ON_ERROR(spi_nand_write_enable(handle->config.device_handle), fail, TAG, "");
+    ESP_GOTO_ON_ERROR(program_load(handle, dst, (uint8_t *)&used_marker, handle->chip.page_size + 2, 2), fail, TAG, "");
     ESP_GOTO_ON_ERROR(program_execute_and_wait(handle, dst, &status), fail, TAG, "");
 
     if ((status & STAT_PROGRAM_FAILED) != 0) {
@@ -322,9 +787,7 @@ esp_err_t nand_copy(spi_nand_flash_device_t *handle, uint32_t src, uint32_t dst)
 
 #if CONFIG_NAND_FLASH_VERIFY_WRITE
     // First read src page data from cache to temp_buf
-    temp_buf = heap_caps_malloc(handle->chip.page_size, MALLOC_CAP_DMA | MALLOC_CAP_8BIT);
-    ESP_RETURN_ON_FALSE(temp_buf != NULL, ESP_ERR_NO_MEM, TAG, "nomem");
-    if (spi_nand_read(handle->config.device_handle, temp_buf, 0, handle->chip.page_size)) {
+    if (read_cache(handle, src, temp_buf, 0, handle->chip.page_size)) {
         ESP_LOGE(TAG, "%s: Failed to read src_page=%"PRIu32"", __func__, src);
         goto fail;
     }
@@ -335,23 +798,37 @@ esp_err_t nand_copy(spi_nand_flash_device_t *handle, uint32_t src, uint32_t dst)
         goto fail;
     }
     // Check if the data in the src page matches the dst page
-    ret = s_verify_write(handle, temp_buf, 0, handle->chip.page_size);
+    ret = s_verify_write(handle, dst, temp_buf, 0, handle->chip.page_size);
     if (ret != ESP_OK) {
         ESP_LOGE(TAG, "%s: dst_page=%"PRIu32" write verification failed", __func__, dst);
     }
-
-    free(temp_buf);
 #endif //CONFIG_NAND_FLASH_VERIFY_WRITE
     return ret;
 
 fail:
-#if CONFIG_NAND_FLASH_VERIFY_WRITE
-    free(temp_buf);
-#endif //CONFIG_NAND_FLASH_VERIFY_WRITE
     ESP_LOGE(TAG, "Error in nand_copy %d", ret);
     return ret;
 }
 
+bool nand_need_data_refresh(spi_nand_flash_device_t *handle)
+{
+    uint8_t min_bits_corrected = 0;
+    bool ret = false;
+    if (handle->chip.ecc_data.ecc_corrected_bits_status == STAT_ECC_1_TO_3_BITS_CORRECTED) {
+        min_bits_corrected = 1;
+    } else if (handle->chip.ecc_data.ecc_corrected_bits_status == STAT_ECC_4_TO_6_BITS_CORRECTED) {
+        min_bits_corrected = 4;
+    } else if (handle->chip.ecc_data.ecc_corrected_bits_status == STAT_ECC_7_8_BITS_CORRECTED) {
+        min_bits_corrected = 7;
+    }
+
+    // if number of corrected bits is greater than refresh threshold then rewite the sector
+    if (min_bits_corrected >= handle->chip.ecc_data.ecc_data_refresh_threshold) {
+        ret = true;
+    }
+    return ret;
+}
+
 esp_err_t nand_get_ecc_status(spi_nand_flash_device_t *handle, uint32_t page)
 {
     esp_err_t ret = ESP_OK;
@@ -25,6 +25,7 @@ esp_err_t spi_nand_micron_init(spi_nand_flash_device_t *dev)
     spi_nand_execute_transaction(dev->config.device_handle, &t);
     dev->chip.ecc_data.ecc_status_reg_len_in_bits = 3;
     dev->chip.erase_block_delay_us = 2000;
+    dev->chip.flags = NAND_FLAG_READ_CACHE_SEQ | NAND_FLAG_IO_DUAL | NAND_FLAG_IO_QUAD;
     ESP_LOGD(TAG, "%s: device_id: %x\n", __func__, device_id);
     switch (device_id) {
     case MICRON_DI_34:
@@ -0,0 +1,169 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "esp_check.h"
+#include "nand.h"
+#include "nand_refresh.h"
+
+#define SLOT_FREE UINT32_MAX
+
+#define DUE_WORD(block)     ((block) / 32)
+#define DUE_BIT(block)      (1U << ((block) % 32))
+
+static const char *TAG = "nand_refresh";
+
+esp_err_t nand_refresh_init(spi_nand_flash_device_t *handle)
+{
+    nand_refresh_t *refresh = &handle->refresh;
+    memset(refresh, 0, sizeof(*refresh));
+#if CONFIG_NAND_FLASH_REFRESH_QUEUE_SIZE > 0
+    refresh->sector_ids = malloc(CONFIG_NAND_FLASH_REFRESH_QUEUE_SIZE * sizeof(uint32_t));
+    ESP_RETURN_ON_FALSE(refresh->sector_ids != NULL, ESP_ERR_NO_MEM, TAG, "nomem");
+    for (uint32_t i = 0; i < CONFIG_NAND_FLASH_REFRESH_QUEUE_SIZE; i++) {
+        refresh->sector_ids[i] = SLOT_FREE;
+    }
+    refresh->num_entries = CONFIG_NAND_FLASH_REFRESH_QUEUE_SIZE;
+#endif
+#if CONFIG_NAND_FLASH_READ_DISTURB_THRESHOLD > 0
+    refresh->block_reads = calloc(handle->chip.num_blocks, sizeof(uint32_t));
+    refresh->blocks_due = calloc((handle->chip.num_blocks + 31) / 32, sizeof(uint32_t));
+    if (refresh->block_reads == NULL || refresh->blocks_due == NULL) {
+        nand_refresh_deinit(handle);
+        return ESP_ERR_NO_MEM;
+    }
+#endif
+    return ESP_OK;
+}
+
+void nand_refresh_deinit(spi_nand_flash_device_t *handle)
+{
+    nand_refresh_t *refresh = &handle->refresh;
+    free(refresh->sector_ids);
+    free(refresh->block_reads);
+    free(refresh->blocks_due);
+    refresh->sector_ids = NULL;
+    refresh->block_reads = NULL;
+    refresh->blocks_due = NULL;
+    refresh->num_entries = 0;
+    refresh->num_queued = 0;
+    refresh->num_blocks_due = 0;
+}
+
+void nand_refresh_count_read(spi_nand_flash_device_t *handle, uint32_t page)
+{
+#if CONFIG_NAND_FLASH_READ_DISTURB_THRESHOLD > 0
+    nand_refresh_t *refresh = &handle->refresh;
+    if (refresh->block_reads == NULL) {
+        return;
+    }
+    const uint32_t block = page >> handle->chip.log2_ppb;
+    // Only the read which reaches the threshold marks the block. Reads while its sectors are moved out, and Dhara's
+    // reads of the garbage left behind, do not mark it again before it is erased.
+    if (++refresh->block_reads[block] == CONFIG_NAND_FLASH_READ_DISTURB_THRESHOLD) {
+        refresh->blocks_due[DUE_WORD(block)] |= DUE_BIT(block);
+        refresh->num_blocks_due++;
+        refresh->stats.blocks_due++;
+    }
+#endif
+}
+
+void nand_refresh_block_erased(spi_nand_flash_device_t *handle, uint32_t block)
+{
+    nand_refresh_t *refresh = &handle->refresh;
+    if (refresh->block_reads == NULL) {
+        return;
+    }
+    refresh->block_reads[block] = 0;
+    if (refresh->blocks_due[DUE_WORD(block)] & DUE_BIT(block)) {
+        refresh->blocks_due[DUE_WORD(block)] &= ~DUE_BIT(block);
+        refresh->num_blocks_due--;
+    }
+}
+
+static int find_slot(nand_refresh_t *refresh, uint32_t sector_id)
+{
+    for (uint32_t i = 0; i < refresh->num_entries; i++) {
+        if (refresh->sector_ids[i] == sector_id) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static esp_err_t refresh_queued_sector(spi_nand_flash_device_t *handle, int slot)
+{
+    nand_refresh_t *refresh = &handle->refresh;
+    ESP_RETURN_ON_ERROR(handle->ops->refresh_sector(handle, refresh->sector_ids[slot]), TAG,
+                        "failed to refresh sector %"PRIu32, refresh->sector_ids[slot]);
+    refresh->sector_ids[slot] = SLOT_FREE;
+    refresh->num_queued--;
+    refresh->stats.sectors_refreshed++;
+    return ESP_OK;
+}
+
+esp_err_t nand_refresh_queue_sector(spi_nand_flash_device_t *handle, uint32_t sector_id, const uint8_t *data)
+{
+    nand_refresh_t *refresh = &handle->refresh;
+    refresh->stats.sectors_queued++;
+    if (refresh->num_entries == 0) {
+        // The sector is still in the caller's buffer, rewriting it costs a single page program
+        ESP_RETURN_ON_ERROR(handle->ops->write(handle, data, sector_id), TAG, "");
+        refresh->stats.sectors_refreshed++;
+        return ESP_OK;
+    }
+
+    if (find_slot(refresh, sector_id) >= 0) {
+        return ESP_OK;
+    }
+    if (refresh->num_queued == refresh->num_entries) {
+        refresh->stats.queue_full++;
+        for (uint32_t i = 0; i < refresh->num_entries; i++) {
+            ESP_RETURN_ON_ERROR(refresh_queued_sector(handle, i), TAG, "");
+        }
+    }
+    refresh->sector_ids[find_slot(refresh, SLOT_FREE)] = sector_id;
+    refresh->num_queued++;
+    return ESP_OK;
+}
+
+bool nand_refresh_pending(spi_nand_flash_device_t *handle)
+{
+    return handle->refresh.num_queued > 0 || handle->refresh.num_blocks_due > 0;
+}
+
+esp_err_t nand_refresh_run(spi_nand_flash_device_t *handle, uint32_t max_steps)
+{
+    nand_refresh_t *refresh = &handle->refresh;
+    uint32_t steps = 0;
+
+    for (uint32_t i = 0; i < refresh->num_entries && refresh->num_queued > 0 && steps < max_steps; i++) {
+        if (refresh->sector_ids[i] != SLOT_FREE) {
+            ESP_RETURN_ON_ERROR(refresh_queued_sector(handle, i), TAG, "");
+            steps++;
+        }
+    }
+
+    for (uint32_t block = 0; block < handle->chip.num_blocks && refresh->num_blocks_due > 0 && steps < max_steps; block++) {
+        if (!(refresh->blocks_due[DUE_WORD(block)] & DUE_BIT(block))) {
+            continue;
+        }
+        uint32_t sectors_moved;
+        ESP_RETURN_ON_ERROR(handle->ops->refresh_block(handle, block, &sectors_moved), TAG,
+                            "failed to refresh block %"PRIu32, block);
+        // The block only holds garbage now. It stays counted until Dhara erases it, so it is not marked again. Garbage
+        // collection inside the moves may have erased it already.
+        if (refresh->blocks_due[DUE_WORD(block)] & DUE_BIT(block)) {
+            refresh->blocks_due[DUE_WORD(block)] &= ~DUE_BIT(block);
+            refresh->num_blocks_due--;
+        }
+        refresh->stats.blocks_refreshed++;
+        refresh->stats.block_sectors_moved += sectors_moved;
+        steps++;
+    }
+    return ESP_OK;
+}
@@ -0,0 +1,141 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "esp_check.h"
+#include "esp_heap_caps.h"
+#include "nand.h"
+#include "nand_sector_cache.h"
+
+#define CACHE_EMPTY UINT32_MAX
+
+static const char *TAG = "nand_cache";
+
+esp_err_t nand_sector_cache_init(spi_nand_flash_device_t *handle)
+{
+    nand_sector_cache_t *cache = &handle->sector_cache;
+    memset(cache, 0, sizeof(*cache));
+#if CONFIG_NAND_FLASH_SECTOR_CACHE_SIZE > 0
+    cache->entries = calloc(CONFIG_NAND_FLASH_SECTOR_CACHE_SIZE, sizeof(nand_sector_cache_entry_t));
+    ESP_RETURN_ON_FALSE(cache->entries != NULL, ESP_ERR_NO_MEM, TAG, "nomem");
+    cache->data = heap_caps_malloc(CONFIG_NAND_FLASH_SECTOR_CACHE_SIZE * handle->chip.sector_size, MALLOC_CAP_8BIT);
+    if (cache->data == NULL) {
+        free(cache->entries);
+        cache->entries = NULL;
+        return ESP_ERR_NO_MEM;
+    }
+    cache->num_entries = CONFIG_NAND_FLASH_SECTOR_CACHE_SIZE;
+    nand_sector_cache_clear(handle);
+#endif
+    return ESP_OK;
+}
+
+void nand_sector_cache_deinit(spi_nand_flash_device_t *handle)
+{
+    nand_sector_cache_t *cache = &handle->sector_cache;
+    free(cache->entries);
+    free(cache->data);
+    cache->entries = NULL;
+    cache->data = NULL;
+    cache->num_entries = 0;
+}
+
+static nand_sector_cache_entry_t *find_entry(nand_sector_cache_t *cache, uint32_t sector_id)
+{
+    for (uint32_t i = 0; i < cache->num_entries; i++) {
+        if (cache->entries[i].sector_id == sector_id) {
+            return &cache->entries[i];
+        }
+    }
+    return NULL;
+}
+
+static void touch_entry(nand_sector_cache_t *cache, nand_sector_cache_entry_t *entry)
+{
+    if (cache->use_counter == UINT32_MAX) {
+        // Restart the ages instead of wrapping around, which would make the newest entry look like the oldest
+        for (uint32_t i = 0; i < cache->num_entries; i++) {
+            if (cache->entries[i].sector_id != CACHE_EMPTY) {
+                cache->entries[i].last_use = 1;
+            }
+        }
+        cache->use_counter = 1;
+    }
+    entry->last_use = ++cache->use_counter;
+}
+
+static inline uint8_t *entry_data(spi_nand_flash_device_t *handle, nand_sector_cache_entry_t *entry)
+{
+    return handle->sector_cache.data + (entry - handle->sector_cache.entries) * handle->chip.sector_size;
+}
+
+bool nand_sector_cache_read(spi_nand_flash_device_t *handle, uint32_t sector_id, uint8_t *buffer)
+{
+    nand_sector_cache_t *cache = &handle->sector_cache;
+    if (cache->num_entries == 0) {
+        return false;
+    }
+
+    nand_sector_cache_entry_t *entry = find_entry(cache, sector_id);
+    if (entry == NULL) {
+        cache->misses++;
+        return false;
+    }
+    touch_entry(cache, entry);
+    memcpy(buffer, entry_data(handle, entry), handle->chip.sector_size);
+    cache->hits++;
+    return true;
+}
+
+void nand_sector_cache_insert(spi_nand_flash_device_t *handle, uint32_t sector_id, const uint8_t *data)
+{
+    nand_sector_cache_t *cache = &handle->sector_cache;
+    if (cache->num_entries == 0) {
+        return;
+    }
+
+    nand_sector_cache_entry_t *entry = find_entry(cache, sector_id);
+    if (entry == NULL) {
+        // Empty entries have last_use 0, so they are taken before any used one is evicted
+        entry = &cache->entries[0];
+        for (uint32_t i = 1; i < cache->num_entries; i++) {
+            if (cache->entries[i].last_use < entry->last_use) {
+                entry = &cache->entries[i];
+            }
+        }
+        entry->sector_id = sector_id;
+    }
+    touch_entry(cache, entry);
+    memcpy(entry_data(handle, entry), data, handle->chip.sector_size);
+}
+
+void nand_sector_cache_update(spi_nand_flash_device_t *handle, uint32_t sector_id, const uint8_t *data)
+{
+    nand_sector_cache_entry_t *entry = find_entry(&handle->sector_cache, sector_id);
+    if (entry) {
+        memcpy(entry_data(handle, entry), data, handle->chip.sector_size);
+    }
+}
+
+void nand_sector_cache_invalidate(spi_nand_flash_device_t *handle, uint32_t sector_id)
+{
+    nand_sector_cache_entry_t *entry = find_entry(&handle->sector_cache, sector_id);
+    if (entry) {
+        entry->sector_id = CACHE_EMPTY;
+        entry->last_use = 0;
+    }
+}
+
+void nand_sector_cache_clear(spi_nand_flash_device_t *handle)
+{
+    nand_sector_cache_t *cache = &handle->sector_cache;
+    for (uint32_t i = 0; i < cache->num_entries; i++) {
+        cache->entries[i].sector_id = CACHE_EMPTY;
+        cache->entries[i].last_use = 0;
+    }
+    cache->use_counter = 0;
+}
@@ -26,6 +26,7 @@ esp_err_t spi_nand_winbond_init(spi_nand_flash_device_t *dev)
     uint16_t device_id = (device_id_buf[0] << 8) + device_id_buf[1];
     dev->chip.read_page_delay_us = 10;
     dev->chip.erase_block_delay_us = 2500;
+    dev->chip.flags = NAND_FLAG_IO_DUAL | NAND_FLAG_IO_QUAD;
     dev->chip.program_page_delay_us = 320;
     ESP_LOGD(TAG, "%s: device_id: %x\n", __func__, device_id);
     switch (device_id) {
@@ -38,6 +39,10 @@ esp_err_t spi_nand_winbond_init(spi_nand_flash_device_t *dev)
     case WINBOND_DI_BC21:
         dev->chip.num_blocks = 1024;
         break;
+    case WINBOND_DI_AB21:
+        dev->chip.num_blocks = 2048;
+        dev->chip.num_dies = 2;
+        break;
     default:
         return ESP_ERR_INVALID_RESPONSE;
     }
@@ -0,0 +1,178 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "esp_check.h"
+#include "esp_heap_caps.h"
+#include "nand.h"
+#include "nand_impl.h"
+#include "nand_write_back.h"
+
+#define SLOT_FREE UINT32_MAX
+
+static const char *TAG = "nand_write_back";
+
+esp_err_t nand_write_back_init(spi_nand_flash_device_t *handle)
+{
+    nand_write_back_t *wb = &handle->write_back;
+    memset(wb, 0, sizeof(*wb));
+#if CONFIG_NAND_FLASH_WRITE_BACK_SIZE > 0
+    wb->sector_ids = malloc(CONFIG_NAND_FLASH_WRITE_BACK_SIZE * sizeof(uint32_t));
+    ESP_RETURN_ON_FALSE(wb->sector_ids != NULL, ESP_ERR_NO_MEM, TAG, "nomem");
+    // Sectors are handed to the ops table straight from this buffer, so it has to be usable by the SPI driver
+    wb->data = heap_caps_malloc(CONFIG_NAND_FLASH_WRITE_BACK_SIZE * handle->chip.sector_size, MALLOC_CAP_DMA | MALLOC_CAP_8BIT);
+    if (wb->data == NULL) {
+        free(wb->sector_ids);
+        wb->sector_ids = NULL;
+        return ESP_ERR_NO_MEM;
+    }
+    wb->num_entries = CONFIG_NAND_FLASH_WRITE_BACK_SIZE;
+    nand_write_back_discard_all(handle);
+#endif
+    return ESP_OK;
+}
+
+void nand_write_back_deinit(spi_nand_flash_device_t *handle)
+{
+    nand_write_back_t *wb = &handle->write_back;
+    free(wb->sector_ids);
+    free(wb->data);
+    wb->sector_ids = NULL;
+    wb->data = NULL;
+    wb->num_entries = 0;
+    wb->num_used = 0;
+}
+
+// Finds the slot holding sector_id, or a free slot for SLOT_FREE
+static int find_slot(nand_write_back_t *wb, uint32_t sector_id)
+{
+    for (uint32_t i = 0; i < wb->num_entries; i++) {
+        if (wb->sector_ids[i] == sector_id) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static inline uint8_t *slot_data(spi_nand_flash_device_t *handle, int slot)
+{
+    return handle->write_back.data + slot * handle->chip.sector_size;
+}
+
+bool nand_write_back_read(spi_nand_flash_device_t *handle, uint32_t sector_id, uint8_t *buffer)
+{
+    int slot = find_slot(&handle->write_back, sector_id);
+    if (slot < 0) {
+        return false;
+    }
+    memcpy(buffer, slot_data(handle, slot), handle->chip.sector_size);
+    return true;
+}
+
+void nand_write_back_overlay(spi_nand_flash_device_t *handle, uint8_t *buffer, uint32_t start_sector, uint32_t sector_count)
+{
+    nand_write_back_t *wb = &handle->write_back;
+    if (wb->num_used == 0) {
+        return;
+    }
+    for (uint32_t i = 0; i < wb->num_entries; i++) {
+        uint32_t sector_id = wb->sector_ids[i];
+        if (sector_id != SLOT_FREE && sector_id >= start_sector && sector_id - start_sector < sector_count) {
+            memcpy(buffer + (sector_id - start_sector) * handle->chip.sector_size, slot_data(handle, i), handle->chip.sector_size);
+        }
+    }
+}
+
+esp_err_t nand_write_back_flush(spi_nand_flash_device_t *handle)
+{
+    nand_write_back_t *wb = &handle->write_back;
+    if (wb->num_used == 0) {
+        return ESP_OK;
+    }
+
+    wb->flushes++;
+    for (uint32_t i = 0; i < wb->num_entries; i++) {
+        if (wb->sector_ids[i] == SLOT_FREE) {
+            continue;
+        }
+        // Sectors which failed to be written stay buffered, so a later flush can retry them
+        ESP_RETURN_ON_ERROR(handle->ops->write(handle, slot_data(handle, i), wb->sector_ids[i]), TAG,
+                            "failed to write back sector %"PRIu32, wb->sector_ids[i]);
+        wb->sector_ids[i] = SLOT_FREE;
+        wb->num_used--;
+        wb->flushed_sectors++;
+    }
+    return ESP_OK;
+}
+
+esp_err_t nand_write_back_write(spi_nand_flash_device_t *handle, const uint8_t *data, uint32_t sector_id)
+{
+    nand_write_back_t *wb = &handle->write_back;
+    if (wb->num_entries == 0) {
+        return handle->ops->write(handle, data, sector_id);
+    }
+
+    wb->writes++;
+    int slot = find_slot(wb, sector_id);
+    if (slot >= 0) {
+        wb->coalesced++;
+    } else {
+        if (wb->num_used == wb->num_entries) {
+            ESP_RETURN_ON_ERROR(nand_write_back_flush(handle), TAG, "");
+        }
+        slot = find_slot(wb, SLOT_FREE);
+        if (wb->num_used == 0) {
+            wb->oldest_us = nand_get_time_us();
+        }
+        wb->sector_ids[slot] = sector_id;
+        wb->num_used++;
+    }
+    memcpy(slot_data(handle, slot), data, handle->chip.sector_size);
+
+#if CONFIG_NAND_FLASH_WRITE_BACK_SIZE > 0
+    if (nand_get_time_us() - wb->oldest_us >= CONFIG_NAND_FLASH_WRITE_BACK_MAX_AGE_MS * 1000LL) {
+        ESP_RETURN_ON_ERROR(nand_write_back_flush(handle), TAG, "");
+    }
+#endif
+    return ESP_OK;
+}
+
+esp_err_t nand_write_back_write_sectors(spi_nand_flash_device_t *handle, const uint8_t *data, uint32_t start_sector, uint32_t sector_count)
+{
+    nand_write_back_t *wb = &handle->write_back;
+    if (sector_count >= wb->num_entries) {
+        // Ranges which do not fit are written directly, and replace what was buffered for them
+        for (uint32_t i = 0; i < sector_count; i++) {
+            nand_write_back_discard(handle, start_sector + i);
+        }
+        return handle->ops->write_sectors(handle, data, start_sector, sector_count);
+    }
+
+    for (uint32_t i = 0; i < sector_count; i++) {
+        ESP_RETURN_ON_ERROR(nand_write_back_write(handle, data + i * handle->chip.sector_size, start_sector + i), TAG, "");
+    }
+    return ESP_OK;
+}
+
+void nand_write_back_discard(spi_nand_flash_device_t *handle, uint32_t sector_id)
+{
+    nand_write_back_t *wb = &handle->write_back;
+    int slot = find_slot(wb, sector_id);
+    if (slot >= 0) {
+        wb->sector_ids[slot] = SLOT_FREE;
+        wb->num_used--;
+    }
+}
+
+void nand_write_back_discard_all(spi_nand_flash_device_t *handle)
+{
+    nand_write_back_t *wb = &handle->write_back;
+    for (uint32_t i = 0; i < wb->num_entries; i++) {
+        wb->sector_ids[i] = SLOT_FREE;
+    }
+    wb->num_used = 0;
+}
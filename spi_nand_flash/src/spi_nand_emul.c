@@ -0,0 +1,664 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+#include "esp_check.h"
+#include "esp_log.h"
+#include "spi_nand_emul.h"
+#include "spi_nand_oper.h"
+#include "nand.h"
+#include "nand_flash_devices.h"
+
+#define EMUL_DEFAULT_DEVICE_ID      WINBOND_DI_AA21
+#define EMUL_TEMP_FILE_TEMPLATE     "/tmp/spi_nand_emul_XXXXXX"
+
+#define EMUL_ECC_STATUS_SHIFT       4
+#define EMUL_ECC_STATUS_MASK        (0x07 << EMUL_ECC_STATUS_SHIFT)
+
+#define EMUL_CACHE_BUSY_US          3       // Data register to cache transfer time of cache reads
+
+#define EMUL_NO_PAGE                UINT32_MAX
+
+#define EMUL_BLOCK_PROGRAM_FAIL     (1 << 0)
+#define EMUL_BLOCK_ERASE_FAIL       (1 << 1)
+
+#define EMUL_MAX_DIES               4
+
+static const char *TAG = "spi_nand_emul";
+
+// State each die of a stacked package keeps for itself. Single die chips only use the first one.
+typedef struct {
+    uint8_t *cache;                 // emulated cache register, page data followed by OOB area
+    uint32_t cache_page;            // page last read into the cache, its plane is checked on two-plane chips
+    uint8_t reg_protect;
+    uint8_t reg_config;
+    uint8_t reg_status;             // everything except STAT_BUSY, which is derived from busy_until_us
+    int64_t busy_until_us;
+    uint32_t data_reg_page;         // page held or being loaded in the data register during cache reads
+    int64_t data_reg_ready_us;      // end of the background page load started by a sequential cache read
+} emul_die_t;
+
+struct spi_nand_emul_t {
+    spi_nand_emul_config_t config;
+    char *file_path;
+    bool is_temp_file;
+    int fd;
+    uint8_t *storage;               // mapped backing file, every page is followed by its OOB area
+    size_t storage_size;
+    uint32_t page_size;
+    uint32_t oob_size;
+    uint32_t pages_per_block;
+    uint32_t num_blocks;
+    uint32_t num_dies;
+    bool plane_select;              // cache accesses carry the plane in the column address, see NAND_FLAG_PLANE_SELECT
+    uint32_t read_page_delay_us;
+    uint32_t program_page_delay_us;
+    uint32_t erase_block_delay_us;
+    uint8_t *page_ecc_status;       // injected ECC field per page
+    uint8_t *page_programs;         // programs of each page since its block was erased
+    uint8_t num_partial_programs;   // programs a page takes between two erases, more are rejected
+    uint8_t *block_faults;          // injected EMUL_BLOCK_* failures per block
+    emul_die_t dies[EMUL_MAX_DIES];
+    uint8_t active_die;             // die selected with SOFTWARE DIE SELECT, commands go to this die
+    spi_nand_emul_stats_t stats;
+};
+
+static int64_t s_time_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static inline emul_die_t *s_die(struct spi_nand_emul_t *emul)
+{
+    return &emul->dies[emul->active_die];
+}
+
+static bool s_is_busy(struct spi_nand_emul_t *emul)
+{
+    return s_time_us() < s_die(emul)->busy_until_us;
+}
+
+static inline int64_t s_scaled_us(struct spi_nand_emul_t *emul, uint32_t delay_us)
+{
+    return (int64_t)delay_us * emul->config.timing_scale_percent / 100;
+}
+
+static void s_start_operation(struct spi_nand_emul_t *emul, uint32_t delay_us)
+{
+    emul->stats.busy_time_us += delay_us;
+    if (emul->config.timing_scale_percent) {
+        s_die(emul)->busy_until_us = s_time_us() + s_scaled_us(emul, delay_us);
+    }
+}
+
+static inline uint32_t s_page_stride(struct spi_nand_emul_t *emul)
+{
+    return emul->page_size + emul->oob_size;
+}
+
+static inline uint8_t *s_page_ptr(struct spi_nand_emul_t *emul, uint32_t page)
+{
+    return emul->storage + (size_t)page * s_page_stride(emul);
+}
+
+static esp_err_t s_check_page(struct spi_nand_emul_t *emul, uint32_t page)
+{
+    ESP_RETURN_ON_FALSE(emul->storage != NULL, ESP_ERR_INVALID_STATE, TAG, "chip not attached");
+    ESP_RETURN_ON_FALSE(page < emul->num_blocks * emul->pages_per_block, ESP_ERR_INVALID_ARG, TAG,
+                        "page %"PRIu32" out of range", page);
+    return ESP_OK;
+}
+
+// Page addresses sent to the chip are relative to the selected die
+static esp_err_t s_die_page(struct spi_nand_emul_t *emul, uint32_t row, uint32_t *page)
+{
+    const uint32_t pages_per_die = emul->num_blocks / emul->num_dies * emul->pages_per_block;
+    ESP_RETURN_ON_FALSE(emul->storage != NULL, ESP_ERR_INVALID_STATE, TAG, "chip not attached");
+    ESP_RETURN_ON_FALSE(row < pages_per_die, ESP_ERR_INVALID_ARG, TAG, "page %"PRIu32" out of range of a die", row);
+    *page = emul->active_die * pages_per_die + row;
+    return ESP_OK;
+}
+
+static inline uint32_t s_plane(struct spi_nand_emul_t *emul, uint32_t page)
+{
+    return (page / emul->pages_per_block) & 1;
+}
+
+// Strips the plane select bit from the column of a cache access, after checking it against the plane of the page
+// in the cache
+static esp_err_t s_cache_column(struct spi_nand_emul_t *emul, uint32_t address, uint32_t *column)
+{
+    *column = address;
+    if (!emul->plane_select) {
+        return ESP_OK;
+    }
+    const uint32_t plane_bit = emul->page_size << 1;
+    const uint32_t cache_page = s_die(emul)->cache_page;
+    ESP_RETURN_ON_FALSE(cache_page == EMUL_NO_PAGE || ((address & plane_bit) != 0) == s_plane(emul, cache_page),
+                        ESP_ERR_INVALID_ARG, TAG, "column 0x%04"PRIx32" selects the wrong plane for page %"PRIu32, address, cache_page);
+    *column = address & ~plane_bit;
+    return ESP_OK;
+}
+
+static esp_err_t s_check_block(struct spi_nand_emul_t *emul, uint32_t block)
+{
+    ESP_RETURN_ON_FALSE(emul->storage != NULL, ESP_ERR_INVALID_STATE, TAG, "chip not attached");
+    ESP_RETURN_ON_FALSE(block < emul->num_blocks, ESP_ERR_INVALID_ARG, TAG, "block %"PRIu32" out of range", block);
+    return ESP_OK;
+}
+
+static esp_err_t s_read_id(struct spi_nand_emul_t *emul, spi_nand_transaction_t *t)
+{
+    // READ ID returns the manufacturer ID followed by the device ID. The address byte and dummy bits a vendor
+    // driver clocks out before sampling select where in that sequence the response starts.
+    uint8_t id[3];
+    size_t id_len = 0;
+    id[id_len++] = emul->config.manufacturer_id;
+    if (emul->config.device_id > 0xFF) {
+        id[id_len++] = emul->config.device_id >> 8;
+    }
+    id[id_len++] = emul->config.device_id & 0xFF;
+
+    size_t skip = (t->address_bytes * 8 + t->dummy_bits) / 8;
+    skip = skip ? skip - 1 : 0;
+    for (size_t i = 0; i < t->miso_len; i++) {
+        t->miso_data[i] = (skip + i < id_len) ? id[skip + i] : 0x00;
+    }
+    return ESP_OK;
+}
+
+static esp_err_t s_read_register(struct spi_nand_emul_t *emul, spi_nand_transaction_t *t)
+{
+    uint8_t val;
+    switch (t->address) {
+    case REG_PROTECT:
+        val = s_die(emul)->reg_protect;
+        break;
+    case REG_CONFIG:
+        val = s_die(emul)->reg_config;
+        break;
+    case REG_STATUS:
+        val = s_die(emul)->reg_status | (s_is_busy(emul) ? STAT_BUSY : 0);
+        break;
+    default:
+        ESP_LOGE(TAG, "read of unknown register 0x%02"PRIx32, t->address);
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    t->miso_data[0] = val;
+    return ESP_OK;
+}
+
+static esp_err_t s_write_register(struct spi_nand_emul_t *emul, spi_nand_transaction_t *t)
+{
+    switch (t->address) {
+    case REG_PROTECT:
+        s_die(emul)->reg_protect = t->mosi_data[0];
+        break;
+    case REG_CONFIG:
+        s_die(emul)->reg_config = t->mosi_data[0];
+        break;
+    case REG_STATUS:
+        // Status register is read only
+        break;
+    default:
+        ESP_LOGE(TAG, "write of unknown register 0x%02"PRIx32, t->address);
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    return ESP_OK;
+}
+
+static esp_err_t s_page_read(struct spi_nand_emul_t *emul, uint32_t row)
+{
+    emul_die_t *die = s_die(emul);
+    uint32_t page;
+    ESP_RETURN_ON_ERROR(s_die_page(emul, row, &page), TAG, "");
+
+    memcpy(die->cache, s_page_ptr(emul, page), s_page_stride(emul));
+    die->cache_page = page;
+    die->reg_status &= ~EMUL_ECC_STATUS_MASK;
+    die->reg_status |= emul->page_ecc_status[page] << EMUL_ECC_STATUS_SHIFT;
+    emul->stats.page_reads++;
+    s_start_operation(emul, emul->read_page_delay_us);
+    die->data_reg_page = page;
+    die->data_reg_ready_us = die->busy_until_us;
+    return ESP_OK;
+}
+
+static esp_err_t s_page_read_cache(struct spi_nand_emul_t *emul, bool last)
+{
+    emul_die_t *die = s_die(emul);
+    ESP_RETURN_ON_FALSE(die->data_reg_page != EMUL_NO_PAGE, ESP_ERR_INVALID_STATE, TAG, "cache read without page read");
+    uint32_t page = die->data_reg_page;
+    if (!last) {
+        ESP_RETURN_ON_FALSE((page + 1) % emul->pages_per_block != 0, ESP_ERR_INVALID_ARG, TAG,
+                            "sequential cache read past the end of block %"PRIu32, page / emul->pages_per_block);
+    }
+
+    // The page in the data register moves to the cache once its load from the array has completed
+    memcpy(die->cache, s_page_ptr(emul, page), s_page_stride(emul));
+    die->cache_page = page;
+    die->reg_status &= ~EMUL_ECC_STATUS_MASK;
+    die->reg_status |= emul->page_ecc_status[page] << EMUL_ECC_STATUS_SHIFT;
+    if (emul->config.timing_scale_percent) {
+        int64_t now = s_time_us();
+        die->busy_until_us = MAX(now, die->data_reg_ready_us) + s_scaled_us(emul, EMUL_CACHE_BUSY_US);
+    }
+    emul->stats.busy_time_us += EMUL_CACHE_BUSY_US;
+
+    if (last) {
+        die->data_reg_page = EMUL_NO_PAGE;
+    } else {
+        // The next page loads in the background while the cache is read out
+        die->data_reg_page = page + 1;
+        die->data_reg_ready_us = die->busy_until_us + s_scaled_us(emul, emul->read_page_delay_us);
+        emul->stats.page_reads++;
+        emul->stats.busy_time_us += emul->read_page_delay_us;
+    }
+    return ESP_OK;
+}
+
+static esp_err_t s_read_cache(struct spi_nand_emul_t *emul, spi_nand_transaction_t *t)
+{
+    ESP_RETURN_ON_FALSE(emul->storage != NULL, ESP_ERR_INVALID_STATE, TAG, "chip not attached");
+
+    uint32_t stride = s_page_stride(emul);
+    uint32_t start;
+    ESP_RETURN_ON_ERROR(s_cache_column(emul, t->address, &start), TAG, "");
+    for (uint32_t i = 0; i < t->miso_len; i++) {
+        uint32_t column = start + i;
+        t->miso_data[i] = column < stride ? s_die(emul)->cache[column] : 0xFF;
+    }
+    emul->stats.bytes_read += t->miso_len;
+    return ESP_OK;
+}
+
+static esp_err_t s_check_data_lines(struct spi_nand_emul_t *emul, spi_nand_transaction_t *t, int lines)
+{
+    uint32_t mode = t->flags & (SPI_TRANS_MODE_DIO | SPI_TRANS_MODE_QIO);
+    uint32_t expected = lines == 4 ? SPI_TRANS_MODE_QIO : lines == 2 ? SPI_TRANS_MODE_DIO : 0;
+    ESP_RETURN_ON_FALSE(mode == expected, ESP_ERR_INVALID_ARG, TAG, "command 0x%02x sent with the wrong number of data lines",
+                        t->command);
+    // GigaDevice parts only drive IO2/IO3 as data lines once the QE bit is set
+    ESP_RETURN_ON_FALSE(lines != 4 || emul->config.manufacturer_id != SPI_NAND_FLASH_GIGADEVICE_MI ||
+                        (s_die(emul)->reg_config & CONFIG_QUAD_ENABLE), ESP_ERR_INVALID_STATE, TAG, "x4 transfer with QE bit clear");
+    return ESP_OK;
+}
+
+static esp_err_t s_load_cache(struct spi_nand_emul_t *emul, spi_nand_transaction_t *t)
+{
+    ESP_RETURN_ON_FALSE(emul->storage != NULL, ESP_ERR_INVALID_STATE, TAG, "chip not attached");
+
+    uint32_t stride = s_page_stride(emul);
+    uint32_t start;
+    ESP_RETURN_ON_ERROR(s_cache_column(emul, t->address, &start), TAG, "");
+    for (uint32_t i = 0; i < t->mosi_len && start + i < stride; i++) {
+        s_die(emul)->cache[start + i] = t->mosi_data[i];
+    }
+    emul->stats.bytes_loaded += t->mosi_len;
+    return ESP_OK;
+}
+
+// PROGRAM LOAD (02h/32h) sets the whole cache to 0xFF before loading, RANDOM PROGRAM LOAD (84h/34h) keeps it
+static esp_err_t s_load_cache_reset(struct spi_nand_emul_t *emul, spi_nand_transaction_t *t)
+{
+    ESP_RETURN_ON_FALSE(emul->storage != NULL, ESP_ERR_INVALID_STATE, TAG, "chip not attached");
+
+    memset(s_die(emul)->cache, 0xFF, s_page_stride(emul));
+    // The cache no longer holds a page read from the array, so it can be programmed to either plane
+    s_die(emul)->cache_page = EMUL_NO_PAGE;
+    return s_load_cache(emul, t);
+}
+
+static esp_err_t s_program_execute(struct spi_nand_emul_t *emul, uint32_t row)
+{
+    emul_die_t *die = s_die(emul);
+    uint32_t page;
+    ESP_RETURN_ON_ERROR(s_die_page(emul, row, &page), TAG, "");
+    // Each plane has its own cache, internal data moves can not cross planes
+    ESP_RETURN_ON_FALSE(!emul->plane_select || die->cache_page == EMUL_NO_PAGE || s_plane(emul, page) == s_plane(emul, die->cache_page),
+                        ESP_ERR_INVALID_ARG, TAG, "program of page %"PRIu32" from the cache of the other plane", page);
+
+    die->reg_status &= ~(STAT_PROGRAM_FAILED);
+    die->data_reg_page = EMUL_NO_PAGE;
+    if ((die->reg_status & STAT_WRITE_ENABLED) == 0) {
+        ESP_LOGW(TAG, "program of page %"PRIu32" ignored, write enable not set", page);
+        return ESP_OK;
+    }
+    die->reg_status &= ~(STAT_WRITE_ENABLED);
+    ESP_RETURN_ON_FALSE(emul->page_programs[page] < emul->num_partial_programs, ESP_ERR_INVALID_STATE, TAG,
+                        "page %"PRIu32" programmed more than %d times since its block was erased", page, emul->num_partial_programs);
+    emul->page_programs[page]++;
+
+    if (emul->block_faults[page / emul->pages_per_block] & EMUL_BLOCK_PROGRAM_FAIL) {
+        die->reg_status |= STAT_PROGRAM_FAILED;
+    } else {
+        // Programming can only clear bits
+        uint8_t *dst = s_page_ptr(emul, page);
+        for (uint32_t i = 0; i < s_page_stride(emul); i++) {
+            dst[i] &= die->cache[i];
+        }
+    }
+    emul->stats.page_programs++;
+    s_start_operation(emul, emul->program_page_delay_us);
+    return ESP_OK;
+}
+
+static esp_err_t s_erase_block(struct spi_nand_emul_t *emul, uint32_t row)
+{
+    emul_die_t *die = s_die(emul);
+    uint32_t page;
+    ESP_RETURN_ON_ERROR(s_die_page(emul, row, &page), TAG, "");
+
+    uint32_t block = page / emul->pages_per_block;
+    die->reg_status &= ~(STAT_ERASE_FAILED);
+    die->data_reg_page = EMUL_NO_PAGE;
+    if ((die->reg_status & STAT_WRITE_ENABLED) == 0) {
+        ESP_LOGW(TAG, "erase of block %"PRIu32" ignored, write enable not set", block);
+        return ESP_OK;
+    }
+    die->reg_status &= ~(STAT_WRITE_ENABLED);
+
+    if (emul->block_faults[block] & EMUL_BLOCK_ERASE_FAIL) {
+        die->reg_status |= STAT_ERASE_FAILED;
+    } else {
+        uint32_t first_page = block * emul->pages_per_block;
+        memset(s_page_ptr(emul, first_page), 0xFF, (size_t)emul->pages_per_block * s_page_stride(emul));
+        memset(&emul->page_ecc_status[first_page], 0, emul->pages_per_block);
+        memset(&emul->page_programs[first_page], 0, emul->pages_per_block);
+    }
+    emul->stats.block_erases++;
+    s_start_operation(emul, emul->erase_block_delay_us);
+    return ESP_OK;
+}
+
+esp_err_t spi_nand_execute_transaction(spi_device_handle_t device, spi_nand_transaction_t *transaction)
+{
+    struct spi_nand_emul_t *emul = device;
+    emul->stats.transactions++;
+
+    // Status reads and die selection are accepted while the selected die is busy, which lets the host start an
+    // operation on another die
+    if (transaction->command != CMD_READ_REGISTER && transaction->command != CMD_READ_ID &&
+            transaction->command != CMD_DIE_SELECT && s_is_busy(emul)) {
+        ESP_LOGE(TAG, "command 0x%02x issued while the chip is busy", transaction->command);
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    switch (transaction->command) {
+    case CMD_READ_ID:
+        return s_read_id(emul, transaction);
+    case CMD_READ_REGISTER:
+        return s_read_register(emul, transaction);
+    case CMD_SET_REGISTER:
+        return s_write_register(emul, transaction);
+    case CMD_WRITE_ENABLE:
+        s_die(emul)->reg_status |= STAT_WRITE_ENABLED;
+        return ESP_OK;
+    case CMD_DIE_SELECT:
+        ESP_RETURN_ON_FALSE(emul->num_dies > 1, ESP_ERR_NOT_SUPPORTED, TAG, "die select on a single die chip");
+        ESP_RETURN_ON_FALSE(transaction->address < emul->num_dies, ESP_ERR_INVALID_ARG, TAG, "die %"PRIu32" out of range",
+                            transaction->address);
+        emul->active_die = transaction->address;
+        return ESP_OK;
+    case CMD_PAGE_READ:
+        return s_page_read(emul, transaction->address);
+    case CMD_PAGE_READ_CACHE_SEQ:
+        return s_page_read_cache(emul, false);
+    case CMD_PAGE_READ_CACHE_LAST:
+        return s_page_read_cache(emul, true);
+    case CMD_READ_FAST:
+        ESP_RETURN_ON_ERROR(s_check_data_lines(emul, transaction, 1), TAG, "");
+        return s_read_cache(emul, transaction);
+    case CMD_READ_X2:
+        ESP_RETURN_ON_ERROR(s_check_data_lines(emul, transaction, 2), TAG, "");
+        return s_read_cache(emul, transaction);
+    case CMD_READ_X4:
+        ESP_RETURN_ON_ERROR(s_check_data_lines(emul, transaction, 4), TAG, "");
+        return s_read_cache(emul, transaction);
+    case CMD_PROGRAM_LOAD:
+        ESP_RETURN_ON_ERROR(s_check_data_lines(emul, transaction, 1), TAG, "");
+        return s_load_cache(emul, transaction);
+    case CMD_PROGRAM_LOAD_X4:
+        ESP_RETURN_ON_ERROR(s_check_data_lines(emul, transaction, 4), TAG, "");
+        return s_load_cache(emul, transaction);
+    case CMD_PROGRAM_LOAD_RESET:
+        ESP_RETURN_ON_ERROR(s_check_data_lines(emul, transaction, 1), TAG, "");
+        return s_load_cache_reset(emul, transaction);
+    case CMD_PROGRAM_LOAD_RESET_X4:
+        ESP_RETURN_ON_ERROR(s_check_data_lines(emul, transaction, 4), TAG, "");
+        return s_load_cache_reset(emul, transaction);
+    case CMD_PROGRAM_EXECUTE:
+        return s_program_execute(emul, transaction->address);
+    case CMD_ERASE_BLOCK:
+        return s_erase_block(emul, transaction->address);
+    default:
+        ESP_LOGE(TAG, "unsupported command 0x%02x", transaction->command);
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+}
+
+esp_err_t spi_nand_emul_attach_chip(spi_device_handle_t emul, const spi_nand_chip_t *chip)
+{
+    esp_err_t ret = ESP_OK;
+    uint32_t pages_per_block = 1 << chip->log2_ppb;
+
+    ESP_RETURN_ON_FALSE(chip->num_dies >= 1 && chip->num_dies <= EMUL_MAX_DIES && chip->num_blocks % chip->num_dies == 0,
+                        ESP_ERR_NOT_SUPPORTED, TAG, "unsupported number of dies");
+    emul->read_page_delay_us = chip->read_page_delay_us;
+    emul->program_page_delay_us = chip->program_page_delay_us;
+    emul->erase_block_delay_us = chip->erase_block_delay_us;
+    emul->num_partial_programs = chip->num_partial_programs;
+
+    if (emul->storage != NULL) {
+        // Re-initialisation of the NAND layer on an already attached chip
+        ESP_RETURN_ON_FALSE(emul->page_size == chip->page_size && emul->pages_per_block == pages_per_block &&
+                            emul->num_blocks == chip->num_blocks && emul->num_dies == chip->num_dies, ESP_ERR_INVALID_STATE, TAG, "chip geometry changed");
+        return ESP_OK;
+    }
+
+    emul->page_size = chip->page_size;
+    emul->oob_size = chip->page_size / 32; // 64 bytes of OOB per 2 KB page
+    emul->pages_per_block = pages_per_block;
+    emul->num_blocks = chip->num_blocks;
+    emul->num_dies = chip->num_dies;
+    emul->plane_select = (chip->flags & NAND_FLAG_PLANE_SELECT) != 0;
+    emul->storage_size = (size_t)emul->num_blocks * emul->pages_per_block * s_page_stride(emul);
+
+    if (emul->file_path) {
+        emul->fd = open(emul->file_path, O_RDWR | O_CREAT, 0600);
+    } else {
+        emul->file_path = strdup(EMUL_TEMP_FILE_TEMPLATE);
+        ESP_RETURN_ON_FALSE(emul->file_path != NULL, ESP_ERR_NO_MEM, TAG, "nomem");
+        emul->is_temp_file = true;
+        emul->fd = mkstemp(emul->file_path);
+    }
+    ESP_RETURN_ON_FALSE(emul->fd >= 0, ESP_FAIL, TAG, "failed to open %s", emul->file_path);
+
+    struct stat st;
+    ESP_GOTO_ON_FALSE(fstat(emul->fd, &st) == 0, ESP_FAIL, fail, TAG, "failed to stat %s", emul->file_path);
+    // A backing file of the right size keeps its content, anything else starts as an erased chip
+    bool fresh = (size_t)st.st_size != emul->storage_size;
+    if (fresh) {
+        ESP_GOTO_ON_FALSE(ftruncate(emul->fd, emul->storage_size) == 0, ESP_FAIL, fail, TAG, "failed to resize %s", emul->file_path);
+    }
+
+    void *storage = mmap(NULL, emul->storage_size, PROT_READ | PROT_WRITE, MAP_SHARED, emul->fd, 0);
+    ESP_GOTO_ON_FALSE(storage != MAP_FAILED, ESP_FAIL, fail, TAG, "failed to map %s", emul->file_path);
+    emul->storage = storage;
+    if (fresh) {
+        memset(emul->storage, 0xFF, emul->storage_size);
+    }
+
+    for (uint32_t i = 0; i < emul->num_dies; i++) {
+        emul->dies[i].cache = malloc(s_page_stride(emul));
+        ESP_GOTO_ON_FALSE(emul->dies[i].cache, ESP_ERR_NO_MEM, fail, TAG, "nomem");
+        memset(emul->dies[i].cache, 0xFF, s_page_stride(emul));
+    }
+    emul->page_ecc_status = calloc(emul->num_blocks * emul->pages_per_block, sizeof(uint8_t));
+    emul->page_programs = calloc(emul->num_blocks * emul->pages_per_block, sizeof(uint8_t));
+    emul->block_faults = calloc(emul->num_blocks, sizeof(uint8_t));
+    ESP_GOTO_ON_FALSE(emul->page_ecc_status && emul->page_programs && emul->block_faults, ESP_ERR_NO_MEM, fail, TAG, "nomem");
+
+    ESP_LOGD(TAG, "attached %"PRIu32" blocks of %"PRIu32" pages (%"PRIu32"+%"PRIu32" bytes), backing file %s",
+             emul->num_blocks, emul->pages_per_block, emul->page_size, emul->oob_size, emul->file_path);
+    return ESP_OK;
+
+fail:
+    if (emul->storage) {
+        munmap(emul->storage, emul->storage_size);
+        emul->storage = NULL;
+    }
+    for (uint32_t i = 0; i < EMUL_MAX_DIES; i++) {
+        free(emul->dies[i].cache);
+        emul->dies[i].cache = NULL;
+    }
+    free(emul->page_ecc_status);
+    free(emul->page_programs);
+    free(emul->block_faults);
+    emul->page_ecc_status = NULL;
+    emul->page_programs = NULL;
+    emul->block_faults = NULL;
+    close(emul->fd);
+    emul->fd = -1;
+    // spi_nand_emul_deinit only removes the file of an attached chip
+    if (emul->is_temp_file || !emul->config.keep_file) {
+        unlink(emul->file_path);
+    }
+    return ret;
+}
+
+esp_err_t spi_nand_emul_init(const spi_nand_emul_config_t *config, spi_device_handle_t *handle)
+{
+    ESP_RETURN_ON_FALSE(config != NULL && handle != NULL, ESP_ERR_INVALID_ARG, TAG, "invalid argument");
+
+    struct spi_nand_emul_t *emul = calloc(1, sizeof(struct spi_nand_emul_t));
+    ESP_RETURN_ON_FALSE(emul != NULL, ESP_ERR_NO_MEM, TAG, "nomem");
+
+    emul->config = *config;
+    if (!emul->config.manufacturer_id) {
+        emul->config.manufacturer_id = SPI_NAND_FLASH_WINBOND_MI;
+    }
+    if (!emul->config.device_id) {
+        emul->config.device_id = EMUL_DEFAULT_DEVICE_ID;
+    }
+    if (config->file_path) {
+        emul->file_path = strdup(config->file_path);
+        if (emul->file_path == NULL) {
+            free(emul);
+            return ESP_ERR_NO_MEM;
+        }
+    }
+    emul->config.file_path = NULL;
+    emul->fd = -1;
+    for (uint32_t i = 0; i < EMUL_MAX_DIES; i++) {
+        emul->dies[i].cache_page = EMUL_NO_PAGE;
+        emul->dies[i].data_reg_page = EMUL_NO_PAGE;
+        // Chips power up with all blocks locked
+        emul->dies[i].reg_protect = 0x7C;
+    }
+
+    *handle = emul;
+    return ESP_OK;
+}
+
+esp_err_t spi_nand_emul_deinit(spi_device_handle_t handle)
+{
+    esp_err_t ret = ESP_OK;
+
+    if (handle->storage) {
+        if (munmap(handle->storage, handle->storage_size) != 0) {
+            ret = ESP_FAIL;
+        }
+    }
+    if (handle->fd >= 0) {
+        close(handle->fd);
+        if (handle->is_temp_file || !handle->config.keep_file) {
+            unlink(handle->file_path);
+        }
+    }
+    for (uint32_t i = 0; i < EMUL_MAX_DIES; i++) {
+        free(handle->dies[i].cache);
+    }
+    free(handle->page_ecc_status);
+    free(handle->page_programs);
+    free(handle->block_faults);
+    free(handle->file_path);
+    free(handle);
+    return ret;
+}
+
+esp_err_t spi_nand_emul_set_bad_block(spi_device_handle_t handle, uint32_t block)
+{
+    ESP_RETURN_ON_ERROR(s_check_block(handle, block), TAG, "");
+
+    // Factory bad block marker: first two OOB bytes of the block's first page are not 0xFF
+    uint8_t *oob = s_page_ptr(handle, block * handle->pages_per_block) + handle->page_size;
+    oob[0] = 0x00;
+    oob[1] = 0x00;
+    return ESP_OK;
+}
+
+esp_err_t spi_nand_emul_inject_ecc_status(spi_device_handle_t handle, uint32_t page, uint8_t ecc_status)
+{
+    ESP_RETURN_ON_ERROR(s_check_page(handle, page), TAG, "");
+    ESP_RETURN_ON_FALSE(ecc_status <= (EMUL_ECC_STATUS_MASK >> EMUL_ECC_STATUS_SHIFT), ESP_ERR_INVALID_ARG, TAG,
+                        "invalid ecc status %d", ecc_status);
+
+    handle->page_ecc_status[page] = ecc_status;
+    return ESP_OK;
+}
+
+static esp_err_t s_set_block_fault(spi_device_handle_t handle, uint32_t block, uint8_t fault, bool fail)
+{
+    ESP_RETURN_ON_ERROR(s_check_block(handle, block), TAG, "");
+
+    if (fail) {
+        handle->block_faults[block] |= fault;
+    } else {
+        handle->block_faults[block] &= ~fault;
+    }
+    return ESP_OK;
+}
+
+esp_err_t spi_nand_emul_inject_program_fail(spi_device_handle_t handle, uint32_t block, bool fail)
+{
+    return s_set_block_fault(handle, block, EMUL_BLOCK_PROGRAM_FAIL, fail);
+}
+
+esp_err_t spi_nand_emul_inject_erase_fail(spi_device_handle_t handle, uint32_t block, bool fail)
+{
+    return s_set_block_fault(handle, block, EMUL_BLOCK_ERASE_FAIL, fail);
+}
+
+esp_err_t spi_nand_emul_clear_faults(spi_device_handle_t handle)
+{
+    if (handle->storage) {
+        memset(handle->page_ecc_status, 0, handle->num_blocks * handle->pages_per_block);
+        memset(handle->block_faults, 0, handle->num_blocks);
+    }
+    return ESP_OK;
+}
+
+esp_err_t spi_nand_emul_get_stats(spi_device_handle_t handle, spi_nand_emul_stats_t *stats)
+{
+    *stats = handle->stats;
+    return ESP_OK;
+}
+
+esp_err_t spi_nand_emul_reset_stats(spi_device_handle_t handle)
+{
+    memset(&handle->stats, 0, sizeof(handle->stats));
+    return ESP_OK;
+}
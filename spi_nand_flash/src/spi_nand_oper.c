@@ -8,6 +8,9 @@
 
 #include <string.h>
 #include "spi_nand_oper.h"
+
+// On the linux target, transactions are executed by the emulated chip in spi_nand_emul.c
+#if !CONFIG_IDF_TARGET_LINUX
 #include "driver/spi_master.h"
 
 esp_err_t spi_nand_execute_transaction(spi_device_handle_t device, spi_nand_transaction_t *transaction)
@@ -43,6 +46,7 @@ esp_err_t spi_nand_execute_transaction(spi_device_handle_t device, spi_nand_tran
     }
     return ret;
 }
+#endif //!CONFIG_IDF_TARGET_LINUX
 
 esp_err_t spi_nand_read_register(spi_device_handle_t device, uint8_t reg, uint8_t *val)
 {
@@ -92,23 +96,60 @@ esp_err_t spi_nand_read_page(spi_device_handle_t device, uint32_t page)
     return spi_nand_execute_transaction(device, &t);
 }
 
-esp_err_t spi_nand_read(spi_device_handle_t device, uint8_t *data, uint16_t column, uint16_t length)
+esp_err_t spi_nand_read_page_cache_seq(spi_device_handle_t device)
+{
+    spi_nand_transaction_t  t = {
+        .command = CMD_PAGE_READ_CACHE_SEQ
+    };
+
+    return spi_nand_execute_transaction(device, &t);
+}
+
+esp_err_t spi_nand_read_page_cache_last(spi_device_handle_t device)
 {
     spi_nand_transaction_t  t = {
-        .command = CMD_READ_FAST,
+        .command = CMD_PAGE_READ_CACHE_LAST
+    };
+
+    return spi_nand_execute_transaction(device, &t);
+}
+
+static esp_err_t read_cache(spi_device_handle_t device, uint8_t command, uint32_t mode_flags, uint8_t *data, uint16_t column, uint16_t length)
+{
+    spi_nand_transaction_t  t = {
+        .command = command,
         .address_bytes = 2,
         .address = column,
         .miso_len = length,
         .miso_data = data,
         .dummy_bits = 8,
 #if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 2, 0)
-        .flags = SPI_TRANS_DMA_BUFFER_ALIGN_MANUAL,
+        .flags = SPI_TRANS_DMA_BUFFER_ALIGN_MANUAL | mode_flags,
+#else
+        .flags = mode_flags,
 #endif
     };
 
     return spi_nand_execute_transaction(device, &t);
 }
 
+esp_err_t spi_nand_read(spi_device_handle_t device, uint8_t *data, uint16_t column, uint16_t length)
+{
+    return read_cache(device, CMD_READ_FAST, 0, data, column, length);
+}
+
+esp_err_t spi_nand_read_x2(spi_device_handle_t device, uint8_t *data, uint16_t column, uint16_t length)
+{
+    // Command and address on one line, data on two lines
+    return read_cache(device, CMD_READ_X2, SPI_TRANS_MODE_DIO, data, column, length);
+}
+
+esp_err_t spi_nand_read_x4(spi_device_handle_t device, uint8_t *data, uint16_t column, uint16_t length)
+{
+    // Command and address on one line, data on four lines
+    return read_cache(device, CMD_READ_X4, SPI_TRANS_MODE_QIO, data, column, length);
+}
+
 esp_err_t spi_nand_program_execute(spi_device_handle_t device, uint32_t page)
 {
     spi_nand_transaction_t  t = {
@@ -133,6 +174,47 @@ esp_err_t spi_nand_program_load(spi_device_handle_t device, const uint8_t *data,
     return spi_nand_execute_transaction(device, &t);
 }
 
+esp_err_t spi_nand_program_load_x4(spi_device_handle_t device, const uint8_t *data, uint16_t column, uint16_t length)
+{
+    spi_nand_transaction_t  t = {
+        .command = CMD_PROGRAM_LOAD_X4,
+        .address_bytes = 2,
+        .address = column,
+        .mosi_len = length,
+        .mosi_data = data,
+        .flags = SPI_TRANS_MODE_QIO,
+    };
+
+    return spi_nand_execute_transaction(device, &t);
+}
+
+esp_err_t spi_nand_program_load_reset(spi_device_handle_t device, const uint8_t *data, uint16_t column, uint16_t length)
+{
+    spi_nand_transaction_t  t = {
+        .command = CMD_PROGRAM_LOAD_RESET,
+        .address_bytes = 2,
+        .address = column,
+        .mosi_len = length,
+        .mosi_data = data
+    };
+
+    return spi_nand_execute_transaction(device, &t);
+}
+
+esp_err_t spi_nand_program_load_reset_x4(spi_device_handle_t device, const uint8_t *data, uint16_t column, uint16_t length)
+{
+    spi_nand_transaction_t  t = {
+        .command = CMD_PROGRAM_LOAD_RESET_X4,
+        .address_bytes = 2,
+        .address = column,
+        .mosi_len = length,
+        .mosi_data = data,
+        .flags = SPI_TRANS_MODE_QIO,
+    };
+
+    return spi_nand_execute_transaction(device, &t);
+}
+
 esp_err_t spi_nand_erase_block(spi_device_handle_t device, uint32_t page)
 {
     spi_nand_transaction_t  t = {
@@ -143,3 +225,14 @@ esp_err_t spi_nand_erase_block(spi_device_handle_t device, uint32_t page)
 
     return spi_nand_execute_transaction(device, &t);
 }
+
+esp_err_t spi_nand_die_select(spi_device_handle_t device, uint8_t die)
+{
+    spi_nand_transaction_t  t = {
+        .command = CMD_DIE_SELECT,
+        .address_bytes = 1,
+        .address = die
+    };
+
+    return spi_nand_execute_transaction(device, &t);
+}
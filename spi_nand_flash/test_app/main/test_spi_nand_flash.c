@@ -192,6 +192,41 @@ TEST_CASE("write nand flash sectors", "[spi_nand_flash]")
     deinit_nand_flash(nand_flash_device_handle, spi);
 }
 
+TEST_CASE("read and write nand flash sector ranges", "[spi_nand_flash]")
+{
+    uint32_t sector_size;
+    const uint32_t sector_count = 32;
+    spi_nand_flash_device_t *nand_flash_device_handle;
+    spi_device_handle_t spi;
+    setup_nand_flash(&nand_flash_device_handle, &spi);
+
+    TEST_ESP_OK(spi_nand_flash_get_sector_size(nand_flash_device_handle, &sector_size));
+
+    uint8_t *pattern_buf = (uint8_t *)heap_caps_malloc(sector_size * sector_count, MALLOC_CAP_DEFAULT);
+    TEST_ASSERT_NOT_NULL(pattern_buf);
+    uint8_t *temp_buf = (uint8_t *)heap_caps_malloc(sector_size * sector_count, MALLOC_CAP_DMA);
+    TEST_ASSERT_NOT_NULL(temp_buf);
+
+    fill_buffer(PATTERN_SEED, pattern_buf, sector_size * sector_count / sizeof(uint32_t));
+
+    int64_t start = esp_timer_get_time();
+    TEST_ESP_OK(spi_nand_flash_write_sectors(nand_flash_device_handle, pattern_buf, 64, sector_count));
+    int64_t write_time = esp_timer_get_time() - start;
+
+    memset(temp_buf, 0x00, sector_size * sector_count);
+    start = esp_timer_get_time();
+    TEST_ESP_OK(spi_nand_flash_read_sectors(nand_flash_device_handle, temp_buf, 64, sector_count));
+    int64_t read_time = esp_timer_get_time() - start;
+    check_buffer(PATTERN_SEED, temp_buf, sector_size * sector_count / sizeof(uint32_t));
+
+    printf("Wrote %" PRIu32 " bytes in %" PRId64 " us, avg %.2f kB/s\n", sector_size * sector_count, write_time, (float)sector_size * sector_count / write_time * 1000);
+    printf("Read %" PRIu32 " bytes in %" PRId64 " us, avg %.2f kB/s\n", sector_size * sector_count, read_time, (float)sector_size * sector_count / read_time * 1000);
+
+    free(pattern_buf);
+    free(temp_buf);
+    deinit_nand_flash(nand_flash_device_handle, spi);
+}
+
 TEST_CASE("copy nand flash sectors", "[spi_nand_flash]")
 {
     spi_nand_flash_device_t *nand_flash_device_handle;
@@ -244,23 +279,24 @@ TEST_CASE("verify nand_prog, nand_read, nand_copy, nand_is_free works", "[spi_na
     spi_nand_flash_device_t *nand_flash_device_handle;
     spi_device_handle_t spi;
     setup_nand_flash(&nand_flash_device_handle, &spi);
-    uint32_t sector_num, sector_size, block_size;
+    uint32_t sector_num, sector_size, page_size, block_size;
 
     TEST_ESP_OK(spi_nand_flash_get_capacity(nand_flash_device_handle, &sector_num));
     TEST_ESP_OK(spi_nand_flash_get_sector_size(nand_flash_device_handle, &sector_size));
+    TEST_ESP_OK(spi_nand_flash_get_page_size(nand_flash_device_handle, &page_size));
     TEST_ESP_OK(spi_nand_flash_get_block_size(nand_flash_device_handle, &block_size));
     printf("Number of sectors: %" PRIu32 ", Sector size: %" PRIu32 "\n", sector_num, sector_size);
 
-    uint8_t *pattern_buf = (uint8_t *)heap_caps_malloc(sector_size, MALLOC_CAP_DEFAULT);
+    uint8_t *pattern_buf = (uint8_t *)heap_caps_malloc(page_size, MALLOC_CAP_DEFAULT);
     TEST_ASSERT_NOT_NULL(pattern_buf);
-    uint8_t *temp_buf = (uint8_t *)heap_caps_malloc(sector_size, MALLOC_CAP_DEFAULT);
+    uint8_t *temp_buf = (uint8_t *)heap_caps_malloc(page_size, MALLOC_CAP_DEFAULT);
     TEST_ASSERT_NOT_NULL(temp_buf);
 
-    fill_buffer(PATTERN_SEED, pattern_buf, sector_size / sizeof(uint32_t));
+    fill_buffer(PATTERN_SEED, pattern_buf, page_size / sizeof(uint32_t));
 
     bool is_page_free = true;
     uint32_t test_block = 20;
-    uint32_t test_page = test_block * (block_size / sector_size); //(block_num * pages_per_block)
+    uint32_t test_page = test_block * (block_size / page_size); //(block_num * pages_per_block)
     uint32_t dst_page = test_page + 1;
     if (test_page < sector_num) {
         // Verify if test_page is free
@@ -272,13 +308,13 @@ TEST_CASE("verify nand_prog, nand_read, nand_copy, nand_is_free works", "[spi_na
         TEST_ESP_OK(nand_wrap_is_free(nand_flash_device_handle, test_page, &is_page_free));
         TEST_ASSERT_TRUE(is_page_free == false);
         // read test_page and verify with pattern_buf
-        TEST_ESP_OK(nand_wrap_read(nand_flash_device_handle, test_page, 0, sector_size, temp_buf));
-        check_buffer(PATTERN_SEED, temp_buf, sector_size / sizeof(uint32_t));
+        TEST_ESP_OK(nand_wrap_read(nand_flash_device_handle, test_page, 0, page_size, temp_buf));
+        check_buffer(PATTERN_SEED, temp_buf, page_size / sizeof(uint32_t));
         // Copy test_page to dst_page
         TEST_ESP_OK(nand_wrap_copy(nand_flash_device_handle, test_page, dst_page));
         // read dst_page and verify with pattern_buf
-        TEST_ESP_OK(nand_wrap_read(nand_flash_device_handle, dst_page, 0, sector_size, temp_buf));
-        check_buffer(PATTERN_SEED, temp_buf, sector_size / sizeof(uint32_t));
+        TEST_ESP_OK(nand_wrap_read(nand_flash_device_handle, dst_page, 0, page_size, temp_buf));
+        check_buffer(PATTERN_SEED, temp_buf, page_size / sizeof(uint32_t));
     }
     free(pattern_buf);
     free(temp_buf);
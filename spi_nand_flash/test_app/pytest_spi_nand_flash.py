@@ -4,3 +4,9 @@ import pytest
 @pytest.mark.spi_nand_flash
 def test_spi_nand_flash(dut) -> None:
     dut.run_all_single_board_cases()
+
+
+@pytest.mark.spi_nand_flash
+@pytest.mark.parametrize('config', ['subpage_sectors'], indirect=True)
+def test_spi_nand_flash_subpage_sectors(dut) -> None:
+    dut.run_all_single_board_cases()